@@ -0,0 +1,149 @@
+/**
+ * @file esp.c  Host implementation of misc. ESP-IDF system functions
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <esp_err.h>
+#include <esp_log.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <esp_crc.h>
+#include <esp_heap_caps.h>
+#include <esp_mac.h>
+
+int esp_log_level = 3;
+esp_reset_reason_t host_reset_reason = ESP_RST_POWERON;
+
+
+const char *esp_err_to_name(esp_err_t code)
+{
+    static __thread char buf[16];
+
+    switch (code) {
+    case ESP_OK:                     return "ESP_OK";
+    case ESP_FAIL:                   return "ESP_FAIL";
+    case ESP_ERR_NO_MEM:             return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG:        return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE:      return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE:       return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND:          return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_TIMEOUT:            return "ESP_ERR_TIMEOUT";
+    case ESP_ERR_INVALID_CRC:        return "ESP_ERR_INVALID_CRC";
+    case ESP_ERR_NVS_NOT_FOUND:      return "ESP_ERR_NVS_NOT_FOUND";
+    case ESP_ERR_NVS_TYPE_MISMATCH:  return "ESP_ERR_NVS_TYPE_MISMATCH";
+    case ESP_ERR_NVS_INVALID_LENGTH: return "ESP_ERR_NVS_INVALID_LENGTH";
+    default:
+        snprintf(buf, sizeof(buf), "0x%x", code);
+        return buf;
+    }
+}
+
+
+void esp_restart(void)
+{
+    ESP_LOGW("esp", "restart requested, exiting");
+    exit(0);
+}
+
+
+uint32_t esp_get_free_heap_size(void)
+{
+    return 0;
+}
+
+
+uint32_t esp_get_minimum_free_heap_size(void)
+{
+    return 0;
+}
+
+
+void heap_caps_get_info(multi_heap_info_t *info, uint32_t caps)
+{
+    (void) caps;
+    memset(info, 0, sizeof(*info));
+}
+
+
+uint32_t esp_random(void)
+{
+    return (uint32_t) random();
+}
+
+
+esp_reset_reason_t esp_reset_reason(void)
+{
+    return host_reset_reason;
+}
+
+
+esp_err_t esp_read_mac(uint8_t *mac, esp_mac_type_t type)
+{
+    static const uint8_t host_mac[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+
+    memcpy(mac, host_mac, sizeof(host_mac));
+    mac[5] += type;
+    return ESP_OK;
+}
+
+
+static int64_t mono_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static int64_t start_us;
+
+__attribute__((constructor)) static void timer_start(void)
+{
+    start_us = mono_us();
+}
+
+
+int64_t esp_timer_get_time(void)
+{
+    return mono_us() - start_us;
+}
+
+
+/* Same result as the ROM function: esp_crc32_le(0, ...) is the CRC-32 of
+ * IEEE 802.3 */
+uint32_t esp_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len)
+{
+    int i;
+
+    crc = ~crc;
+    while (len--) {
+        crc ^= *buf++;
+        for (i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+
+    return ~crc;
+}
+
+
+#ifndef HAVE_STRLCPY
+size_t strlcpy(char *dst, const char *src, size_t size)
+{
+    size_t len = strlen(src);
+
+    if (size) {
+        size_t n = len < size - 1 ? len : size - 1;
+        memcpy(dst, src, n);
+        dst[n] = 0;
+    }
+
+    return len;
+}
+#endif
@@ -0,0 +1,112 @@
+/**
+ * @file flash.c  Host implementation of the esp_partition API
+ *
+ * The data partitions of partitions.csv used by the host build, kept in
+ * memory with the semantics of NOR flash: erased bytes are 0xff and a write
+ * can only clear bits.
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <esp_partition.h>
+
+#define SECTOR_SIZE 4096
+
+struct part {
+    esp_partition_t p;
+    uint8_t *mem;
+};
+
+static struct part parts[] = {
+    { .p = { .type = ESP_PARTITION_TYPE_DATA, .subtype = 0x41,
+             .address = 0x318000, .size = 0x30000, .label = "history" } },
+};
+
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+
+
+static uint8_t *mem(const esp_partition_t *p, size_t off, size_t size)
+{
+    struct part *part = (struct part *) p;
+
+    if (off > p->size || size > p->size - off)
+        return NULL;
+
+    if (!part->mem) {
+        part->mem = malloc(p->size);
+        if (!part->mem)
+            return NULL;
+
+        memset(part->mem, 0xff, p->size);
+    }
+
+    return part->mem + off;
+}
+
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type,
+        esp_partition_subtype_t subtype, const char *label)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+        if (parts[i].p.type == type && parts[i].p.subtype == subtype &&
+                (!label || !strcmp(parts[i].p.label, label)))
+            return &parts[i].p;
+    }
+
+    return NULL;
+}
+
+
+esp_err_t esp_partition_read(const esp_partition_t *part, size_t src_offset,
+                             void *dst, size_t size)
+{
+    uint8_t *m;
+
+    pthread_mutex_lock(&mtx);
+    m = mem(part, src_offset, size);
+    if (m)
+        memcpy(dst, m, size);
+    pthread_mutex_unlock(&mtx);
+
+    return m ? ESP_OK : ESP_ERR_INVALID_SIZE;
+}
+
+
+esp_err_t esp_partition_write(const esp_partition_t *part, size_t dst_offset,
+                              const void *src, size_t size)
+{
+    const uint8_t *s = src;
+    uint8_t *m;
+    size_t i;
+
+    pthread_mutex_lock(&mtx);
+    m = mem(part, dst_offset, size);
+    for (i = 0; m && i < size; i++)
+        m[i] &= s[i];
+    pthread_mutex_unlock(&mtx);
+
+    return m ? ESP_OK : ESP_ERR_INVALID_SIZE;
+}
+
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *part,
+                                    size_t offset, size_t size)
+{
+    uint8_t *m;
+
+    if (offset % SECTOR_SIZE || size % SECTOR_SIZE)
+        return ESP_ERR_INVALID_ARG;
+
+    pthread_mutex_lock(&mtx);
+    m = mem(part, offset, size);
+    if (m)
+        memset(m, 0xff, size);
+    pthread_mutex_unlock(&mtx);
+
+    return m ? ESP_OK : ESP_ERR_INVALID_SIZE;
+}
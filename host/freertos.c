@@ -0,0 +1,407 @@
+/**
+ * @file freertos.c  Host implementation of the FreeRTOS subset, tasks are
+ *                   pthreads, queues use a mutex and condition variables
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+struct host_task {
+    pthread_t thread;
+    char name[16];
+    TaskFunction_t fn;
+    void *arg;
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    uint32_t notify;
+    uint32_t stack;
+};
+
+struct host_queue {
+    pthread_mutex_t mtx;
+    pthread_cond_t can_recv;
+    pthread_cond_t can_send;
+    size_t item_size;
+    size_t len;
+    size_t cnt;
+    size_t head;
+    bool is_static;
+    uint8_t *data;
+};
+
+_Static_assert(sizeof(struct host_task) <= sizeof(StaticTask_t),
+               "StaticTask_t too small");
+_Static_assert(sizeof(struct host_queue) <= sizeof(StaticQueue_t),
+               "StaticQueue_t too small");
+
+static __thread struct host_task *current;
+
+
+static struct timespec deadline(TickType_t ticks)
+{
+    struct timespec ts;
+    uint64_t ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ns = (uint64_t) ticks * (1000000000 / configTICK_RATE_HZ) + ts.tv_nsec;
+    ts.tv_sec += ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    return ts;
+}
+
+
+static void cond_init(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+
+/* Waits on cond, returns false on timeout */
+static bool cond_wait(pthread_cond_t *cond, pthread_mutex_t *mtx,
+                      TickType_t ticks, const struct timespec *ts)
+{
+    if (ticks == portMAX_DELAY)
+        return !pthread_cond_wait(cond, mtx);
+
+    return pthread_cond_timedwait(cond, mtx, ts) != ETIMEDOUT;
+}
+
+
+static void *task_main(void *arg)
+{
+    struct host_task *t = arg;
+
+    current = t;
+    t->fn(t->arg);
+    return NULL;
+}
+
+
+static void task_init(struct host_task *t, const char *name)
+{
+    snprintf(t->name, sizeof(t->name), "%s", name);
+    pthread_mutex_init(&t->mtx, NULL);
+    cond_init(&t->cond);
+}
+
+
+static struct host_task *task_new(const char *name)
+{
+    struct host_task *t = calloc(1, sizeof(*t));
+
+    if (t)
+        task_init(t, name);
+
+    return t;
+}
+
+
+static bool task_start(struct host_task *t, TaskFunction_t fn, void *arg)
+{
+    pthread_attr_t attr;
+    int err;
+
+    t->fn  = fn;
+    t->arg = arg;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    err = pthread_create(&t->thread, &attr, task_main, t);
+    pthread_attr_destroy(&attr);
+    return !err;
+}
+
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack,
+                       void *arg, UBaseType_t prio, TaskHandle_t *handle)
+{
+    struct host_task *t;
+    (void) prio;
+
+    t = task_new(name);
+    if (!t)
+        return pdFAIL;
+
+    t->stack = stack;
+
+    if (!task_start(t, fn, arg)) {
+        free(t);
+        return pdFAIL;
+    }
+
+    if (handle)
+        *handle = t;
+
+    return pdPASS;
+}
+
+
+TaskHandle_t xTaskCreateStatic(TaskFunction_t fn, const char *name,
+                               uint32_t stack, void *arg, UBaseType_t prio,
+                               StackType_t *stack_buf, StaticTask_t *tcb)
+{
+    struct host_task *t = (struct host_task *) tcb;
+    (void) prio;
+    (void) stack_buf;
+
+    memset(t, 0, sizeof(*t));
+    task_init(t, name);
+    t->stack = stack;
+    return task_start(t, fn, arg) ? t : NULL;
+}
+
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name,
+                                   uint32_t stack, void *arg,
+                                   UBaseType_t prio, TaskHandle_t *handle,
+                                   BaseType_t core)
+{
+    (void) core;
+    return xTaskCreate(fn, name, stack, arg, prio, handle);
+}
+
+
+void vTaskDelete(TaskHandle_t task)
+{
+    if (!task || task == current)
+        pthread_exit(NULL);
+}
+
+
+void vTaskDelay(TickType_t ticks)
+{
+    struct timespec ts = deadline(ticks);
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+           EINTR)
+        ;
+}
+
+
+TickType_t xTaskGetTickCount(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (TickType_t) (ts.tv_sec * configTICK_RATE_HZ +
+                         ts.tv_nsec / (1000000000 / configTICK_RATE_HZ));
+}
+
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    /* threads not created by xTaskCreate(), e.g. main() */
+    if (!current)
+        current = task_new("main");
+
+    return current;
+}
+
+
+const char *pcTaskGetName(TaskHandle_t task)
+{
+    if (!task)
+        task = xTaskGetCurrentTaskHandle();
+
+    return task->name;
+}
+
+
+/* ESP-IDF system tasks do not exist on the host */
+TaskHandle_t xTaskGetHandle(const char *name)
+{
+    (void) name;
+    return NULL;
+}
+
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task)
+{
+    if (!task)
+        task = xTaskGetCurrentTaskHandle();
+
+    return task->stack;
+}
+
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+    struct host_task *t = xTaskGetCurrentTaskHandle();
+    struct timespec ts = deadline(ticks);
+    uint32_t val;
+
+    pthread_mutex_lock(&t->mtx);
+    while (!t->notify) {
+        if (!ticks || !cond_wait(&t->cond, &t->mtx, ticks, &ts))
+            break;
+    }
+
+    val = t->notify;
+    if (val)
+        t->notify = clear ? 0 : val - 1;
+    pthread_mutex_unlock(&t->mtx);
+
+    return val;
+}
+
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    pthread_mutex_lock(&task->mtx);
+    task->notify++;
+    pthread_cond_signal(&task->cond);
+    pthread_mutex_unlock(&task->mtx);
+    return pdPASS;
+}
+
+
+static void queue_init(struct host_queue *q, UBaseType_t len,
+                       UBaseType_t item_size, uint8_t *data)
+{
+    pthread_mutex_init(&q->mtx, NULL);
+    cond_init(&q->can_recv);
+    cond_init(&q->can_send);
+    q->len = len;
+    q->item_size = item_size;
+    q->data = data;
+}
+
+
+QueueHandle_t xQueueCreate(UBaseType_t len, UBaseType_t item_size)
+{
+    struct host_queue *q = calloc(1, sizeof(*q) + len * item_size);
+
+    if (!q)
+        return NULL;
+
+    queue_init(q, len, item_size, (uint8_t *) (q + 1));
+    return q;
+}
+
+
+QueueHandle_t xQueueCreateStatic(UBaseType_t len, UBaseType_t item_size,
+                                 uint8_t *storage, StaticQueue_t *buf)
+{
+    struct host_queue *q = (struct host_queue *) buf;
+
+    memset(q, 0, sizeof(*q));
+    queue_init(q, len, item_size, storage);
+    q->is_static = true;
+    return q;
+}
+
+
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t ticks)
+{
+    struct timespec ts = deadline(ticks);
+
+    pthread_mutex_lock(&q->mtx);
+    while (q->cnt == q->len) {
+        if (!ticks || !cond_wait(&q->can_send, &q->mtx, ticks, &ts)) {
+            pthread_mutex_unlock(&q->mtx);
+            return pdFAIL;
+        }
+    }
+
+    if (item)
+        memcpy(q->data + ((q->head + q->cnt) % q->len) * q->item_size, item,
+               q->item_size);
+    q->cnt++;
+    pthread_cond_signal(&q->can_recv);
+    pthread_mutex_unlock(&q->mtx);
+    return pdPASS;
+}
+
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t ticks)
+{
+    struct timespec ts = deadline(ticks);
+
+    pthread_mutex_lock(&q->mtx);
+    while (!q->cnt) {
+        if (!ticks || !cond_wait(&q->can_recv, &q->mtx, ticks, &ts)) {
+            pthread_mutex_unlock(&q->mtx);
+            return pdFAIL;
+        }
+    }
+
+    if (item)
+        memcpy(item, q->data + q->head * q->item_size, q->item_size);
+    q->head = (q->head + 1) % q->len;
+    q->cnt--;
+    pthread_cond_signal(&q->can_send);
+    pthread_mutex_unlock(&q->mtx);
+    return pdPASS;
+}
+
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q)
+{
+    UBaseType_t cnt;
+
+    pthread_mutex_lock(&q->mtx);
+    cnt = q->cnt;
+    pthread_mutex_unlock(&q->mtx);
+    return cnt;
+}
+
+
+void vQueueDelete(QueueHandle_t q)
+{
+    if (!q->is_static)
+        free(q);
+}
+
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t init)
+{
+    QueueHandle_t q = xQueueCreate(max, 0);
+
+    if (q)
+        q->cnt = init;
+
+    return q;
+}
+
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return xSemaphoreCreateCounting(1, 0);
+}
+
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return xSemaphoreCreateCounting(1, 1);
+}
+
+
+SemaphoreHandle_t xSemaphoreCreateCountingStatic(UBaseType_t max,
+                                                 UBaseType_t init,
+                                                 StaticSemaphore_t *buf)
+{
+    QueueHandle_t q = xQueueCreateStatic(max, 0, NULL, buf);
+
+    q->cnt = init;
+    return q;
+}
+
+
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t *buf)
+{
+    return xSemaphoreCreateCountingStatic(1, 1, buf);
+}
@@ -0,0 +1,960 @@
+/**
+ * @file httpd.c  Host implementation of the esp_http_server subset used by
+ *                webui.c
+ *
+ * Like the ESP-IDF server, one thread runs an event loop over the listening
+ * and the client sockets and calls the URI handlers synchronously. Requests
+ * handed over with httpd_req_async_handler_begin() are detached from the
+ * loop until httpd_req_async_handler_complete().
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <esp_log.h>
+#include <esp_http_server.h>
+
+#define RECV_BUF   4096
+#define HDR_MAX    2048
+#define READY_MAX  64
+
+static const char *TAG = "httpd";
+
+uint16_t httpd_host_port = 8080;
+
+struct server;
+
+struct conn {
+    int fd;
+    struct server *srv;
+    char buf[RECV_BUF];     /* received, not yet consumed bytes */
+    size_t len;
+    bool busy;              /* owned by an async handler */
+    bool close;
+    unsigned long used;     /* for LRU purge */
+};
+
+struct req_aux {
+    struct conn *c;
+    char hdr[HDR_MAX];
+    size_t body_remain;
+    char status[48];
+    char type[64];
+    char extra[512];
+    size_t extra_len;
+    bool http10;
+    bool hdr_sent;
+    bool done;
+    bool detached;
+};
+
+struct server {
+    httpd_config_t cfg;
+    int lfd;
+    int ep;
+    int evfd;
+    pthread_t thread;
+    volatile bool run;
+    httpd_uri_t *uris;
+    size_t nuris;
+    struct conn **conns;
+    unsigned long use_cnt;
+    pthread_mutex_t mtx;
+    struct conn *ready[READY_MAX];
+    size_t nready;
+};
+
+
+static int wait_fd(int fd, short events, int timeout_s)
+{
+    struct pollfd pfd = { .fd = fd, .events = events };
+    int n;
+
+    do {
+        n = poll(&pfd, 1, timeout_s * 1000);
+    } while (n < 0 && errno == EINTR);
+
+    return n;
+}
+
+
+static int send_all(struct conn *c, const struct iovec *iov, int cnt)
+{
+    struct iovec v[4];
+    ssize_t n;
+    int i;
+
+    memcpy(v, iov, cnt * sizeof(*iov));
+    i = 0;
+    while (i < cnt) {
+        n = writev(c->fd, v + i, cnt - i);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            if (wait_fd(c->fd, POLLOUT, c->srv->cfg.send_wait_timeout) <= 0)
+                return HTTPD_SOCK_ERR_TIMEOUT;
+            continue;
+        }
+
+        if (n < 0)
+            return HTTPD_SOCK_ERR_FAIL;
+
+        while (i < cnt && (size_t) n >= v[i].iov_len) {
+            n -= v[i].iov_len;
+            i++;
+        }
+
+        if (i < cnt) {
+            v[i].iov_base = (char *) v[i].iov_base + n;
+            v[i].iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Reads more bytes into the connection buffer */
+static int conn_fill(struct conn *c, int timeout_s)
+{
+    ssize_t n;
+
+    if (c->len == sizeof(c->buf))
+        return HTTPD_SOCK_ERR_INVALID;
+
+    while (true) {
+        n = recv(c->fd, c->buf + c->len, sizeof(c->buf) - c->len,
+                 MSG_DONTWAIT);
+        if (n > 0) {
+            c->len += n;
+            return n;
+        }
+
+        if (n == 0)
+            return HTTPD_SOCK_ERR_FAIL;
+
+        if (errno != EAGAIN && errno != EINTR)
+            return HTTPD_SOCK_ERR_FAIL;
+
+        if (wait_fd(c->fd, POLLIN, timeout_s) <= 0)
+            return HTTPD_SOCK_ERR_TIMEOUT;
+    }
+}
+
+
+static void conn_consume(struct conn *c, size_t n)
+{
+    memmove(c->buf, c->buf + n, c->len - n);
+    c->len -= n;
+}
+
+
+static void conn_close(struct conn *c)
+{
+    struct server *srv = c->srv;
+    size_t i;
+
+    pthread_mutex_lock(&srv->mtx);
+    for (i = 0; i < srv->cfg.max_open_sockets; i++) {
+        if (srv->conns[i] == c)
+            srv->conns[i] = NULL;
+    }
+    pthread_mutex_unlock(&srv->mtx);
+
+    epoll_ctl(srv->ep, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c);
+}
+
+
+static void conn_arm(struct conn *c)
+{
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT };
+
+    ev.data.ptr = c;
+    epoll_ctl(c->srv->ep, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+
+static const char *hdr_find(const struct req_aux *aux, const char *field,
+                            size_t *len)
+{
+    size_t l = strlen(field);
+    const char *p = aux->hdr;
+    const char *e;
+
+    while (*p) {
+        e = strstr(p, "\r\n");
+        if (!e)
+            e = p + strlen(p);
+
+        if ((size_t) (e - p) > l && !strncasecmp(p, field, l) && p[l] == ':') {
+            p += l + 1;
+            p += strspn(p, " \t");
+            *len = e - p;
+            return p;
+        }
+
+        p = *e ? e + 2 : e;
+    }
+
+    return NULL;
+}
+
+
+static esp_err_t send_header(httpd_req_t *r, bool chunked, size_t len)
+{
+    struct req_aux *aux = r->aux;
+    char hdr[256];
+    struct iovec iov[3];
+    int n;
+
+    n = snprintf(hdr, sizeof(hdr), "HTTP/1.1 %s\r\nContent-Type: %s\r\n",
+                 aux->status, aux->type);
+    if (chunked)
+        n += snprintf(hdr + n, sizeof(hdr) - n,
+                      "Transfer-Encoding: chunked\r\n");
+    else
+        n += snprintf(hdr + n, sizeof(hdr) - n, "Content-Length: %zu\r\n",
+                      len);
+
+    if (aux->c->close)
+        n += snprintf(hdr + n, sizeof(hdr) - n, "Connection: close\r\n");
+
+    iov[0].iov_base = hdr;
+    iov[0].iov_len  = n;
+    iov[1].iov_base = aux->extra;
+    iov[1].iov_len  = aux->extra_len;
+    iov[2].iov_base = "\r\n";
+    iov[2].iov_len  = 2;
+    aux->hdr_sent = true;
+    return send_all(aux->c, iov, 3) ? ESP_ERR_HTTPD_RESP_HDR : ESP_OK;
+}
+
+
+esp_err_t httpd_resp_set_status(httpd_req_t *r, const char *status)
+{
+    struct req_aux *aux = r->aux;
+
+    snprintf(aux->status, sizeof(aux->status), "%s", status);
+    return ESP_OK;
+}
+
+
+esp_err_t httpd_resp_set_type(httpd_req_t *r, const char *type)
+{
+    struct req_aux *aux = r->aux;
+
+    snprintf(aux->type, sizeof(aux->type), "%s", type);
+    return ESP_OK;
+}
+
+
+esp_err_t httpd_resp_set_hdr(httpd_req_t *r, const char *field,
+                             const char *value)
+{
+    struct req_aux *aux = r->aux;
+    int n;
+
+    n = snprintf(aux->extra + aux->extra_len,
+                 sizeof(aux->extra) - aux->extra_len, "%s: %s\r\n",
+                 field, value);
+    if (n < 0 || (size_t) n >= sizeof(aux->extra) - aux->extra_len)
+        return ESP_ERR_HTTPD_RESP_HDR;
+
+    aux->extra_len += n;
+    return ESP_OK;
+}
+
+
+esp_err_t httpd_resp_send(httpd_req_t *r, const char *buf, ssize_t buf_len)
+{
+    struct req_aux *aux = r->aux;
+    struct iovec iov;
+
+    if (aux->hdr_sent)
+        return ESP_ERR_HTTPD_RESP_SEND;
+
+    if (buf_len == HTTPD_RESP_USE_STRLEN)
+        buf_len = buf ? strlen(buf) : 0;
+
+    if (send_header(r, false, buf_len))
+        return ESP_ERR_HTTPD_RESP_HDR;
+
+    aux->done = true;
+    iov.iov_base = (void *) buf;
+    iov.iov_len  = buf_len;
+    return buf_len && send_all(aux->c, &iov, 1) ? ESP_ERR_HTTPD_RESP_SEND :
+                                                  ESP_OK;
+}
+
+
+esp_err_t httpd_resp_send_chunk(httpd_req_t *r, const char *buf,
+                                ssize_t buf_len)
+{
+    struct req_aux *aux = r->aux;
+    struct iovec iov[3];
+    char size[16];
+
+    if (aux->done)
+        return ESP_ERR_HTTPD_RESP_SEND;
+
+    if (buf_len == HTTPD_RESP_USE_STRLEN)
+        buf_len = buf ? strlen(buf) : 0;
+
+    if (!aux->hdr_sent && send_header(r, true, 0))
+        return ESP_ERR_HTTPD_RESP_HDR;
+
+    if (!buf || !buf_len) {
+        aux->done = true;
+        iov[0].iov_base = "0\r\n\r\n";
+        iov[0].iov_len  = 5;
+        return send_all(aux->c, iov, 1) ? ESP_ERR_HTTPD_RESP_SEND : ESP_OK;
+    }
+
+    iov[0].iov_base = size;
+    iov[0].iov_len  = snprintf(size, sizeof(size), "%zx\r\n", buf_len);
+    iov[1].iov_base = (void *) buf;
+    iov[1].iov_len  = buf_len;
+    iov[2].iov_base = "\r\n";
+    iov[2].iov_len  = 2;
+    return send_all(aux->c, iov, 3) ? ESP_ERR_HTTPD_RESP_SEND : ESP_OK;
+}
+
+
+esp_err_t httpd_resp_send_err(httpd_req_t *req, httpd_err_code_t error,
+                              const char *msg)
+{
+    const char *status;
+
+    switch (error) {
+    case HTTPD_400_BAD_REQUEST:  status = HTTPD_400; break;
+    case HTTPD_404_NOT_FOUND:    status = HTTPD_404; break;
+    case HTTPD_408_REQ_TIMEOUT:  status = HTTPD_408; break;
+    default:                     status = HTTPD_500; break;
+    }
+
+    httpd_resp_set_status(req, status);
+    httpd_resp_set_type(req, "text/plain");
+    return httpd_resp_send(req, msg ? msg : status, HTTPD_RESP_USE_STRLEN);
+}
+
+
+int httpd_req_recv(httpd_req_t *r, char *buf, size_t buf_len)
+{
+    struct req_aux *aux = r->aux;
+    struct conn *c = aux->c;
+    size_t n;
+    int err;
+
+    if (!aux->body_remain)
+        return 0;
+
+    if (!c->len) {
+        err = conn_fill(c, c->srv->cfg.recv_wait_timeout);
+        if (err < 0)
+            return err;
+    }
+
+    n = buf_len;
+    if (n > c->len)
+        n = c->len;
+    if (n > aux->body_remain)
+        n = aux->body_remain;
+
+    memcpy(buf, c->buf, n);
+    conn_consume(c, n);
+    aux->body_remain -= n;
+    return n;
+}
+
+
+size_t httpd_req_get_hdr_value_len(httpd_req_t *r, const char *field)
+{
+    size_t len;
+
+    return hdr_find(r->aux, field, &len) ? len : 0;
+}
+
+
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t *r, const char *field,
+                                      char *val, size_t val_size)
+{
+    const char *v;
+    size_t len;
+
+    v = hdr_find(r->aux, field, &len);
+    if (!v)
+        return ESP_ERR_NOT_FOUND;
+
+    if (!val_size)
+        return ESP_ERR_INVALID_ARG;
+
+    snprintf(val, val_size, "%.*s", (int) len, v);
+    return len >= val_size ? ESP_ERR_HTTPD_RESULT_TRUNC : ESP_OK;
+}
+
+
+size_t httpd_req_get_url_query_len(httpd_req_t *r)
+{
+    const char *q = strchr(r->uri, '?');
+
+    return q ? strlen(q + 1) : 0;
+}
+
+
+esp_err_t httpd_req_get_url_query_str(httpd_req_t *r, char *buf,
+                                      size_t buf_len)
+{
+    const char *q = strchr(r->uri, '?');
+
+    if (!q)
+        return ESP_ERR_NOT_FOUND;
+
+    if (!buf_len)
+        return ESP_ERR_INVALID_ARG;
+
+    snprintf(buf, buf_len, "%s", q + 1);
+    return strlen(q + 1) >= buf_len ? ESP_ERR_HTTPD_RESULT_TRUNC : ESP_OK;
+}
+
+
+esp_err_t httpd_query_key_value(const char *qry, const char *key, char *val,
+                                size_t val_size)
+{
+    size_t klen = strlen(key);
+    const char *p = qry;
+    const char *e;
+    size_t vlen;
+
+    while (p && *p) {
+        e = strchr(p, '&');
+        if (!e)
+            e = p + strlen(p);
+
+        if ((size_t) (e - p) > klen && !strncmp(p, key, klen) &&
+                p[klen] == '=') {
+            p += klen + 1;
+            vlen = e - p;
+            snprintf(val, val_size, "%.*s", (int) vlen, p);
+            return vlen >= val_size ? ESP_ERR_HTTPD_RESULT_TRUNC : ESP_OK;
+        }
+
+        p = *e ? e + 1 : NULL;
+    }
+
+    return ESP_ERR_NOT_FOUND;
+}
+
+
+int httpd_req_to_sockfd(httpd_req_t *r)
+{
+    struct req_aux *aux = r->aux;
+
+    return aux->c->fd;
+}
+
+
+static httpd_req_t *req_alloc(void)
+{
+    httpd_req_t *r = calloc(1, sizeof(*r) + sizeof(struct req_aux));
+
+    if (r)
+        r->aux = r + 1;
+
+    return r;
+}
+
+
+esp_err_t httpd_req_async_handler_begin(httpd_req_t *r, httpd_req_t **out)
+{
+    httpd_req_t *copy;
+    struct req_aux *aux = r->aux;
+
+    copy = req_alloc();
+    if (!copy)
+        return ESP_ERR_NO_MEM;
+
+    memcpy(copy, r, sizeof(*r));
+    copy->aux = copy + 1;
+    memcpy(copy->aux, aux, sizeof(*aux));
+    aux->detached = true;
+    aux->c->busy = true;
+    *out = copy;
+    return ESP_OK;
+}
+
+
+/* Finishes a request, returns true if the connection stays open */
+static bool req_finish(httpd_req_t *r, esp_err_t err)
+{
+    struct req_aux *aux = r->aux;
+    struct conn *c = aux->c;
+    char buf[256];
+
+    if (err == ESP_OK && !aux->hdr_sent)
+        httpd_resp_send(r, "", 0);
+
+    /* drain unread body */
+    while (err == ESP_OK && aux->body_remain) {
+        if (httpd_req_recv(r, buf, sizeof(buf)) <= 0)
+            err = ESP_FAIL;
+    }
+
+    if (err != ESP_OK || (aux->hdr_sent && !aux->done))
+        c->close = true;
+
+    return !c->close;
+}
+
+
+esp_err_t httpd_req_async_handler_complete(httpd_req_t *r)
+{
+    struct req_aux *aux = r->aux;
+    struct conn *c = aux->c;
+    struct server *srv = c->srv;
+    bool keep;
+    uint64_t one = 1;
+
+    keep = req_finish(r, ESP_OK);
+    free(r);
+    if (!keep) {
+        conn_close(c);
+        return ESP_OK;
+    }
+
+    /* under the lock so free_slot() cannot purge it in between */
+    pthread_mutex_lock(&srv->mtx);
+    if (!c->len) {
+        c->busy = false;
+        conn_arm(c);
+        pthread_mutex_unlock(&srv->mtx);
+        return ESP_OK;
+    }
+
+    /* pipelined request already buffered, let the loop process it, the
+     * connection stays busy until then */
+    if (srv->nready < READY_MAX)
+        srv->ready[srv->nready++] = c;
+    pthread_mutex_unlock(&srv->mtx);
+    if (write(srv->evfd, &one, sizeof(one)) < 0)
+        ESP_LOGE(TAG, "eventfd write failed");
+
+    return ESP_OK;
+}
+
+
+static const httpd_uri_t *find_uri(struct server *srv, const char *uri,
+                                   int method, bool *path_found)
+{
+    size_t plen = strcspn(uri, "?");
+    size_t i;
+
+    *path_found = false;
+    for (i = 0; i < srv->nuris; i++) {
+        if (strlen(srv->uris[i].uri) != plen ||
+                strncmp(srv->uris[i].uri, uri, plen))
+            continue;
+
+        *path_found = true;
+        if ((int) srv->uris[i].method == method)
+            return &srv->uris[i];
+    }
+
+    return NULL;
+}
+
+
+static int parse_method(const char *m, size_t len)
+{
+    static const struct {
+        const char *name;
+        int method;
+    } methods[] = {
+        { "GET", HTTP_GET },
+        { "POST", HTTP_POST },
+        { "HEAD", HTTP_HEAD },
+        { "PUT", HTTP_PUT },
+        { "DELETE", HTTP_DELETE },
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+        if (strlen(methods[i].name) == len &&
+                !strncmp(methods[i].name, m, len))
+            return methods[i].method;
+    }
+
+    return -1;
+}
+
+
+/* Reads and dispatches one request, returns false if the connection is
+ * closed or detached */
+static bool handle_request(struct conn *c)
+{
+    struct server *srv = c->srv;
+    const httpd_uri_t *h;
+    httpd_req_t *r;
+    struct req_aux *aux;
+    char *end, *sp1, *sp2, *eol;
+    const char *v;
+    size_t len, hlen;
+    bool found;
+    esp_err_t err;
+
+    while (!(end = memmem(c->buf, c->len, "\r\n\r\n", 4))) {
+        if (conn_fill(c, srv->cfg.recv_wait_timeout) < 0) {
+            conn_close(c);
+            return false;
+        }
+    }
+
+    r = req_alloc();
+    if (!r) {
+        conn_close(c);
+        return false;
+    }
+
+    aux = r->aux;
+    aux->c = c;
+    r->handle = srv;
+    strcpy(aux->status, HTTPD_200);
+    strcpy(aux->type, HTTPD_TYPE_TEXT);
+
+    eol = memmem(c->buf, end + 2 - c->buf, "\r\n", 2);
+    sp1 = memchr(c->buf, ' ', eol - c->buf);
+    sp2 = sp1 ? memchr(sp1 + 1, ' ', eol - sp1 - 1) : NULL;
+    r->method = sp1 ? parse_method(c->buf, sp1 - c->buf) : -1;
+    len = sp2 ? (size_t) (sp2 - sp1 - 1) : 0;
+    if (!sp2 || len > HTTPD_MAX_URI_LEN || r->method < 0) {
+        c->close = true;
+        httpd_resp_send_err(r, HTTPD_400_BAD_REQUEST, NULL);
+        free(r);
+        conn_close(c);
+        return false;
+    }
+
+    memcpy((char *) r->uri, sp1 + 1, len);
+    aux->http10 = !strncmp(sp2 + 1, "HTTP/1.0", 8);
+
+    hlen = end + 2 - (eol + 2);
+    if (hlen >= sizeof(aux->hdr))
+        hlen = sizeof(aux->hdr) - 1;
+    memcpy(aux->hdr, eol + 2, hlen);
+    conn_consume(c, end + 4 - c->buf);
+
+    if ((v = hdr_find(aux, "Content-Length", &len)))
+        r->content_len = strtoul(v, NULL, 10);
+    aux->body_remain = r->content_len;
+
+    c->close = aux->http10;
+    if ((v = hdr_find(aux, "Connection", &len))) {
+        if (!strncasecmp(v, "close", 5))
+            c->close = true;
+        else if (!strncasecmp(v, "keep-alive", 10))
+            c->close = false;
+    }
+
+    h = find_uri(srv, r->uri, r->method, &found);
+    if (h) {
+        r->user_ctx = h->user_ctx;
+        err = h->handler(r);
+    }
+    else {
+        err = httpd_resp_send_err(r, HTTPD_404_NOT_FOUND, found ?
+                                  "Method not allowed" : "Not found");
+    }
+
+    if (aux->detached) {
+        free(r);
+        return false;
+    }
+
+    if (!req_finish(r, err)) {
+        free(r);
+        conn_close(c);
+        return false;
+    }
+
+    free(r);
+    return true;
+}
+
+
+static void process(struct conn *c)
+{
+    c->used = ++c->srv->use_cnt;
+    while (handle_request(c)) {
+        if (!c->len) {
+            conn_arm(c);
+            return;
+        }
+    }
+}
+
+
+static void set_keepalive(struct server *srv, int fd)
+{
+    int one = 1;
+
+    if (!srv->cfg.keep_alive_enable)
+        return;
+
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &srv->cfg.keep_alive_idle,
+               sizeof(int));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &srv->cfg.keep_alive_interval,
+               sizeof(int));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &srv->cfg.keep_alive_count,
+               sizeof(int));
+}
+
+
+/* Returns a free connection slot, purges the least recently used idle
+ * connection if enabled */
+static size_t free_slot(struct server *srv)
+{
+    struct conn *c, *lru = NULL;
+    size_t i;
+
+    pthread_mutex_lock(&srv->mtx);
+    for (i = 0; i < srv->cfg.max_open_sockets; i++) {
+        c = srv->conns[i];
+        if (!c) {
+            pthread_mutex_unlock(&srv->mtx);
+            return i;
+        }
+
+        if (!c->busy && (!lru || c->used < lru->used))
+            lru = c;
+    }
+    pthread_mutex_unlock(&srv->mtx);
+
+    if (!srv->cfg.lru_purge_enable || !lru)
+        return SIZE_MAX;
+
+    ESP_LOGD(TAG, "purging LRU socket %d", lru->fd);
+    conn_close(lru);
+    return free_slot(srv);
+}
+
+
+static void accept_conn(struct server *srv)
+{
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT };
+    struct conn *c;
+    size_t slot;
+    int fd;
+
+    fd = accept4(srv->lfd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    slot = free_slot(srv);
+    if (slot == SIZE_MAX) {
+        close(fd);
+        return;
+    }
+
+    if (srv->cfg.open_fn && srv->cfg.open_fn(srv, fd) != ESP_OK) {
+        close(fd);
+        return;
+    }
+
+    c = calloc(1, sizeof(*c));
+    if (!c) {
+        close(fd);
+        return;
+    }
+
+    set_keepalive(srv, fd);
+    c->fd = fd;
+    c->srv = srv;
+    c->used = ++srv->use_cnt;
+    pthread_mutex_lock(&srv->mtx);
+    srv->conns[slot] = c;
+    pthread_mutex_unlock(&srv->mtx);
+    ev.data.ptr = c;
+    epoll_ctl(srv->ep, EPOLL_CTL_ADD, fd, &ev);
+}
+
+
+static void process_ready(struct server *srv)
+{
+    struct conn *ready[READY_MAX];
+    uint64_t val;
+    size_t i, n;
+
+    if (read(srv->evfd, &val, sizeof(val)) < 0)
+        return;
+
+    pthread_mutex_lock(&srv->mtx);
+    n = srv->nready;
+    memcpy(ready, srv->ready, n * sizeof(*ready));
+    srv->nready = 0;
+    pthread_mutex_unlock(&srv->mtx);
+
+    for (i = 0; i < n; i++) {
+        ready[i]->busy = false;
+        process(ready[i]);
+    }
+}
+
+
+static void *server_loop(void *arg)
+{
+    struct server *srv = arg;
+    struct epoll_event evs[16];
+    bool acc;
+    int i, n;
+
+    while (srv->run) {
+        n = epoll_wait(srv->ep, evs, 16, -1);
+        acc = false;
+        for (i = 0; i < n; i++) {
+            if (evs[i].data.ptr == &srv->lfd)
+                acc = true;
+            else if (evs[i].data.ptr == &srv->evfd)
+                process_ready(srv);
+            else
+                process(evs[i].data.ptr);
+        }
+
+        /* accept last, an LRU purge must not free a connection that still
+         * has an event in this batch */
+        if (acc)
+            accept_conn(srv);
+    }
+
+    return NULL;
+}
+
+
+esp_err_t httpd_start(httpd_handle_t *handle, const httpd_config_t *config)
+{
+    struct sockaddr_in6 addr = { 0 };
+    struct epoll_event ev = { .events = EPOLLIN };
+    struct server *srv;
+    int one = 1;
+    int zero = 0;
+
+    if (!handle || !config)
+        return ESP_ERR_INVALID_ARG;
+
+    signal(SIGPIPE, SIG_IGN);
+    srv = calloc(1, sizeof(*srv));
+    if (!srv)
+        return ESP_ERR_HTTPD_ALLOC_MEM;
+
+    srv->cfg   = *config;
+    srv->uris  = calloc(config->max_uri_handlers, sizeof(*srv->uris));
+    srv->conns = calloc(config->max_open_sockets, sizeof(*srv->conns));
+    pthread_mutex_init(&srv->mtx, NULL);
+    srv->lfd  = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    srv->ep   = epoll_create1(EPOLL_CLOEXEC);
+    srv->evfd = eventfd(0, EFD_CLOEXEC);
+    if (!srv->uris || !srv->conns || srv->lfd < 0 || srv->ep < 0 ||
+            srv->evfd < 0)
+        goto fail;
+
+    setsockopt(srv->lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(srv->lfd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_port   = htons(config->server_port);
+    addr.sin6_addr   = in6addr_any;
+    if (bind(srv->lfd, (struct sockaddr *) &addr, sizeof(addr)) ||
+            listen(srv->lfd, config->backlog_conn)) {
+        ESP_LOGE(TAG, "bind/listen port %u: %s", config->server_port,
+                 strerror(errno));
+        goto fail;
+    }
+
+    ev.data.ptr = &srv->lfd;
+    epoll_ctl(srv->ep, EPOLL_CTL_ADD, srv->lfd, &ev);
+    ev.data.ptr = &srv->evfd;
+    epoll_ctl(srv->ep, EPOLL_CTL_ADD, srv->evfd, &ev);
+
+    srv->run = true;
+    if (pthread_create(&srv->thread, NULL, server_loop, srv))
+        goto fail;
+
+    *handle = srv;
+    return ESP_OK;
+
+ fail:
+    if (srv->lfd >= 0)
+        close(srv->lfd);
+    if (srv->ep >= 0)
+        close(srv->ep);
+    if (srv->evfd >= 0)
+        close(srv->evfd);
+    free(srv->uris);
+    free(srv->conns);
+    free(srv);
+    return ESP_ERR_HTTPD_TASK;
+}
+
+
+esp_err_t httpd_stop(httpd_handle_t handle)
+{
+    struct server *srv = handle;
+    uint64_t one = 1;
+    size_t i;
+
+    if (!srv)
+        return ESP_ERR_INVALID_ARG;
+
+    srv->run = false;
+    if (write(srv->evfd, &one, sizeof(one)) < 0)
+        ESP_LOGE(TAG, "eventfd write failed");
+    pthread_join(srv->thread, NULL);
+
+    for (i = 0; i < srv->cfg.max_open_sockets; i++) {
+        if (srv->conns[i] && !srv->conns[i]->busy)
+            conn_close(srv->conns[i]);
+    }
+
+    close(srv->lfd);
+    close(srv->ep);
+    close(srv->evfd);
+    free(srv->uris);
+    free(srv->conns);
+    free(srv);
+    return ESP_OK;
+}
+
+
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle,
+                                     const httpd_uri_t *uri_handler)
+{
+    struct server *srv = handle;
+    size_t i;
+
+    if (!srv || !uri_handler)
+        return ESP_ERR_INVALID_ARG;
+
+    for (i = 0; i < srv->nuris; i++) {
+        if (!strcmp(srv->uris[i].uri, uri_handler->uri) &&
+                srv->uris[i].method == uri_handler->method)
+            return ESP_ERR_HTTPD_HANDLER_EXISTS;
+    }
+
+    if (srv->nuris == srv->cfg.max_uri_handlers)
+        return ESP_ERR_HTTPD_HANDLERS_FULL;
+
+    srv->uris[srv->nuris++] = *uri_handler;
+    return ESP_OK;
+}
@@ -0,0 +1,11 @@
+/**
+ * @file esp_attr.h  Host shim, no memory placement on the host
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+#ifndef ESP_ATTR_H
+#define ESP_ATTR_H
+#define IRAM_ATTR
+#define DRAM_ATTR
+#define RTC_NOINIT_ATTR
+#endif
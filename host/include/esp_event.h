@@ -0,0 +1,16 @@
+/**
+ * @file esp_event.h  Host shim
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+#ifndef ESP_EVENT_H
+#define ESP_EVENT_H
+#include <stdint.h>
+#include "esp_err.h"
+
+typedef const char *esp_event_base_t;
+typedef void (*esp_event_handler_t)(void *arg, esp_event_base_t base,
+                                    int32_t id, void *data);
+
+#define ESP_EVENT_ANY_ID -1
+#endif
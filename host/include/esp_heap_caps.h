@@ -0,0 +1,27 @@
+/**
+ * @file esp_heap_caps.h  Host shim
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+#ifndef ESP_HEAP_CAPS_H
+#define ESP_HEAP_CAPS_H
+#include <stddef.h>
+#include <stdint.h>
+
+#define MALLOC_CAP_EXEC      (1 << 0)
+#define MALLOC_CAP_DMA       (1 << 3)
+#define MALLOC_CAP_INTERNAL  (1 << 11)
+
+typedef struct {
+    size_t total_free_bytes;
+    size_t total_allocated_bytes;
+    size_t largest_free_block;
+    size_t minimum_free_bytes;
+    size_t allocated_blocks;
+    size_t free_blocks;
+    size_t total_blocks;
+} multi_heap_info_t;
+
+/* no heap statistics on the host, all zero */
+void heap_caps_get_info(multi_heap_info_t *info, uint32_t caps);
+#endif
@@ -0,0 +1,22 @@
+/**
+ * @file esp_idf_version.h  Host shim
+ *
+ * The host build behaves like IDF 5.1, the minimum of
+ * main/idf_component.yml.
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+#ifndef ESP_IDF_VERSION_H
+#define ESP_IDF_VERSION_H
+
+#define ESP_IDF_VERSION_MAJOR 5
+#define ESP_IDF_VERSION_MINOR 1
+#define ESP_IDF_VERSION_PATCH 0
+
+#define ESP_IDF_VERSION_VAL(major, minor, patch) \
+    (((major) << 16) | ((minor) << 8) | (patch))
+
+#define ESP_IDF_VERSION ESP_IDF_VERSION_VAL(ESP_IDF_VERSION_MAJOR, \
+                                            ESP_IDF_VERSION_MINOR, \
+                                            ESP_IDF_VERSION_PATCH)
+#endif
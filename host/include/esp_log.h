@@ -0,0 +1,23 @@
+/**
+ * @file esp_log.h  Host shim of the ESP-IDF logging macros
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+#ifndef ESP_LOG_H
+#define ESP_LOG_H
+#include <stdio.h>
+#include "esp_err.h"
+
+extern int esp_log_level;
+
+#define ESP_HOST_LOG(l, c, tag, fmt, ...) do {                          \
+        if (esp_log_level >= (l))                                       \
+            fprintf(stderr, c " (%s) " fmt "\n", tag, ##__VA_ARGS__);   \
+    } while (0)
+
+#define ESP_LOGE(tag, fmt, ...) ESP_HOST_LOG(1, "E", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) ESP_HOST_LOG(2, "W", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) ESP_HOST_LOG(3, "I", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) ESP_HOST_LOG(4, "D", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGV(tag, fmt, ...) ESP_HOST_LOG(5, "V", tag, fmt, ##__VA_ARGS__)
+#endif
@@ -0,0 +1,33 @@
+/**
+ * @file esp_system.h  Host shim
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+#ifndef ESP_SYSTEM_H
+#define ESP_SYSTEM_H
+#include <stdint.h>
+#include "esp_err.h"
+
+typedef enum {
+    ESP_RST_UNKNOWN,
+    ESP_RST_POWERON,
+    ESP_RST_EXT,
+    ESP_RST_SW,
+    ESP_RST_PANIC,
+    ESP_RST_INT_WDT,
+    ESP_RST_TASK_WDT,
+    ESP_RST_WDT,
+    ESP_RST_DEEPSLEEP,
+    ESP_RST_BROWNOUT,
+    ESP_RST_SDIO,
+} esp_reset_reason_t;
+
+/* reported by esp_reset_reason() */
+extern esp_reset_reason_t host_reset_reason;
+
+void esp_restart(void) __attribute__((noreturn));
+uint32_t esp_get_free_heap_size(void);
+uint32_t esp_get_minimum_free_heap_size(void);
+uint32_t esp_random(void);
+esp_reset_reason_t esp_reset_reason(void);
+#endif
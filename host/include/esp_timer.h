@@ -0,0 +1,12 @@
+/**
+ * @file esp_timer.h  Host shim
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+#ifndef ESP_TIMER_H
+#define ESP_TIMER_H
+#include <stdint.h>
+
+/* Microseconds since start */
+int64_t esp_timer_get_time(void);
+#endif
@@ -0,0 +1,38 @@
+/**
+ * @file FreeRTOS.h  Host shim of the FreeRTOS subset used by the firmware,
+ *                   implemented with pthreads in freertos.c
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+#ifndef FREERTOS_H
+#define FREERTOS_H
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "esp_attr.h"
+
+typedef int32_t  BaseType_t;
+typedef uint32_t UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE  0
+#define pdTRUE   1
+#define pdPASS   pdTRUE
+#define pdFAIL   pdFALSE
+
+#define configTICK_RATE_HZ  1000
+#define portTICK_PERIOD_MS  (1000 / configTICK_RATE_HZ)
+#define portMAX_DELAY       ((TickType_t) 0xffffffff)
+#define pdMS_TO_TICKS(ms)   ((TickType_t) (ms) * configTICK_RATE_HZ / 1000)
+
+#define tskNO_AFFINITY      0x7fffffff
+
+/* Critical sections map to a mutex, sufficient for data protection */
+typedef pthread_mutex_t portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED PTHREAD_MUTEX_INITIALIZER
+#define portENTER_CRITICAL(mux)      pthread_mutex_lock(mux)
+#define portEXIT_CRITICAL(mux)       pthread_mutex_unlock(mux)
+#define portENTER_CRITICAL_ISR(mux)  pthread_mutex_lock(mux)
+#define portEXIT_CRITICAL_ISR(mux)   pthread_mutex_unlock(mux)
+#endif
@@ -0,0 +1,24 @@
+/**
+ * @file semphr.h  Host shim, semaphores are queues without payload
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+#ifndef SEMPHR_H
+#define SEMPHR_H
+#include "queue.h"
+
+typedef QueueHandle_t SemaphoreHandle_t;
+typedef StaticQueue_t StaticSemaphore_t;
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t init);
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+SemaphoreHandle_t xSemaphoreCreateCountingStatic(UBaseType_t max,
+                                                 UBaseType_t init,
+                                                 StaticSemaphore_t *buf);
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t *buf);
+
+#define xSemaphoreTake(s, ticks) xQueueReceive((s), NULL, (ticks))
+#define xSemaphoreGive(s)        xQueueSend((s), NULL, 0)
+#define vSemaphoreDelete(s)      vQueueDelete(s)
+#endif
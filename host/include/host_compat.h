@@ -0,0 +1,15 @@
+/**
+ * @file host_compat.h  Newlib functions missing in the host libc, included
+ *                      into every host compile unit
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+#ifndef HOST_COMPAT_H
+#define HOST_COMPAT_H
+#include <stddef.h>
+#include <string.h>
+
+#ifndef HAVE_STRLCPY
+size_t strlcpy(char *dst, const char *src, size_t size);
+#endif
+#endif
@@ -0,0 +1,8 @@
+#ifndef LWIP_SOCKETS_H
+#define LWIP_SOCKETS_H
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
@@ -0,0 +1,35 @@
+/**
+ * @file nvs.h  Host shim of the NVS API, backed by a file
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+#ifndef NVS_H
+#define NVS_H
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+typedef uint32_t nvs_handle_t;
+
+typedef enum {
+    NVS_READONLY,
+    NVS_READWRITE
+} nvs_open_mode_t;
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t mode, nvs_handle_t *h);
+void nvs_close(nvs_handle_t h);
+esp_err_t nvs_commit(nvs_handle_t h);
+esp_err_t nvs_erase_key(nvs_handle_t h, const char *key);
+esp_err_t nvs_erase_all(nvs_handle_t h);
+esp_err_t nvs_set_i32(nvs_handle_t h, const char *key, int32_t value);
+esp_err_t nvs_get_i32(nvs_handle_t h, const char *key, int32_t *value);
+esp_err_t nvs_set_u32(nvs_handle_t h, const char *key, uint32_t value);
+esp_err_t nvs_get_u32(nvs_handle_t h, const char *key, uint32_t *value);
+esp_err_t nvs_set_str(nvs_handle_t h, const char *key, const char *value);
+esp_err_t nvs_get_str(nvs_handle_t h, const char *key, char *value,
+                      size_t *len);
+esp_err_t nvs_set_blob(nvs_handle_t h, const char *key, const void *value,
+                       size_t len);
+esp_err_t nvs_get_blob(nvs_handle_t h, const char *key, void *value,
+                       size_t *len);
+#endif
@@ -0,0 +1,145 @@
+/**
+ * @file main.c  Host build of the web UI
+ *
+ * Serves the real webui.c handlers on localhost with a file backed NVS, for
+ * load tests and profiling without a board.
+ *
+ * Usage: pool_host [-p port] [-l log lines per second] [-m mqtt-uri]
+ *                  [-c coap-port] [-s syslog-host:port] [-H days] [-F] [-P]
+ *                  [-v]
+ *
+ * -F simulates low flow, -P a panic reset, for fleet monitoring tests. -H
+ * fills the history with minute samples of the last days, for exports.
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "nvs_flash.h"
+#include "log.h"
+#include "settings.h"
+#include "webui.h"
+#include "mqtt.h"
+#include "coap.h"
+#include "syslog.h"
+#include "history.h"
+#include "sysinfo.h"
+#include "mem.h"
+#include "memprof.h"
+#include "cmd.h"
+#include "stubs.h"
+
+static const char *TAG = "host";
+
+
+/* The main thread stands in for both control tasks */
+static void apply_cmds(void)
+{
+    struct cmd c;
+
+    while (cmd_take(CMD_BOX_POOL, &c) || cmd_take(CMD_BOX_MAIN, &c)) {
+        switch (c.type) {
+        case CMD_FORCE:
+            webui_set_force((enum force_run) c.arg);
+            cmd_done(&c, ESP_OK);
+            break;
+        case CMD_UPGRADE:
+            cmd_done(&c, ESP_ERR_NOT_SUPPORTED);
+            break;
+        case CMD_SWITCH:
+            history_event(HIST_EV_POLARITY, 0);
+            cmd_done(&c, ESP_OK);
+            break;
+        default:
+            cmd_done(&c, ESP_OK);
+            break;
+        }
+    }
+}
+
+
+int main(int argc, char *argv[])
+{
+    httpd_handle_t server;
+    const char *mqtt_uri = "";
+    const char *syslog_target = "";
+    unsigned rate = 0;
+    unsigned days = 0;
+    int coap_port = 0;
+    unsigned n = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:l:m:c:s:H:FPv")) != -1) {
+        switch (opt) {
+        case 'p': httpd_host_port = atoi(optarg); break;
+        case 'l': rate = atoi(optarg); break;
+        case 'm': mqtt_uri = optarg; break;
+        case 'c': coap_port = atoi(optarg); break;
+        case 's': syslog_target = optarg; break;
+        case 'H': days = atoi(optarg); break;
+        case 'F': host_low_flow = true; break;
+        case 'P': host_reset_reason = ESP_RST_PANIC; break;
+        case 'v': esp_log_level = 4; break;
+        default:
+            fprintf(stderr, "usage: pool_host [-p port] [-l lines/s] "
+                    "[-m mqtt-uri] [-c coap-port] [-s syslog-host:port] "
+                    "[-H days] [-F] [-P] [-v]\n");
+            return 2;
+        }
+    }
+
+    esp_log_level = esp_log_level > 3 ? esp_log_level : 2;
+    sysinfo_init();
+    sysinfo_boot(BOOT_APP);
+    /* the host clock is kept in sync by the OS */
+    sysinfo_time_sync(NULL);
+    ESP_ERROR_CHECK(nvs_flash_init());
+    settings_init();
+    history_init();
+    if (days) {
+        uint32_t t = (uint32_t) time(NULL) / 60 * 60 - days * 86400;
+
+        for (; t < (uint32_t) time(NULL) / 60 * 60; t += 60)
+            history_sample(t);
+    }
+    sysinfo_boot(BOOT_NVS);
+    sysinfo_boot(BOOT_NET);
+
+    server = start_webserver();
+    if (!server)
+        return 1;
+
+    sysinfo_boot(BOOT_HTTPD);
+    syslog_init(syslog_target);
+    mqtt_init(mqtt_uri);
+    coap_init(coap_port);
+    mem_init_done();
+    sysinfo_boot(BOOT_READY);
+    ESP_LOGW(TAG, "listening on port %u", httpd_host_port);
+    cmd_register(CMD_BOX_POOL);
+    cmd_register(CMD_BOX_MAIN);
+    while (true) {
+        mem_check();
+        memprof_poll();
+        history_poll();
+        if (!rate) {
+            if (cmd_wait(1000))
+                apply_cmds();
+            continue;
+        }
+
+        /* emulate log traffic of the control loop */
+        logs(LOG_SRC_POOL, "host log line %u", n++);
+        if (cmd_wait(1000 / rate))
+            apply_cmds();
+    }
+
+    return 0;
+}
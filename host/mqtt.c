@@ -0,0 +1,470 @@
+/**
+ * @file mqtt.c  Host implementation of the esp-mqtt client subset
+ *
+ * MQTT 3.1.1 over plain TCP. A thread connects, reads and dispatches the
+ * events and reconnects after a second on errors. Publish with QoS 1 is
+ * sent once, without retransmission.
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "esp_log.h"
+#include "mqtt_client.h"
+
+#define PKT_MAX (1 << 20)
+
+enum {
+    CONNECT   = 0x10,
+    CONNACK   = 0x20,
+    PUBLISH   = 0x30,
+    PUBACK    = 0x40,
+    SUBSCRIBE = 0x82,
+    SUBACK    = 0x90,
+    PINGREQ   = 0xc0,
+};
+
+struct esp_mqtt_client {
+    char host[128];
+    char port[8];
+    char client_id[32];
+    char *will_topic;
+    char *will_msg;
+    int will_qos;
+    int will_retain;
+    int keepalive;
+    esp_event_handler_t handler;
+    void *arg;
+    pthread_t thread;
+    pthread_mutex_t mtx;        /* serialises writes */
+    int fd;                     /* -1 if not connected */
+    uint16_t msg_id;
+};
+
+static const char *TAG = "mqtt_host";
+
+
+static size_t put_len(uint8_t *p, size_t len)
+{
+    size_t n = 0;
+
+    do {
+        p[n] = len % 128;
+        len /= 128;
+        if (len)
+            p[n] |= 0x80;
+        n++;
+    } while (len);
+
+    return n;
+}
+
+
+static size_t put_str(uint8_t *p, const char *s, size_t len)
+{
+    p[0] = len >> 8;
+    p[1] = len & 0xff;
+    memcpy(p + 2, s, len);
+    return len + 2;
+}
+
+
+static int send_all(int fd, const uint8_t *p, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n <= 0)
+            return -1;
+
+        p   += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+
+/* Sends fixed header and body, connected fd unless fd >= 0 is given */
+static int send_pkt(struct esp_mqtt_client *c, int fd, uint8_t type,
+                    const uint8_t *body, size_t len)
+{
+    uint8_t hdr[5];
+    size_t hl;
+    int err;
+
+    hdr[0] = type;
+    hl = 1 + put_len(hdr + 1, len);
+
+    pthread_mutex_lock(&c->mtx);
+    if (fd < 0)
+        fd = c->fd;
+
+    err = fd < 0 || send_all(fd, hdr, hl) || send_all(fd, body, len) ? -1 : 0;
+    pthread_mutex_unlock(&c->mtx);
+
+    return err;
+}
+
+
+static int recv_all(int fd, uint8_t *p, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        n = recv(fd, p, len, 0);
+        if (n <= 0)
+            return -1;
+
+        p   += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+
+/* Reads one packet, *body is malloc'ed */
+static int recv_pkt(int fd, uint8_t *type, uint8_t **body, size_t *len)
+{
+    size_t l = 0;
+    int shift = 0;
+    uint8_t b;
+
+    if (recv_all(fd, type, 1))
+        return -1;
+
+    do {
+        if (recv_all(fd, &b, 1) || shift > 21)
+            return -1;
+
+        l |= (size_t) (b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+
+    if (l > PKT_MAX)
+        return -1;
+
+    *body = malloc(l + 1);
+    if (!*body)
+        return -1;
+
+    if (recv_all(fd, *body, l)) {
+        free(*body);
+        return -1;
+    }
+
+    *len = l;
+    return 0;
+}
+
+
+static void dispatch(struct esp_mqtt_client *c, esp_mqtt_event_t *ev)
+{
+    ev->client = c;
+    if (c->handler)
+        c->handler(c->arg, "MQTT_EVENTS", ev->event_id, ev);
+}
+
+
+static int tcp_connect(struct esp_mqtt_client *c)
+{
+    struct addrinfo hints = { 0 }, *ai, *a;
+    int one = 1;
+    int fd = -1;
+
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(c->host, c->port, &hints, &ai))
+        return -1;
+
+    for (a = ai; a; a = a->ai_next) {
+        fd = socket(a->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            continue;
+
+        if (!connect(fd, a->ai_addr, a->ai_addrlen))
+            break;
+
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(ai);
+    if (fd >= 0)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    return fd;
+}
+
+
+static int mqtt_connect(struct esp_mqtt_client *c, int fd)
+{
+    uint8_t buf[512];
+    uint8_t type, *body;
+    uint8_t flags = 0x02;       /* clean session */
+    size_t n = 0, len;
+    int ok;
+
+    n += put_str(buf + n, "MQTT", 4);
+    buf[n++] = 4;
+    if (c->will_topic) {
+        flags |= 0x04 | (c->will_qos << 3) | (c->will_retain ? 0x20 : 0);
+    }
+    buf[n++] = flags;
+    buf[n++] = c->keepalive >> 8;
+    buf[n++] = c->keepalive & 0xff;
+    n += put_str(buf + n, c->client_id, strlen(c->client_id));
+    if (c->will_topic) {
+        n += put_str(buf + n, c->will_topic, strlen(c->will_topic));
+        n += put_str(buf + n, c->will_msg, strlen(c->will_msg));
+    }
+
+    if (send_pkt(c, fd, CONNECT, buf, n) || recv_pkt(fd, &type, &body, &len))
+        return -1;
+
+    ok = type == CONNACK && len == 2 && body[1] == 0;
+    free(body);
+    return ok ? 0 : -1;
+}
+
+
+static void handle_publish(struct esp_mqtt_client *c, uint8_t type,
+                           uint8_t *body, size_t len)
+{
+    esp_mqtt_event_t ev = { .event_id = MQTT_EVENT_DATA };
+    int qos = (type >> 1) & 3;
+    size_t tl, off;
+    uint8_t ack[2];
+
+    if (len < 2)
+        return;
+
+    tl  = body[0] << 8 | body[1];
+    off = 2 + tl + (qos ? 2 : 0);
+    if (off > len)
+        return;
+
+    if (qos) {
+        ack[0] = body[2 + tl];
+        ack[1] = body[3 + tl];
+        ev.msg_id = ack[0] << 8 | ack[1];
+        send_pkt(c, -1, PUBACK, ack, 2);
+    }
+
+    ev.topic     = (char *) body + 2;
+    ev.topic_len = tl;
+    ev.data      = (char *) body + off;
+    ev.data_len  = ev.total_data_len = len - off;
+    dispatch(c, &ev);
+}
+
+
+static void *client_thread(void *arg)
+{
+    struct esp_mqtt_client *c = arg;
+    esp_mqtt_event_t ev = { 0 };
+    struct pollfd pfd;
+    uint8_t type, *body;
+    size_t len;
+    int fd;
+
+    while (true) {
+        fd = tcp_connect(c);
+        if (fd < 0 || mqtt_connect(c, fd)) {
+            ESP_LOGW(TAG, "connect to %s:%s failed", c->host, c->port);
+            if (fd >= 0)
+                close(fd);
+            sleep(1);
+            continue;
+        }
+
+        pthread_mutex_lock(&c->mtx);
+        c->fd = fd;
+        pthread_mutex_unlock(&c->mtx);
+        ev.event_id = MQTT_EVENT_CONNECTED;
+        dispatch(c, &ev);
+
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        while (true) {
+            if (!poll(&pfd, 1, c->keepalive * 500)) {
+                if (send_pkt(c, -1, PINGREQ, NULL, 0))
+                    break;
+                continue;
+            }
+
+            if (recv_pkt(fd, &type, &body, &len))
+                break;
+
+            if ((type & 0xf0) == PUBLISH) {
+                handle_publish(c, type, body, len);
+            }
+            else if (type == SUBACK || type == PUBACK) {
+                ev.event_id = type == SUBACK ? MQTT_EVENT_SUBSCRIBED :
+                                               MQTT_EVENT_PUBLISHED;
+                ev.msg_id = len >= 2 ? body[0] << 8 | body[1] : 0;
+                dispatch(c, &ev);
+            }
+
+            free(body);
+        }
+
+        pthread_mutex_lock(&c->mtx);
+        c->fd = -1;
+        pthread_mutex_unlock(&c->mtx);
+        close(fd);
+        ev.event_id = MQTT_EVENT_DISCONNECTED;
+        dispatch(c, &ev);
+        sleep(1);
+    }
+
+    return NULL;
+}
+
+
+esp_mqtt_client_handle_t esp_mqtt_client_init(
+    const esp_mqtt_client_config_t *config)
+{
+    struct esp_mqtt_client *c;
+    const char *uri = config->broker.address.uri;
+    const char *p;
+
+    if (!uri || strncmp(uri, "mqtt://", 7))
+        return NULL;
+
+    c = calloc(1, sizeof(*c));
+    if (!c)
+        return NULL;
+
+    uri += 7;
+    p = strchr(uri, ':');
+    snprintf(c->host, sizeof(c->host), "%.*s",
+             (int) (p ? p - uri : (int) strlen(uri)), uri);
+    snprintf(c->port, sizeof(c->port), "%s", p ? p + 1 : "1883");
+    if (config->credentials.client_id)
+        snprintf(c->client_id, sizeof(c->client_id), "%s",
+                 config->credentials.client_id);
+    else
+        snprintf(c->client_id, sizeof(c->client_id), "pool-host-%d",
+                 (int) getpid());
+
+    if (config->session.last_will.topic) {
+        c->will_topic  = strdup(config->session.last_will.topic);
+        c->will_msg    = strdup(config->session.last_will.msg ?
+                                config->session.last_will.msg : "");
+        c->will_qos    = config->session.last_will.qos;
+        c->will_retain = config->session.last_will.retain;
+    }
+
+    c->keepalive = config->session.keepalive ? config->session.keepalive : 120;
+    c->fd = -1;
+    pthread_mutex_init(&c->mtx, NULL);
+    return c;
+}
+
+
+esp_err_t esp_mqtt_client_register_event(esp_mqtt_client_handle_t client,
+                                         esp_mqtt_event_id_t event,
+                                         esp_event_handler_t handler,
+                                         void *arg)
+{
+    (void) event;
+    client->handler = handler;
+    client->arg = arg;
+    return ESP_OK;
+}
+
+
+esp_err_t esp_mqtt_client_start(esp_mqtt_client_handle_t client)
+{
+    if (pthread_create(&client->thread, NULL, client_thread, client))
+        return ESP_FAIL;
+
+    pthread_detach(client->thread);
+    return ESP_OK;
+}
+
+
+static uint16_t next_id(struct esp_mqtt_client *c)
+{
+    uint16_t id;
+
+    pthread_mutex_lock(&c->mtx);
+    id = ++c->msg_id ? c->msg_id : ++c->msg_id;
+    pthread_mutex_unlock(&c->mtx);
+
+    return id;
+}
+
+
+int esp_mqtt_client_publish(esp_mqtt_client_handle_t client,
+                            const char *topic, const char *data, int len,
+                            int qos, int retain)
+{
+    size_t tl = strlen(topic);
+    uint16_t id = 0;
+    uint8_t *buf;
+    size_t n = 0;
+    int err;
+
+    if (!len && data)
+        len = strlen(data);
+
+    buf = malloc(tl + len + 4);
+    if (!buf)
+        return -1;
+
+    n += put_str(buf, topic, tl);
+    if (qos) {
+        id = next_id(client);
+        buf[n++] = id >> 8;
+        buf[n++] = id & 0xff;
+    }
+
+    if (len)
+        memcpy(buf + n, data, len);
+    n += len;
+
+    err = send_pkt(client, -1, PUBLISH | (qos & 3) << 1 | (retain ? 1 : 0),
+                   buf, n);
+    free(buf);
+
+    return err ? -1 : id;
+}
+
+
+int esp_mqtt_client_subscribe(esp_mqtt_client_handle_t client,
+                              const char *topic, int qos)
+{
+    size_t tl = strlen(topic);
+    uint16_t id = next_id(client);
+    uint8_t *buf;
+    size_t n = 0;
+    int err;
+
+    buf = malloc(tl + 5);
+    if (!buf)
+        return -1;
+
+    buf[n++] = id >> 8;
+    buf[n++] = id & 0xff;
+    n += put_str(buf + n, topic, tl);
+    buf[n++] = qos;
+
+    err = send_pkt(client, -1, SUBSCRIBE, buf, n);
+    free(buf);
+
+    return err ? -1 : id;
+}
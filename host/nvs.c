@@ -0,0 +1,438 @@
+/**
+ * @file nvs.c  Host implementation of the NVS API
+ *
+ * All entries are kept in memory and written to the file $POOL_NVS (default
+ * nvs.bin) on nvs_commit(). The file is a sequence of records
+ * [ns len][ns][key len][key][type][u32 len][data].
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <nvs.h>
+#include <nvs_flash.h>
+
+#define NS_MAX      16
+#define KEY_MAX     16      /* like NVS, including the terminating zero */
+#define HANDLE_MAX  32
+
+enum type {
+    TYPE_I32,
+    TYPE_U32,
+    TYPE_STR,
+    TYPE_BLOB,
+};
+
+struct entry {
+    struct entry *next;
+    char ns[KEY_MAX];
+    char key[KEY_MAX];
+    enum type type;
+    size_t len;
+    uint8_t data[];
+};
+
+struct handle {
+    bool used;
+    bool rw;
+    char ns[KEY_MAX];
+};
+
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct entry *entries;
+static struct handle handles[HANDLE_MAX];
+static bool initialized;
+
+
+static const char *nvs_path(void)
+{
+    const char *p = getenv("POOL_NVS");
+
+    return p ? p : "nvs.bin";
+}
+
+
+static void clear(void)
+{
+    struct entry *e;
+
+    while ((e = entries)) {
+        entries = e->next;
+        free(e);
+    }
+}
+
+
+static struct entry *find(const char *ns, const char *key)
+{
+    struct entry *e;
+
+    for (e = entries; e; e = e->next) {
+        if (!strcmp(e->ns, ns) && !strcmp(e->key, key))
+            return e;
+    }
+
+    return NULL;
+}
+
+
+static bool ns_exists(const char *ns)
+{
+    struct entry *e;
+
+    for (e = entries; e; e = e->next) {
+        if (!strcmp(e->ns, ns))
+            return true;
+    }
+
+    return false;
+}
+
+
+static bool read_str(FILE *f, char *s)
+{
+    int len = fgetc(f);
+
+    if (len == EOF || len >= KEY_MAX || fread(s, 1, len, f) != (size_t) len)
+        return false;
+
+    s[len] = 0;
+    return true;
+}
+
+
+static void load(void)
+{
+    struct entry hdr, *e;
+    uint32_t len;
+    int type;
+    FILE *f;
+
+    f = fopen(nvs_path(), "rb");
+    if (!f)
+        return;
+
+    while (read_str(f, hdr.ns) && read_str(f, hdr.key)) {
+        type = fgetc(f);
+        if (type == EOF || fread(&len, sizeof(len), 1, f) != 1)
+            break;
+
+        e = malloc(sizeof(*e) + len);
+        if (!e)
+            break;
+
+        *e = hdr;
+        e->type = type;
+        e->len = len;
+        if (fread(e->data, 1, len, f) != len) {
+            free(e);
+            break;
+        }
+
+        e->next = entries;
+        entries = e;
+    }
+
+    fclose(f);
+}
+
+
+static int save(void)
+{
+    char tmp[512];
+    struct entry *e;
+    uint32_t len;
+    FILE *f;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", nvs_path());
+    f = fopen(tmp, "wb");
+    if (!f)
+        return ESP_FAIL;
+
+    for (e = entries; e; e = e->next) {
+        len = e->len;
+        fputc(strlen(e->ns), f);
+        fputs(e->ns, f);
+        fputc(strlen(e->key), f);
+        fputs(e->key, f);
+        fputc(e->type, f);
+        fwrite(&len, sizeof(len), 1, f);
+        fwrite(e->data, 1, e->len, f);
+    }
+
+    if (fclose(f))
+        return ESP_FAIL;
+
+    return rename(tmp, nvs_path()) ? ESP_FAIL : ESP_OK;
+}
+
+
+esp_err_t nvs_flash_init(void)
+{
+    pthread_mutex_lock(&mtx);
+    if (!initialized) {
+        load();
+        initialized = true;
+    }
+    pthread_mutex_unlock(&mtx);
+    return ESP_OK;
+}
+
+
+esp_err_t nvs_flash_erase(void)
+{
+    pthread_mutex_lock(&mtx);
+    clear();
+    remove(nvs_path());
+    pthread_mutex_unlock(&mtx);
+    return ESP_OK;
+}
+
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t mode, nvs_handle_t *h)
+{
+    esp_err_t err = ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+    size_t i;
+
+    if (!name || !h)
+        return ESP_ERR_INVALID_ARG;
+
+    if (strlen(name) >= KEY_MAX)
+        return ESP_ERR_NVS_INVALID_NAME;
+
+    pthread_mutex_lock(&mtx);
+    if (!initialized) {
+        pthread_mutex_unlock(&mtx);
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+
+    if (mode == NVS_READONLY && !ns_exists(name)) {
+        pthread_mutex_unlock(&mtx);
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+
+    for (i = 0; i < HANDLE_MAX; i++) {
+        if (handles[i].used)
+            continue;
+
+        handles[i].used = true;
+        handles[i].rw = mode == NVS_READWRITE;
+        strcpy(handles[i].ns, name);
+        *h = i + 1;
+        err = ESP_OK;
+        break;
+    }
+    pthread_mutex_unlock(&mtx);
+
+    return err;
+}
+
+
+static struct handle *get_handle(nvs_handle_t h)
+{
+    if (!h || h > HANDLE_MAX || !handles[h - 1].used)
+        return NULL;
+
+    return &handles[h - 1];
+}
+
+
+void nvs_close(nvs_handle_t h)
+{
+    pthread_mutex_lock(&mtx);
+    if (get_handle(h))
+        handles[h - 1].used = false;
+    pthread_mutex_unlock(&mtx);
+}
+
+
+esp_err_t nvs_commit(nvs_handle_t h)
+{
+    esp_err_t err;
+
+    pthread_mutex_lock(&mtx);
+    err = get_handle(h) ? save() : ESP_ERR_NVS_INVALID_HANDLE;
+    pthread_mutex_unlock(&mtx);
+    return err;
+}
+
+
+static esp_err_t set(nvs_handle_t h, const char *key, enum type type,
+                     const void *data, size_t len)
+{
+    struct handle *hd;
+    struct entry *e, **pp;
+
+    if (!key || strlen(key) >= KEY_MAX)
+        return ESP_ERR_NVS_INVALID_NAME;
+
+    pthread_mutex_lock(&mtx);
+    hd = get_handle(h);
+    if (!hd || !hd->rw) {
+        pthread_mutex_unlock(&mtx);
+        return hd ? ESP_ERR_NVS_READ_ONLY : ESP_ERR_NVS_INVALID_HANDLE;
+    }
+
+    for (pp = &entries; *pp; pp = &(*pp)->next) {
+        if (!strcmp((*pp)->ns, hd->ns) && !strcmp((*pp)->key, key)) {
+            e = *pp;
+            *pp = e->next;
+            free(e);
+            break;
+        }
+    }
+
+    e = malloc(sizeof(*e) + len);
+    if (!e) {
+        pthread_mutex_unlock(&mtx);
+        return ESP_ERR_NO_MEM;
+    }
+
+    strcpy(e->ns, hd->ns);
+    strcpy(e->key, key);
+    e->type = type;
+    e->len = len;
+    memcpy(e->data, data, len);
+    e->next = entries;
+    entries = e;
+    pthread_mutex_unlock(&mtx);
+    return ESP_OK;
+}
+
+
+/* Copies an entry, *len is in/out like nvs_get_blob() */
+static esp_err_t get(nvs_handle_t h, const char *key, enum type type,
+                     void *data, size_t *len)
+{
+    struct handle *hd;
+    struct entry *e;
+    esp_err_t err = ESP_OK;
+
+    pthread_mutex_lock(&mtx);
+    hd = get_handle(h);
+    e = hd ? find(hd->ns, key) : NULL;
+    if (!hd)
+        err = ESP_ERR_NVS_INVALID_HANDLE;
+    else if (!e)
+        err = ESP_ERR_NVS_NOT_FOUND;
+    else if (e->type != type)
+        err = ESP_ERR_NVS_TYPE_MISMATCH;
+    else if (data && *len < e->len)
+        err = ESP_ERR_NVS_INVALID_LENGTH;
+
+    if (!err) {
+        if (data)
+            memcpy(data, e->data, e->len);
+        *len = e->len;
+    }
+    pthread_mutex_unlock(&mtx);
+
+    return err;
+}
+
+
+esp_err_t nvs_erase_key(nvs_handle_t h, const char *key)
+{
+    struct handle *hd;
+    struct entry *e, **pp;
+    esp_err_t err = ESP_ERR_NVS_NOT_FOUND;
+
+    pthread_mutex_lock(&mtx);
+    hd = get_handle(h);
+    for (pp = &entries; hd && *pp; pp = &(*pp)->next) {
+        if (!strcmp((*pp)->ns, hd->ns) && !strcmp((*pp)->key, key)) {
+            e = *pp;
+            *pp = e->next;
+            free(e);
+            err = ESP_OK;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mtx);
+
+    return hd ? err : ESP_ERR_NVS_INVALID_HANDLE;
+}
+
+
+esp_err_t nvs_erase_all(nvs_handle_t h)
+{
+    struct handle *hd;
+    struct entry *e, **pp;
+
+    pthread_mutex_lock(&mtx);
+    hd = get_handle(h);
+    pp = &entries;
+    while (hd && *pp) {
+        if (!strcmp((*pp)->ns, hd->ns)) {
+            e = *pp;
+            *pp = e->next;
+            free(e);
+        }
+        else {
+            pp = &(*pp)->next;
+        }
+    }
+    pthread_mutex_unlock(&mtx);
+
+    return hd ? ESP_OK : ESP_ERR_NVS_INVALID_HANDLE;
+}
+
+
+esp_err_t nvs_set_i32(nvs_handle_t h, const char *key, int32_t value)
+{
+    return set(h, key, TYPE_I32, &value, sizeof(value));
+}
+
+
+esp_err_t nvs_get_i32(nvs_handle_t h, const char *key, int32_t *value)
+{
+    size_t len = sizeof(*value);
+
+    return get(h, key, TYPE_I32, value, &len);
+}
+
+
+esp_err_t nvs_set_u32(nvs_handle_t h, const char *key, uint32_t value)
+{
+    return set(h, key, TYPE_U32, &value, sizeof(value));
+}
+
+
+esp_err_t nvs_get_u32(nvs_handle_t h, const char *key, uint32_t *value)
+{
+    size_t len = sizeof(*value);
+
+    return get(h, key, TYPE_U32, value, &len);
+}
+
+
+esp_err_t nvs_set_str(nvs_handle_t h, const char *key, const char *value)
+{
+    return set(h, key, TYPE_STR, value, strlen(value) + 1);
+}
+
+
+esp_err_t nvs_get_str(nvs_handle_t h, const char *key, char *value,
+                      size_t *len)
+{
+    return get(h, key, TYPE_STR, value, len);
+}
+
+
+esp_err_t nvs_set_blob(nvs_handle_t h, const char *key, const void *value,
+                       size_t len)
+{
+    return set(h, key, TYPE_BLOB, value, len);
+}
+
+
+esp_err_t nvs_get_blob(nvs_handle_t h, const char *key, void *value,
+                       size_t *len)
+{
+    return get(h, key, TYPE_BLOB, value, len);
+}
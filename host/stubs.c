@@ -0,0 +1,123 @@
+/**
+ * @file stubs.c  Host stand-ins for the hardware modules used by webui.c
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include "wifi.h"
+#include "counters.h"
+#include "pool.h"
+#include "fanctl.h"
+#include "esp_timer.h"
+#include "webui.h"
+#include "stubs.h"
+
+static struct wifi_hist hist;
+static uint32_t counters[CNT_MAX];
+bool host_low_flow;
+
+
+bool wifi_scan_running(void)
+{
+    return false;
+}
+
+
+size_t wifi_scan_get(struct wifi_ap *aps, size_t max, time_t *when)
+{
+    static const struct wifi_ap ap = {
+        .ssid = "host",
+        .channel = 1,
+        .rssi = -40,
+    };
+
+    if (!max)
+        return 0;
+
+    aps[0] = ap;
+    if (when)
+        *when = 0;
+
+    return 1;
+}
+
+
+int wifi_rssi(void)
+{
+    return -40;
+}
+
+
+/* Fan controller of the device fed with the simulated cell state, a load
+ * in the middle of the curve while powered */
+static int fan_sim(bool powered)
+{
+    static struct fanctl fan;
+    static bool init;
+    static int64_t last;
+    int64_t now = esp_timer_get_time() / 1000;
+    struct fanctl_cfg cfg;
+    uint32_t ms;
+
+    if (!init) {
+        fanctl_defaults(&cfg);
+        fanctl_init(&fan, &cfg);
+        fanctl_load(&fan, (cfg.lo_mv + cfg.hi_mv) / 2);
+        last = now;
+        init = true;
+    }
+
+    ms = (uint32_t) (now - last);
+    last = now;
+    fanctl_run(&fan, powered);
+    return fanctl_step(&fan, ms) / 10;
+}
+
+
+/* no flow switch, the cell follows the schedule unless low flow is
+ * simulated */
+void pool_get_state(struct pool_state *st)
+{
+    st->flow_ok  = !host_low_flow;
+    st->powered  = webui_check_time() && st->flow_ok;
+    st->polarity = 0;
+    st->flow_rate = -1;
+    st->cutoff_ns = 0;
+    st->fan = fan_sim(st->powered);
+    st->cell.ma = -1;
+    st->cell.balance = 0;
+    st->cell.cl2_g = 0;
+}
+
+
+const struct wifi_hist *wifi_reconnect_hist(void)
+{
+    return &hist;
+}
+
+
+void counters_add(enum counter c, uint32_t n)
+{
+    if (c < CNT_MAX)
+        counters[c] += n;
+}
+
+
+uint32_t counters_get(enum counter c)
+{
+    return c < CNT_MAX ? counters[c] : 0;
+}
+
+
+const char *counters_name(enum counter c)
+{
+    static const char *names[CNT_MAX] = {
+        "K1 cycles", "K2 cycles", "K3 cycles", "K4 cycles", "K5 cycles",
+        "cell s", "polarity 0 s", "polarity 1 s", "low flow",
+        "polarity 0 mAh", "polarity 1 mAh",
+    };
+
+    return c < CNT_MAX ? names[c] : "";
+}
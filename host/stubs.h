@@ -0,0 +1,7 @@
+#ifndef HOST_STUBS_H
+#define HOST_STUBS_H
+#include <stdbool.h>
+
+/* simulated flow switch, for fleet monitoring tests */
+extern bool host_low_flow;
+#endif
@@ -0,0 +1,254 @@
+/**
+ * @file bench.c  Microbenchmarks on the device for a bench build
+ *
+ * Modules register functions with bench_add(), GET /bench runs them and
+ * reports min, median and max CPU cycles over N runs with interrupts
+ * enabled and, for functions that never block, disabled. The first call
+ * of a round is reported on its own, it runs with a cold cache. A sample is
+ * taken again if the task moved to the other core in between.
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_cpu.h"
+#include "esp_rom_sys.h"
+#include "nvs.h"
+#include "log.h"
+#include "webui.h"
+#include "bench.h"
+
+#if CONFIG_POOL_BENCH
+
+#define BENCH_MAX   12
+#define RUNS_MAX    256
+#define RUNS_DEF    32
+#define BENCH_NS    "bench"
+
+struct bench {
+    const char *name;
+    bench_h *fn;
+    void *arg;
+    unsigned flags;
+};
+
+struct round {
+    uint32_t first;
+    uint32_t min;
+    uint32_t med;
+    uint32_t max;
+};
+
+static struct bench benches[BENCH_MAX];
+static size_t nbench;
+static uint32_t samples[RUNS_MAX];
+static bool busy;
+static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+static portMUX_TYPE irq_mux = portMUX_INITIALIZER_UNLOCKED;
+static nvs_handle_t nvs;
+static uint32_t nvs_val;
+static unsigned log_n;
+
+
+static void bench_empty(void *arg)
+{
+    (void) arg;
+}
+
+
+/* unthrottled source, a new text each time to skip the deduplication */
+static void bench_log(void *arg)
+{
+    (void) arg;
+    logs(LOG_SRC_POOL, "bench %u", log_n++);
+}
+
+
+static void bench_check_time(void *arg)
+{
+    (void) arg;
+    webui_check_time();
+}
+
+
+static void bench_nvs_read(void *arg)
+{
+    uint32_t v;
+    (void) arg;
+
+    nvs_get_u32(nvs, "val", &v);
+}
+
+
+/* a new value each time, NVS skips writes of an equal value */
+static void bench_nvs_write(void *arg)
+{
+    (void) arg;
+
+    nvs_set_u32(nvs, "val", ++nvs_val);
+    nvs_commit(nvs);
+}
+
+
+static const struct bench builtin[] = {
+    { "empty",      bench_empty,      NULL, BENCH_IRQ_OFF },
+    { "logw",       bench_log,        NULL, 0 },
+    { "check_time", bench_check_time, NULL, 0 },
+    { "nvs_read",   bench_nvs_read,   NULL, 0 },
+    { "nvs_write",  bench_nvs_write,  NULL, 0 },
+};
+
+#define BUILTIN (sizeof(builtin) / sizeof(builtin[0]))
+
+
+/* builtin ones first, called with the count taken under the lock */
+static const struct bench *get(size_t i)
+{
+    return i < BUILTIN ? &builtin[i] : &benches[i - BUILTIN];
+}
+
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+
+static uint32_t measure(const struct bench *b, bool irq_off)
+{
+    uint32_t t0, t;
+    int core;
+
+    do {
+        if (irq_off)
+            portENTER_CRITICAL(&irq_mux);
+
+        core = xPortGetCoreID();
+        t0 = esp_cpu_get_cycle_count();
+        b->fn(b->arg);
+        t = esp_cpu_get_cycle_count() - t0;
+        if (irq_off)
+            portEXIT_CRITICAL(&irq_mux);
+    } while (core != xPortGetCoreID());
+
+    return t;
+}
+
+
+static void run(const struct bench *b, unsigned runs, bool irq_off,
+                struct round *r)
+{
+    unsigned i;
+
+    r->first = measure(b, irq_off);
+    for (i = 0; i < runs; i++) {
+        samples[i] = measure(b, irq_off);
+
+        /* let the idle task feed the watchdog during slow rounds */
+        if (!irq_off && i % 16 == 15)
+            vTaskDelay(1);
+    }
+
+    qsort(samples, runs, sizeof(samples[0]), cmp_u32);
+    r->min = samples[0];
+    r->med = samples[runs / 2];
+    r->max = samples[runs - 1];
+}
+
+
+static void put_round(struct tpl_out *o, const char *key,
+                      const struct round *r)
+{
+    tpl_printf(o, ",\"%s\":{\"first\":%" PRIu32 ",\"min\":%" PRIu32
+               ",\"med\":%" PRIu32 ",\"max\":%" PRIu32 "}", key, r->first,
+               r->min, r->med, r->max);
+}
+
+
+void bench_add(const char *name, bench_h *fn, void *arg, unsigned flags)
+{
+    size_t i;
+
+    portENTER_CRITICAL(&mux);
+    for (i = 0; i < nbench && strcmp(benches[i].name, name); i++)
+        ;
+
+    if (i == nbench && nbench < BENCH_MAX) {
+        benches[i].name = name;
+        benches[i].fn = fn;
+        benches[i].arg = arg;
+        benches[i].flags = flags;
+        nbench++;
+    }
+    portEXIT_CRITICAL(&mux);
+}
+
+
+/* Runs all benchmarks or the one of the given name (empty: all), one
+ * request at a time. Nothing is written on error. */
+esp_err_t bench_render(struct tpl_out *o, const char *name, unsigned runs)
+{
+    struct round r;
+    bool found = false;
+    size_t i, n;
+
+    if (!runs)
+        runs = RUNS_DEF;
+    else if (runs > RUNS_MAX)
+        runs = RUNS_MAX;
+
+    portENTER_CRITICAL(&mux);
+    n = BUILTIN + nbench;
+    for (i = 0; i < n; i++)
+        found |= !*name || !strcmp(get(i)->name, name);
+
+    if (busy || !found) {
+        portEXIT_CRITICAL(&mux);
+        return busy ? ESP_ERR_INVALID_STATE : ESP_ERR_NOT_FOUND;
+    }
+
+    busy = true;
+    portEXIT_CRITICAL(&mux);
+
+    if (!nvs && nvs_open(BENCH_NS, NVS_READWRITE, &nvs))
+        nvs = 0;
+
+    tpl_printf(o, "{\"cpu_mhz\":%" PRIu32 ",\"runs\":%u,\"bench\":[",
+               (uint32_t) esp_rom_get_cpu_ticks_per_us(), runs);
+    for (i = 0, found = false; i < n; i++) {
+        const struct bench *b = get(i);
+
+        if (*name && strcmp(b->name, name))
+            continue;
+
+        tpl_printf(o, "%s{\"name\":\"%s\"", found ? "," : "", b->name);
+        run(b, runs, false, &r);
+        put_round(o, "irq", &r);
+        if (b->flags & BENCH_IRQ_OFF) {
+            run(b, runs, true, &r);
+            put_round(o, "noirq", &r);
+        }
+        else {
+            tpl_puts(o, ",\"noirq\":null");
+        }
+
+        tpl_puts(o, "}");
+        found = true;
+        vTaskDelay(1);
+    }
+
+    tpl_puts(o, "]}");
+
+    portENTER_CRITICAL(&mux);
+    busy = false;
+    portEXIT_CRITICAL(&mux);
+    return ESP_OK;
+}
+#endif
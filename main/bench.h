@@ -0,0 +1,19 @@
+#ifndef BENCH_H
+#define BENCH_H
+#include <stdint.h>
+#include "config.h"
+#include "tpl.h"
+
+/* 1: bench build with GET /bench */
+#ifndef CONFIG_POOL_BENCH
+#define CONFIG_POOL_BENCH 0
+#endif
+
+/* never blocks, also measured with interrupts disabled */
+#define BENCH_IRQ_OFF  1
+
+typedef void (bench_h)(void *arg);
+
+void bench_add(const char *name, bench_h *fn, void *arg, unsigned flags);
+esp_err_t bench_render(struct tpl_out *o, const char *name, unsigned runs);
+#endif
@@ -0,0 +1,143 @@
+/**
+ * @file cbor.c  Minimal CBOR (RFC 8949) encoder and item decoder
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include <string.h>
+#include "cbor.h"
+
+
+void cbor_init(struct cbor *c, uint8_t *buf, size_t size)
+{
+    c->buf  = buf;
+    c->size = size;
+    c->len  = 0;
+    c->err  = false;
+}
+
+
+static void put(struct cbor *c, const void *p, size_t len)
+{
+    if (c->err || c->len + len > c->size) {
+        c->err = true;
+        return;
+    }
+
+    memcpy(c->buf + c->len, p, len);
+    c->len += len;
+}
+
+
+static void head(struct cbor *c, enum cbor_major major, uint64_t v)
+{
+    uint8_t b[9];
+    size_t n, i;
+
+    if (v < 24) {
+        b[0] = major << 5 | v;
+        put(c, b, 1);
+        return;
+    }
+
+    n = v <= 0xff ? 1 : v <= 0xffff ? 2 : v <= 0xffffffff ? 4 : 8;
+    b[0] = major << 5 | (n == 1 ? 24 : n == 2 ? 25 : n == 4 ? 26 : 27);
+    for (i = 0; i < n; i++)
+        b[n - i] = v >> (8 * i);
+
+    put(c, b, n + 1);
+}
+
+
+void cbor_map(struct cbor *c, size_t n)
+{
+    head(c, CBOR_MAP, n);
+}
+
+
+void cbor_array(struct cbor *c, size_t n)
+{
+    head(c, CBOR_ARRAY, n);
+}
+
+
+void cbor_uint(struct cbor *c, uint64_t v)
+{
+    head(c, CBOR_UINT, v);
+}
+
+
+void cbor_int(struct cbor *c, int64_t v)
+{
+    if (v < 0)
+        head(c, CBOR_NEG, (uint64_t) (-1 - v));
+    else
+        head(c, CBOR_UINT, v);
+}
+
+
+void cbor_text(struct cbor *c, const char *s)
+{
+    size_t len = strlen(s);
+
+    head(c, CBOR_TEXT, len);
+    put(c, s, len);
+}
+
+
+void cbor_bool(struct cbor *c, bool v)
+{
+    uint8_t b = CBOR_SIMPLE << 5 | (v ? 21 : 20);
+
+    put(c, &b, 1);
+}
+
+
+/* Decodes the item at *p and advances past its head (and data for byte and
+ * text strings). Indefinite lengths are not supported. */
+bool cbor_next(const uint8_t **p, const uint8_t *end, struct cbor_item *it)
+{
+    const uint8_t *q = *p;
+    uint8_t ai;
+    size_t n, i;
+
+    if (q >= end)
+        return false;
+
+    it->major = *q >> 5;
+    ai = *q++ & 0x1f;
+    if (ai < 24) {
+        it->val = ai;
+    }
+    else if (ai <= 27) {
+        n = 1 << (ai - 24);
+        if ((size_t) (end - q) < n)
+            return false;
+
+        it->val = 0;
+        for (i = 0; i < n; i++)
+            it->val = it->val << 8 | *q++;
+    }
+    else {
+        return false;
+    }
+
+    it->data = NULL;
+    if (it->major == CBOR_BYTES || it->major == CBOR_TEXT) {
+        if ((uint64_t) (end - q) < it->val)
+            return false;
+
+        it->data = q;
+        q += it->val;
+    }
+
+    *p = q;
+    return true;
+}
+
+
+bool cbor_text_eq(const struct cbor_item *it, const char *s)
+{
+    return it->major == CBOR_TEXT && strlen(s) == it->val &&
+           !memcmp(it->data, s, it->val);
+}
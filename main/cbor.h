@@ -0,0 +1,42 @@
+#ifndef CBOR_H
+#define CBOR_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum cbor_major {
+    CBOR_UINT  = 0,
+    CBOR_NEG   = 1,
+    CBOR_BYTES = 2,
+    CBOR_TEXT  = 3,
+    CBOR_ARRAY = 4,
+    CBOR_MAP   = 5,
+    CBOR_TAG   = 6,
+    CBOR_SIMPLE = 7,
+};
+
+/* Encoder into a fixed buffer, err is set if it does not fit */
+struct cbor {
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+    bool err;
+};
+
+/* One decoded item, containers only report their item count */
+struct cbor_item {
+    enum cbor_major major;
+    uint64_t val;               /* value, length or count */
+    const uint8_t *data;        /* CBOR_BYTES, CBOR_TEXT */
+};
+
+void cbor_init(struct cbor *c, uint8_t *buf, size_t size);
+void cbor_map(struct cbor *c, size_t n);
+void cbor_array(struct cbor *c, size_t n);
+void cbor_uint(struct cbor *c, uint64_t v);
+void cbor_int(struct cbor *c, int64_t v);
+void cbor_text(struct cbor *c, const char *s);
+void cbor_bool(struct cbor *c, bool v);
+bool cbor_next(const uint8_t **p, const uint8_t *end, struct cbor_item *it);
+bool cbor_text_eq(const struct cbor_item *it, const char *s);
+#endif
@@ -0,0 +1,136 @@
+/**
+ * @file cell.c  Cell charge per polarity and charge balanced reversal
+ *
+ * The cell current from the sense input is integrated per polarity into
+ * the counters CNT_POL0_MAH and CNT_POL1_MAH, which survive reboots. The
+ * polarity is reversed once the balance (polarity 0 minus polarity 1) has
+ * crossed half of CONFIG_CELL_FLIP_MAH in the direction of the running
+ * polarity, so every phase moves CONFIG_CELL_FLIP_MAH and the electrodes
+ * see the same charge either way, across reboots and short windows.
+ * Without current sense (CONFIG_CELL_MA_PER_V 0) the balance is the time
+ * per polarity and a phase lasts CELL_FLIP_SECS. An older imbalance is
+ * worked off with phases of up to CONFIG_CELL_FLIP_MAX_SECS.
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include "esp_log.h"
+#include "config.h"
+#include "counters.h"
+#include "cell.h"
+
+/* sense input scale in mA per V, 0: no current sense */
+#ifndef CONFIG_CELL_MA_PER_V
+#define CONFIG_CELL_MA_PER_V 0
+#endif
+
+#ifndef CONFIG_CELL_FLIP_MAH
+#define CONFIG_CELL_FLIP_MAH 1500
+#endif
+
+/* phase limits, the maximum also covers a broken current sense */
+#ifndef CONFIG_CELL_FLIP_MIN_SECS
+#define CONFIG_CELL_FLIP_MIN_SECS 300
+#endif
+
+#ifndef CONFIG_CELL_FLIP_MAX_SECS
+#define CONFIG_CELL_FLIP_MAX_SECS 3600
+#endif
+
+/* current efficiency of the chlorine production in % */
+#ifndef CONFIG_CELL_EFFICIENCY
+#define CONFIG_CELL_EFFICIENCY 100
+#endif
+
+/* phase without current sense, the former fixed interval */
+#define CELL_FLIP_SECS  (20 * 60)
+
+/* Cl2 by Faraday: 70.9 g/mol / (2 * 96485 C/mol) = 1.3227 g/Ah */
+#define CL2_MG_PER_AH   1323
+
+static const char *TAG = "cell";
+
+static int32_t ma = -1;
+static uint32_t mas[2];         /* mA ms below one mAh */
+static int phase_lev = -1;
+static uint32_t phase_ms;
+
+
+static int32_t half(void)
+{
+    return (CONFIG_CELL_MA_PER_V ? CONFIG_CELL_FLIP_MAH : CELL_FLIP_SECS) / 2;
+}
+
+
+static int32_t balance(void)
+{
+    if (CONFIG_CELL_MA_PER_V)
+        return (int32_t) (counters_get(CNT_POL0_MAH) -
+                          counters_get(CNT_POL1_MAH));
+
+    return (int32_t) (counters_get(CNT_POL0_SEC) -
+                      counters_get(CNT_POL1_SEC));
+}
+
+
+/* Returns the polarity to start with */
+int cell_init(void)
+{
+    int32_t b = balance();
+
+    ESP_LOGI(TAG, "balance %d %s, start with polarity %d", (int) b,
+             CONFIG_CELL_MA_PER_V ? "mAh" : "s", b > 0);
+    return b > 0;
+}
+
+
+/* Integrates the current of the energised cell over ms at polarity lev,
+ * mv of the sense input */
+void cell_sample(int lev, int32_t mv, uint32_t ms)
+{
+    uint32_t mah;
+
+    if (lev != phase_lev) {
+        phase_lev = lev;
+        phase_ms = 0;
+    }
+
+    phase_ms += ms;
+    if (!CONFIG_CELL_MA_PER_V)
+        return;
+
+    ma = mv > 0 ? (int32_t) ((int64_t) mv * CONFIG_CELL_MA_PER_V / 1000) : 0;
+    mas[lev] += (uint32_t) ma * ms;
+    mah = mas[lev] / 3600000;
+    if (mah) {
+        mas[lev] -= mah * 3600000;
+        counters_add(lev ? CNT_POL1_MAH : CNT_POL0_MAH, mah);
+    }
+}
+
+
+/* Polarity lev has moved its share of the balance */
+bool cell_flip_due(int lev)
+{
+    int32_t b = balance();
+
+    if (lev != phase_lev || phase_ms < CONFIG_CELL_FLIP_MIN_SECS * 1000)
+        return false;
+
+    if (phase_ms >= CONFIG_CELL_FLIP_MAX_SECS * 1000)
+        return true;
+
+    return lev ? b <= -half() : b >= half();
+}
+
+
+void cell_get(struct cell_stats *st)
+{
+    uint64_t mah = (uint64_t) counters_get(CNT_POL0_MAH) +
+                   counters_get(CNT_POL1_MAH);
+
+    st->ma = CONFIG_CELL_MA_PER_V ? ma : -1;
+    st->balance = balance();
+    st->cl2_g = (uint32_t) (mah * CL2_MG_PER_AH * CONFIG_CELL_EFFICIENCY /
+                            100 / 1000000);
+}
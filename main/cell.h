@@ -0,0 +1,16 @@
+#ifndef CELL_H
+#define CELL_H
+#include <stdbool.h>
+#include <stdint.h>
+
+struct cell_stats {
+    int32_t ma;             /* last cell current, -1 no current sense */
+    int32_t balance;        /* polarity 0 minus 1, mAh (s without sense) */
+    uint32_t cl2_g;         /* chlorine produced */
+};
+
+int cell_init(void);
+void cell_sample(int lev, int32_t mv, uint32_t ms);
+bool cell_flip_due(int lev);
+void cell_get(struct cell_stats *st);
+#endif
@@ -0,0 +1,224 @@
+/**
+ * @file cmd.c  Command mailboxes of the control tasks
+ *
+ * Commands from the web UI, MQTT and CoAP are posted into the mailbox of
+ * the task that applies them, a bounded multi-producer ring without locks:
+ * a producer claims a slot by compare-and-swap on the head and publishes it
+ * by its sequence number, the single consumer takes slots in order. In lap
+ * n of the ring a slot is free at sequence 2n and filled at 2n + 1, so the
+ * zeroed ring is ready without init. The
+ * consumer is woken by a task notification, so a command is applied right
+ * after the post instead of at the next poll.
+ *
+ * Every command gets an id as acknowledgement. Its state, error and the
+ * latency from post to applied are kept in a ring of the last CMD_RESULTS
+ * commands for the APIs.
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "snapshot.h"
+#include "cmd.h"
+
+#define CMD_SLOTS   8           /* per mailbox, a power of two */
+
+struct slot {
+    uint32_t seq;               /* 2 * lap, + 1 while filled */
+    struct cmd cmd;
+};
+
+struct mailbox {
+    struct slot slot[CMD_SLOTS];
+    uint32_t head;              /* next slot to claim */
+    uint32_t tail;              /* next slot to take, consumer only */
+    TaskHandle_t task;
+};
+
+/* result ring, rec.id is written last and checked by the readers */
+struct rec {
+    uint32_t id;
+    struct cmd_result r;
+};
+
+static const enum cmd_box box_of[CMD_TYPES] = {
+    [CMD_SWITCH]    = CMD_BOX_POOL,
+    [CMD_FORCE]     = CMD_BOX_POOL,
+    [CMD_UPGRADE]   = CMD_BOX_MAIN,
+    [CMD_WIFI_SCAN] = CMD_BOX_MAIN,
+};
+
+static const char *names[CMD_TYPES] = {
+    [CMD_SWITCH]    = "switch",
+    [CMD_FORCE]     = "force",
+    [CMD_UPGRADE]   = "upgrade",
+    [CMD_WIFI_SCAN] = "wifi",
+};
+
+static struct mailbox boxes[CMD_BOXES];
+static struct rec recs[CMD_RESULTS];
+static uint32_t next_id;
+static uint32_t pending[CMD_TYPES];
+
+
+static uint32_t lap(uint32_t pos)
+{
+    return pos / CMD_SLOTS * 2;
+}
+
+
+static void rec_put(const struct cmd *c, enum cmd_state state, int32_t err)
+{
+    struct rec *rec = &recs[c->id % CMD_RESULTS];
+
+    __atomic_store_n(&rec->id, 0, __ATOMIC_RELEASE);
+    rec->r.id = c->id;
+    rec->r.type = c->type;
+    rec->r.arg = c->arg;
+    rec->r.state = state;
+    rec->r.err = err;
+    rec->r.latency = state == CMD_QUEUED ? 0 :
+                     (uint32_t) (esp_timer_get_time() - c->posted);
+    __atomic_store_n(&rec->id, c->id, __ATOMIC_RELEASE);
+}
+
+
+/* Posts a command to the task applying it, returns its id or 0 if the
+ * mailbox is full. Safe from any task. */
+uint32_t cmd_post(enum cmd_type type, int32_t arg)
+{
+    struct mailbox *mb;
+    struct slot *s;
+    struct cmd c;
+    uint32_t pos, seq;
+
+    if (type >= CMD_TYPES)
+        return 0;
+
+    mb = &boxes[box_of[type]];
+    c.type = type;
+    c.arg = arg;
+    c.posted = esp_timer_get_time();
+    do {
+        c.id = __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+    } while (!c.id);
+
+    pos = __atomic_load_n(&mb->head, __ATOMIC_RELAXED);
+    for (;;) {
+        s = &mb->slot[pos % CMD_SLOTS];
+        seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (seq == lap(pos)) {
+            if (__atomic_compare_exchange_n(&mb->head, &pos, pos + 1, false,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        }
+        else if ((int32_t) (seq - lap(pos)) < 0) {
+            /* full, the slot of the last lap is not taken yet */
+            return 0;
+        }
+        else {
+            pos = __atomic_load_n(&mb->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    s->cmd = c;
+    rec_put(&c, CMD_QUEUED, 0);
+    __atomic_add_fetch(&pending[type], 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->seq, lap(pos) + 1, __ATOMIC_RELEASE);
+
+    if (__atomic_load_n(&mb->task, __ATOMIC_ACQUIRE))
+        xTaskNotifyGive(mb->task);
+
+    return c.id;
+}
+
+
+/* The calling task consumes the mailbox box */
+void cmd_register(enum cmd_box box)
+{
+    __atomic_store_n(&boxes[box].task, xTaskGetCurrentTaskHandle(),
+                     __ATOMIC_RELEASE);
+}
+
+
+/* Sleeps up to ms or until a command is posted */
+bool cmd_wait(uint32_t ms)
+{
+    return ulTaskNotifyTake(pdTRUE, (ms + portTICK_PERIOD_MS - 1) /
+                            portTICK_PERIOD_MS) != 0;
+}
+
+
+bool cmd_take(enum cmd_box box, struct cmd *c)
+{
+    struct mailbox *mb = &boxes[box];
+    struct slot *s = &mb->slot[mb->tail % CMD_SLOTS];
+
+    if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != lap(mb->tail) + 1)
+        return false;
+
+    *c = s->cmd;
+    __atomic_store_n(&s->seq, lap(mb->tail) + 2, __ATOMIC_RELEASE);
+    mb->tail++;
+    return true;
+}
+
+
+/* The consumer applied c, err 0 on success */
+void cmd_done(const struct cmd *c, int32_t err)
+{
+    rec_put(c, err ? CMD_FAILED : CMD_DONE, err);
+    __atomic_sub_fetch(&pending[c->type], 1, __ATOMIC_RELAXED);
+    snapshot_touch();
+}
+
+
+/* A command of type is posted and not yet applied */
+bool cmd_pending(enum cmd_type type)
+{
+    return type < CMD_TYPES &&
+           __atomic_load_n(&pending[type], __ATOMIC_RELAXED);
+}
+
+
+/* Result of command id, false if unknown or overwritten */
+bool cmd_result(uint32_t id, struct cmd_result *r)
+{
+    struct rec *rec = &recs[id % CMD_RESULTS];
+
+    if (!id || __atomic_load_n(&rec->id, __ATOMIC_ACQUIRE) != id)
+        return false;
+
+    *r = rec->r;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&rec->id, __ATOMIC_RELAXED) == id;
+}
+
+
+/* Id of the last posted command */
+uint32_t cmd_last(void)
+{
+    return __atomic_load_n(&next_id, __ATOMIC_RELAXED);
+}
+
+
+const char *cmd_name(enum cmd_type type)
+{
+    return type < CMD_TYPES ? names[type] : "";
+}
+
+
+const char *cmd_state_name(enum cmd_state state)
+{
+    switch (state) {
+    case CMD_QUEUED: return "queued";
+    case CMD_DONE:   return "done";
+    case CMD_FAILED: return "failed";
+    }
+
+    return "";
+}
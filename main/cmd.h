@@ -0,0 +1,56 @@
+#ifndef CMD_H
+#define CMD_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CMD_RESULTS 16          /* results kept */
+
+enum cmd_type {
+    CMD_SWITCH,             /* reverse the polarity */
+    CMD_FORCE,              /* arg: enum force_run */
+    CMD_UPGRADE,
+    CMD_WIFI_SCAN,
+    CMD_TYPES
+};
+
+/* consumer task of a command */
+enum cmd_box {
+    CMD_BOX_POOL,           /* pool_loop() */
+    CMD_BOX_MAIN,           /* main loop */
+    CMD_BOXES
+};
+
+enum cmd_state {
+    CMD_QUEUED,
+    CMD_DONE,
+    CMD_FAILED,
+};
+
+struct cmd {
+    uint32_t id;
+    enum cmd_type type;
+    int32_t arg;
+    int64_t posted;         /* us since boot */
+};
+
+struct cmd_result {
+    uint32_t id;
+    enum cmd_type type;
+    int32_t arg;
+    enum cmd_state state;
+    int32_t err;            /* esp_err_t of a failed command */
+    uint32_t latency;       /* us from post to applied */
+};
+
+uint32_t cmd_post(enum cmd_type type, int32_t arg);
+void cmd_register(enum cmd_box box);
+bool cmd_wait(uint32_t ms);
+bool cmd_take(enum cmd_box box, struct cmd *c);
+void cmd_done(const struct cmd *c, int32_t err);
+bool cmd_pending(enum cmd_type type);
+bool cmd_result(uint32_t id, struct cmd_result *r);
+uint32_t cmd_last(void);
+const char *cmd_name(enum cmd_type type);
+const char *cmd_state_name(enum cmd_state state);
+#endif
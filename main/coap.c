@@ -0,0 +1,784 @@
+/**
+ * @file coap.c  CoAP (RFC 7252) endpoint with CBOR payloads
+ *
+ * Compact UDP alternative to the web page for polling a fleet of
+ * controllers. Reads the same state as the web page and MQTT, commands map
+ * onto the actions of the web form. /status supports Observe (RFC 7641):
+ * observers get a NON notification when a value changes and a CON refresh
+ * every CONFIG_COAP_REFRESH_SECS. An observer that answers with RST or did
+ * not acknowledge the previous refresh is dropped. There are no
+ * retransmissions, a client repeats a lost request.
+ *
+ *   GET  /.well-known/core   link format
+ *   GET  /status             {"running":b,"powered":b,"polarity":n,
+ *                            "flow":b,"force":"none|on|off",
+ *                            "schedule":[hh,mm,duration]}, observable
+ *   GET  /counters           {"k1":n,..}
+ *   GET  /settings           {"hh":n,"mm":n,"duration":n}
+ *   PUT  /settings           same map, keys may be omitted
+ *   POST /cmd/force          "none" | "on" | "off"
+ *   POST /cmd/switch         switch polarity
+ *   POST /cmd/upgrade        start OTA
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "lwip/sockets.h"
+#include "config.h"
+#include "log.h"
+#include "settings.h"
+#include "counters.h"
+#include "webui.h"
+#include "pool.h"
+#include "cbor.h"
+#include "mem.h"
+#include "coap.h"
+
+/* UDP port, 0 disables CoAP */
+#ifndef CONFIG_COAP_PORT
+#define CONFIG_COAP_PORT 5683
+#endif
+
+#ifndef CONFIG_COAP_OBSERVERS
+#define CONFIG_COAP_OBSERVERS 4
+#endif
+
+#ifndef CONFIG_COAP_REFRESH_SECS
+#define CONFIG_COAP_REFRESH_SECS 300
+#endif
+
+#define MSG_MAX     256
+#define PAYLOAD_MAX 192
+#define URI_MAX     32
+#define TKL_MAX     8
+#define RECENT_MAX  8
+#define CF_LINK     40
+#define CF_CBOR     60
+
+enum coap_type {
+    CON,
+    NON,
+    ACK,
+    RST
+};
+
+enum coap_code {
+    EMPTY          = 0x00,
+    GET            = 0x01,
+    POST           = 0x02,
+    PUT            = 0x03,
+    CHANGED        = 0x44,
+    CONTENT        = 0x45,
+    BAD_REQUEST    = 0x80,
+    BAD_OPTION     = 0x82,
+    NOT_FOUND      = 0x84,
+    BAD_METHOD     = 0x85,
+    NOT_ACCEPTABLE = 0x86,
+    BAD_FORMAT     = 0x8f,
+    UNAVAILABLE    = 0xa3,
+};
+
+enum coap_opt {
+    OPT_URI_HOST       = 3,
+    OPT_OBSERVE        = 6,
+    OPT_URI_PORT       = 7,
+    OPT_URI_PATH       = 11,
+    OPT_CONTENT_FORMAT = 12,
+    OPT_URI_QUERY      = 15,
+    OPT_ACCEPT         = 17,
+};
+
+struct peer {
+    struct sockaddr_storage addr;
+    socklen_t alen;
+};
+
+struct request {
+    uint8_t type;
+    uint8_t code;
+    uint16_t mid;
+    uint8_t tkl;
+    uint8_t token[TKL_MAX];
+    char path[URI_MAX];
+    bool path_long;
+    bool bad_option;        /* unknown critical option */
+    int32_t observe;        /* -1 if absent */
+    int32_t format;
+    int32_t accept;
+    const uint8_t *payload;
+    size_t plen;
+};
+
+struct observer {
+    struct peer peer;
+    uint8_t tkl;
+    uint8_t token[TKL_MAX];
+    uint16_t mid;           /* of the unacknowledged CON refresh */
+    bool pending;
+    bool used;
+};
+
+/* answered non-idempotent requests, a duplicate gets the same code */
+struct recent {
+    struct peer peer;
+    uint16_t mid;
+    uint8_t code;
+    bool used;
+};
+
+static const char *TAG = "coap";
+static const char *force_names[] = { "none", "on", "off" };
+static const char core_links[] =
+    "</status>;ct=60;obs,</counters>;ct=60,</settings>;ct=60,"
+    "</cmd/force>,</cmd/switch>,</cmd/upgrade>";
+
+static int sock = -1;
+static uint16_t next_mid;
+static uint32_t obs_seq;
+static struct observer observers[CONFIG_COAP_OBSERVERS];
+static struct recent recent[RECENT_MAX];
+static size_t recent_pos;
+static uint8_t last_status[PAYLOAD_MAX];
+static size_t last_status_len;
+MEM_TASKS(coap, 4096, 1);
+
+
+static bool peer_eq(const struct peer *a, const struct peer *b)
+{
+    return a->alen == b->alen && !memcmp(&a->addr, &b->addr, a->alen);
+}
+
+
+static bool opt_ext(const uint8_t **p, const uint8_t *end, uint32_t *v)
+{
+    if (*v < 13)
+        return true;
+
+    if (*v == 15)
+        return false;
+
+    if (*v == 13) {
+        if (end - *p < 1)
+            return false;
+
+        *v = 13 + (*p)[0];
+        *p += 1;
+    }
+    else {
+        if (end - *p < 2)
+            return false;
+
+        *v = 269 + ((*p)[0] << 8 | (*p)[1]);
+        *p += 2;
+    }
+
+    return true;
+}
+
+
+static int32_t opt_uint(const uint8_t *p, uint32_t len)
+{
+    int32_t v = 0;
+
+    if (len > 3)
+        return -1;
+
+    while (len--)
+        v = v << 8 | *p++;
+
+    return v;
+}
+
+
+static bool parse(const uint8_t *p, size_t len, struct request *r)
+{
+    const uint8_t *end = p + len;
+    uint32_t num = 0, delta, olen;
+    size_t n;
+
+    if (len < 4 || p[0] >> 6 != 1)
+        return false;
+
+    r->type = p[0] >> 4 & 3;
+    r->tkl  = p[0] & 0xf;
+    r->code = p[1];
+    r->mid  = p[2] << 8 | p[3];
+    if (r->tkl > TKL_MAX || 4 + r->tkl > len)
+        return false;
+
+    memcpy(r->token, p + 4, r->tkl);
+    p += 4 + r->tkl;
+
+    r->path[0] = '\0';
+    r->path_long = r->bad_option = false;
+    r->observe = r->format = r->accept = -1;
+    r->payload = NULL;
+    r->plen = 0;
+    while (p < end) {
+        if (*p == 0xff) {
+            if (++p == end)
+                return false;
+
+            r->payload = p;
+            r->plen = end - p;
+            break;
+        }
+
+        delta = *p >> 4;
+        olen  = *p & 0xf;
+        p++;
+        if (!opt_ext(&p, end, &delta) || !opt_ext(&p, end, &olen) ||
+                (uint32_t) (end - p) < olen)
+            return false;
+
+        num += delta;
+        switch (num) {
+        case OPT_URI_PATH:
+            n = strlen(r->path);
+            if (n + 1 + olen >= sizeof(r->path)) {
+                r->path_long = true;
+                break;
+            }
+
+            r->path[n] = '/';
+            memcpy(r->path + n + 1, p, olen);
+            r->path[n + 1 + olen] = '\0';
+            break;
+        case OPT_OBSERVE:
+            r->observe = opt_uint(p, olen);
+            break;
+        case OPT_CONTENT_FORMAT:
+            r->format = opt_uint(p, olen);
+            break;
+        case OPT_ACCEPT:
+            r->accept = opt_uint(p, olen);
+            break;
+        case OPT_URI_HOST:
+        case OPT_URI_PORT:
+        case OPT_URI_QUERY:
+            break;
+        default:
+            if (num & 1)
+                r->bad_option = true;
+            break;
+        }
+
+        p += olen;
+    }
+
+    return true;
+}
+
+
+static size_t put_opt(uint8_t *p, uint32_t delta, const uint8_t *val,
+                      size_t len)
+{
+    size_t n = 1;
+
+    /* values here are short, only the delta may need an extension */
+    if (delta >= 13) {
+        p[0] = 13 << 4 | len;
+        p[n++] = delta - 13;
+    }
+    else {
+        p[0] = delta << 4 | len;
+    }
+
+    memcpy(p + n, val, len);
+    return n + len;
+}
+
+
+static size_t put_opt_uint(uint8_t *p, uint32_t delta, uint32_t v)
+{
+    uint8_t b[4];
+    size_t n = 0;
+    int i;
+
+    for (i = 3; i >= 0; i--) {
+        if (n || v >> (8 * i))
+            b[n++] = v >> (8 * i);
+    }
+
+    return put_opt(p, delta, b, n);
+}
+
+
+/* Sends a message with optional Observe and Content-Format option and
+ * payload, observe and format -1 if absent */
+static void send_msg(const struct peer *peer, uint8_t type, uint8_t code,
+                     uint16_t mid, const uint8_t *token, uint8_t tkl,
+                     int32_t observe, int32_t format,
+                     const uint8_t *payload, size_t plen)
+{
+    uint8_t buf[MSG_MAX];
+    uint32_t num = 0;
+    size_t n = 0;
+
+    if (4 + tkl + 2 * 5 + 1 + plen > sizeof(buf))
+        return;
+
+    buf[n++] = 1 << 6 | type << 4 | tkl;
+    buf[n++] = code;
+    buf[n++] = mid >> 8;
+    buf[n++] = mid & 0xff;
+    if (tkl)
+        memcpy(buf + n, token, tkl);
+    n += tkl;
+    if (observe >= 0) {
+        n += put_opt_uint(buf + n, OPT_OBSERVE - num, observe & 0xffffff);
+        num = OPT_OBSERVE;
+    }
+
+    if (format >= 0)
+        n += put_opt_uint(buf + n, OPT_CONTENT_FORMAT - num, format);
+
+    if (plen) {
+        buf[n++] = 0xff;
+        memcpy(buf + n, payload, plen);
+        n += plen;
+    }
+
+    if (sendto(sock, buf, n, 0, (const struct sockaddr *) &peer->addr,
+               peer->alen) < 0)
+        ESP_LOGW(TAG, "sendto failed (%d)", errno);
+}
+
+
+static size_t encode_status(uint8_t *buf, size_t size)
+{
+    struct pool_state ps;
+    struct settings set;
+    struct cbor c;
+
+    pool_get_state(&ps);
+    settings_get(&set);
+    cbor_init(&c, buf, size);
+    cbor_map(&c, 6);
+    cbor_text(&c, "running");
+    cbor_bool(&c, webui_check_time());
+    cbor_text(&c, "powered");
+    cbor_bool(&c, ps.powered);
+    cbor_text(&c, "polarity");
+    cbor_uint(&c, ps.polarity);
+    cbor_text(&c, "flow");
+    cbor_bool(&c, ps.flow_ok);
+    cbor_text(&c, "force");
+    cbor_text(&c, force_names[webui_force()]);
+    cbor_text(&c, "schedule");
+    cbor_array(&c, 3);
+    cbor_uint(&c, set.hh);
+    cbor_uint(&c, set.mm);
+    cbor_uint(&c, set.duration);
+
+    return c.err ? 0 : c.len;
+}
+
+
+static size_t encode_counters(uint8_t *buf, size_t size)
+{
+    struct cbor c;
+    int i;
+
+    cbor_init(&c, buf, size);
+    cbor_map(&c, CNT_MAX);
+    for (i = 0; i < CNT_MAX; i++) {
+        cbor_text(&c, counters_name(i));
+        cbor_uint(&c, counters_get(i));
+    }
+
+    return c.err ? 0 : c.len;
+}
+
+
+static size_t encode_settings(uint8_t *buf, size_t size)
+{
+    struct settings set;
+    struct cbor c;
+
+    settings_get(&set);
+    cbor_init(&c, buf, size);
+    cbor_map(&c, 3);
+    cbor_text(&c, "hh");
+    cbor_uint(&c, set.hh);
+    cbor_text(&c, "mm");
+    cbor_uint(&c, set.mm);
+    cbor_text(&c, "duration");
+    cbor_uint(&c, set.duration);
+
+    return c.err ? 0 : c.len;
+}
+
+
+static uint8_t put_settings(const struct request *r)
+{
+    const uint8_t *p = r->payload, *end = p + r->plen;
+    struct cbor_item key, val;
+    struct settings set;
+    uint64_t n;
+
+    if (r->format >= 0 && r->format != CF_CBOR)
+        return BAD_FORMAT;
+
+    if (!cbor_next(&p, end, &val) || val.major != CBOR_MAP)
+        return BAD_REQUEST;
+
+    settings_get(&set);
+    for (n = val.val; n; n--) {
+        if (!cbor_next(&p, end, &key) || !cbor_next(&p, end, &val) ||
+                val.major != CBOR_UINT)
+            return BAD_REQUEST;
+
+        if (cbor_text_eq(&key, "hh") && val.val <= 23)
+            set.hh = val.val;
+        else if (cbor_text_eq(&key, "mm") && val.val <= 59)
+            set.mm = val.val;
+        else if (cbor_text_eq(&key, "duration") && val.val >= 1 &&
+                 val.val <= 12)
+            set.duration = val.val;
+        else
+            return BAD_REQUEST;
+    }
+
+    settings_set(&set);
+    logs(LOG_SRC_NET, "coap schedule %02d:%02d %d", (int) set.hh,
+         (int) set.mm, (int) set.duration);
+    return CHANGED;
+}
+
+
+static uint8_t post_cmd(const struct request *r)
+{
+    const char *cmd = r->path + 5;
+    const uint8_t *p = r->payload;
+    struct cbor_item it;
+    size_t i;
+
+    /* 5.03 if the mailbox of the control task is full */
+    if (!strcmp(cmd, "switch"))
+        return webui_request_switch() ? CHANGED : UNAVAILABLE;
+
+    if (!strcmp(cmd, "upgrade")) {
+        logs(LOG_SRC_NET, "coap upgrade");
+        return webui_request_upgrade() ? CHANGED : UNAVAILABLE;
+    }
+
+    if (strcmp(cmd, "force"))
+        return NOT_FOUND;
+
+    if (r->format >= 0 && r->format != CF_CBOR)
+        return BAD_FORMAT;
+
+    if (!cbor_next(&p, p + r->plen, &it))
+        return BAD_REQUEST;
+
+    for (i = 0; i < sizeof(force_names) / sizeof(force_names[0]); i++) {
+        if (cbor_text_eq(&it, force_names[i])) {
+            logs(LOG_SRC_NET, "coap force %s", force_names[i]);
+            return webui_request_force((enum force_run) i) ?
+                   CHANGED : UNAVAILABLE;
+        }
+    }
+
+    return BAD_REQUEST;
+}
+
+
+static struct observer *find_observer(const struct peer *peer,
+                                      const struct request *r)
+{
+    int i;
+
+    for (i = 0; i < CONFIG_COAP_OBSERVERS; i++) {
+        struct observer *o = &observers[i];
+
+        if (o->used && peer_eq(&o->peer, peer) && o->tkl == r->tkl &&
+                !memcmp(o->token, r->token, r->tkl))
+            return o;
+    }
+
+    return NULL;
+}
+
+
+/* Registers or removes the observer, returns true if it is registered */
+static bool observe(const struct peer *peer, const struct request *r)
+{
+    struct observer *o = find_observer(peer, r);
+    int i;
+
+    if (r->observe == 1) {
+        if (o)
+            o->used = false;
+        return false;
+    }
+
+    if (r->observe != 0)
+        return o != NULL;
+
+    for (i = 0; !o && i < CONFIG_COAP_OBSERVERS; i++) {
+        if (!observers[i].used)
+            o = &observers[i];
+    }
+
+    if (!o)
+        return false;
+
+    o->peer = *peer;
+    o->tkl = r->tkl;
+    memcpy(o->token, r->token, r->tkl);
+    o->pending = false;
+    o->used = true;
+    return true;
+}
+
+
+static uint8_t recent_code(const struct peer *peer, uint16_t mid)
+{
+    int i;
+
+    for (i = 0; i < RECENT_MAX; i++) {
+        if (recent[i].used && recent[i].mid == mid &&
+                peer_eq(&recent[i].peer, peer))
+            return recent[i].code;
+    }
+
+    return EMPTY;
+}
+
+
+static void recent_add(const struct peer *peer, uint16_t mid, uint8_t code)
+{
+    struct recent *e = &recent[recent_pos++ % RECENT_MAX];
+
+    e->peer = *peer;
+    e->mid  = mid;
+    e->code = code;
+    e->used = true;
+}
+
+
+/* ACK or RST of a CON refresh */
+static void handle_reply(const struct peer *peer, const struct request *r)
+{
+    int i;
+
+    for (i = 0; i < CONFIG_COAP_OBSERVERS; i++) {
+        struct observer *o = &observers[i];
+
+        if (!o->used || !o->pending || o->mid != r->mid ||
+                !peer_eq(&o->peer, peer))
+            continue;
+
+        o->pending = false;
+        if (r->type == RST)
+            o->used = false;
+    }
+}
+
+
+static void handle(const struct peer *peer, const struct request *r)
+{
+    uint8_t payload[PAYLOAD_MAX];
+    uint8_t type = r->type == CON ? ACK : NON;
+    uint16_t mid = r->type == CON ? r->mid : next_mid++;
+    int32_t obs = -1, format = -1;
+    size_t plen = 0;
+    uint8_t code;
+
+    if (r->type == ACK || r->type == RST) {
+        handle_reply(peer, r);
+        return;
+    }
+
+    /* ping */
+    if (r->code == EMPTY) {
+        if (r->type == CON)
+            send_msg(peer, RST, EMPTY, r->mid, NULL, 0, -1, -1, NULL, 0);
+        return;
+    }
+
+    if (r->code >> 5)
+        return;
+
+    if (r->code != GET) {
+        code = recent_code(peer, r->mid);
+        if (code != EMPTY) {
+            send_msg(peer, type, code, mid, r->token, r->tkl, -1, -1,
+                     NULL, 0);
+            return;
+        }
+    }
+
+    if (r->bad_option) {
+        code = BAD_OPTION;
+    }
+    else if (r->path_long) {
+        code = NOT_FOUND;
+    }
+    else if (!strcmp(r->path, "/.well-known/core")) {
+        code = r->code == GET ? CONTENT : BAD_METHOD;
+        if (code == CONTENT) {
+            plen = sizeof(core_links) - 1;
+            memcpy(payload, core_links, plen);
+            format = CF_LINK;
+        }
+    }
+    else if (!strcmp(r->path, "/status") || !strcmp(r->path, "/counters") ||
+             !strcmp(r->path, "/settings")) {
+        if (r->accept >= 0 && r->accept != CF_CBOR)
+            code = NOT_ACCEPTABLE;
+        else if (r->code == PUT && !strcmp(r->path, "/settings"))
+            code = put_settings(r);
+        else if (r->code != GET)
+            code = BAD_METHOD;
+        else
+            code = CONTENT;
+
+        if (code == CONTENT) {
+            format = CF_CBOR;
+            if (!strcmp(r->path, "/status")) {
+                plen = encode_status(payload, sizeof(payload));
+                if (observe(peer, r))
+                    obs = obs_seq;
+            }
+            else if (!strcmp(r->path, "/counters")) {
+                plen = encode_counters(payload, sizeof(payload));
+            }
+            else {
+                plen = encode_settings(payload, sizeof(payload));
+            }
+        }
+    }
+    else if (!strncmp(r->path, "/cmd/", 5)) {
+        code = r->code == POST ? post_cmd(r) : BAD_METHOD;
+    }
+    else {
+        code = NOT_FOUND;
+    }
+
+    if (r->code != GET)
+        recent_add(peer, r->mid, code);
+
+    send_msg(peer, type, code, mid, r->token, r->tkl, obs, format, payload,
+             plen);
+}
+
+
+/* Notifies the observers if the status changed, refresh sends CON */
+static void notify(bool refresh)
+{
+    uint8_t payload[PAYLOAD_MAX];
+    size_t plen;
+    int i;
+
+    plen = encode_status(payload, sizeof(payload));
+    if (!refresh && plen == last_status_len &&
+            !memcmp(payload, last_status, plen))
+        return;
+
+    memcpy(last_status, payload, plen);
+    last_status_len = plen;
+    obs_seq++;
+    for (i = 0; i < CONFIG_COAP_OBSERVERS; i++) {
+        struct observer *o = &observers[i];
+
+        if (!o->used)
+            continue;
+
+        if (refresh && o->pending) {
+            ESP_LOGI(TAG, "observer gone");
+            o->used = false;
+            continue;
+        }
+
+        if (refresh) {
+            o->pending = true;
+            o->mid = next_mid;
+        }
+
+        send_msg(&o->peer, refresh ? CON : NON, CONTENT, next_mid++,
+                 o->token, o->tkl, obs_seq, CF_CBOR, payload, plen);
+    }
+}
+
+
+static void coap_task(void *arg)
+{
+    const TickType_t refresh_ticks = pdMS_TO_TICKS(CONFIG_COAP_REFRESH_SECS *
+                                                   1000);
+    TickType_t last_poll = xTaskGetTickCount();
+    TickType_t last_refresh = last_poll;
+    uint8_t buf[MSG_MAX];
+    struct request r;
+    struct peer peer;
+    TickType_t now;
+    ssize_t n;
+    (void) arg;
+
+    last_status_len = encode_status(last_status, sizeof(last_status));
+    while (true) {
+        peer.alen = sizeof(peer.addr);
+        n = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr *) &peer.addr,
+                     &peer.alen);
+        if (n > 0 && parse(buf, n, &r))
+            handle(&peer, &r);
+
+        /* the state is polled once per second and after each request */
+        now = xTaskGetTickCount();
+        if (n <= 0 && now - last_poll < pdMS_TO_TICKS(1000))
+            continue;
+
+        last_poll = now;
+        if (now - last_refresh >= refresh_ticks) {
+            last_refresh = now;
+            notify(true);
+        }
+        else {
+            notify(false);
+        }
+    }
+}
+
+
+/* Binds the UDP socket and starts the server task, port -1 for
+ * CONFIG_COAP_PORT, 0 disables */
+void coap_init(int port)
+{
+    struct sockaddr_in sa = { 0 };
+    struct timeval tv = { .tv_sec = 1 };
+
+    if (port < 0)
+        port = CONFIG_COAP_PORT;
+
+    if (!port || sock >= 0)
+        return;
+
+    sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0) {
+        ESP_LOGE(TAG, "socket failed (%d)", errno);
+        return;
+    }
+
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    sa.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(sock, (struct sockaddr *) &sa, sizeof(sa))) {
+        ESP_LOGE(TAG, "bind port %d failed (%d)", port, errno);
+        close(sock);
+        sock = -1;
+        return;
+    }
+
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    next_mid = esp_random();
+    MEM_TASK_CREATE(coap, 0, &coap_task, "coap", NULL, 4, NULL);
+    ESP_LOGI(TAG, "listening on port %d", port);
+}
@@ -0,0 +1,4 @@
+#ifndef COAP_H
+#define COAP_H
+void coap_init(int port);
+#endif
@@ -0,0 +1,287 @@
+/**
+ * @file counters.c
+ *
+ * Wear counters. The values live in RTC memory, which survives soft resets,
+ * and are appended as snapshots to a log structured flash partition every
+ * COUNTERS_SNAPSHOT_S seconds. On power loss at most one interval is lost.
+ * New counters are appended to enum counter, a log of shorter snapshots is
+ * migrated once at boot.
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_crc.h"
+#include "esp_timer.h"
+#include "esp_partition.h"
+#include "counters.h"
+
+#define COUNTERS_SNAPSHOT_S  600
+#define COUNTERS_SUBTYPE     0x40
+#define COUNTERS_LABEL       "counters"
+#define RTC_MAGIC            0x504f4f4c
+#define SECTOR_SIZE          4096
+#define SEQ_EMPTY            0xffffffff
+
+static const char *TAG = "counters";
+
+/* one snapshot in flash */
+struct rec {
+    uint32_t seq;
+    uint32_t val[CNT_MAX];
+    uint32_t crc;
+};
+
+#define RECS_PER_SECTOR (SECTOR_SIZE / sizeof(struct rec))
+
+/* snapshot before the charge counters */
+#define CNT_V1  (CNT_LOW_FLOW + 1)
+
+struct rec_v1 {
+    uint32_t seq;
+    uint32_t val[CNT_V1];
+    uint32_t crc;
+};
+
+#define RECS_V1_PER_SECTOR (SECTOR_SIZE / sizeof(struct rec_v1))
+
+struct rtc_counters {
+    uint32_t magic;
+    uint32_t val[CNT_MAX];
+    uint32_t crc;
+};
+
+static RTC_NOINIT_ATTR struct rtc_counters rtc;
+static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+static const esp_partition_t *part;
+static uint32_t seq;        /* sequence number of the last snapshot */
+static size_t pos;          /* slot of the next snapshot */
+static size_t slots;
+static int64_t last_snap;
+static uint32_t snap_crc;
+
+static const char *names[CNT_MAX] = {
+    [CNT_K1]       = "K1 cycles",
+    [CNT_K2]       = "K2 cycles",
+    [CNT_K3]       = "K3 cycles",
+    [CNT_K4]       = "K4 cycles",
+    [CNT_K5]       = "K5 cycles",
+    [CNT_CELL_SEC] = "cell s",
+    [CNT_POL0_SEC] = "polarity 0 s",
+    [CNT_POL1_SEC] = "polarity 1 s",
+    [CNT_LOW_FLOW] = "low flow",
+    [CNT_POL0_MAH] = "polarity 0 mAh",
+    [CNT_POL1_MAH] = "polarity 1 mAh",
+};
+
+
+static uint32_t crc(const uint32_t *val)
+{
+    return esp_crc32_le(0, (const uint8_t *) val, CNT_MAX * sizeof(*val));
+}
+
+
+static bool rec_valid(const struct rec *r)
+{
+    return r->seq != SEQ_EMPTY && r->crc == crc(r->val);
+}
+
+
+static size_t slot_offset(size_t slot)
+{
+    return (slot / RECS_PER_SECTOR) * SECTOR_SIZE +
+           (slot % RECS_PER_SECTOR) * sizeof(struct rec);
+}
+
+
+/* Finds the newest valid snapshot. Only done once at boot. */
+static bool scan_log(struct rec *last)
+{
+    struct rec r;
+    bool found = false;
+    size_t i;
+
+    for (i = 0; i < slots; i++) {
+        if (esp_partition_read(part, slot_offset(i), &r, sizeof(r)) ||
+                !rec_valid(&r) || (found && r.seq <= last->seq))
+            continue;
+
+        *last = r;
+        pos = i + 1;
+        found = true;
+    }
+
+    if (pos >= slots)
+        pos = 0;
+
+    /* a torn write leaves the next slot dirty, continue in a fresh sector */
+    if (pos % RECS_PER_SECTOR &&
+            (esp_partition_read(part, slot_offset(pos), &r, sizeof(r)) ||
+             r.seq != SEQ_EMPTY)) {
+        pos = (pos / RECS_PER_SECTOR + 1) * RECS_PER_SECTOR;
+        if (pos >= slots)
+            pos = 0;
+    }
+
+    return found;
+}
+
+
+/* Newest snapshot of the v1 log, the new log starts over at slot 0 */
+static bool scan_log_v1(struct rec *last)
+{
+    struct rec_v1 r;
+    bool found = false;
+    size_t i, n = (part->size / SECTOR_SIZE) * RECS_V1_PER_SECTOR;
+
+    for (i = 0; i < n; i++) {
+        if (esp_partition_read(part, (i / RECS_V1_PER_SECTOR) * SECTOR_SIZE +
+                               (i % RECS_V1_PER_SECTOR) * sizeof(r),
+                               &r, sizeof(r)) ||
+                r.seq == SEQ_EMPTY ||
+                r.crc != esp_crc32_le(0, (const uint8_t *) r.val,
+                                      sizeof(r.val)) ||
+                (found && r.seq <= last->seq))
+            continue;
+
+        memset(last->val, 0, sizeof(last->val));
+        memcpy(last->val, r.val, sizeof(r.val));
+        last->seq = r.seq;
+        last->crc = 0;      /* written again on the next flush */
+        found = true;
+    }
+
+    if (found) {
+        ESP_LOGI(TAG, "migrated counters of seq %" PRIu32, last->seq);
+        pos = 0;
+    }
+
+    return found;
+}
+
+
+static void write_snapshot(const uint32_t *val)
+{
+    struct rec r;
+    int err;
+
+    if (!part)
+        return;
+
+    if (pos % RECS_PER_SECTOR == 0) {
+        err = esp_partition_erase_range(part, slot_offset(pos), SECTOR_SIZE);
+        if (err) {
+            ESP_LOGE(TAG, "Error (%s) erasing", esp_err_to_name(err));
+            return;
+        }
+    }
+
+    r.seq = ++seq;
+    memcpy(r.val, val, sizeof(r.val));
+    r.crc = crc(r.val);
+    err = esp_partition_write(part, slot_offset(pos), &r, sizeof(r));
+    if (err) {
+        ESP_LOGE(TAG, "Error (%s) writing", esp_err_to_name(err));
+        return;
+    }
+
+    snap_crc = r.crc;
+    if (++pos >= slots)
+        pos = 0;
+}
+
+
+void counters_init(void)
+{
+    struct rec last;
+    bool found = false;
+    bool rtc_ok;
+    size_t i;
+
+    part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                    COUNTERS_SUBTYPE, COUNTERS_LABEL);
+    if (part) {
+        slots = (part->size / SECTOR_SIZE) * RECS_PER_SECTOR;
+        found = scan_log(&last) || scan_log_v1(&last);
+        if (found)
+            seq = last.seq;
+    }
+    else {
+        ESP_LOGW(TAG, "no counters partition, counters are not persistent");
+    }
+
+    rtc_ok = rtc.magic == RTC_MAGIC && rtc.crc == crc(rtc.val);
+    if (rtc_ok && found) {
+        /* RTC survives soft resets only, take the larger values */
+        for (i = 0; i < CNT_MAX; i++) {
+            if (last.val[i] > rtc.val[i])
+                rtc.val[i] = last.val[i];
+        }
+    }
+    else if (found) {
+        memcpy(rtc.val, last.val, sizeof(rtc.val));
+    }
+    else if (!rtc_ok) {
+        memset(rtc.val, 0, sizeof(rtc.val));
+    }
+
+    rtc.magic = RTC_MAGIC;
+    rtc.crc = crc(rtc.val);
+    snap_crc = found ? last.crc : 0;
+    last_snap = esp_timer_get_time();
+    ESP_LOGI(TAG, "counters loaded, seq %u", seq);
+}
+
+
+void counters_add(enum counter c, uint32_t n)
+{
+    if (c >= CNT_MAX)
+        return;
+
+    portENTER_CRITICAL(&mux);
+    rtc.val[c] += n;
+    rtc.crc = crc(rtc.val);
+    portEXIT_CRITICAL(&mux);
+}
+
+
+uint32_t counters_get(enum counter c)
+{
+    return c < CNT_MAX ? rtc.val[c] : 0;
+}
+
+
+const char *counters_name(enum counter c)
+{
+    return c < CNT_MAX ? names[c] : "";
+}
+
+
+void counters_flush(void)
+{
+    uint32_t val[CNT_MAX];
+    uint32_t c;
+
+    portENTER_CRITICAL(&mux);
+    memcpy(val, rtc.val, sizeof(val));
+    c = rtc.crc;
+    portEXIT_CRITICAL(&mux);
+
+    last_snap = esp_timer_get_time();
+    if (c != snap_crc)
+        write_snapshot(val);
+}
+
+
+/* Called periodically by a low priority task */
+void counters_poll(void)
+{
+    if (esp_timer_get_time() - last_snap >= COUNTERS_SNAPSHOT_S * 1000000LL)
+        counters_flush();
+}
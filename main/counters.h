@@ -0,0 +1,26 @@
+#ifndef COUNTERS_H
+#define COUNTERS_H
+#include <stdint.h>
+
+enum counter {
+    CNT_K1,             /* relay switching cycles */
+    CNT_K2,
+    CNT_K3,
+    CNT_K4,
+    CNT_K5,
+    CNT_CELL_SEC,       /* cell energised, in seconds */
+    CNT_POL0_SEC,       /* time at polarity 0, in seconds */
+    CNT_POL1_SEC,       /* time at polarity 1, in seconds */
+    CNT_LOW_FLOW,       /* low flow trips */
+    CNT_POL0_MAH,       /* cell charge at polarity 0, in mAh */
+    CNT_POL1_MAH,       /* cell charge at polarity 1, in mAh */
+    CNT_MAX
+};
+
+void counters_init(void);
+void counters_poll(void);
+void counters_flush(void);
+void counters_add(enum counter c, uint32_t n);
+uint32_t counters_get(enum counter c);
+const char *counters_name(enum counter c);
+#endif
@@ -0,0 +1,74 @@
+/**
+ * @file eth.c  OpenCores Ethernet of the QEMU esp32 machine
+ *
+ * Built with sdkconfig.qemu the firmware gets its address by DHCP from the
+ * user mode network of QEMU instead of connecting to the WiFi, everything
+ * above the netif is the same.
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "esp_event.h"
+#include "esp_log.h"
+#include "esp_netif.h"
+#include "eth.h"
+
+#if CONFIG_ETH_USE_OPENETH
+#include "esp_eth.h"
+
+#define GOT_IP_BIT BIT0
+
+static const char *TAG = "eth";
+static EventGroupHandle_t s_eth_event_group;
+
+
+static void got_ip(void *arg, esp_event_base_t event_base, int32_t event_id,
+                   void *event_data)
+{
+    ip_event_got_ip_t *event = (ip_event_got_ip_t *) event_data;
+
+    ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
+    xEventGroupSetBits(s_eth_event_group, GOT_IP_BIT);
+}
+
+
+int eth_init(void)
+{
+    esp_netif_config_t cfg = ESP_NETIF_DEFAULT_ETH();
+    eth_mac_config_t mac_cfg = ETH_MAC_DEFAULT_CONFIG();
+    eth_phy_config_t phy_cfg = ETH_PHY_DEFAULT_CONFIG();
+    esp_eth_handle_t eth = NULL;
+    esp_eth_config_t eth_cfg;
+    esp_eth_mac_t *mac;
+    esp_eth_phy_t *phy;
+    esp_netif_t *netif;
+
+    s_eth_event_group = xEventGroupCreate();
+    ESP_ERROR_CHECK(esp_netif_init());
+    ESP_ERROR_CHECK(esp_event_loop_create_default());
+    netif = esp_netif_new(&cfg);
+
+    /* the emulated PHY has no autonegotiation */
+    phy_cfg.autonego_timeout_ms = 100;
+    mac = esp_eth_mac_new_openeth(&mac_cfg);
+    phy = esp_eth_phy_new_dp83848(&phy_cfg);
+    eth_cfg = (esp_eth_config_t) ETH_DEFAULT_CONFIG(mac, phy);
+    ESP_ERROR_CHECK(esp_eth_driver_install(&eth_cfg, &eth));
+    ESP_ERROR_CHECK(esp_netif_attach(netif, esp_eth_new_netif_glue(eth)));
+    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_ETH_GOT_IP,
+                                               &got_ip, NULL));
+    ESP_ERROR_CHECK(esp_eth_start(eth));
+
+    xEventGroupWaitBits(s_eth_event_group, GOT_IP_BIT, pdFALSE, pdFALSE,
+                        portMAX_DELAY);
+    return ESP_OK;
+}
+#else
+int eth_init(void)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+#endif
@@ -0,0 +1,10 @@
+#ifndef ETH_H
+#define ETH_H
+
+/* Ethernet of the QEMU machine instead of WiFi, see tools/qemu_test.sh */
+#ifndef CONFIG_ETH_USE_OPENETH
+#define CONFIG_ETH_USE_OPENETH 0
+#endif
+
+int eth_init(void);
+#endif
@@ -0,0 +1,108 @@
+/**
+ * @file fan.c  Fan PWM by LEDC
+ *
+ * The fan output is driven by an LEDC channel at CONFIG_FAN_PWM_HZ, the
+ * duty comes from fanctl.c. fan_poll() is called from the control loop and
+ * only touches LEDC when the duty changed.
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include "freertos/FreeRTOS.h"
+#include "driver/ledc.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "config.h"
+#include "fanctl.h"
+#include "fan.h"
+
+#ifndef CONFIG_FAN_PWM_HZ
+#define CONFIG_FAN_PWM_HZ 25000
+#endif
+
+#define FAN_MODE    LEDC_LOW_SPEED_MODE
+#define FAN_TIMER   LEDC_TIMER_0
+#define FAN_CHANNEL LEDC_CHANNEL_0
+#define FAN_BITS    LEDC_TIMER_10_BIT
+
+static const char *TAG = "fan";
+
+static struct fanctl ctl;
+static bool ready;
+static int32_t duty = -1;
+static int64_t last;
+
+
+void fan_init(int gpio)
+{
+    struct fanctl_cfg cfg;
+    ledc_timer_config_t timer = {
+        .speed_mode = FAN_MODE,
+        .duty_resolution = FAN_BITS,
+        .timer_num = FAN_TIMER,
+        .freq_hz = CONFIG_FAN_PWM_HZ,
+        .clk_cfg = LEDC_AUTO_CLK,
+    };
+    ledc_channel_config_t chan = {
+        .gpio_num = gpio,
+        .speed_mode = FAN_MODE,
+        .channel = FAN_CHANNEL,
+        .timer_sel = FAN_TIMER,
+        .duty = 0,
+    };
+    esp_err_t err;
+
+    fanctl_defaults(&cfg);
+    fanctl_init(&ctl, &cfg);
+    err = ledc_timer_config(&timer);
+    if (!err)
+        err = ledc_channel_config(&chan);
+    if (err) {
+        ESP_LOGE(TAG, "ledc init failed (%s)", esp_err_to_name(err));
+        return;
+    }
+
+    ready = true;
+    last = esp_timer_get_time();
+}
+
+
+/* Cell energised or off, off starts the cool-down tail */
+void fan_run(bool on)
+{
+    fanctl_run(&ctl, on);
+}
+
+
+/* Cell current reading in mV, -1 none */
+void fan_load(int32_t mv)
+{
+    fanctl_load(&ctl, mv);
+}
+
+
+void fan_poll(void)
+{
+    uint32_t ms = (uint32_t) ((esp_timer_get_time() - last) / 1000);
+    int32_t d;
+
+    if (!ready)
+        return;
+
+    d = fanctl_step(&ctl, ms);
+    last += ms * 1000LL;
+    if (d == duty)
+        return;
+
+    duty = d;
+    ledc_set_duty(FAN_MODE, FAN_CHANNEL,
+                  (uint32_t) d * ((1 << FAN_BITS) - 1) / 1000);
+    ledc_update_duty(FAN_MODE, FAN_CHANNEL);
+}
+
+
+/* Current duty in % */
+int fan_duty(void)
+{
+    return ready ? (int) ctl.duty / 10 : 0;
+}
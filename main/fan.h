@@ -0,0 +1,11 @@
+#ifndef FAN_H
+#define FAN_H
+#include <stdbool.h>
+#include <stdint.h>
+
+void fan_init(int gpio);
+void fan_run(bool on);
+void fan_load(int32_t mv);
+void fan_poll(void);
+int fan_duty(void);
+#endif
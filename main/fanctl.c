@@ -0,0 +1,115 @@
+/**
+ * @file fanctl.c  Fan duty from the cell load, soft start and cool-down
+ *
+ * Control logic of fan.c without hardware, also used by the host build and
+ * tools/fansim.c. While the cell is energised the target duty is a linear
+ * curve of the cell current reading, full speed without a reading. A rising
+ * duty is limited to full scale per ramp_ms, a falling one follows at once.
+ * After the cell is switched off the fan keeps running at the minimum duty
+ * for tail_ms.
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include <string.h>
+#include "config.h"
+#include "fanctl.h"
+
+/* duty in % */
+#ifndef CONFIG_FAN_MIN
+#define CONFIG_FAN_MIN 40
+#endif
+
+#ifndef CONFIG_FAN_MAX
+#define CONFIG_FAN_MAX 100
+#endif
+
+#ifndef CONFIG_FAN_LOAD_LO_MV
+#define CONFIG_FAN_LOAD_LO_MV 200
+#endif
+
+#ifndef CONFIG_FAN_LOAD_HI_MV
+#define CONFIG_FAN_LOAD_HI_MV 800
+#endif
+
+#ifndef CONFIG_FAN_RAMP_SECS
+#define CONFIG_FAN_RAMP_SECS 3
+#endif
+
+#ifndef CONFIG_FAN_TAIL_SECS
+#define CONFIG_FAN_TAIL_SECS 120
+#endif
+
+
+/* Configuration from config.h */
+void fanctl_defaults(struct fanctl_cfg *cfg)
+{
+    cfg->min = CONFIG_FAN_MIN * 10;
+    cfg->max = CONFIG_FAN_MAX * 10;
+    cfg->lo_mv = CONFIG_FAN_LOAD_LO_MV;
+    cfg->hi_mv = CONFIG_FAN_LOAD_HI_MV;
+    cfg->ramp_ms = CONFIG_FAN_RAMP_SECS * 1000;
+    cfg->tail_ms = CONFIG_FAN_TAIL_SECS * 1000;
+}
+
+
+void fanctl_init(struct fanctl *f, const struct fanctl_cfg *cfg)
+{
+    memset(f, 0, sizeof(*f));
+    f->cfg = *cfg;
+    f->load_mv = -1;
+}
+
+
+void fanctl_run(struct fanctl *f, bool on)
+{
+    if (f->on && !on && f->duty)
+        f->tail_ms = f->cfg.tail_ms;
+    else if (on)
+        f->tail_ms = 0;
+
+    f->on = on;
+}
+
+
+void fanctl_load(struct fanctl *f, int32_t mv)
+{
+    f->load_mv = mv;
+}
+
+
+int32_t fanctl_curve(const struct fanctl_cfg *cfg, int32_t mv)
+{
+    if (mv < 0 || mv >= cfg->hi_mv || cfg->hi_mv <= cfg->lo_mv)
+        return cfg->max;
+
+    if (mv <= cfg->lo_mv)
+        return cfg->min;
+
+    return cfg->min + (cfg->max - cfg->min) * (mv - cfg->lo_mv) /
+           (cfg->hi_mv - cfg->lo_mv);
+}
+
+
+/* Advances the controller by ms and returns the duty */
+int32_t fanctl_step(struct fanctl *f, uint32_t ms)
+{
+    int32_t target = 0;
+    uint32_t rise;
+
+    if (f->on) {
+        target = fanctl_curve(&f->cfg, f->load_mv);
+    }
+    else if (f->tail_ms) {
+        f->tail_ms = ms < f->tail_ms ? f->tail_ms - ms : 0;
+        target = f->cfg.min < f->duty ? f->cfg.min : f->duty;
+    }
+
+    rise = f->cfg.ramp_ms ? (uint64_t) ms * 1000 / f->cfg.ramp_ms : 1000;
+    if (target > f->duty + (int32_t) rise)
+        f->duty += rise;
+    else
+        f->duty = target;
+
+    return f->duty;
+}
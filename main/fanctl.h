@@ -0,0 +1,30 @@
+#ifndef FANCTL_H
+#define FANCTL_H
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Duties in per mille, loads in mV of the cell current input */
+struct fanctl_cfg {
+    int32_t min;            /* at lo_mv and during the cool-down tail */
+    int32_t max;            /* at hi_mv and above */
+    int32_t lo_mv;
+    int32_t hi_mv;
+    uint32_t ramp_ms;       /* 0 to full scale */
+    uint32_t tail_ms;       /* cool-down after the cell is switched off */
+};
+
+struct fanctl {
+    struct fanctl_cfg cfg;
+    bool on;                /* cell energised */
+    int32_t load_mv;        /* -1 no reading */
+    uint32_t tail_ms;       /* remaining cool-down */
+    int32_t duty;
+};
+
+void fanctl_defaults(struct fanctl_cfg *cfg);
+void fanctl_init(struct fanctl *f, const struct fanctl_cfg *cfg);
+void fanctl_run(struct fanctl *f, bool on);
+void fanctl_load(struct fanctl *f, int32_t mv);
+int32_t fanctl_curve(const struct fanctl_cfg *cfg, int32_t mv);
+int32_t fanctl_step(struct fanctl *f, uint32_t ms);
+#endif
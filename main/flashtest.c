@@ -0,0 +1,216 @@
+/**
+ * @file flashtest.c  Low flow cutoff latency while the flash is written
+ *
+ * Bench test for CONFIG_FLASH_STRESS, the flow switch has to be
+ * disconnected. The flow input is switched to input/output and a gptimer
+ * alarm drives it alternately high (low flow) and low every PERIOD_US.
+ * Meanwhile a task commits an NVS blob and erases and writes a sector of
+ * the passive OTA partition in a loop, so the flash cache is disabled most
+ * of the time. The trigger and the flow ISR run from IRAM, the latency from
+ * driving the input until the relays are off is taken from
+ * esp_timer_get_time(). A cutoff that did not happen within PERIOD_US
+ * counts as missed.
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include <string.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/gpio.h"
+#include "driver/gptimer.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "soc/gpio_reg.h"
+#include "nvs.h"
+#include "config.h"
+#include "mem.h"
+#include "pool.h"
+#include "flashtest.h"
+
+/* seconds of flash stress after boot, 0 off */
+#ifndef CONFIG_FLASH_STRESS
+#define CONFIG_FLASH_STRESS 0
+#endif
+
+#define PERIOD_US   25000
+#define ROUND_SECS  10
+#define BLOB_SIZE   2048
+#define SECTOR      4096
+
+static const char *TAG = "flashtest";
+MEM_TASKS(flashtest, 4096, 1);
+
+static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+static int pin;
+static bool high;
+static int64_t trig_at;             /* input driven to low flow */
+static bool trig_flash;             /* during a flash operation */
+static volatile bool in_flash;      /* flash operation running */
+
+/* latencies in us */
+static struct stats {
+    uint32_t n;
+    uint32_t n_flash;
+    uint32_t missed;
+    uint32_t sum;
+    uint32_t max;
+    uint32_t max_flash;
+} stats;
+
+
+/* gptimer alarm, runs while the cache is disabled. Drives the flow input
+ * to low flow and a period later back, then takes the cutoff time of the
+ * flow ISR. */
+static bool trigger(gptimer_handle_t timer,
+                    const gptimer_alarm_event_data_t *edata, void *arg)
+{
+    int64_t cut;
+    uint32_t d;
+    (void) timer;
+    (void) edata;
+    (void) arg;
+
+    high = !high;
+    if (high) {
+        trig_at = esp_timer_get_time();
+        trig_flash = in_flash;
+        REG_WRITE(GPIO_OUT_W1TS_REG, BIT(pin));
+        return false;
+    }
+
+    REG_WRITE(GPIO_OUT_W1TC_REG, BIT(pin));
+    cut = pool_cutoff_at();
+    portENTER_CRITICAL_ISR(&mux);
+    if (cut < trig_at) {
+        stats.missed++;
+    }
+    else {
+        d = (uint32_t) (cut - trig_at);
+        stats.n++;
+        stats.sum += d;
+        if (d > stats.max)
+            stats.max = d;
+
+        if (trig_flash) {
+            stats.n_flash++;
+            if (d > stats.max_flash)
+                stats.max_flash = d;
+        }
+    }
+    portEXIT_CRITICAL_ISR(&mux);
+
+    return false;
+}
+
+
+static void log_stats(void)
+{
+    struct stats s;
+
+    portENTER_CRITICAL(&mux);
+    s = stats;
+    portEXIT_CRITICAL(&mux);
+
+    ESP_LOGI(TAG, "cutoffs %" PRIu32 " (%" PRIu32 " during flash ops), "
+             "missed %" PRIu32 ", latency avg %" PRIu32 " us max %" PRIu32
+             " us, during flash ops max %" PRIu32 " us", s.n, s.n_flash,
+             s.missed, s.n ? s.sum / s.n : 0, s.max, s.max_flash);
+}
+
+
+static void flashtest_task(void *arg)
+{
+    static uint8_t blob[BLOB_SIZE];
+    static uint8_t sector[SECTOR];
+    const esp_partition_t *part = esp_ota_get_next_update_partition(NULL);
+    int64_t end = esp_timer_get_time() + CONFIG_FLASH_STRESS * 1000000LL;
+    int64_t round = esp_timer_get_time();
+    nvs_handle_t nvs;
+    uint32_t i = 0;
+    (void) arg;
+
+    memset(sector, 0x5a, sizeof(sector));
+    if (nvs_open("flashtest", NVS_READWRITE, &nvs)) {
+        ESP_LOGE(TAG, "nvs_open failed");
+        mem_task_exit();
+        return;
+    }
+
+    ESP_LOGW(TAG, "flash stress for %d s, OTA partition %s is overwritten",
+             CONFIG_FLASH_STRESS, part ? part->label : "-");
+    while (esp_timer_get_time() < end) {
+        memset(blob, (int) i++, sizeof(blob));
+        in_flash = true;
+        nvs_set_blob(nvs, "blob", blob, sizeof(blob));
+        nvs_commit(nvs);
+        in_flash = false;
+
+        if (part) {
+            in_flash = true;
+            esp_partition_erase_range(part, 0, SECTOR);
+            esp_partition_write(part, 0, sector, SECTOR);
+            in_flash = false;
+        }
+
+        if (esp_timer_get_time() - round < ROUND_SECS * 1000000LL)
+            continue;
+
+        round = esp_timer_get_time();
+        log_stats();
+    }
+
+    nvs_erase_key(nvs, "blob");
+    nvs_commit(nvs);
+    nvs_close(nvs);
+    ESP_LOGW(TAG, "done");
+    log_stats();
+    mem_task_exit();
+}
+
+
+/* Starts the test on the flow input gpio, after the flow ISR is installed */
+void flashtest_start(int gpio)
+{
+    gptimer_config_t timer_cfg = {
+        .clk_src = GPTIMER_CLK_SRC_DEFAULT,
+        .direction = GPTIMER_COUNT_UP,
+        .resolution_hz = 1000000,
+    };
+    gptimer_alarm_config_t alarm_cfg = {
+        .alarm_count = PERIOD_US,
+        .flags.auto_reload_on_alarm = true,
+    };
+    gptimer_event_callbacks_t cbs = {
+        .on_alarm = trigger,
+    };
+    gptimer_handle_t timer;
+    esp_err_t err;
+
+    if (!CONFIG_FLASH_STRESS)
+        return;
+
+    pin = gpio;
+    gpio_set_direction(gpio, GPIO_MODE_INPUT_OUTPUT);
+    gpio_set_level(gpio, 0);
+
+    err = gptimer_new_timer(&timer_cfg, &timer);
+    if (!err)
+        err = gptimer_set_alarm_action(timer, &alarm_cfg);
+    if (!err)
+        err = gptimer_register_event_callbacks(timer, &cbs, NULL);
+    if (!err)
+        err = gptimer_enable(timer);
+    if (!err)
+        err = gptimer_start(timer);
+    if (err) {
+        ESP_LOGE(TAG, "gptimer init failed (%s)", esp_err_to_name(err));
+        return;
+    }
+
+    MEM_TASK_CREATE(flashtest, 0, &flashtest_task, "flashtest", NULL, 3,
+                    NULL);
+}
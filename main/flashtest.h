@@ -0,0 +1,5 @@
+#ifndef FLASHTEST_H
+#define FLASHTEST_H
+
+void flashtest_start(int gpio);
+#endif
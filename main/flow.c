@@ -0,0 +1,170 @@
+/**
+ * @file flow.c  Flow rate of a hall-effect meter counted by PCNT
+ *
+ * The pulses on the flow input are counted by a PCNT unit with its glitch
+ * filter, no interrupt per pulse. The driver extends the 16 bit counter at
+ * the high limit. flow_poll() records the total once a second into a ring
+ * of FLOW_HIST seconds, rates over sliding windows are the difference of
+ * two entries. Flow is low if the rate over CONFIG_FLOW_WINDOW_SECS drops
+ * below CONFIG_FLOW_MIN_LPM and ok again 10% above it.
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include "freertos/FreeRTOS.h"
+#include "driver/gpio.h"
+#include "driver/pulse_cnt.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "config.h"
+#include "flow.h"
+
+/* 0: flow switch on the flow input, otherwise pulses per litre of the
+ * meter */
+#ifndef CONFIG_FLOW_PULSES_PER_L
+#define CONFIG_FLOW_PULSES_PER_L 0
+#endif
+
+#ifndef CONFIG_FLOW_MIN_LPM
+#define CONFIG_FLOW_MIN_LPM 30
+#endif
+
+#ifndef CONFIG_FLOW_WINDOW_SECS
+#define CONFIG_FLOW_WINDOW_SECS 5
+#endif
+
+/* pulses shorter than this are ignored, at most 12787 ns (1023 APB cycles) */
+#ifndef CONFIG_FLOW_GLITCH_NS
+#define CONFIG_FLOW_GLITCH_NS 10000
+#endif
+
+#define FLOW_HIST   61
+#define PCNT_LIMIT  32767
+
+static const char *TAG = "flow";
+
+static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+static pcnt_unit_handle_t unit;
+static uint32_t pulses_per_l;
+static uint32_t hist[FLOW_HIST];    /* pulse totals, one per second */
+static size_t head;
+static size_t filled;
+static int64_t next_us;
+static bool ok;
+
+
+bool flow_init(int gpio)
+{
+    pcnt_unit_config_t unit_cfg = {
+        .high_limit = PCNT_LIMIT,
+        .low_limit = -1,
+        .flags.accum_count = 1,
+    };
+    pcnt_glitch_filter_config_t filter_cfg = {
+        .max_glitch_ns = CONFIG_FLOW_GLITCH_NS,
+    };
+    pcnt_chan_config_t chan_cfg = {
+        .edge_gpio_num = gpio,
+        .level_gpio_num = -1,
+    };
+    pcnt_channel_handle_t chan;
+    esp_err_t err;
+
+    if (!CONFIG_FLOW_PULSES_PER_L)
+        return false;
+
+    err = pcnt_new_unit(&unit_cfg, &unit);
+    if (!err)
+        err = pcnt_unit_set_glitch_filter(unit, &filter_cfg);
+    if (!err)
+        err = pcnt_new_channel(unit, &chan_cfg, &chan);
+    if (!err)
+        err = pcnt_channel_set_edge_action(chan,
+                PCNT_CHANNEL_EDGE_ACTION_INCREASE,
+                PCNT_CHANNEL_EDGE_ACTION_HOLD);
+    if (!err)
+        err = pcnt_unit_add_watch_point(unit, PCNT_LIMIT);
+    if (!err)
+        err = pcnt_unit_enable(unit);
+    if (!err)
+        err = pcnt_unit_clear_count(unit);
+    if (!err)
+        err = pcnt_unit_start(unit);
+    if (err) {
+        ESP_LOGE(TAG, "pcnt init failed (%s)", esp_err_to_name(err));
+        unit = NULL;
+        return false;
+    }
+
+    pulses_per_l = CONFIG_FLOW_PULSES_PER_L;
+
+    /* open collector output of the meter */
+    gpio_set_pull_mode(gpio, GPIO_PULLUP_ONLY);
+    ESP_LOGI(TAG, "meter on GPIO%d, %d pulses/l, low below %d l/min", gpio,
+             CONFIG_FLOW_PULSES_PER_L, CONFIG_FLOW_MIN_LPM);
+    return true;
+}
+
+
+/* Records the pulse total once a second and updates the flow state,
+ * called from the control loop */
+void flow_poll(void)
+{
+    int64_t now = esp_timer_get_time();
+    int32_t rate;
+    int count;
+
+    if (!unit || now < next_us)
+        return;
+
+    next_us = (next_us ? next_us : now) + 1000000;
+    if (pcnt_unit_get_count(unit, &count))
+        return;
+
+    portENTER_CRITICAL(&mux);
+    head = (head + 1) % FLOW_HIST;
+    hist[head] = (uint32_t) count;
+    if (filled < FLOW_HIST)
+        filled++;
+    portEXIT_CRITICAL(&mux);
+
+    rate = flow_rate(0);
+    if (ok && rate < CONFIG_FLOW_MIN_LPM * 10)
+        ok = false;
+    else if (!ok && rate >= CONFIG_FLOW_MIN_LPM * 11)
+        ok = true;
+}
+
+
+/* Rate over the last secs seconds (at most 60, 0 for the window of the low
+ * flow decision) in 0.1 l/min, -1 without meter. Shorter after boot. */
+int32_t flow_rate(int secs)
+{
+    uint32_t pulses;
+
+    if (!unit)
+        return -1;
+
+    if (!secs)
+        secs = CONFIG_FLOW_WINDOW_SECS;
+
+    portENTER_CRITICAL(&mux);
+    if (secs > (int) filled - 1)
+        secs = filled - 1;
+
+    pulses = secs > 0 ?
+             hist[head] - hist[(head + FLOW_HIST - secs) % FLOW_HIST] : 0;
+    portEXIT_CRITICAL(&mux);
+
+    if (secs <= 0)
+        return 0;
+
+    return (int32_t) ((uint64_t) pulses * 600 /
+                      ((uint64_t) pulses_per_l * secs));
+}
+
+
+bool flow_ok(void)
+{
+    return ok;
+}
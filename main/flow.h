@@ -0,0 +1,10 @@
+#ifndef FLOW_H
+#define FLOW_H
+#include <stdbool.h>
+#include <stdint.h>
+
+bool flow_init(int gpio);
+void flow_poll(void);
+int32_t flow_rate(int secs);
+bool flow_ok(void);
+#endif
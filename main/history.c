@@ -0,0 +1,388 @@
+/**
+ * @file history.c  Telemetry and journal history in flash
+ *
+ * A sample of the state is taken every minute, control events are queued
+ * by the control loop. Both are appended by the main loop as 16 byte
+ * records to a log structured flash partition like the one of counters.c,
+ * the sector ahead is erased when the log wraps. With the default
+ * partition a week of minute samples fits with room for events.
+ *
+ * history_export() streams the records of a time range as they are stored:
+ * a sector is read into the send buffer, the records outside the query are
+ * squeezed out in place and the rest is sent as one chunk after a 16 byte
+ * header. Sequence numbers make the export resumable. Records are written
+ * with a synced clock only, the log is assumed to be ordered by time.
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_crc.h"
+#include "esp_partition.h"
+#include "counters.h"
+#include "pool.h"
+#include "wifi.h"
+#include "history.h"
+
+#define HISTORY_SUBTYPE  0x41
+#define HISTORY_LABEL    "history"
+#define SECTOR_SIZE      4096
+#define RECS_PER_SECTOR  (SECTOR_SIZE / sizeof(struct hist_rec))
+#define SEQ_EMPTY        0xffffffff
+#define QUEUE_MAX        16
+
+/* earlier clocks are not synced yet */
+#define TIME_VALID       1577836800
+
+static const char *TAG = "history";
+
+/* Start of an export, little endian */
+struct hist_hdr {
+    char magic[4];      /* "PHST" */
+    uint8_t version;
+    uint8_t rec_size;
+    uint16_t types;     /* of the query */
+    uint32_t first;     /* oldest stored sequence number */
+    uint32_t next;      /* records up to next - 1 follow */
+};
+
+_Static_assert(sizeof(struct hist_rec) == 16, "record size");
+_Static_assert(sizeof(struct hist_hdr) == sizeof(struct hist_rec),
+               "header size");
+
+static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+static const esp_partition_t *part;
+static size_t slots;
+static size_t pos;              /* slot of the next record */
+static uint32_t first;
+static uint32_t next = 1;
+static struct hist_rec queue[QUEUE_MAX];
+static size_t queued;
+static uint32_t dropped;
+static uint32_t last_min;
+static uint32_t last_cell;
+static bool busy;
+
+/* header and one sector, for the boot scan and exports */
+static struct hist_rec buf[1 + RECS_PER_SECTOR];
+
+
+static uint16_t crc(const struct hist_rec *r)
+{
+    return (uint16_t) esp_crc32_le(0, (const uint8_t *) r,
+                                   offsetof(struct hist_rec, crc));
+}
+
+
+static bool rec_valid(const struct hist_rec *r)
+{
+    return r->seq != SEQ_EMPTY && r->crc == crc(r);
+}
+
+
+static size_t sectors(void)
+{
+    return slots / RECS_PER_SECTOR;
+}
+
+
+/* Newest valid record of the sector before slot end, false if none */
+static bool last_rec(size_t sector, size_t end, struct hist_rec *r)
+{
+    while (end-- > 0) {
+        if (!esp_partition_read(part, sector * SECTOR_SIZE +
+                                end * sizeof(*r), r, sizeof(*r)) &&
+                rec_valid(r))
+            return true;
+    }
+
+    return false;
+}
+
+
+/* Finds the newest and oldest record, once at boot */
+static void scan_log(void)
+{
+    uint32_t newest = 0;
+    bool found = false;
+    size_t s, i;
+
+    first = 0;
+    for (s = 0; s < sectors(); s++) {
+        if (esp_partition_read(part, s * SECTOR_SIZE, &buf[1], SECTOR_SIZE))
+            continue;
+
+        for (i = 0; i < RECS_PER_SECTOR; i++) {
+            const struct hist_rec *r = &buf[1 + i];
+
+            if (!rec_valid(r))
+                continue;
+
+            if (!found || r->seq < first)
+                first = r->seq;
+
+            if (!found || r->seq > newest) {
+                newest = r->seq;
+                pos = s * RECS_PER_SECTOR + i + 1;
+            }
+
+            found = true;
+        }
+    }
+
+    next = found ? newest + 1 : 1;
+    first = found ? first : next;
+    if (pos >= slots)
+        pos = 0;
+
+    /* a torn write leaves the next slot dirty, continue in a fresh sector */
+    if (pos % RECS_PER_SECTOR &&
+            (esp_partition_read(part, pos * sizeof(buf[0]), &buf[0],
+                                sizeof(buf[0])) ||
+             buf[0].seq != SEQ_EMPTY)) {
+        pos = (pos / RECS_PER_SECTOR + 1) * RECS_PER_SECTOR;
+        if (pos >= slots)
+            pos = 0;
+    }
+}
+
+
+/* Appends a record, called by the main loop only */
+static void append(struct hist_rec *r)
+{
+    size_t sector = pos / RECS_PER_SECTOR;
+    struct hist_rec last;
+    esp_err_t err;
+
+    if (!part)
+        return;
+
+    if (pos % RECS_PER_SECTOR == 0) {
+        /* the oldest records go */
+        if (last_rec(sector, RECS_PER_SECTOR, &last) && last.seq >= first) {
+            portENTER_CRITICAL(&mux);
+            first = last.seq + 1;
+            portEXIT_CRITICAL(&mux);
+        }
+
+        err = esp_partition_erase_range(part, sector * SECTOR_SIZE,
+                                        SECTOR_SIZE);
+        if (err) {
+            ESP_LOGE(TAG, "Error (%s) erasing", esp_err_to_name(err));
+            return;
+        }
+    }
+
+    r->seq = next;
+    r->crc = crc(r);
+    err = esp_partition_write(part, pos * sizeof(*r), r, sizeof(*r));
+    if (err) {
+        ESP_LOGE(TAG, "Error (%s) writing", esp_err_to_name(err));
+        return;
+    }
+
+    portENTER_CRITICAL(&mux);
+    next++;
+    if (++pos >= slots)
+        pos = 0;
+    portEXIT_CRITICAL(&mux);
+}
+
+
+void history_init(void)
+{
+    part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                    HISTORY_SUBTYPE, HISTORY_LABEL);
+    if (!part) {
+        ESP_LOGW(TAG, "no history partition, no history is kept");
+        return;
+    }
+
+    slots = (part->size / SECTOR_SIZE) * RECS_PER_SECTOR;
+    scan_log();
+    ESP_LOGI(TAG, "history %" PRIu32 "..%" PRIu32 ", %u slots", first,
+             next - 1, (unsigned) slots);
+}
+
+
+/* Appends a sample of the state at unix time t */
+void history_sample(uint32_t t)
+{
+    struct hist_rec r = { .t = t, .type = HIST_SAMPLE };
+    struct pool_state ps;
+    uint32_t cell = counters_get(CNT_CELL_SEC);
+
+    pool_get_state(&ps);
+    r.val = ps.flow_rate > INT16_MAX ? INT16_MAX : (int16_t) ps.flow_rate;
+    r.code = (ps.powered ? HIST_F_POWERED : 0) |
+             (ps.polarity ? HIST_F_POLARITY : 0) |
+             (ps.flow_ok ? HIST_F_FLOW_OK : 0);
+    r.cell_s = cell - last_cell > UINT8_MAX ? UINT8_MAX : cell - last_cell;
+    r.rssi = (int8_t) wifi_rssi();
+    last_cell = cell;
+    append(&r);
+}
+
+
+/* Queues a control event for the journal, called by the control loop */
+void history_event(enum hist_event ev, int32_t arg)
+{
+    time_t t = time(NULL);
+    struct hist_rec r = {
+        .t = (uint32_t) t,
+        .val = arg > INT16_MAX ? INT16_MAX :
+               arg < INT16_MIN ? INT16_MIN : (int16_t) arg,
+        .type = HIST_EVENT,
+        .code = ev,
+    };
+
+    if (t < TIME_VALID)
+        return;
+
+    portENTER_CRITICAL(&mux);
+    if (queued < QUEUE_MAX)
+        queue[queued++] = r;
+    else
+        dropped++;
+    portEXIT_CRITICAL(&mux);
+}
+
+
+/* Writes queued events and a sample every minute, called once a second
+ * by the main loop */
+void history_poll(void)
+{
+    struct hist_rec r;
+    time_t t = time(NULL);
+    bool more = true;
+
+    while (more) {
+        portENTER_CRITICAL(&mux);
+        more = queued > 0;
+        if (more) {
+            r = queue[0];
+            memmove(&queue[0], &queue[1], --queued * sizeof(queue[0]));
+        }
+        portEXIT_CRITICAL(&mux);
+
+        if (more)
+            append(&r);
+    }
+
+    if (t < TIME_VALID || (uint32_t) t / 60 == last_min)
+        return;
+
+    /* the first minute after boot only starts the cell time */
+    if (!last_min)
+        last_cell = counters_get(CNT_CELL_SEC);
+    else
+        history_sample((uint32_t) t - (uint32_t) t % 60);
+
+    last_min = (uint32_t) t / 60;
+}
+
+
+void history_stats(struct hist_stats *st)
+{
+    portENTER_CRITICAL(&mux);
+    st->first = first;
+    st->next = next;
+    st->slots = slots;
+    st->dropped = dropped;
+    portEXIT_CRITICAL(&mux);
+}
+
+
+static bool match(const struct hist_query *q, const struct hist_rec *r,
+                  uint32_t end)
+{
+    return rec_valid(r) && r->seq >= q->offset && r->seq < end &&
+           r->t >= q->from && (!q->to || r->t <= q->to) &&
+           r->type < HIST_TYPES && (!q->types || q->types & 1 << r->type);
+}
+
+
+/* Streams the records of the query, oldest first. Full sectors before the
+ * query are skipped by their last record, the export stops at the first
+ * sector after it. One export at a time, ESP_ERR_INVALID_STATE while
+ * another one runs. */
+esp_err_t history_export(const struct hist_query *q, tpl_flush_h *send,
+                         void *arg)
+{
+    struct hist_hdr *h = (struct hist_hdr *) &buf[0];
+    struct hist_rec last;
+    size_t start, s, i, out = 1;
+    uint32_t end;
+    esp_err_t err = ESP_OK;
+    bool hdr = true;
+
+    if (!part)
+        return ESP_ERR_NOT_FOUND;
+
+    portENTER_CRITICAL(&mux);
+    if (busy) {
+        portEXIT_CRITICAL(&mux);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    busy = true;
+    start = pos / RECS_PER_SECTOR + 1;
+    end = next;
+    memcpy(h->magic, "PHST", sizeof(h->magic));
+    h->version = 1;
+    h->rec_size = sizeof(struct hist_rec);
+    h->types = q->types ? q->types : (1 << HIST_TYPES) - 1;
+    h->first = first;
+    h->next = end;
+    portEXIT_CRITICAL(&mux);
+
+    for (s = 0; s < sectors() && !err; s++) {
+        size_t sector = (start + s) % sectors();
+
+        if (!esp_partition_read(part, (sector + 1) * SECTOR_SIZE -
+                                sizeof(last), &last, sizeof(last)) &&
+                rec_valid(&last) &&
+                (last.seq < q->offset || last.t < q->from))
+            continue;
+
+        if (esp_partition_read(part, sector * SECTOR_SIZE, &buf[1],
+                               SECTOR_SIZE))
+            continue;
+
+        if (q->to && rec_valid(&buf[1]) && buf[1].seq < end &&
+                buf[1].t > q->to)
+            break;
+
+        for (i = 1; i <= RECS_PER_SECTOR; i++) {
+            if (!match(q, &buf[i], end))
+                continue;
+
+            if (out != i)
+                buf[out] = buf[i];
+
+            out++;
+        }
+
+        if (out) {
+            err = send(arg, (const char *) buf, out * sizeof(buf[0]));
+            hdr = false;
+        }
+
+        out = 0;
+    }
+
+    /* all sectors skipped */
+    if (hdr && !err)
+        err = send(arg, (const char *) buf, sizeof(buf[0]));
+
+    portENTER_CRITICAL(&mux);
+    busy = false;
+    portEXIT_CRITICAL(&mux);
+    return err;
+}
@@ -0,0 +1,61 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+#include <stdbool.h>
+#include <stdint.h>
+#include "tpl.h"
+
+/* Record types, the bit 1 << type selects them in a query */
+enum hist_type {
+    HIST_SAMPLE,        /* telemetry, once a minute */
+    HIST_EVENT,         /* journal of control events */
+    HIST_TYPES
+};
+
+enum hist_event {
+    HIST_EV_ON,         /* arg: polarity */
+    HIST_EV_OFF,
+    HIST_EV_CUTOFF,     /* arg: ISR cutoff in ns */
+    HIST_EV_FLOW_OK,
+    HIST_EV_FLOW_LOW,   /* arg: rate in 0.1 l/min, -1 flow switch */
+    HIST_EV_POLARITY,   /* arg: polarity */
+};
+
+/* flags of a sample */
+#define HIST_F_POWERED   0x01
+#define HIST_F_POLARITY  0x02
+#define HIST_F_FLOW_OK   0x04
+
+/* One record as stored in flash and exported, little endian, 16 bytes */
+struct hist_rec {
+    uint32_t seq;
+    uint32_t t;         /* unix time */
+    int16_t val;        /* sample: flow 0.1 l/min, -1 no meter; event: arg */
+    uint8_t type;
+    uint8_t code;       /* sample: HIST_F_*, event: enum hist_event */
+    uint8_t cell_s;     /* sample: seconds powered in the minute */
+    int8_t rssi;        /* sample: dBm */
+    uint16_t crc;       /* low half of the CRC-32 of the bytes before */
+};
+
+struct hist_query {
+    uint32_t from;      /* unix time, inclusive */
+    uint32_t to;        /* unix time, inclusive, 0 open */
+    uint32_t offset;    /* first sequence number, to resume */
+    unsigned types;     /* 1 << enum hist_type, 0 all */
+};
+
+struct hist_stats {
+    uint32_t first;     /* oldest stored sequence number */
+    uint32_t next;      /* sequence number of the next record */
+    uint32_t slots;     /* records the partition holds */
+    uint32_t dropped;   /* events lost while the queue was full */
+};
+
+void history_init(void);
+void history_poll(void);
+void history_sample(uint32_t t);
+void history_event(enum hist_event ev, int32_t arg);
+void history_stats(struct hist_stats *st);
+esp_err_t history_export(const struct hist_query *q, tpl_flush_h *send,
+                         void *arg);
+#endif
@@ -1,122 +1,367 @@
 /**
- * @file log.c
+ * @file log.c  Ring of log lines for the web page
+ *
+ * A line equal to the last one of its source is not stored again, the
+ * stored line counts the repetitions. Each source but the control loop has
+ * a token bucket of CONFIG_LOG_QUOTA lines per minute and a burst of
+ * CONFIG_LOG_BURST, lines above it are dropped before they are formatted
+ * and the next stored line of the source tells how many. Control events
+ * (relays, flow) go to CONFIG_LOG_CTRL_LINES reserved lines, only newer
+ * control events push them out. Stored lines are shipped by syslog.c as
+ * well.
  *
  * Copyright (C) 2021 Christian Spielberger
  */
 
 #include <stdio.h>
 #include <stdint.h>
-#include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <stdarg.h>
 #include <esp_log.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+#include "snapshot.h"
+#include "mem.h"
+#include "syslog.h"
 #include "log.h"
 
+/* Length of a line with CONFIG_STATIC_MEM, longer ones are truncated.
+ * Without it longer lines are stored but not deduplicated. */
+#ifndef CONFIG_LOG_LINE_MAX
+#define CONFIG_LOG_LINE_MAX 96
+#endif
+
+#ifndef CONFIG_LOG_CTRL_LINES
+#define CONFIG_LOG_CTRL_LINES 20
+#endif
+
+#ifndef CONFIG_LOG_QUOTA
+#define CONFIG_LOG_QUOTA 12
+#endif
+
+#ifndef CONFIG_LOG_BURST
+#define CONFIG_LOG_BURST 10
+#endif
+
 #define MAX_LINES  100
+#define MIN_US     60000000LL
+
+/* a token is one line per minute, in us */
+#define TOKEN      MIN_US
+#define BUCKET     (CONFIG_LOG_BURST * MIN_US)
+
+struct meta {
+    uint32_t seq;
+    uint16_t rep;       /* repetitions of the line */
+    uint16_t drop;      /* lines of the source dropped before it */
+};
+
+/* a part of the ring, general lines and control events */
+struct part {
+    uint32_t base;
+    uint32_t size;
+    uint32_t w;
+    uint32_t n;
+};
+
+struct source {
+    int64_t tokens;
+    int64_t last;
+    uint32_t slot;      /* last line of the source */
+    uint32_t seq;
+    uint16_t drop;
+};
+
 static char *lines[MAX_LINES] = {};
-static uint32_t w  =  0;
-static uint32_t r  =  0;
-static uint32_t r0 =  0;
+#if CONFIG_STATIC_MEM
+static char slots[MAX_LINES][CONFIG_LOG_LINE_MAX];
+#endif
+static struct meta meta[MAX_LINES];
+static struct part parts[2] = {
+    { .base = 0, .size = MAX_LINES - CONFIG_LOG_CTRL_LINES },
+    { .base = MAX_LINES - CONFIG_LOG_CTRL_LINES,
+      .size = CONFIG_LOG_CTRL_LINES },
+};
+static struct source sources[LOG_SRCS];
+static uint32_t seq;
+static uint32_t repeated;
+static uint32_t dropped;
+static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
 
-static uint32_t rr(uint32_t idx)
+static uint32_t rr(const struct part *p, uint32_t idx)
 {
     idx++;
-    if (idx == MAX_LINES)
+    if (idx == p->size)
         idx = 0;
 
     return idx;
 }
 
 
-static size_t va_list_size(const char *fmt, va_list ap)
+/* Refills the bucket of the source, false if the quota is used up. The
+ * token is taken when the line is stored. */
+static bool quota(struct source *s)
+{
+    int64_t now = esp_timer_get_time();
+    bool ok;
+
+    portENTER_CRITICAL(&mux);
+    if (!s->last)
+        s->tokens = BUCKET;
+    else
+        s->tokens += (now - s->last) * CONFIG_LOG_QUOTA;
+
+    s->last = now;
+    if (s->tokens > BUCKET)
+        s->tokens = BUCKET;
+
+    ok = s->tokens >= TOKEN;
+    if (!ok) {
+        if (s->drop < UINT16_MAX)
+            s->drop++;
+
+        dropped++;
+    }
+    portEXIT_CRITICAL(&mux);
+
+    return ok;
+}
+
+
+/* Counts a repetition of the last line of the source, called locked */
+static bool repeat(struct source *s, const char *line)
+{
+    struct meta *m = &meta[s->slot];
+
+    if (!s->seq || m->seq != s->seq || !lines[s->slot] ||
+        strcmp(lines[s->slot], line))
+        return false;
+
+    if (m->rep < UINT16_MAX)
+        m->rep++;
+
+    repeated++;
+    return true;
+}
+
+
+/* Stores the line, called locked. Returns the replaced line. */
+static char *store(struct source *s, bool ctrl, char *line, bool limit)
 {
-    size_t size = 0;
-    const char *s;
-
-    while (*fmt) {
-        switch (*fmt++) {
-            case 's':              /* string */
-                s = va_arg(ap, char *);
-                size += strlen(s);
-                break;
-            case 'd':              /* int */
-            case 'i':
-            case 'u':
-                size += 10;
-                break;
-            case 'f':              /* float */
-                size += 10;
-                break;
-            case 'c':              /* char */
-                size++;
-                break;
-            case 'x':
-            case 'X':
-                size += 4;
-                break;
+    struct part *p = &parts[ctrl];
+    uint32_t slot = p->base + p->w;
+    char *old = lines[slot];
+
+    lines[slot] = line;
+    meta[slot].seq = ++seq;
+    meta[slot].rep = 0;
+    meta[slot].drop = s->drop;
+    s->drop = 0;
+    s->slot = slot;
+    s->seq = seq;
+    if (limit)
+        s->tokens -= TOKEN;
+
+    p->w = rr(p, p->w);
+    if (p->n < p->size)
+        p->n++;
+
+    return old;
+}
+
+
+static void logv(enum log_src src, bool ctrl, const char *fmt, va_list ap)
+{
+    struct source *s = &sources[src];
+    bool limit = !ctrl && src != LOG_SRC_POOL;
+    char line[CONFIG_LOG_LINE_MAX];
+    bool dup;
+#if !CONFIG_STATIC_MEM
+    char *new;
+    char *old;
+    va_list aq;
+    size_t l;
+#endif
+
+    if (!fmt || (limit && !quota(s)))
+        return;
+
+#if CONFIG_STATIC_MEM
+    vsnprintf(line, sizeof(line), fmt, ap);
+
+    portENTER_CRITICAL(&mux);
+    dup = repeat(s, line);
+    if (!dup) {
+        uint32_t slot = parts[ctrl].base + parts[ctrl].w;
+
+        memcpy(slots[slot], line, sizeof(line));
+        store(s, ctrl, slots[slot], limit);
+    }
+    portEXIT_CRITICAL(&mux);
+
+    if (!dup)
+        syslog_push(src, ctrl, line);
+#else
+    va_copy(aq, ap);
+    l = vsnprintf(line, sizeof(line), fmt, aq);
+    va_end(aq);
+
+    if (l < sizeof(line)) {
+        portENTER_CRITICAL(&mux);
+        dup = repeat(s, line);
+        portEXIT_CRITICAL(&mux);
+        if (dup) {
+            snapshot_touch();
+            return;
         }
     }
 
-    return size;
+    new = mem_alloc(l + 1);
+    if (!new)
+        return;
+
+    if (l < sizeof(line))
+        memcpy(new, line, l + 1);
+    else
+        vsnprintf(new, l + 1, fmt, ap);
+
+    syslog_push(src, ctrl, new);
+
+    /* readers copy lines under the lock, free the old one outside */
+    portENTER_CRITICAL(&mux);
+    old = store(s, ctrl, new, limit);
+    portEXIT_CRITICAL(&mux);
+
+    mem_free(old);
+#endif
+
+    /* a repetition changes the count shown */
+    snapshot_touch();
 }
 
 
 void logw(const char *fmt, ...)
 {
     va_list ap;
-    size_t l;
 
-    if (!fmt)
+    va_start(ap, fmt);
+    logv(LOG_SRC_SYS, false, fmt, ap);
+    va_end(ap);
+}
+
+
+void logs(enum log_src src, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (src >= LOG_SRCS)
         return;
 
     va_start(ap, fmt);
-    l = va_list_size(fmt, ap);
+    logv(src, false, fmt, ap);
     va_end(ap);
-    l += strlen(fmt) + 10;
+}
+
+
+void logc(const char *fmt, ...)
+{
+    va_list ap;
 
-    free(lines[w]);
-    lines[w] = malloc(l + 1);
     va_start(ap, fmt);
-    vsnprintf(lines[w], l, fmt, ap);
+    logv(LOG_SRC_POOL, true, fmt, ap);
     va_end(ap);
+}
 
-    w = rr(w);
 
-    if (r == w)
-        r = rr(r);
+void log_iter_init(struct log_iter *it)
+{
+    int i;
 
-    if (r0 == w)
-        r0 = rr(r0);
+    portENTER_CRITICAL(&mux);
+    for (i = 0; i < 2; i++) {
+        it->idx[i] = (parts[i].w + parts[i].size - parts[i].n) %
+                     parts[i].size;
+        it->cnt[i] = parts[i].n;
+    }
+    portEXIT_CRITICAL(&mux);
 }
 
 
-const char *logr(void)
+/* Merges both parts by sequence number */
+bool log_next(struct log_iter *it, char *buf, size_t size)
 {
-    const char *ret = NULL;
+    struct meta m = {0};
+    bool ret = false;
+    size_t l;
+    int k;
+
+    if (!size)
+        return false;
+
+    while (!ret && (it->cnt[0] || it->cnt[1])) {
+        portENTER_CRITICAL(&mux);
+        if (!it->cnt[0])
+            k = 1;
+        else if (!it->cnt[1])
+            k = 0;
+        else
+            k = meta[parts[1].base + it->idx[1]].seq <
+                meta[parts[0].base + it->idx[0]].seq;
+
+        if (lines[parts[k].base + it->idx[k]]) {
+            strlcpy(buf, lines[parts[k].base + it->idx[k]], size);
+            m = meta[parts[k].base + it->idx[k]];
+            ret = true;
+        }
+        portEXIT_CRITICAL(&mux);
 
-    if (r != w) {
-        ret = lines[r];
-        r = rr(r);
+        it->idx[k] = rr(&parts[k], it->idx[k]);
+        it->cnt[k]--;
     }
 
-    return ret;
+    if (!ret)
+        return false;
+
+    l = strlen(buf);
+    if (m.rep && l < size)
+        l += snprintf(buf + l, size - l, " (repeated %u times)",
+                      (unsigned) m.rep);
+    if (m.drop && l < size)
+        snprintf(buf + l, size - l, " (%u dropped before)",
+                 (unsigned) m.drop);
+
+    return true;
 }
 
 
-void log_rewind(void)
+void log_stats(uint32_t *rep, uint32_t *drop)
 {
-    r = r0;
+    portENTER_CRITICAL(&mux);
+    *rep = repeated;
+    *drop = dropped;
+    portEXIT_CRITICAL(&mux);
 }
 
 
 void log_clear(void)
 {
+    char *old[MAX_LINES];
     size_t i;
 
+    portENTER_CRITICAL(&mux);
     for (i = 0; i < MAX_LINES; i++) {
-        free(lines[i]);
+        old[i] = lines[i];
         lines[i] = NULL;
+        meta[i].seq = 0;
     }
 
-    r = r0 = w = 0;
+    for (i = 0; i < 2; i++)
+        parts[i].w = parts[i].n = 0;
+    portEXIT_CRITICAL(&mux);
+
+    for (i = 0; i < MAX_LINES && !CONFIG_STATIC_MEM; i++)
+        mem_free(old[i]);
+
+    snapshot_touch();
 }
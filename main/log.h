@@ -1,7 +1,29 @@
 #ifndef LOG_H
 #define LOG_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Source of a line, each but the control loop has its own quota */
+enum log_src {
+    LOG_SRC_POOL,
+    LOG_SRC_WIFI,
+    LOG_SRC_NET,        /* web, MQTT, CoAP */
+    LOG_SRC_SYS,
+    LOG_SRCS
+};
+
+/* Iterates the log lines from old to new, safe against concurrent logw() */
+struct log_iter {
+    uint32_t idx[2];
+    uint32_t cnt[2];
+};
+
 void logw(const char *fmt, ...);
-const char *logr(void);
-void log_rewind(void);
+void logs(enum log_src src, const char *fmt, ...);
+void logc(const char *fmt, ...);
+void log_iter_init(struct log_iter *it);
+bool log_next(struct log_iter *it, char *buf, size_t size);
+void log_stats(uint32_t *repeated, uint32_t *dropped);
 void log_clear(void);
 #endif
@@ -13,6 +13,7 @@
 #include "esp_spi_flash.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_wifi.h"
 #include "esp_chip_info.h"
 #include "nvs.h"
@@ -26,21 +27,35 @@
 #include <errno.h>
 
 #include "wifi.h"
+#include "eth.h"
 #include "ota.h"
 #include "pool.h"
 #include "webui.h"
+#include "settings.h"
+#include "counters.h"
+#include "history.h"
+#include "mqtt.h"
+#include "coap.h"
+#include "syslog.h"
+#include "sysinfo.h"
+#include "schedule.h"
+#include "mem.h"
+#include "memprof.h"
+#include "cmd.h"
 
 static const char *TAG = "main";
+MEM_TASKS(pool_loop, 8192, 1);
 
 void app_main(void)
 {
     static httpd_handle_t server = NULL;
 
-    // Set timezone to China Standard Time
-    setenv("TZ", ":Europe/Vienna", 1);
+    setenv("TZ", SCHEDULE_TZ, 1);
     tzset();
 
     ESP_LOGI(TAG, "Starting Pool main");
+    sysinfo_init();
+    sysinfo_boot(BOOT_APP);
 
     /* Print chip information */
     esp_chip_info_t chip_info;
@@ -67,27 +82,74 @@ void app_main(void)
     }
     ESP_ERROR_CHECK(ret);
 
+    settings_init();
+    counters_init();
+    history_init();
+    sysinfo_boot(BOOT_NVS);
+#if CONFIG_ETH_USE_OPENETH
+    eth_init();
+#else
     wifi_init_sta();
+#endif
+    sysinfo_boot(BOOT_NET);
 
-    xTaskCreate(&pool_loop, "pool_loop", 8192, NULL, 5, NULL);
+    MEM_TASK_CREATE(pool_loop, 0, &pool_loop, "pool_loop", NULL, 5, NULL);
 
+#if !CONFIG_ETH_USE_OPENETH
     ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT,
                 IP_EVENT_STA_GOT_IP,
                 &webui_connect_handler, &server));
     ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT,
                 WIFI_EVENT_STA_DISCONNECTED,
                 &webui_disconnect_handler, &server));
+#endif
 
     server = start_webserver();
-
+    sysinfo_boot(BOOT_HTTPD);
+    syslog_init(NULL);
+    mqtt_init(NULL);
+    coap_init(-1);
+    mem_init_done();
+    sysinfo_boot(BOOT_READY);
+    ESP_LOGI(TAG, "ready after %lld us", esp_timer_get_time());
+
+    cmd_register(CMD_BOX_MAIN);
+    int64_t next = esp_timer_get_time();
     while (1) {
-        vTaskDelay(1000 / portTICK_PERIOD_MS);
-        if (webui_upgrade())
-            xTaskCreate(&ota_task, "ota_task", 8192, NULL, 5, NULL);
-
+        struct cmd c;
+        int64_t now = esp_timer_get_time();
+
+        /* once a second, commands are applied right away */
+        if (now - next < 1000000)
+            cmd_wait((uint32_t) ((next + 1000000 - now) / 1000));
+
+        while (cmd_take(CMD_BOX_MAIN, &c)) {
+            if (c.type == CMD_UPGRADE) {
+                esp_err_t err = ota_upgrade(&c);
+
+                if (err)
+                    cmd_done(&c, err);
+            }
+            else if (c.type == CMD_WIFI_SCAN && !CONFIG_ETH_USE_OPENETH) {
+                wifi_scan();
+                cmd_done(&c, ESP_OK);
+            }
+            else {
+                cmd_done(&c, ESP_ERR_NOT_SUPPORTED);
+            }
+        }
+
+        now = esp_timer_get_time();
+        if (now - next < 1000000)
+            continue;
+
+        next = now - next < 2000000 ? next + 1000000 : now;
+#if !CONFIG_ETH_USE_OPENETH
         wifi_check();
-
-        if (webui_wifi_scan())
-            wifi_scan();
+#endif
+        counters_poll();
+        history_poll();
+        mem_check();
+        memprof_poll();
     }
 }
@@ -0,0 +1,196 @@
+/**
+ * @file mem.c  Heap guard and static task creation
+ *
+ * Our modules allocate through mem_alloc() and friends. Allocations after
+ * mem_init_done() (end of the init in app_main) are counted with the size
+ * and the caller address of the last one. With CONFIG_STATIC_MEM all tasks,
+ * queues and buffers are static or come from fixed pools, so any late
+ * allocation is a regression and mem_check() logs it. Resolve the caller
+ * with xtensa-esp32-elf-addr2line -e build/pool.elf <addr>.
+ *
+ * Tasks created by MEM_TASK_CREATE() are registered with their stack size
+ * for memprof.c.
+ *
+ * tools/membudget.py lists the static memory per module and the modules
+ * that call the heap directly.
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+#include "esp_log.h"
+#include "log.h"
+#include "mem.h"
+
+static const char *TAG = "mem";
+
+static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+static bool init_done;
+static struct mem_stats stats;
+static uint32_t reported;
+static struct mem_task tasks[MEM_TASKS_MAX];
+static size_t ntasks;
+
+
+static void task_add(const char *name, uint32_t size, TaskHandle_t t)
+{
+    portENTER_CRITICAL(&mux);
+    if (ntasks < MEM_TASKS_MAX) {
+        tasks[ntasks].name   = name;
+        tasks[ntasks].stack  = size;
+        tasks[ntasks].handle = t;
+        ntasks++;
+    }
+    portEXIT_CRITICAL(&mux);
+}
+
+
+BaseType_t mem_task(TaskFunction_t fn, const char *name, uint32_t size,
+                    void *arg, UBaseType_t prio, TaskHandle_t *handle)
+{
+    TaskHandle_t t = NULL;
+
+    if (xTaskCreate(fn, name, size, arg, prio, &t) != pdPASS)
+        return pdFAIL;
+
+    task_add(name, size, t);
+    if (handle)
+        *handle = t;
+
+    return pdPASS;
+}
+
+
+BaseType_t mem_task_static(TaskFunction_t fn, const char *name,
+                           uint32_t size, void *arg, UBaseType_t prio,
+                           TaskHandle_t *handle, StackType_t *stack,
+                           StaticTask_t *tcb)
+{
+    TaskHandle_t t = xTaskCreateStatic(fn, name, size, arg, prio, stack, tcb);
+
+    if (!t)
+        return pdFAIL;
+
+    task_add(name, size, t);
+    if (handle)
+        *handle = t;
+
+    return pdPASS;
+}
+
+
+/* Unregisters and deletes the calling task, instead of vTaskDelete(NULL) */
+void mem_task_exit(void)
+{
+    TaskHandle_t t = xTaskGetCurrentTaskHandle();
+    size_t i;
+
+    portENTER_CRITICAL(&mux);
+    for (i = 0; i < ntasks; i++) {
+        if (tasks[i].handle != t)
+            continue;
+
+        memmove(&tasks[i], &tasks[i + 1], (ntasks - i - 1) * sizeof(tasks[0]));
+        ntasks--;
+        break;
+    }
+    portEXIT_CRITICAL(&mux);
+
+    vTaskDelete(NULL);
+}
+
+
+static void count(size_t size, const void *caller)
+{
+    portENTER_CRITICAL(&mux);
+    if (init_done) {
+        stats.late_allocs++;
+        stats.late_bytes += size;
+        stats.late_caller = caller;
+    }
+    portEXIT_CRITICAL(&mux);
+}
+
+
+void *mem_alloc(size_t size)
+{
+    count(size, __builtin_return_address(0));
+    return malloc(size);
+}
+
+
+void *mem_zalloc(size_t size)
+{
+    count(size, __builtin_return_address(0));
+    return calloc(1, size);
+}
+
+
+void *mem_realloc(void *ptr, size_t size)
+{
+    count(size, __builtin_return_address(0));
+    return realloc(ptr, size);
+}
+
+
+void mem_free(void *ptr)
+{
+    free(ptr);
+}
+
+
+void mem_init_done(void)
+{
+    portENTER_CRITICAL(&mux);
+    init_done = true;
+    portEXIT_CRITICAL(&mux);
+    ESP_LOGI(TAG, "init done, free heap %u", (unsigned)
+             esp_get_free_heap_size());
+}
+
+
+/* Logs new late allocations, called periodically */
+void mem_check(void)
+{
+    struct mem_stats st;
+
+    if (!CONFIG_STATIC_MEM)
+        return;
+
+    mem_get(&st);
+    if (st.late_allocs == reported)
+        return;
+
+    reported = st.late_allocs;
+    ESP_LOGE(TAG, "%u heap allocations after init (%u bytes), last from %p",
+             (unsigned) st.late_allocs, (unsigned) st.late_bytes,
+             st.late_caller);
+    logw("heap allocations after init: %u, last from %p",
+         (unsigned) st.late_allocs, st.late_caller);
+}
+
+
+void mem_get(struct mem_stats *st)
+{
+    portENTER_CRITICAL(&mux);
+    *st = stats;
+    portEXIT_CRITICAL(&mux);
+}
+
+
+size_t mem_tasks(struct mem_task *t, size_t max)
+{
+    size_t n;
+
+    portENTER_CRITICAL(&mux);
+    n = ntasks < max ? ntasks : max;
+    memcpy(t, tasks, n * sizeof(*t));
+    portEXIT_CRITICAL(&mux);
+
+    return n;
+}
@@ -0,0 +1,60 @@
+#ifndef MEM_H
+#define MEM_H
+#include <stddef.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "config.h"
+
+#ifndef CONFIG_STATIC_MEM
+#define CONFIG_STATIC_MEM 0
+#endif
+
+/* Stacks and control blocks of n tasks, static with CONFIG_STATIC_MEM. The
+ * stack size is in bytes (StackType_t is uint8_t on ESP-IDF). */
+#if CONFIG_STATIC_MEM
+#define MEM_TASKS(id, size, n)                                           \
+    static StackType_t id##_stack[n][size];                              \
+    static StaticTask_t id##_tcb[n]
+#define MEM_TASK_CREATE(id, i, fn, name, arg, prio, handle)              \
+    mem_task_static(fn, name, sizeof(id##_stack[i]), arg, prio, handle,  \
+                    id##_stack[i], &id##_tcb[i])
+#else
+#define MEM_TASKS(id, size, n) enum { id##_stack_size = (size) }
+#define MEM_TASK_CREATE(id, i, fn, name, arg, prio, handle)              \
+    mem_task(fn, name, id##_stack_size, arg, prio, handle)
+#endif
+
+#define MEM_TASKS_MAX 12
+
+/* A task created by MEM_TASK_CREATE() */
+struct mem_task {
+    const char *name;
+    uint32_t stack;
+    TaskHandle_t handle;
+};
+
+struct mem_stats {
+    uint32_t late_allocs;   /* by our code after init */
+    uint32_t late_bytes;
+    const void *late_caller;
+};
+
+BaseType_t mem_task(TaskFunction_t fn, const char *name, uint32_t size,
+                    void *arg, UBaseType_t prio, TaskHandle_t *handle);
+BaseType_t mem_task_static(TaskFunction_t fn, const char *name,
+                           uint32_t size, void *arg, UBaseType_t prio,
+                           TaskHandle_t *handle, StackType_t *stack,
+                           StaticTask_t *tcb);
+void mem_task_exit(void);
+
+void *mem_alloc(size_t size);
+void *mem_zalloc(size_t size);
+void *mem_realloc(void *ptr, size_t size);
+void mem_free(void *ptr);
+
+void mem_init_done(void);
+void mem_check(void);
+void mem_get(struct mem_stats *st);
+size_t mem_tasks(struct mem_task *tasks, size_t max);
+#endif
@@ -0,0 +1,199 @@
+/**
+ * @file memprof.c  Time series of stack high-water marks and heap usage
+ *
+ * memprof_poll() is called from the main loop and takes a sample every
+ * CONFIG_MEMPROF_SECS: the stack high-water mark of our tasks (registered
+ * by MEM_TASK_CREATE() with their stack size) and of the ESP-IDF tasks in
+ * sys_tasks, and free, largest free block and minimum free heap of the
+ * internal, DMA capable and IRAM heap. The last CONFIG_MEMPROF_SAMPLES are
+ * kept and served as /mem.json.
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "config.h"
+#include "mem.h"
+#include "memprof.h"
+
+#ifndef CONFIG_MEMPROF_SECS
+#define CONFIG_MEMPROF_SECS 60
+#endif
+
+#ifndef CONFIG_MEMPROF_SAMPLES
+#define CONFIG_MEMPROF_SAMPLES 60
+#endif
+
+/* ESP-IDF tasks, missing ones are skipped */
+static const char *sys_tasks[] = {
+    "main", "IDLE", "IDLE0", "IDLE1", "tiT", "wifi", "sys_evt",
+    "esp_timer", "ipc0", "ipc1", "httpd", "mqtt_task", "mdns",
+};
+
+static const uint32_t caps[MEMPROF_CAPS] = {
+    MALLOC_CAP_INTERNAL, MALLOC_CAP_DMA, MALLOC_CAP_EXEC,
+};
+
+static const char *cap_names[MEMPROF_CAPS] = { "internal", "dma", "iram" };
+
+static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+static struct memprof_task tasks[MEMPROF_TASKS];
+static TaskHandle_t handles[MEMPROF_TASKS];
+static size_t ntasks;
+static struct memprof_sample ring[CONFIG_MEMPROF_SAMPLES];
+static size_t w;
+static size_t cnt;
+
+
+/* Index of the task, added on first sight. By handle, the webui workers
+ * share a name. */
+static int task_idx(TaskHandle_t t, const char *name, uint32_t stack)
+{
+    size_t i;
+
+    for (i = 0; i < ntasks; i++) {
+        if (handles[i] == t)
+            return i;
+    }
+
+    if (ntasks == MEMPROF_TASKS)
+        return -1;
+
+    portENTER_CRITICAL(&mux);
+    handles[ntasks] = t;
+    strlcpy(tasks[ntasks].name, name, sizeof(tasks[ntasks].name));
+    tasks[ntasks].stack = stack;
+    ntasks++;
+    portEXIT_CRITICAL(&mux);
+
+    return ntasks - 1;
+}
+
+
+static void add_hwm(struct memprof_sample *s, bool *seen, const char *name,
+                    uint32_t stack, TaskHandle_t t)
+{
+    uint32_t hwm;
+    int i;
+
+    if (!t)
+        return;
+
+    i = task_idx(t, name, stack);
+    if (i < 0)
+        return;
+
+    hwm = uxTaskGetStackHighWaterMark(t);
+    s->hwm[i] = hwm > UINT16_MAX ? UINT16_MAX : hwm;
+    seen[i] = true;
+}
+
+
+static void sample(struct memprof_sample *s)
+{
+    struct mem_task mt[MEM_TASKS_MAX];
+    bool seen[MEMPROF_TASKS] = { false };
+    multi_heap_info_t info;
+    size_t i, n;
+
+    memset(s, 0, sizeof(*s));
+    s->uptime = esp_timer_get_time() / 1000000;
+    for (i = 0; i < MEMPROF_CAPS; i++) {
+        heap_caps_get_info(&info, caps[i]);
+        s->heap[i].free    = info.total_free_bytes;
+        s->heap[i].largest = info.largest_free_block;
+        s->heap[i].min     = info.minimum_free_bytes;
+    }
+
+    n = mem_tasks(mt, MEM_TASKS_MAX);
+    for (i = 0; i < n; i++)
+        add_hwm(s, seen, mt[i].name, mt[i].stack, mt[i].handle);
+
+    for (i = 0; i < sizeof(sys_tasks) / sizeof(sys_tasks[0]); i++)
+        add_hwm(s, seen, sys_tasks[i], 0, xTaskGetHandle(sys_tasks[i]));
+
+    /* an ended task keeps its column, its handle may be reused by a new
+     * task */
+    for (i = 0; i < ntasks; i++) {
+        if (!seen[i])
+            handles[i] = NULL;
+    }
+}
+
+
+void memprof_poll(void)
+{
+    static int64_t next;
+    struct memprof_sample s;
+    int64_t now = esp_timer_get_time();
+
+    if (now < next)
+        return;
+
+    next = now + (int64_t) CONFIG_MEMPROF_SECS * 1000000;
+    sample(&s);
+
+    portENTER_CRITICAL(&mux);
+    ring[w] = s;
+    w = (w + 1) % CONFIG_MEMPROF_SAMPLES;
+    if (cnt < CONFIG_MEMPROF_SAMPLES)
+        cnt++;
+    portEXIT_CRITICAL(&mux);
+}
+
+
+uint32_t memprof_interval(void)
+{
+    return CONFIG_MEMPROF_SECS;
+}
+
+
+const char *memprof_cap_name(enum memprof_cap cap)
+{
+    return cap < MEMPROF_CAPS ? cap_names[cap] : "?";
+}
+
+
+/* Fragmentation in per mille: share of the free heap outside the largest
+ * free block */
+unsigned memprof_frag(const struct memprof_heap *h)
+{
+    if (!h->free)
+        return 0;
+
+    return 1000 - (unsigned) ((uint64_t) h->largest * 1000 / h->free);
+}
+
+
+size_t memprof_tasks(struct memprof_task *t, size_t max)
+{
+    size_t n;
+
+    portENTER_CRITICAL(&mux);
+    n = ntasks < max ? ntasks : max;
+    memcpy(t, tasks, n * sizeof(*t));
+    portEXIT_CRITICAL(&mux);
+
+    return n;
+}
+
+
+/* Sample i, 0 is the oldest */
+bool memprof_get(size_t i, struct memprof_sample *s)
+{
+    bool ret = false;
+
+    portENTER_CRITICAL(&mux);
+    if (i < cnt) {
+        *s = ring[(w + CONFIG_MEMPROF_SAMPLES - cnt + i) %
+                  CONFIG_MEMPROF_SAMPLES];
+        ret = true;
+    }
+    portEXIT_CRITICAL(&mux);
+
+    return ret;
+}
@@ -0,0 +1,41 @@
+#ifndef MEMPROF_H
+#define MEMPROF_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MEMPROF_TASKS 20
+
+enum memprof_cap {
+    MEMPROF_INTERNAL,
+    MEMPROF_DMA,
+    MEMPROF_IRAM,
+    MEMPROF_CAPS
+};
+
+struct memprof_heap {
+    uint32_t free;
+    uint32_t largest;       /* largest free block */
+    uint32_t min;           /* minimum free since boot */
+};
+
+/* hwm[i] is the stack high-water mark in bytes of task i of
+ * memprof_tasks(), 0 if it did not exist at the time */
+struct memprof_sample {
+    uint32_t uptime;
+    struct memprof_heap heap[MEMPROF_CAPS];
+    uint16_t hwm[MEMPROF_TASKS];
+};
+
+struct memprof_task {
+    char name[16];
+    uint32_t stack;         /* size in bytes, 0 if not ours */
+};
+
+void memprof_poll(void);
+uint32_t memprof_interval(void);
+const char *memprof_cap_name(enum memprof_cap cap);
+unsigned memprof_frag(const struct memprof_heap *h);
+size_t memprof_tasks(struct memprof_task *tasks, size_t max);
+bool memprof_get(size_t i, struct memprof_sample *s);
+#endif
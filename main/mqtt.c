@@ -0,0 +1,383 @@
+/**
+ * @file mqtt.c  MQTT integration
+ *
+ * Publishes the state as retained topics whenever a value changes, and
+ * telemetry samples taken every CONFIG_MQTT_SAMPLE_SECS batched into one
+ * message every CONFIG_MQTT_TELEMETRY_SECS. Commands map onto the actions
+ * of the web form and are acknowledged on <topic>/ack.
+ *
+ *   <topic>/status            online | offline (last will)
+ *   <topic>/state/running     on | off, schedule or force
+ *   <topic>/state/powered     on | off, cell energised
+ *   <topic>/state/polarity    0 | 1
+ *   <topic>/state/flow        ok | low
+ *   <topic>/state/force       none | on | off
+ *   <topic>/state/schedule    HH:MM D (start, duration in hours)
+ *   <topic>/telemetry         {"counters":{..},"samples":[[t,cell s,
+ *                             powered,rssi,free heap],..]}
+ *   <topic>/cmd/force         none | on | off
+ *   <topic>/cmd/switch        switch polarity
+ *   <topic>/cmd/schedule      HH:MM D
+ *   <topic>/cmd/upgrade       start OTA
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "mqtt_client.h"
+#include "config.h"
+#include "log.h"
+#include "settings.h"
+#include "counters.h"
+#include "webui.h"
+#include "wifi.h"
+#include "pool.h"
+#include "mem.h"
+#include "mqtt.h"
+
+/* Broker, e.g. "mqtt://192.168.1.2", empty disables MQTT */
+#ifndef CONFIG_MQTT_URI
+#define CONFIG_MQTT_URI ""
+#endif
+
+#ifndef CONFIG_MQTT_TOPIC
+#define CONFIG_MQTT_TOPIC "pool"
+#endif
+
+#ifndef CONFIG_MQTT_SAMPLE_SECS
+#define CONFIG_MQTT_SAMPLE_SECS 10
+#endif
+
+#ifndef CONFIG_MQTT_TELEMETRY_SECS
+#define CONFIG_MQTT_TELEMETRY_SECS 60
+#endif
+
+#define TOPIC_MAX   64
+#define VAL_MAX     16
+#define SAMPLES_MAX (CONFIG_MQTT_TELEMETRY_SECS / CONFIG_MQTT_SAMPLE_SECS + 1)
+
+static const char *TAG = "mqtt";
+
+enum state_topic {
+    ST_RUNNING,
+    ST_POWERED,
+    ST_POLARITY,
+    ST_FLOW,
+    ST_FORCE,
+    ST_SCHEDULE,
+    ST_MAX
+};
+
+static const char *state_names[ST_MAX] = {
+    [ST_RUNNING]  = "running",
+    [ST_POWERED]  = "powered",
+    [ST_POLARITY] = "polarity",
+    [ST_FLOW]     = "flow",
+    [ST_FORCE]    = "force",
+    [ST_SCHEDULE] = "schedule",
+};
+
+static const char *force_names[] = { "none", "on", "off" };
+
+struct sample {
+    uint32_t t;
+    uint32_t cell_s;
+    uint32_t heap;
+    int32_t flow;       /* 0.1 l/min, -1 no meter */
+    int8_t rssi;
+    bool powered;
+};
+
+static esp_mqtt_client_handle_t client;
+static TaskHandle_t task;
+MEM_TASKS(mqtt, 4096, 1);
+static volatile bool connected;
+static volatile bool resync;            /* publish all states */
+static char published[ST_MAX][VAL_MAX];
+static struct sample samples[SAMPLES_MAX];
+static size_t nsamples;
+
+
+static void topic(char *buf, size_t size, const char *sub)
+{
+    snprintf(buf, size, "%s/%s", CONFIG_MQTT_TOPIC, sub);
+}
+
+
+static void state_values(char val[ST_MAX][VAL_MAX])
+{
+    struct pool_state ps;
+    struct settings set;
+
+    pool_get_state(&ps);
+    settings_get(&set);
+    strlcpy(val[ST_RUNNING], webui_check_time() ? "on" : "off", VAL_MAX);
+    strlcpy(val[ST_POWERED], ps.powered ? "on" : "off", VAL_MAX);
+    snprintf(val[ST_POLARITY], VAL_MAX, "%d", ps.polarity);
+    strlcpy(val[ST_FLOW], ps.flow_ok ? "ok" : "low", VAL_MAX);
+    strlcpy(val[ST_FORCE], force_names[webui_force()], VAL_MAX);
+    snprintf(val[ST_SCHEDULE], VAL_MAX, "%02d:%02d %d", (int) set.hh,
+             (int) set.mm, (int) set.duration);
+}
+
+
+/* Publishes changed states, all if requested, retained with QoS 1 */
+static void publish_state(bool all)
+{
+    char val[ST_MAX][VAL_MAX];
+    char t[TOPIC_MAX];
+    char sub[24];
+    int i;
+
+    state_values(val);
+    for (i = 0; i < ST_MAX; i++) {
+        if (!all && !strcmp(val[i], published[i]))
+            continue;
+
+        snprintf(sub, sizeof(sub), "state/%s", state_names[i]);
+        topic(t, sizeof(t), sub);
+        if (esp_mqtt_client_publish(client, t, val[i], 0, 1, 1) < 0)
+            return;
+
+        strlcpy(published[i], val[i], VAL_MAX);
+    }
+}
+
+
+static void sample(void)
+{
+    struct pool_state ps;
+    struct sample *s;
+
+    /* not connected for a while, keep the newest */
+    if (nsamples == SAMPLES_MAX) {
+        memmove(samples, samples + 1, (SAMPLES_MAX - 1) * sizeof(*samples));
+        nsamples--;
+    }
+
+    pool_get_state(&ps);
+    s = &samples[nsamples++];
+    s->t       = time(NULL);
+    s->cell_s  = counters_get(CNT_CELL_SEC);
+    s->heap    = esp_get_free_heap_size();
+    s->rssi    = wifi_rssi();
+    s->powered = ps.powered;
+    s->flow    = ps.flow_rate;
+}
+
+
+static void publish_telemetry(void)
+{
+    static char buf[64 + CNT_MAX * 32 + SAMPLES_MAX * 64];
+    const size_t size = sizeof(buf);
+    char t[TOPIC_MAX];
+    size_t n, i;
+
+    n = snprintf(buf, size, "{\"counters\":{");
+    for (i = 0; i < CNT_MAX && n < size; i++)
+        n += snprintf(buf + n, size - n, "%s\"%s\":%" PRIu32, i ? "," : "",
+                      counters_name(i), counters_get(i));
+
+    if (n < size)
+        n += snprintf(buf + n, size - n, "},\"samples\":[");
+
+    for (i = 0; i < nsamples && n < size; i++)
+        n += snprintf(buf + n, size - n,
+                      "%s[%" PRIu32 ",%" PRIu32 ",%d,%d,%" PRIu32 ",%" PRId32
+                      "]", i ? "," : "", samples[i].t, samples[i].cell_s,
+                      samples[i].powered, samples[i].rssi, samples[i].heap,
+                      samples[i].flow);
+
+    if (n < size)
+        n += snprintf(buf + n, size - n, "]}");
+
+    topic(t, sizeof(t), "telemetry");
+    if (n < size && esp_mqtt_client_publish(client, t, buf, n, 0, 0) >= 0)
+        nsamples = 0;
+}
+
+
+static bool cmd_schedule(const char *arg)
+{
+    struct settings set;
+    int hh, mm, dur;
+
+    if (sscanf(arg, "%d:%d %d", &hh, &mm, &dur) != 3 ||
+            hh < 0 || hh > 23 || mm < 0 || mm > 59 || dur < 1 || dur > 12)
+        return false;
+
+    settings_get(&set);
+    set.hh = hh;
+    set.mm = mm;
+    set.duration = dur;
+    settings_set(&set);
+    return true;
+}
+
+
+static void handle_cmd(const char *cmd, size_t clen, const char *data,
+                       size_t dlen)
+{
+    char t[TOPIC_MAX];
+    char arg[VAL_MAX];
+    char ack[TOPIC_MAX];
+    uint32_t id = 0;
+    bool ok = true;
+    size_t i;
+
+    snprintf(arg, sizeof(arg), "%.*s", (int) dlen, data);
+    if (clen == 5 && !strncmp(cmd, "force", 5)) {
+        ok = false;
+        for (i = 0; i < sizeof(force_names) / sizeof(force_names[0]); i++) {
+            if (!strcmp(arg, force_names[i])) {
+                id = webui_request_force((enum force_run) i);
+                ok = id != 0;
+            }
+        }
+    }
+    else if (clen == 6 && !strncmp(cmd, "switch", 6)) {
+        id = webui_request_switch();
+        ok = id != 0;
+    }
+    else if (clen == 8 && !strncmp(cmd, "schedule", 8)) {
+        ok = cmd_schedule(arg);
+    }
+    else if (clen == 7 && !strncmp(cmd, "upgrade", 7)) {
+        id = webui_request_upgrade();
+        ok = id != 0;
+    }
+    else {
+        ok = false;
+    }
+
+    logs(LOG_SRC_NET, "mqtt %.*s %s%s", (int) clen, cmd, arg,
+         ok ? "" : " failed");
+    topic(t, sizeof(t), "ack");
+
+    /* the id of a queued command, its result is in /cmd.json */
+    if (id)
+        snprintf(ack, sizeof(ack), "%.*s ok %" PRIu32, (int) clen, cmd, id);
+    else
+        snprintf(ack, sizeof(ack), "%.*s %s", (int) clen, cmd,
+                 ok ? "ok" : "error");
+    esp_mqtt_client_publish(client, t, ack, 0, 0, 0);
+    xTaskNotifyGive(task);
+}
+
+
+static void event_handler(void *arg, esp_event_base_t base, int32_t id,
+                          void *data)
+{
+    esp_mqtt_event_handle_t ev = data;
+    char t[TOPIC_MAX];
+    size_t plen;
+    (void) arg;
+    (void) base;
+
+    switch ((esp_mqtt_event_id_t) id) {
+    case MQTT_EVENT_CONNECTED:
+        ESP_LOGI(TAG, "connected");
+        topic(t, sizeof(t), "status");
+        esp_mqtt_client_publish(client, t, "online", 0, 1, 1);
+        topic(t, sizeof(t), "cmd/+");
+        esp_mqtt_client_subscribe(client, t, 1);
+        connected = true;
+        resync = true;
+        xTaskNotifyGive(task);
+        break;
+    case MQTT_EVENT_DISCONNECTED:
+        ESP_LOGW(TAG, "disconnected");
+        connected = false;
+        break;
+    case MQTT_EVENT_DATA:
+        /* commands are short, ignore fragmented messages */
+        if (ev->current_data_offset || ev->data_len != ev->total_data_len)
+            break;
+
+        topic(t, sizeof(t), "cmd/");
+        plen = strlen(t);
+        if (ev->topic_len > (int) plen && !strncmp(ev->topic, t, plen))
+            handle_cmd(ev->topic + plen, ev->topic_len - plen, ev->data,
+                       ev->data_len);
+        break;
+    default:
+        break;
+    }
+}
+
+
+static void mqtt_task(void *arg)
+{
+    const TickType_t sample_ticks = pdMS_TO_TICKS(CONFIG_MQTT_SAMPLE_SECS *
+                                                  1000);
+    const TickType_t pub_ticks = pdMS_TO_TICKS(CONFIG_MQTT_TELEMETRY_SECS *
+                                               1000);
+    TickType_t last_sample = xTaskGetTickCount() - sample_ticks;
+    TickType_t last_pub = xTaskGetTickCount();
+    TickType_t now;
+    bool all;
+    (void) arg;
+
+    while (true) {
+        /* woken by commands, the state is polled once per second */
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(1000));
+        now = xTaskGetTickCount();
+        if (now - last_sample >= sample_ticks) {
+            sample();
+            last_sample = now;
+        }
+
+        if (!connected)
+            continue;
+
+        all = resync;
+        resync = false;
+        publish_state(all);
+        if (now - last_pub >= pub_ticks) {
+            publish_telemetry();
+            last_pub = now;
+        }
+    }
+}
+
+
+/* Starts the client, uri NULL for CONFIG_MQTT_URI */
+void mqtt_init(const char *uri)
+{
+    static char will[TOPIC_MAX];
+    esp_mqtt_client_config_t cfg = { 0 };
+
+    if (!uri)
+        uri = CONFIG_MQTT_URI;
+
+    if (!*uri || client)
+        return;
+
+    topic(will, sizeof(will), "status");
+    cfg.broker.address.uri = uri;
+    cfg.session.keepalive = 30;
+    cfg.session.last_will.topic = will;
+    cfg.session.last_will.msg = "offline";
+    cfg.session.last_will.qos = 1;
+    cfg.session.last_will.retain = 1;
+
+    client = esp_mqtt_client_init(&cfg);
+    if (!client) {
+        ESP_LOGE(TAG, "init failed");
+        return;
+    }
+
+    MEM_TASK_CREATE(mqtt, 0, &mqtt_task, "mqtt", NULL, 4, &task);
+    esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, event_handler,
+                                   NULL);
+    esp_mqtt_client_start(client);
+    ESP_LOGI(TAG, "broker %s, topic %s", uri, CONFIG_MQTT_TOPIC);
+}
@@ -0,0 +1,4 @@
+#ifndef MQTT_H
+#define MQTT_H
+void mqtt_init(const char *uri);
+#endif
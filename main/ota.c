@@ -5,6 +5,7 @@
  */
 
 
+#include <stdbool.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_system.h"
@@ -21,9 +22,15 @@
 
 #include "ota.h"
 #include "config.h"
+#include "mem.h"
+#include "cmd.h"
 
 
 static const char *TAG = "ota";
+static TaskHandle_t task;
+static struct cmd cur;          /* the upgrade command running */
+static bool busy;
+MEM_TASKS(ota, 8192, 1);
 
 
 #define OTA_URL_SIZE 256
@@ -83,10 +90,9 @@ esp_err_t _http_event_handler(esp_http_client_event_t *evt)
     return ESP_OK;
 }
 
-void ota_task(void *pvParameter)
+static void ota_task(void *pvParameter)
 {
     (void) pvParameter;
-    ESP_LOGI(TAG, "Starting OTA upgrade ...");
     esp_http_client_config_t config = {
         .url = CONFIG_OTA_URL,
         .event_handler = _http_event_handler,
@@ -99,14 +105,39 @@ void ota_task(void *pvParameter)
         .http_config = &config,
     };
 
-    esp_err_t ret = esp_https_ota(&ota_config);
-    if (ret == ESP_OK) {
-        ESP_LOGI(TAG, "=========== Reboot after OTA upgrade ==========");
-        esp_restart();
-    } else {
-        ESP_LOGE(TAG, "Firmware upgrade failed");
-    }
     while (1) {
-        vTaskDelay(1000 / portTICK_PERIOD_MS);
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        ESP_LOGI(TAG, "Starting OTA upgrade ...");
+        esp_err_t ret = esp_https_ota(&ota_config);
+        if (ret == ESP_OK) {
+            ESP_LOGI(TAG, "=========== Reboot after OTA upgrade ==========");
+            esp_restart();
+        } else {
+            ESP_LOGE(TAG, "Firmware upgrade failed");
+        }
+
+        /* the reboot ends a successful upgrade */
+        cmd_done(&cur, ret);
+        __atomic_store_n(&busy, false, __ATOMIC_RELEASE);
     }
 }
+
+
+/* Starts the upgrade of command c, the task is created once and reused for
+ * retries. The task reports the result of c by cmd_done(), the caller only
+ * if an error is returned. */
+esp_err_t ota_upgrade(const struct cmd *c)
+{
+    if (__atomic_load_n(&busy, __ATOMIC_ACQUIRE))
+        return ESP_ERR_INVALID_STATE;
+
+    if (!task &&
+        MEM_TASK_CREATE(ota, 0, &ota_task, "ota_task", NULL, 5, &task) !=
+        pdPASS)
+        return ESP_ERR_NO_MEM;
+
+    cur = *c;
+    __atomic_store_n(&busy, true, __ATOMIC_RELEASE);
+    xTaskNotifyGive(task);
+    return ESP_OK;
+}
@@ -1,4 +1,8 @@
 #ifndef OTA_H
 #define OTA_H
-void ota_task(void *pvParameter);
+#include "esp_err.h"
+
+struct cmd;
+
+esp_err_t ota_upgrade(const struct cmd *c);
 #endif
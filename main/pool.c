@@ -5,13 +5,28 @@
  */
 
 #include <stdio.h>
+#include <inttypes.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_log.h"
 #include "driver/gpio.h"
 #include "driver/adc.h"
 #include "esp_adc_cal.h"
+#include "esp_timer.h"
+#include "esp_cpu.h"
+#include "esp_rom_sys.h"
+#include "soc/gpio_reg.h"
 #include "webui.h"
+#include "counters.h"
+#include "snapshot.h"
+#include "log.h"
+#include "flow.h"
+#include "fan.h"
+#include "cell.h"
+#include "cmd.h"
+#include "flashtest.h"
+#include "bench.h"
+#include "history.h"
 #include "pool.h"
 
 static const char *TAG = "pool";
@@ -32,16 +47,41 @@ static const char *TAG = "pool";
         (1ULL<<GPIO_CL_MINUS)  | \
         (1ULL<<GPIO_CL_PLUS)   | \
         (1ULL<<GPIO_POWER)     | \
-        (1ULL<<GPIO_LED)       | \
-        (1ULL<<GPIO_FAN)         \
+        (1ULL<<GPIO_LED)         \
         )
 
 #define GPIO_INPUT_PIN_SEL  ((1ULL<<GPIO_LOW_FLOW))
 
-#define ESP_INTR_FLAG_DEFAULT 0
+/* cleared by the flow ISR, all below GPIO32 */
+#define CUTOFF_MASK  (\
+        (1UL<<GPIO_WAT_MINUS) | \
+        (1UL<<GPIO_WAT_PLUS)  | \
+        (1UL<<GPIO_CL_MINUS)  | \
+        (1UL<<GPIO_CL_PLUS)   | \
+        (1UL<<GPIO_POWER)       \
+        )
+
 #define DEFAULT_VREF    1100
 #define NO_OF_SAMPLES   64
 
+static const int relay_pin[] = {
+    [CNT_K1] = GPIO_WAT_MINUS,
+    [CNT_K2] = GPIO_WAT_PLUS,
+    [CNT_K3] = GPIO_CL_MINUS,
+    [CNT_K4] = GPIO_CL_PLUS,
+    [CNT_K5] = GPIO_POWER,
+};
+
+static int relay_level[CNT_K5 + 1];
+static bool powered;
+static int powered_lev;
+static bool meter;              /* flow meter instead of flow switch */
+static volatile bool cut;       /* relays cut off by the flow ISR */
+static volatile uint32_t cut_cycles;    /* ISR entry to relays off */
+static volatile int64_t cut_at;
+static uint32_t cut_ns;
+
+
 static void print_char_val_type(esp_adc_cal_value_t val_type)
 {
     if (val_type == ESP_ADC_CAL_VAL_EFUSE_TP) {
@@ -53,52 +93,245 @@ static void print_char_val_type(esp_adc_cal_value_t val_type)
     }
 }
 
-static void IRAM_ATTR low_flow(void* arg)
+/* Flow switch edge. On low flow the cell and the polarity relays are cut
+ * off right here, pool_loop() reconciles its state on the next wake. In
+ * IRAM by linker.lf, it must not touch flash while the cache is disabled. */
+static void low_flow(void* arg)
 {
+    uint32_t t0 = esp_cpu_get_cycle_count();
     bool *changed = (bool *) arg;
 
+    if (REG_READ(GPIO_IN_REG) & BIT(GPIO_LOW_FLOW)) {
+        REG_WRITE(GPIO_OUT_W1TC_REG, CUTOFF_MASK);
+        /* the read back waits until the write left the write buffer */
+        (void) REG_READ(GPIO_OUT_REG);
+        cut_cycles = esp_cpu_get_cycle_count() - t0;
+        cut_at = esp_timer_get_time();
+        cut = true;
+    }
+
     *changed = true;
 }
 
 
+static bool flow_state(void)
+{
+    return meter ? flow_ok() : !gpio_get_level(GPIO_LOW_FLOW);
+}
+
+
+/* Averaged reading of the cell current sense input in mV */
+static int32_t read_mv(adc_channel_t channel,
+                       const esp_adc_cal_characteristics_t *chars)
+{
+    uint32_t raw = 0;
+    int i;
+
+    for (i = 0; i < NO_OF_SAMPLES; i++)
+        raw += adc1_get_raw((adc1_channel_t) channel);
+
+    return (int32_t) esp_adc_cal_raw_to_voltage(raw / NO_OF_SAMPLES, chars);
+}
+
+
+/* Sets a relay and counts its switching cycles */
+static void set_relay(enum counter k, int level)
+{
+    gpio_set_level(relay_pin[k], level);
+    if (level && !relay_level[k])
+        counters_add(k, 1);
+
+    if (level != relay_level[k])
+        snapshot_touch();
+
+    relay_level[k] = level;
+}
+
+
+/* Spare output for the GPIO write bench, -1 none. The relays belong to the
+ * control loop. */
+#ifndef CONFIG_POOL_BENCH_GPIO
+#define CONFIG_POOL_BENCH_GPIO 2
+#endif
+
+#if CONFIG_POOL_BENCH && CONFIG_POOL_BENCH_GPIO >= 0
+/* The output write of set_relay() on the spare pin */
+static void bench_gpio(void *arg)
+{
+    (void) arg;
+
+    gpio_set_level(CONFIG_POOL_BENCH_GPIO, 0);
+}
+#endif
+
+
+static void set_polarity(int lev)
+{
+    set_relay(CNT_K1, lev);
+    set_relay(CNT_K2, !lev);
+    set_relay(CNT_K3, lev);
+    set_relay(CNT_K4, !lev);
+    powered_lev = lev;
+}
+
+
 static void switch_on_off(bool on, int lev)
 {
-    gpio_set_level(GPIO_POWER, on);
-    gpio_set_level(GPIO_FAN, on);
+    set_relay(CNT_K5, on);
+    fan_run(on);
+    powered = on;
 
     if (on) {
         ESP_LOGI(TAG, "Switch on ...");
-        gpio_set_level(GPIO_WAT_MINUS, lev);
-        gpio_set_level(GPIO_WAT_PLUS, !lev);
-        gpio_set_level(GPIO_CL_MINUS, lev);
-        gpio_set_level(GPIO_CL_PLUS, !lev);
+        logc("Switch on, polarity %d", lev);
+        history_event(HIST_EV_ON, lev);
+        set_polarity(lev);
+
+        /* the flow ISR may have fired while switching on */
+        if (cut)
+            REG_WRITE(GPIO_OUT_W1TC_REG, CUTOFF_MASK);
     } else {
         ESP_LOGW(TAG, "Switch off ...");
-        gpio_set_level(GPIO_WAT_MINUS, 0);
-        gpio_set_level(GPIO_WAT_PLUS, 0);
-        gpio_set_level(GPIO_CL_MINUS, 0);
-        gpio_set_level(GPIO_CL_PLUS, 0);
+        logc("Switch off");
+        history_event(HIST_EV_OFF, 0);
+        set_relay(CNT_K1, 0);
+        set_relay(CNT_K2, 0);
+        set_relay(CNT_K3, 0);
+        set_relay(CNT_K4, 0);
+    }
+}
+
+
+/* Accumulates cell on time per polarity */
+static void account_time(void)
+{
+    static int64_t last;
+    static int64_t acc;     /* in us */
+    int64_t now = esp_timer_get_time();
+
+    if (powered && last)
+        acc += now - last;
+
+    last = now;
+    while (acc >= 1000000) {
+        acc -= 1000000;
+        counters_add(CNT_CELL_SEC, 1);
+        counters_add(powered_lev ? CNT_POL1_SEC : CNT_POL0_SEC, 1);
+    }
+}
+
+
+/* Takes over the relay state after a cutoff by the flow ISR */
+static void reconcile_cutoff(void)
+{
+    enum counter k;
+
+    if (!cut)
+        return;
+
+    cut = false;
+    cut_ns = (uint32_t) ((uint64_t) cut_cycles * 1000 /
+                         esp_rom_get_cpu_ticks_per_us());
+    for (k = CNT_K1; k <= CNT_K5; k++)
+        relay_level[k] = 0;
+
+    if (powered) {
+        ESP_LOGW(TAG, "Cut off by flow ISR in %" PRIu32 " ns", cut_ns);
+        logc("Cut off by flow ISR in %" PRIu32 " ns", cut_ns);
+        history_event(HIST_EV_CUTOFF, (int32_t) cut_ns);
+    }
+}
+
+
+/* Commands for the control task, a switch is applied by the loop */
+static void apply_cmd(struct cmd *c, bool *flip, struct cmd *flip_cmd)
+{
+    switch (c->type) {
+    case CMD_SWITCH:
+        if (!powered || *flip) {
+            cmd_done(c, ESP_ERR_INVALID_STATE);
+            break;
+        }
+
+        *flip = true;
+        *flip_cmd = *c;
+        break;
+    case CMD_FORCE:
+        if (c->arg < FORCE_NONE || c->arg > FORCE_OFF) {
+            cmd_done(c, ESP_ERR_INVALID_ARG);
+            break;
+        }
+
+        webui_set_force((enum force_run) c->arg);
+        cmd_done(c, ESP_OK);
+        break;
+    default:
+        cmd_done(c, ESP_ERR_NOT_SUPPORTED);
+        break;
     }
 }
 
 
 static void handle_flow_change(int lev)
 {
-    int on = !gpio_get_level(GPIO_LOW_FLOW);
-    if (on)
+    int on;
+    int32_t rate = flow_rate(0);
+
+    reconcile_cutoff();
+    on = flow_state();
+
+    if (on) {
         ESP_LOGI(TAG, "Flow Ok");
-    else
-        ESP_LOGW(TAG, "Low flow detected");
+        logc("Flow ok");
+        history_event(HIST_EV_FLOW_OK, 0);
+    }
+    else {
+        if (meter) {
+            ESP_LOGW(TAG, "Low flow detected (%d.%d l/min)", (int) rate / 10,
+                     (int) rate % 10);
+            logc("Low flow (%d.%d l/min)", (int) rate / 10, (int) rate % 10);
+            history_event(HIST_EV_FLOW_LOW, rate);
+        }
+        else {
+            ESP_LOGW(TAG, "Low flow detected");
+            logc("Low flow");
+            history_event(HIST_EV_FLOW_LOW, -1);
+        }
 
+        if (powered)
+            counters_add(CNT_LOW_FLOW, 1);
+    }
+
+    snapshot_touch();
     switch_on_off(on && webui_check_time(), lev);
 }
 
 
+/* Time of the last cutoff by the flow ISR in us since boot, in IRAM */
+int64_t pool_cutoff_at(void)
+{
+    return cut_at;
+}
+
+
+void pool_get_state(struct pool_state *st)
+{
+    st->powered  = powered;
+    st->polarity = powered_lev;
+    st->flow_ok  = flow_state();
+    st->flow_rate = flow_rate(60);
+    st->cutoff_ns = cut_ns;
+    st->fan = fan_duty();
+    cell_get(&st->cell);
+}
+
+
 void pool_loop(void *pvParameter)
 {
     bool changed = false;
     bool run = false;
-    esp_adc_cal_characteristics_t *adc_chars;
+    static esp_adc_cal_characteristics_t adc_chars_buf;
+    esp_adc_cal_characteristics_t *adc_chars = &adc_chars_buf;
     const adc_channel_t channel = ADC_CHANNEL_6; /* GPIO34 */
     const adc_bits_width_t width = ADC_WIDTH_BIT_12;
     const adc_atten_t atten = ADC_ATTEN_DB_0;
@@ -115,60 +348,107 @@ void pool_loop(void *pvParameter)
     io_conf.pull_up_en = 0;
     gpio_config(&io_conf);
 
-    /* configure inputs with interrupt for rising edge*/
-    io_conf.intr_type = GPIO_INTR_ANYEDGE;
-    io_conf.pin_bit_mask = GPIO_INPUT_PIN_SEL;
-    io_conf.mode = GPIO_MODE_INPUT;
-    io_conf.pull_down_en = 0;
-    io_conf.pull_up_en = 1;
-    gpio_config(&io_conf);
-
-    /* install gpio isr service */
-    gpio_install_isr_service(ESP_INTR_FLAG_DEFAULT);
-    gpio_isr_handler_add(GPIO_LOW_FLOW, low_flow, &changed);
+    /* the flow input is counted by PCNT with a flow meter */
+    meter = flow_init(GPIO_LOW_FLOW);
+    if (!meter) {
+        /* configure inputs with interrupt for rising edge*/
+        io_conf.intr_type = GPIO_INTR_ANYEDGE;
+        io_conf.pin_bit_mask = GPIO_INPUT_PIN_SEL;
+        io_conf.mode = GPIO_MODE_INPUT;
+        io_conf.pull_down_en = 0;
+        io_conf.pull_up_en = 1;
+        gpio_config(&io_conf);
+
+        /* install gpio isr service, it keeps running during flash
+         * writes */
+        gpio_install_isr_service(ESP_INTR_FLAG_IRAM);
+        gpio_isr_handler_add(GPIO_LOW_FLOW, low_flow, &changed);
+        flashtest_start(GPIO_LOW_FLOW);
+    }
 
     /* configure ADC */
     adc1_config_width(width);
     adc1_config_channel_atten(channel, atten);
-    adc_chars = calloc(1, sizeof(esp_adc_cal_characteristics_t));
     esp_adc_cal_value_t val_type = esp_adc_cal_characterize(unit, atten, width,
             DEFAULT_VREF, adc_chars);
     print_char_val_type(val_type);
 
+    /* PWM on the fan output */
+    fan_init(GPIO_FAN);
+#if CONFIG_POOL_BENCH && CONFIG_POOL_BENCH_GPIO >= 0
+    io_conf.pin_bit_mask = 1ULL << CONFIG_POOL_BENCH_GPIO;
+    io_conf.mode = GPIO_MODE_OUTPUT;
+    io_conf.intr_type = GPIO_INTR_DISABLE;
+    io_conf.pull_up_en = 0;
+    io_conf.pull_down_en = 0;
+    gpio_config(&io_conf);
+    bench_add("gpio", bench_gpio, NULL, BENCH_IRQ_OFF);
+#endif
+
 
     /* main loop */
     ESP_LOGI(TAG, "Starting pool main loop ...");
 
-    int cnt = 0;
-
-    int lev = !gpio_get_level(GPIO_LOW_FLOW);
+    bool flow_last = flow_state();
+    int lev = cell_init();
+    bool flip = false;
+    struct cmd flip_cmd;
+    int64_t sampled = 0;
     gpio_set_level(GPIO_POWER, false);
-    gpio_set_level(GPIO_FAN, false);
-    if (lev) {
+    if (flow_last) {
         ESP_LOGI(TAG, "Flow Ok on startup");
     } else
         ESP_LOGW(TAG, "Low flow detected at startup");
 
-    uint32_t adc = 0;
-
-    /* currently only 3 hours */
+    cmd_register(CMD_BOX_POOL);
     while (true) {
+        struct cmd c;
+        int64_t now;
+
+        /* everything below goes by time, a command wakes up at once */
+        cmd_wait(100);
+        while (cmd_take(CMD_BOX_POOL, &c))
+            apply_cmd(&c, &flip, &flip_cmd);
+
+        account_time();
+        if (meter) {
+            flow_poll();
+            if (flow_ok() != flow_last) {
+                flow_last = flow_ok();
+                changed = true;
+            }
+        }
 
-        /* flip voltage from +/- every 20 minutes */
-        const int d = 20*60;
-        vTaskDelay(100 / portTICK_PERIOD_MS);
+        /* cell current once a second, for the charge balance and the fan
+         * curve */
+        now = esp_timer_get_time();
+        if (!powered) {
+            sampled = 0;
+        }
+        else if (now - sampled >= 1000000) {
+            int32_t mv = read_mv(channel, adc_chars);
 
-        ++cnt;
-        if (webui_switch()) {
-            cnt = 0;
+            cell_sample(powered_lev, mv,
+                        sampled ? (uint32_t) ((now - sampled) / 1000) : 0);
+            fan_load(mv);
+            sampled = now;
         }
 
+        fan_poll();
+
+
         if (!webui_check_time()) {
             if (run) {
                 switch_on_off(false, 0);
                 run = false;
             }
 
+            /* a flip still waiting for flow ends with the window */
+            if (flip) {
+                cmd_done(&flip_cmd, ESP_ERR_INVALID_STATE);
+                flip = false;
+            }
+
             continue;
         }
 
@@ -181,18 +461,21 @@ void pool_loop(void *pvParameter)
             changed = false;
             handle_flow_change(lev);
         }
-        else if (cnt % (10 * d) == 0 && !gpio_get_level(GPIO_LOW_FLOW)) {
-            uint32_t voltage;
+        else if ((flip || cell_flip_due(lev)) && flow_state()) {
+            struct cell_stats cs;
+
+            if (flip)
+                cmd_done(&flip_cmd, ESP_OK);
+
+            flip = false;
             lev = !lev;
-            ESP_LOGI(TAG, "switch to %d\n", lev);
-            gpio_set_level(GPIO_WAT_MINUS, lev);
-            gpio_set_level(GPIO_WAT_PLUS, !lev);
-            gpio_set_level(GPIO_CL_MINUS, lev);
-            gpio_set_level(GPIO_CL_PLUS, !lev);
-
-            adc = adc1_get_raw((adc1_channel_t) channel);
-            voltage = esp_adc_cal_raw_to_voltage(adc, adc_chars);
-            ESP_LOGI(TAG, "Raw: %d\tVoltage: %dmV\n", adc, voltage);
+            cell_get(&cs);
+            ESP_LOGI(TAG, "switch to %d, %d mA, balance %d", lev,
+                     (int) cs.ma, (int) cs.balance);
+            logc("Polarity %d, %d mA, balance %d", lev, (int) cs.ma,
+                 (int) cs.balance);
+            history_event(HIST_EV_POLARITY, lev);
+            set_polarity(lev);
         }
 
     }
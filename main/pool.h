@@ -1,4 +1,20 @@
 #ifndef POOL_H
 #define POOL_H
+#include <stdbool.h>
+#include <stdint.h>
+#include "cell.h"
+
+struct pool_state {
+    bool powered;       /* cell energised */
+    int polarity;
+    bool flow_ok;
+    int32_t flow_rate;  /* 0.1 l/min over the last minute, -1 no meter */
+    uint32_t cutoff_ns; /* last flow ISR cutoff, ISR entry to relays off */
+    int fan;            /* fan duty in % */
+    struct cell_stats cell;
+};
+
 void pool_loop(void *pvParameter);
+void pool_get_state(struct pool_state *st);
+int64_t pool_cutoff_at(void);
 #endif
@@ -0,0 +1,104 @@
+/**
+ * @file schedule.c  Daily schedule window in local time
+ *
+ * A window starts at the first instant of a local day at which the wall
+ * clock reads hh:mm or later and lasts duration hours of real time. On the
+ * night the clocks go back hh:mm may occur twice, the first one counts. If
+ * hh:mm is skipped because the clocks go forward, the window starts with the
+ * jump. Windows may cross midnight.
+ *
+ * Shared by the firmware and tools/schedsweep.c.
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include <stdint.h>
+#include "schedule.h"
+
+
+static int64_t days_from_civil(int64_t y, int m, int d)
+{
+    int64_t era, yoe, doy;
+
+    y -= m <= 2;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = y - era * 400;
+    doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+
+/* Local wall clock of t in seconds, counted like UTC since the epoch */
+static int64_t local_secs(time_t t)
+{
+    struct tm tm;
+
+    localtime_r(&t, &tm);
+    return days_from_civil(tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday) *
+           86400 + tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec;
+}
+
+
+/* Start on the local day days_back days before the one of now. Uses
+ * localtime_r() only, mktime() is slow in the hours around a transition. */
+time_t schedule_start(const struct schedule *s, time_t now, int days_back)
+{
+    int64_t lnow = local_secs(now);
+    int64_t day = (lnow >= 0 ? lnow : lnow - 86399) / 86400 - days_back;
+    int64_t target = day * 86400 + s->hh * 3600 + s->mm * 60;
+    int64_t off[3], t, l, exact = -1, before = -1, after = -1, mid;
+    int i;
+
+    /* UTC offsets a day before and after and the current one, at most one
+     * transition is in between */
+    t = target - (lnow - now);
+    off[0] = lnow - now;
+    off[1] = local_secs(t - 86400) - (t - 86400);
+    off[2] = local_secs(t + 86400) - (t + 86400);
+
+    for (i = 0; i < 3; i++) {
+        t = target - off[i];
+        l = local_secs(t);
+        if (l == target && (exact == -1 || t < exact))
+            exact = t;
+        else if (l < target && (before == -1 || t > before))
+            before = t;
+        else if (l > target && (after == -1 || t < after))
+            after = t;
+    }
+
+    if (exact != -1 || before == -1 || after == -1)
+        return exact != -1 ? exact : after;
+
+    /* hh:mm skipped, the window starts with the jump */
+    while (after - before > 1) {
+        mid = before + (after - before) / 2;
+        if (local_secs(mid) >= target)
+            after = mid;
+        else
+            before = mid;
+    }
+
+    return after;
+}
+
+
+bool schedule_active(const struct schedule *s, time_t now)
+{
+    time_t start, len = (time_t) s->duration * 3600;
+    int back, days;
+
+    if (s->duration <= 0)
+        return false;
+
+    /* windows of previous days reach into today if they cross midnight,
+     * one hour of slack for a transition */
+    days = (s->hh * 60 + s->mm + s->duration * 60 + 60) / 1440;
+    for (back = 0; back <= days; back++) {
+        start = schedule_start(s, now, back);
+        if (start != (time_t) -1 && start <= now && now < start + len)
+            return true;
+    }
+
+    return false;
+}
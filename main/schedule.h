@@ -0,0 +1,18 @@
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+#include <stdbool.h>
+#include <time.h>
+
+/* Western European Time, set once the time is synced */
+#define SCHEDULE_TZ "WEST-1DWEST-2,M3.5.0/02:00:00,M10.5.0/03:00:00"
+
+/* Daily window of duration hours starting at local time hh:mm */
+struct schedule {
+    int hh;
+    int mm;
+    int duration;
+};
+
+time_t schedule_start(const struct schedule *s, time_t now, int days_back);
+bool schedule_active(const struct schedule *s, time_t now);
+#endif
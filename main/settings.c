@@ -0,0 +1,274 @@
+/**
+ * @file settings.c
+ *
+ * Settings are kept in RAM and stored as one versioned, CRC protected blob.
+ * Changes are coalesced and written by a background task after
+ * SETTINGS_DEBOUNCE_MS without further changes.
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_crc.h"
+#include "nvs.h"
+#include "log.h"
+#include "snapshot.h"
+#include "mem.h"
+#include "settings.h"
+
+#define SETTINGS_VERSION     1
+#define SETTINGS_DEBOUNCE_MS 2000
+#define SETTINGS_NS          "pool"
+#define SETTINGS_KEY         "settings"
+/* namespace of the separate i32 keys up to V1.6 */
+#define LEGACY_NS            "storage"
+
+static const char *TAG = "settings";
+
+struct blob_hdr {
+    uint16_t version;
+    uint16_t size;      /* size of the settings following the header */
+    uint32_t crc;       /* CRC32 of the settings */
+};
+
+struct blob {
+    struct blob_hdr hdr;
+    struct settings s;
+};
+
+static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+static struct settings cur;
+static bool dirty;
+static bool erase;
+static TickType_t dirty_tick;
+static uint32_t stored_crc;
+static TaskHandle_t task;
+MEM_TASKS(settings, 2048, 1);
+
+
+static void set_defaults(struct settings *s)
+{
+    memset(s, 0, sizeof(*s));
+    s->duration = 3;
+}
+
+
+static uint32_t crc(const void *data, size_t size)
+{
+    return esp_crc32_le(0, data, size);
+}
+
+
+/* Converts an older blob body into the current struct. Fields unknown to
+ * the stored version keep their defaults. */
+static void migrate(struct settings *s, uint16_t version, const void *data,
+                    size_t size)
+{
+    set_defaults(s);
+    memcpy(s, data, size < sizeof(*s) ? size : sizeof(*s));
+
+    switch (version) {
+    case SETTINGS_VERSION:
+    default:
+        break;
+    }
+}
+
+
+static int read_legacy(struct settings *s)
+{
+    nvs_handle_t nvs;
+    int err;
+
+    err = nvs_open(LEGACY_NS, NVS_READONLY, &nvs);
+    if (err)
+        return err;
+
+    set_defaults(s);
+    err  = nvs_get_i32(nvs, "time_hh", &s->hh);
+    err |= nvs_get_i32(nvs, "time_mm", &s->mm);
+    if (nvs_get_i32(nvs, "duration", &s->duration))
+        s->duration = 3;
+
+    nvs_close(nvs);
+    return err;
+}
+
+
+static int read_blob(struct settings *s)
+{
+    nvs_handle_t nvs;
+    uint8_t buf[sizeof(struct blob_hdr) + 256];
+    struct blob_hdr hdr;
+    size_t len = sizeof(buf);
+    int err;
+
+    err = nvs_open(SETTINGS_NS, NVS_READONLY, &nvs);
+    if (err)
+        return err;
+
+    err = nvs_get_blob(nvs, SETTINGS_KEY, buf, &len);
+    nvs_close(nvs);
+    if (err)
+        return err;
+
+    memcpy(&hdr, buf, sizeof(hdr));
+    if (len < sizeof(hdr) || hdr.size != len - sizeof(hdr) ||
+            crc(buf + sizeof(hdr), hdr.size) != hdr.crc) {
+        ESP_LOGE(TAG, "settings blob corrupt");
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    migrate(s, hdr.version, buf + sizeof(hdr), hdr.size);
+    if (hdr.version == SETTINGS_VERSION && hdr.size == sizeof(*s))
+        stored_crc = hdr.crc;
+
+    return 0;
+}
+
+
+static void write_blob(const struct settings *s)
+{
+    nvs_handle_t nvs;
+    struct blob b;
+    int err;
+
+    b.hdr.version = SETTINGS_VERSION;
+    b.hdr.size    = sizeof(b.s);
+    b.hdr.crc     = crc(s, sizeof(*s));
+    b.s           = *s;
+    if (b.hdr.crc == stored_crc)
+        return;
+
+    err = nvs_open(SETTINGS_NS, NVS_READWRITE, &nvs);
+    if (err) {
+        ESP_LOGE(TAG, "Error (%s) opening NVS", esp_err_to_name(err));
+        return;
+    }
+
+    err  = nvs_set_blob(nvs, SETTINGS_KEY, &b, sizeof(b));
+    err |= nvs_commit(nvs);
+    nvs_close(nvs);
+    if (err) {
+        ESP_LOGE(TAG, "Error (%s) could not update NVS", esp_err_to_name(err));
+        return;
+    }
+
+    stored_crc = b.hdr.crc;
+}
+
+
+static void erase_ns(const char *ns)
+{
+    nvs_handle_t nvs;
+
+    if (nvs_open(ns, NVS_READWRITE, &nvs))
+        return;
+
+    nvs_erase_all(nvs);
+    nvs_commit(nvs);
+    nvs_close(nvs);
+}
+
+
+static void settings_task(void *arg)
+{
+    const TickType_t debounce = pdMS_TO_TICKS(SETTINGS_DEBOUNCE_MS);
+    TickType_t wait = portMAX_DELAY;
+    struct settings s;
+    bool do_erase;
+    bool do_write;
+    (void) arg;
+
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, wait);
+
+        portENTER_CRITICAL(&mux);
+        do_erase = erase;
+        erase = false;
+        do_write = dirty && xTaskGetTickCount() - dirty_tick >= debounce;
+        if (do_write)
+            dirty = false;
+
+        wait = dirty ? debounce - (xTaskGetTickCount() - dirty_tick) :
+                       portMAX_DELAY;
+        s = cur;
+        portEXIT_CRITICAL(&mux);
+
+        if (do_erase) {
+            ESP_LOGI(TAG, "erase settings");
+            erase_ns(SETTINGS_NS);
+            erase_ns(LEGACY_NS);
+            stored_crc = 0;
+        }
+
+        if (do_write)
+            write_blob(&s);
+    }
+}
+
+
+void settings_init(void)
+{
+    struct settings s;
+
+    if (read_blob(&s)) {
+        if (!read_legacy(&s)) {
+            logw("settings migrated from V1.6");
+            write_blob(&s);
+            erase_ns(LEGACY_NS);
+        }
+        else {
+            set_defaults(&s);
+        }
+    }
+
+    cur = s;
+    logw("%s read %02d:%02d duration %d", __FUNCTION__, s.hh, s.mm,
+         s.duration);
+    MEM_TASK_CREATE(settings, 0, &settings_task, "settings", NULL, 2,
+                    &task);
+}
+
+
+void settings_get(struct settings *s)
+{
+    portENTER_CRITICAL(&mux);
+    *s = cur;
+    portEXIT_CRITICAL(&mux);
+}
+
+
+void settings_set(const struct settings *s)
+{
+    portENTER_CRITICAL(&mux);
+    if (memcmp(&cur, s, sizeof(cur))) {
+        cur = *s;
+        dirty = true;
+        dirty_tick = xTaskGetTickCount();
+    }
+    portEXIT_CRITICAL(&mux);
+
+    snapshot_touch();
+    if (task)
+        xTaskNotifyGive(task);
+}
+
+
+void settings_reset(void)
+{
+    portENTER_CRITICAL(&mux);
+    set_defaults(&cur);
+    dirty = false;
+    erase = true;
+    portEXIT_CRITICAL(&mux);
+
+    snapshot_touch();
+    if (task)
+        xTaskNotifyGive(task);
+}
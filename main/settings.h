@@ -0,0 +1,17 @@
+#ifndef SETTINGS_H
+#define SETTINGS_H
+#include <stdint.h>
+
+/* Persistent user settings. New fields are appended at the end only, see
+ * migrate() in settings.c. */
+struct settings {
+    int32_t hh;
+    int32_t mm;
+    int32_t duration;
+};
+
+void settings_init(void);
+void settings_get(struct settings *s);
+void settings_set(const struct settings *s);
+void settings_reset(void);
+#endif
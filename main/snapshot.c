@@ -0,0 +1,226 @@
+/**
+ * @file snapshot.c  Rendered responses cached until the state changes
+ *
+ * Every state change (relay, flow, log line, settings, web command) calls
+ * snapshot_touch() which bumps a generation counter. A snapshot is rendered
+ * once per generation and wall clock minute (the page shows the time and
+ * the schedule state) into one of two buffers and swapped in RCU-style:
+ * readers take a reference on the current buffer and stream it, the next
+ * render goes to the other buffer and the pointer is swapped under a short
+ * critical section. If a slow reader still holds the other buffer,
+ * snapshot_get() returns NULL and the caller renders live.
+ *
+ * With CONFIG_STATIC_MEM the snapshots and their buffers are a fixed pool,
+ * a response larger than CONFIG_SNAPSHOT_SIZE is rendered live.
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_crc.h"
+#include "mem.h"
+#include "snapshot.h"
+
+/* Snapshots and buffer size of each of their two buffers with
+ * CONFIG_STATIC_MEM */
+#ifndef CONFIG_SNAPSHOT_MAX
+#define CONFIG_SNAPSHOT_MAX 2
+#endif
+#ifndef CONFIG_SNAPSHOT_SIZE
+#define CONFIG_SNAPSHOT_SIZE 12288
+#endif
+
+struct snapshot {
+    snapshot_render_h *render;
+    struct snap_buf buf[2];
+    struct snap_buf *cur;       /* holds one reference */
+    SemaphoreHandle_t lock;     /* one renderer at a time */
+#if CONFIG_STATIC_MEM
+    StaticSemaphore_t lock_buf;
+#endif
+};
+
+static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t gen = 1;
+#if CONFIG_STATIC_MEM
+static struct snapshot pool[CONFIG_SNAPSHOT_MAX];
+static char pool_data[CONFIG_SNAPSHOT_MAX][2][CONFIG_SNAPSHOT_SIZE];
+static size_t npool;
+#endif
+
+
+void snapshot_touch(void)
+{
+    portENTER_CRITICAL(&mux);
+    gen++;
+    portEXIT_CRITICAL(&mux);
+}
+
+
+#if CONFIG_STATIC_MEM
+struct snapshot *snapshot_alloc(snapshot_render_h *render)
+{
+    struct snapshot *s;
+    int i;
+
+    if (npool == CONFIG_SNAPSHOT_MAX)
+        return NULL;
+
+    s = &pool[npool];
+    s->lock = xSemaphoreCreateMutexStatic(&s->lock_buf);
+    for (i = 0; i < 2; i++) {
+        s->buf[i].data = pool_data[npool][i];
+        s->buf[i].size = CONFIG_SNAPSHOT_SIZE;
+    }
+
+    npool++;
+    s->render = render;
+    return s;
+}
+
+
+static esp_err_t append(void *arg, const char *buf, size_t len)
+{
+    struct snap_buf *b = arg;
+
+    if (b->len + len > b->size)
+        return ESP_ERR_NO_MEM;
+
+    memcpy(b->data + b->len, buf, len);
+    b->len += len;
+    return ESP_OK;
+}
+#else
+struct snapshot *snapshot_alloc(snapshot_render_h *render)
+{
+    struct snapshot *s = mem_zalloc(sizeof(*s));
+
+    if (!s)
+        return NULL;
+
+    s->lock = xSemaphoreCreateMutex();
+    if (!s->lock) {
+        mem_free(s);
+        return NULL;
+    }
+
+    s->render = render;
+    return s;
+}
+
+
+static esp_err_t append(void *arg, const char *buf, size_t len)
+{
+    struct snap_buf *b = arg;
+    size_t size;
+    char *data;
+
+    if (b->len + len > b->size) {
+        size = b->size ? b->size : 4096;
+        while (size < b->len + len)
+            size *= 2;
+
+        data = mem_realloc(b->data, size);
+        if (!data)
+            return ESP_ERR_NO_MEM;
+
+        b->data = data;
+        b->size = size;
+    }
+
+    memcpy(b->data + b->len, buf, len);
+    b->len += len;
+    return ESP_OK;
+}
+#endif
+
+
+static struct snap_buf *acquire(struct snapshot *s, uint32_t g, uint32_t min)
+{
+    struct snap_buf *b;
+
+    portENTER_CRITICAL(&mux);
+    b = s->cur;
+    if (b && b->gen == g && b->minute == min)
+        b->refs++;
+    else
+        b = NULL;
+    portEXIT_CRITICAL(&mux);
+
+    return b;
+}
+
+
+static struct snap_buf *render(struct snapshot *s, uint32_t g, uint32_t min)
+{
+    struct snap_buf *b = s->cur == &s->buf[0] ? &s->buf[1] : &s->buf[0];
+    struct tpl_out o;
+    uint32_t refs;
+
+    portENTER_CRITICAL(&mux);
+    refs = b->refs;
+    portEXIT_CRITICAL(&mux);
+    if (refs)
+        return NULL;
+
+    b->len = 0;
+    tpl_init(&o, append, b);
+    s->render(&o);
+    if (tpl_flush(&o))
+        return NULL;
+
+    snprintf(b->etag, sizeof(b->etag), "\"%08" PRIx32 "\"",
+             esp_crc32_le(0, (const uint8_t *) b->data, b->len));
+    b->gen    = g;
+    b->minute = min;
+
+    portENTER_CRITICAL(&mux);
+    if (s->cur)
+        s->cur->refs--;
+
+    b->refs = 2;
+    s->cur = b;
+    portEXIT_CRITICAL(&mux);
+
+    return b;
+}
+
+
+/* Returns the current snapshot, renders it if the state changed since */
+const struct snap_buf *snapshot_get(struct snapshot *s)
+{
+    uint32_t min = time(NULL) / 60;
+    struct snap_buf *b;
+    uint32_t g;
+
+    portENTER_CRITICAL(&mux);
+    g = gen;
+    portEXIT_CRITICAL(&mux);
+
+    b = acquire(s, g, min);
+    if (b)
+        return b;
+
+    xSemaphoreTake(s->lock, portMAX_DELAY);
+    b = acquire(s, g, min);
+    if (!b)
+        b = render(s, g, min);
+    xSemaphoreGive(s->lock);
+
+    return b;
+}
+
+
+void snapshot_put(struct snapshot *s, const struct snap_buf *b)
+{
+    (void) s;
+
+    portENTER_CRITICAL(&mux);
+    ((struct snap_buf *) b)->refs--;
+    portEXIT_CRITICAL(&mux);
+}
@@ -0,0 +1,25 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+#include <stdint.h>
+#include <stddef.h>
+#include "tpl.h"
+
+/* A rendered response. Valid until snapshot_put(). */
+struct snap_buf {
+    uint32_t refs;
+    uint32_t gen;
+    uint32_t minute;
+    size_t len;
+    size_t size;
+    char etag[12];
+    char *data;
+};
+
+struct snapshot;
+typedef esp_err_t (snapshot_render_h)(struct tpl_out *o);
+
+void snapshot_touch(void);
+struct snapshot *snapshot_alloc(snapshot_render_h *render);
+const struct snap_buf *snapshot_get(struct snapshot *s);
+void snapshot_put(struct snapshot *s, const struct snap_buf *b);
+#endif
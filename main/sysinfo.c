@@ -0,0 +1,105 @@
+/**
+ * @file sysinfo.c  Uptime, reset history and time sync age for monitoring
+ *
+ * The boot counter lives in RTC memory, it counts the resets since the last
+ * power on. A fleet monitor sees a reboot loop as a growing count with a
+ * short uptime. The boot phases are timed for the QEMU benchmark.
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "sysinfo.h"
+
+#define RTC_MAGIC 0x424f4f54
+
+struct rtc_boots {
+    uint32_t magic;
+    uint32_t boots;
+    uint32_t check;
+};
+
+static RTC_NOINIT_ATTR struct rtc_boots rtc;
+static const char *reset_name = "unknown";
+static volatile int64_t last_sync = -1;
+static uint32_t boot_us[BOOT_PHASES];
+
+
+static const char *reason_name(esp_reset_reason_t r)
+{
+    switch (r) {
+    case ESP_RST_POWERON:   return "poweron";
+    case ESP_RST_EXT:       return "ext";
+    case ESP_RST_SW:        return "sw";
+    case ESP_RST_PANIC:     return "panic";
+    case ESP_RST_INT_WDT:   return "int_wdt";
+    case ESP_RST_TASK_WDT:  return "task_wdt";
+    case ESP_RST_WDT:       return "wdt";
+    case ESP_RST_DEEPSLEEP: return "deepsleep";
+    case ESP_RST_BROWNOUT:  return "brownout";
+    default:                return "unknown";
+    }
+}
+
+
+void sysinfo_init(void)
+{
+    esp_reset_reason_t r = esp_reset_reason();
+    bool valid = rtc.magic == RTC_MAGIC && rtc.check == ~rtc.boots;
+
+    if (!valid || r == ESP_RST_POWERON)
+        rtc.boots = 0;
+    else
+        rtc.boots++;
+
+    rtc.magic = RTC_MAGIC;
+    rtc.check = ~rtc.boots;
+    reset_name = reason_name(r);
+}
+
+
+void sysinfo_get(struct sysinfo *si)
+{
+    int64_t now = esp_timer_get_time();
+    int64_t sync = last_sync;
+
+    si->uptime   = now / 1000000;
+    si->boots    = rtc.boots;
+    si->reset    = reset_name;
+    si->sntp_age = sync < 0 ? -1 : (int32_t) ((now - sync) / 1000000);
+    memcpy(si->boot_us, boot_us, sizeof(si->boot_us));
+}
+
+
+/* SNTP sync notification */
+void sysinfo_time_sync(struct timeval *tv)
+{
+    (void) tv;
+    last_sync = esp_timer_get_time();
+}
+
+
+/* Records the end of a boot phase, once */
+void sysinfo_boot(enum boot_phase phase)
+{
+    if (phase >= BOOT_PHASES || boot_us[phase])
+        return;
+
+    boot_us[phase] = (uint32_t) esp_timer_get_time();
+    if (!boot_us[phase])
+        boot_us[phase] = 1;
+}
+
+
+const char *sysinfo_boot_name(enum boot_phase phase)
+{
+    static const char *names[BOOT_PHASES] = {
+        "app", "nvs", "net", "httpd", "ready"
+    };
+
+    return phase < BOOT_PHASES ? names[phase] : "?";
+}
@@ -0,0 +1,29 @@
+#ifndef SYSINFO_H
+#define SYSINFO_H
+#include <stdint.h>
+#include <sys/time.h>
+
+/* Boot phases, time since start of the image */
+enum boot_phase {
+    BOOT_APP,               /* app_main() entered */
+    BOOT_NVS,               /* settings and counters loaded */
+    BOOT_NET,               /* IP address */
+    BOOT_HTTPD,             /* web server listening */
+    BOOT_READY,             /* MQTT, CoAP started, main loop */
+    BOOT_PHASES
+};
+
+struct sysinfo {
+    uint32_t uptime;        /* seconds */
+    uint32_t boots;         /* resets since power on */
+    const char *reset;      /* reason of the last reset */
+    int32_t sntp_age;       /* seconds since the last sync, -1 never */
+    uint32_t boot_us[BOOT_PHASES];  /* 0 not reached yet */
+};
+
+void sysinfo_init(void);
+void sysinfo_get(struct sysinfo *si);
+void sysinfo_time_sync(struct timeval *tv);
+void sysinfo_boot(enum boot_phase phase);
+const char *sysinfo_boot_name(enum boot_phase phase);
+#endif
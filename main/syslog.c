@@ -0,0 +1,320 @@
+/**
+ * @file syslog.c  Log lines to a remote syslog collector (RFC 5424 over UDP)
+ *
+ * syslog_push() copies a line with its time into a backlog ring of
+ * CONFIG_SYSLOG_BACKLOG bytes and never blocks, a full backlog drops its
+ * oldest records. A task of low priority packs the records into datagrams
+ * of at most CONFIG_SYSLOG_DGRAM bytes, one message per line, and sends
+ * them when a datagram is full or every CONFIG_SYSLOG_FLUSH_MS. Records are
+ * taken from the backlog after a successful send only, so they survive a
+ * WiFi outage and drain after the reconnect.
+ *
+ *   <PRI>1 TIMESTAMP HOSTNAME pool - MSGID - MSG
+ *
+ * Facility local0, control events as notice and the rest as info. MSGID is
+ * the source (pool, wifi, net, sys), TIMESTAMP "-" before the time sync.
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
+#include "config.h"
+#include "mem.h"
+#include "syslog.h"
+
+/* collector as host:port, empty disables syslog */
+#ifndef CONFIG_SYSLOG_TARGET
+#define CONFIG_SYSLOG_TARGET ""
+#endif
+
+#ifndef CONFIG_SYSLOG_BACKLOG
+#define CONFIG_SYSLOG_BACKLOG 8192
+#endif
+
+/* payload of a datagram, below the MTU */
+#ifndef CONFIG_SYSLOG_DGRAM
+#define CONFIG_SYSLOG_DGRAM 1400
+#endif
+
+#ifndef CONFIG_SYSLOG_FLUSH_MS
+#define CONFIG_SYSLOG_FLUSH_MS 2000
+#endif
+
+#ifndef CONFIG_MDNS_HOSTNAME
+#define CONFIG_MDNS_HOSTNAME ""
+#endif
+
+#define FACILITY    16      /* local0 */
+#define SEV_NOTICE  5
+#define SEV_INFO    6
+#define TEXT_MAX    480
+#define TARGET_MAX  64
+
+struct rec {
+    int64_t us;             /* since the epoch */
+    uint16_t len;
+    uint8_t src;
+    uint8_t ctrl;
+};
+
+static const char *TAG = "syslog";
+static const char *src_name[LOG_SRCS] = { "pool", "wifi", "net", "sys" };
+
+static uint8_t ring[CONFIG_SYSLOG_BACKLOG];
+static uint32_t head;       /* free running byte offsets */
+static uint32_t tail;
+static struct syslog_stats stats;
+static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t task;
+static char collector[TARGET_MAX];
+static char hostname[32];
+static char dgram[CONFIG_SYSLOG_DGRAM];
+MEM_TASKS(syslog, 4096, 1);
+
+
+static void ring_write(uint32_t off, const void *p, size_t n)
+{
+    size_t i = off % sizeof(ring);
+    size_t part = n < sizeof(ring) - i ? n : sizeof(ring) - i;
+
+    memcpy(ring + i, p, part);
+    memcpy(ring, (const uint8_t *) p + part, n - part);
+}
+
+
+static void ring_read(uint32_t off, void *p, size_t n)
+{
+    size_t i = off % sizeof(ring);
+    size_t part = n < sizeof(ring) - i ? n : sizeof(ring) - i;
+
+    memcpy(p, ring + i, part);
+    memcpy((uint8_t *) p + part, ring, n - part);
+}
+
+
+/* Called from log.c for every stored line */
+void syslog_push(enum log_src src, bool ctrl, const char *text)
+{
+    struct rec r = { .src = src, .ctrl = ctrl };
+    struct timeval tv;
+    bool wake;
+
+    if (!task || src >= LOG_SRCS)
+        return;
+
+    gettimeofday(&tv, NULL);
+    r.us = (int64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+    r.len = strnlen(text, TEXT_MAX);
+
+    portENTER_CRITICAL(&mux);
+    while (sizeof(ring) - (head - tail) < sizeof(r) + r.len) {
+        struct rec old;
+
+        ring_read(tail, &old, sizeof(old));
+        tail += sizeof(old) + old.len;
+        stats.dropped++;
+    }
+
+    ring_write(head, &r, sizeof(r));
+    ring_write(head + sizeof(r), text, r.len);
+    head += sizeof(r) + r.len;
+    wake = head - tail >= CONFIG_SYSLOG_DGRAM;
+    portEXIT_CRITICAL(&mux);
+
+    if (wake)
+        xTaskNotifyGive(task);
+}
+
+
+/* Like snprintf(), returns the length without truncation */
+static size_t format(char *buf, size_t size, const struct rec *r,
+                     const char *text)
+{
+    time_t t = r->us / 1000000;
+    char ts[32] = "-";
+    struct tm tm;
+    int n;
+
+    /* "-" before the time sync */
+    if (t > 1600000000) {
+        gmtime_r(&t, &tm);
+        n = strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", &tm);
+        snprintf(ts + n, sizeof(ts) - n, ".%06dZ", (int) (r->us % 1000000));
+    }
+
+    n = snprintf(buf, size, "<%d>1 %s %s pool - %s - %.*s\n",
+                 FACILITY * 8 + (r->ctrl ? SEV_NOTICE : SEV_INFO), ts,
+                 hostname, src_name[r->src], (int) r->len, text);
+    return n < 0 ? 0 : n;
+}
+
+
+/* Packs records from the tail into dgram, returns the length and the
+ * offset after the last packed record */
+static size_t pack(uint32_t *end, uint32_t *count)
+{
+    char text[TEXT_MAX];
+    struct rec r;
+    uint32_t pos;
+    size_t len = 0;
+    size_t n;
+
+    portENTER_CRITICAL(&mux);
+    pos = tail;
+    portEXIT_CRITICAL(&mux);
+
+    *count = 0;
+    while (true) {
+        portENTER_CRITICAL(&mux);
+        /* the oldest records were pushed out meanwhile */
+        if ((int32_t) (pos - tail) < 0)
+            pos = tail;
+
+        if (pos == head) {
+            portEXIT_CRITICAL(&mux);
+            break;
+        }
+
+        ring_read(pos, &r, sizeof(r));
+        ring_read(pos + sizeof(r), text, r.len);
+        portEXIT_CRITICAL(&mux);
+
+        n = format(dgram + len, sizeof(dgram) - len, &r, text);
+        if (n >= sizeof(dgram) - len) {
+            if (len)
+                break;
+
+            /* a single overlong message is truncated */
+            n = sizeof(dgram);
+            dgram[n - 1] = '\n';
+        }
+
+        len += n;
+        pos += sizeof(r) + r.len;
+        (*count)++;
+    }
+
+    *end = pos;
+    return len;
+}
+
+
+static bool resolve(struct sockaddr_in *sa)
+{
+    struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_DGRAM,
+    };
+    struct addrinfo *res;
+    char host[TARGET_MAX];
+    char *port;
+
+    strlcpy(host, collector, sizeof(host));
+    port = strrchr(host, ':');
+    if (port)
+        *port++ = 0;
+
+    if (getaddrinfo(host, port ? port : "514", &hints, &res) || !res)
+        return false;
+
+    memcpy(sa, res->ai_addr, sizeof(*sa));
+    freeaddrinfo(res);
+    return true;
+}
+
+
+static void syslog_task(void *arg)
+{
+    struct sockaddr_in sa = { 0 };
+    bool resolved = false;
+    uint32_t end, count;
+    size_t len;
+    bool warned = false;
+    int sock = -1;
+    (void) arg;
+
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CONFIG_SYSLOG_FLUSH_MS));
+
+        /* like the resolve, retried every round until it works */
+        if (sock < 0) {
+            sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+            if (sock < 0) {
+                if (!warned)
+                    ESP_LOGE(TAG, "socket failed (%d)", errno);
+
+                warned = true;
+                continue;
+            }
+        }
+
+        if (!resolved)
+            resolved = resolve(&sa);
+
+        /* drain, keep the records on a failed send for the next round */
+        while (resolved && (len = pack(&end, &count)) > 0) {
+            if (sendto(sock, dgram, len, 0, (struct sockaddr *) &sa,
+                       sizeof(sa)) < 0) {
+                portENTER_CRITICAL(&mux);
+                stats.errors++;
+                portEXIT_CRITICAL(&mux);
+                resolved = false;
+                break;
+            }
+
+            portENTER_CRITICAL(&mux);
+            if ((int32_t) (end - tail) > 0)
+                tail = end;
+
+            stats.sent += count;
+            stats.datagrams++;
+            portEXIT_CRITICAL(&mux);
+        }
+    }
+}
+
+
+void syslog_stats(struct syslog_stats *st)
+{
+    portENTER_CRITICAL(&mux);
+    *st = stats;
+    st->backlog = head - tail;
+    portEXIT_CRITICAL(&mux);
+}
+
+
+/* target host:port, NULL for CONFIG_SYSLOG_TARGET, empty disables */
+void syslog_init(const char *target)
+{
+    uint8_t mac[6];
+
+    if (!target)
+        target = CONFIG_SYSLOG_TARGET;
+
+    if (!*target || task)
+        return;
+
+    if (*CONFIG_MDNS_HOSTNAME) {
+        strlcpy(hostname, CONFIG_MDNS_HOSTNAME, sizeof(hostname));
+    }
+    else {
+        esp_read_mac(mac, ESP_MAC_WIFI_STA);
+        snprintf(hostname, sizeof(hostname), "pool-%02x%02x%02x", mac[3],
+                 mac[4], mac[5]);
+    }
+
+    strlcpy(collector, target, sizeof(collector));
+    MEM_TASK_CREATE(syslog, 0, &syslog_task, "syslog", NULL, 1, &task);
+    ESP_LOGI(TAG, "shipping to %s as %s", collector, hostname);
+}
@@ -0,0 +1,18 @@
+#ifndef SYSLOG_H
+#define SYSLOG_H
+#include <stdbool.h>
+#include <stdint.h>
+#include "log.h"
+
+struct syslog_stats {
+    uint32_t sent;          /* records */
+    uint32_t datagrams;
+    uint32_t dropped;       /* oldest records pushed out of the backlog */
+    uint32_t errors;        /* failed sends, kept for the next try */
+    uint32_t backlog;       /* bytes queued */
+};
+
+void syslog_init(const char *target);
+void syslog_push(enum log_src src, bool ctrl, const char *text);
+void syslog_stats(struct syslog_stats *st);
+#endif
@@ -0,0 +1,178 @@
+/**
+ * @file tpl.c  Renderer for the compiled HTML templates
+ *
+ * Output is collected into a buffer of one TCP segment and handed to the
+ * flush handler only when it is full, so a page with many log lines goes
+ * out in a few full-sized writes instead of one chunk per fragment. Nothing
+ * is truncated, larger fragments are split across writes. A single
+ * tpl_printf() larger than the buffer is formatted on the heap, with
+ * CONFIG_STATIC_MEM it fails with ESP_ERR_INVALID_SIZE.
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "mem.h"
+#include "tpl.h"
+
+
+void tpl_init(struct tpl_out *o, tpl_flush_h *flush, void *arg)
+{
+    o->flush = flush;
+    o->arg   = arg;
+    o->err   = ESP_OK;
+    o->len   = 0;
+}
+
+
+esp_err_t tpl_flush(struct tpl_out *o)
+{
+    if (o->len && !o->err)
+        o->err = o->flush(o->arg, o->buf, o->len);
+
+    o->len = 0;
+    return o->err;
+}
+
+
+void tpl_write(struct tpl_out *o, const char *p, size_t len)
+{
+    size_t n;
+
+    while (len && !o->err) {
+        n = sizeof(o->buf) - o->len;
+        if (n > len)
+            n = len;
+
+        memcpy(o->buf + o->len, p, n);
+        o->len += n;
+        p   += n;
+        len -= n;
+        if (o->len == sizeof(o->buf))
+            tpl_flush(o);
+    }
+}
+
+
+void tpl_puts(struct tpl_out *o, const char *s)
+{
+    if (s)
+        tpl_write(o, s, strlen(s));
+}
+
+
+void tpl_escape(struct tpl_out *o, const char *s)
+{
+    const char *e;
+    size_t n;
+
+    if (!s)
+        return;
+
+    while (*s) {
+        n = strcspn(s, "&<>\"");
+        tpl_write(o, s, n);
+        s += n;
+        if (!*s)
+            break;
+
+        e = *s == '&' ? "&amp;" :
+            *s == '<' ? "&lt;" :
+            *s == '>' ? "&gt;" : "&quot;";
+        tpl_puts(o, e);
+        s++;
+    }
+}
+
+
+void tpl_printf(struct tpl_out *o, const char *fmt, ...)
+{
+    size_t space = sizeof(o->buf) - o->len;
+    va_list ap;
+    char *tmp;
+    int n;
+
+    if (o->err)
+        return;
+
+    va_start(ap, fmt);
+    n = vsnprintf(o->buf + o->len, space, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+
+    if ((size_t) n < space) {
+        o->len += n;
+        if (o->len == sizeof(o->buf))
+            tpl_flush(o);
+        return;
+    }
+
+    /* did not fit, start a new segment or format on the heap */
+    if ((size_t) n < sizeof(o->buf)) {
+        tpl_flush(o);
+        if (o->err)
+            return;
+
+        va_start(ap, fmt);
+        vsnprintf(o->buf, sizeof(o->buf), fmt, ap);
+        va_end(ap);
+        o->len = n;
+        return;
+    }
+
+    if (CONFIG_STATIC_MEM) {
+        o->err = ESP_ERR_INVALID_SIZE;
+        return;
+    }
+
+    tmp = mem_alloc(n + 1);
+    if (!tmp) {
+        o->err = ESP_ERR_NO_MEM;
+        return;
+    }
+
+    va_start(ap, fmt);
+    vsnprintf(tmp, n + 1, fmt, ap);
+    va_end(ap);
+    tpl_write(o, tmp, n);
+    mem_free(tmp);
+}
+
+
+esp_err_t tpl_render(struct tpl_out *o, const struct tpl_seg *segs, size_t n,
+                     const void *vals, void *arg)
+{
+    const char *v = vals;
+    const struct tpl_seg *s;
+    tpl_fn *fn;
+    size_t i;
+
+    for (i = 0; i < n && !o->err; i++) {
+        s = &segs[i];
+        switch (s->type) {
+        case TPL_TEXT:
+            tpl_write(o, s->text, s->arg);
+            break;
+        case TPL_STR:
+            tpl_escape(o, *(const char * const *) (v + s->off));
+            break;
+        case TPL_INT:
+            tpl_printf(o, "%d", *(const int *) (v + s->off));
+            break;
+        case TPL_BOOL:
+            if (!*(const bool *) (v + s->off))
+                i += s->arg;
+            break;
+        case TPL_FN:
+            fn = *(tpl_fn * const *) (v + s->off);
+            if (fn)
+                fn(o, arg);
+            break;
+        }
+    }
+
+    return o->err;
+}
@@ -0,0 +1,53 @@
+#ifndef TPL_H
+#define TPL_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <esp_err.h>
+#include "config.h"
+
+/* Payload of one output write, TCP MSS (1440) minus chunk framing */
+#ifndef CONFIG_WEBUI_SEG_SIZE
+#define CONFIG_WEBUI_SEG_SIZE 1432
+#endif
+
+enum tpl_type {
+    TPL_TEXT,           /* arg: length of text */
+    TPL_STR,
+    TPL_INT,
+    TPL_BOOL,           /* arg: segments to skip if false */
+    TPL_FN,
+};
+
+/* One entry of a segment table generated by tools/htmlgen.py */
+struct tpl_seg {
+    uint8_t type;
+    uint16_t arg;
+    uint16_t off;       /* offset of the value in the values struct */
+    const char *text;
+};
+
+typedef esp_err_t (tpl_flush_h)(void *arg, const char *buf, size_t len);
+
+/* Collects output into CONFIG_WEBUI_SEG_SIZE writes. After a failed flush
+ * further output is dropped and err is kept. */
+struct tpl_out {
+    tpl_flush_h *flush;
+    void *arg;
+    esp_err_t err;
+    size_t len;
+    char buf[CONFIG_WEBUI_SEG_SIZE];
+};
+
+typedef void (tpl_fn)(struct tpl_out *o, void *arg);
+
+void tpl_init(struct tpl_out *o, tpl_flush_h *flush, void *arg);
+void tpl_write(struct tpl_out *o, const char *p, size_t len);
+void tpl_puts(struct tpl_out *o, const char *s);
+void tpl_escape(struct tpl_out *o, const char *s);
+void tpl_printf(struct tpl_out *o, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+esp_err_t tpl_flush(struct tpl_out *o);
+esp_err_t tpl_render(struct tpl_out *o, const struct tpl_seg *segs, size_t n,
+                     const void *vals, void *arg);
+#endif
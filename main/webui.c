@@ -6,13 +6,35 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <inttypes.h>
 #include <time.h>
 #include <string.h>
 #include <errno.h>
 #include <esp_log.h>
-#include <nvs_flash.h>
-#include <nvs.h>
+#include <esp_system.h>
+#include <esp_idf_version.h>
+#include <lwip/sockets.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "config.h"
 #include "log.h"
+#include "settings.h"
+#include "counters.h"
+#include "wifi.h"
+#include "tpl.h"
+#include "snapshot.h"
+#include "sysinfo.h"
+#include "schedule.h"
+#include "mem.h"
+#include "memprof.h"
+#include "pool.h"
+#include "cmd.h"
+#include "bench.h"
+#include "syslog.h"
+#include "history.h"
+#include "page_tpl.h"
 #include "webui.h"
 
 #ifndef MIN
@@ -21,112 +43,77 @@
 
 static const char *TAG = "webui";
 
-#define HTML_HEADER \
-"<!DOCTYPE html>\n" \
-"<html>\n" \
-"<header>" \
-"<meta name=\"viewport\" content=\"width=device-width, initial-scale=1\">" \
-"</header>" \
-"<body>\n" \
-"<h2>Pool Saltwater System V1.6</h2>" \
-"<h3>%s</h3>\n" \
-"\n"
-
-#define HTML_FOOTER \
-"\n" \
-"</body>\n" \
-"</html>\n"
-
-#define HTML_INPUT_TIME \
-"<label for=\"stime\">Start time:</label><br>\n" \
-"<input type=\"time\" id=\"stime\" name=\"stime\" min=\"06:00\" max=\"23:00\"" \
-" value=\"%s\" step=\"60\"><br>\n" \
-"  <br>\n" \
-"<label for=\"duration\">Duration: %d h</label><br>\n" \
-"<input type=\"range\" id=\"duration\" name=\"duration\" min=\"1\" max=\"12\"" \
-" value=\"%d\"><br>\n"
-
-#define HTML_FORM1 \
-"" \
-"<form action=\"\" method=\"post\">\n"
-
-
-#define HTML_FORM2 \
-"  <input type=\"submit\" value=\"Ok\"><br>\n" \
-"  <br>\n" \
-"  <br>\n" \
-"  <br>\n" \
-"  <input type=\"radio\" id=\"nocommand\" name=\"command\" checked=\"checked\">\n" \
-"  <label for=\"nocommand\">-- none --</label><br>\n" \
-"  <input type=\"radio\" id=\"upgrade\" name=\"command\" value=\"upgrade\">\n" \
-"  <label for=\"upgrade\">Upgrade</label><br>\n" \
-"  <input type=\"radio\" id=\"reboot\" name=\"command\" value=\"reboot\">\n" \
-"  <label for=\"reboot\">Reboot</label><br>\n" \
-"  <input type=\"radio\" id=\"reset\" name=\"command\" value=\"reset\">\n" \
-"  <label for=\"reset\">Reset</label><br>\n" \
-"  <input type=\"radio\" id=\"wifi\" name=\"command\" value=\"wifi\">\n" \
-"  <label for=\"wifi\">Wifi Scan</label><br>\n" \
-"  <input type=\"radio\" id=\"switch\" name=\"command\" value=\"switch\">\n" \
-"  <label for=\"switch\">Switch Voltage</label><br>\n" \
-"  <br>\n" \
-"  <br>\n" \
-
-
-#define HTML_FORM3 \
-"  <input type=\"radio\" id=\"noforce\" name=\"force\" value=\"none\"%s>\n"\
-"  <label for=\"noforce\">-- none --</label><br>\n"\
-"  <input type=\"radio\" id=\"forceon\" name=\"force\" value=\"on\"%s>\n"\
-"  <label for=\"forceon\">force on</label><br>\n"\
-"  <input type=\"radio\" id=\"forceoff\" name=\"force\" value=\"off\"%s>\n"\
-"  <label for=\"forceoff\">force off</label><br>\n"\
-"</form>\n"
-
-
-#define HTML_LOG \
-"<p></p>" \
-"<p>Log</p>" \
-
-#define BUF_SIZE 512
-
-enum force_run {
-    FORCE_NONE,
-    FORCE_ON,
-    FORCE_OFF
-};
+/* Number of tasks serving long responses */
+#ifndef CONFIG_WEBUI_WORKERS
+#define CONFIG_WEBUI_WORKERS 2
+#endif
+
+/* Open client sockets, at most CONFIG_LWIP_MAX_SOCKETS - 3 */
+#ifndef CONFIG_WEBUI_MAX_SOCKETS
+#define CONFIG_WEBUI_MAX_SOCKETS 7
+#endif
+
+#ifndef CONFIG_WEBUI_BACKLOG
+#define CONFIG_WEBUI_BACKLOG 5
+#endif
+
+/* Stack of the httpd and worker tasks, the page renderer keeps one TCP
+ * segment on the stack */
+#ifndef CONFIG_WEBUI_STACK
+#define CONFIG_WEBUI_STACK 6144
+#endif
+
+/* httpd_req_async_handler_begin() came with 5.1, the minimum version of
+ * idf_component.yml. Older versions serve all requests in the httpd task. */
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 0)
+#define WEBUI_ASYNC 1
+#endif
+
+/* longest log line shown on the page */
+#define LOG_LINE 512
 
 struct webui {
-    int hh;
-    int mm;
-    int duration;
-    bool upgrade;
     bool reboot;
-    bool wifi;
     bool reset;
-    bool switc;
     int dcnt;
     enum force_run force;
 };
 
 static struct webui d;
 
+typedef esp_err_t (*async_handler_t)(httpd_req_t *req);
+
+struct async_req {
+    httpd_req_t *req;
+    async_handler_t handler;
+};
+
+static struct snapshot *page_snap;
+static struct snapshot *status_snap;
+#ifdef WEBUI_ASYNC
+static QueueHandle_t async_queue;
+static SemaphoreHandle_t async_ready;
+MEM_TASKS(worker, CONFIG_WEBUI_STACK, CONFIG_WEBUI_WORKERS);
+#endif
+
 static time_t current_time(void);
 
 
-static void init_hh_mm(void)
+/* Current time as start, the form default of an unset schedule */
+static void now_hh_mm(struct settings *s)
 {
     time_t cur = current_time();
     struct tm tm;
 
     localtime_r(&cur, &tm);
-    d.hh = tm.tm_hour;
-    d.mm = tm.tm_min;
+    s->hh = tm.tm_hour;
+    s->mm = tm.tm_min;
 }
 
 
-static esp_err_t send_chunk(httpd_req_t *req, const char *str)
+static esp_err_t chunk_flush(void *arg, const char *buf, size_t len)
 {
-    size_t s = strlen(str);
-    return httpd_resp_send_chunk(req, str, s);
+    return httpd_resp_send_chunk(arg, buf, len);
 }
 
 
@@ -142,108 +129,401 @@ void str_current_time(char *buf, size_t size)
 }
 
 
-static esp_err_t send_html(httpd_req_t *req)
+static void put_hist(struct tpl_out *o, const uint32_t *hist)
+{
+    int i;
+
+    for (i = 0; i < WIFI_HIST_BUCKETS; i++)
+        tpl_printf(o, "%s%" PRIu32, i ? "/" : "", hist[i]);
+}
+
+
+static void put_reconnects(struct tpl_out *o, void *arg)
+{
+    const struct wifi_hist *hist = wifi_reconnect_hist();
+    (void) arg;
+
+    tpl_puts(o, "<p>Wifi reconnects fast ");
+    put_hist(o, hist->fast);
+    tpl_puts(o, " full ");
+    put_hist(o, hist->full);
+    tpl_puts(o, " (&lt;0.25/0.5/1/2/4/8/16/more s)</p>");
+}
+
+
+static void put_scan(struct tpl_out *o, void *arg)
 {
-    char  buf[BUF_SIZE];
+    struct wifi_ap aps[WIFI_SCAN_MAX];
+    char ts[10];
+    time_t when;
+    size_t i, n;
+    struct tm tm;
+    (void) arg;
+
+    n = wifi_scan_get(aps, WIFI_SCAN_MAX, &when);
+    if (!n)
+        return;
+
+    strftime(ts, sizeof(ts), "%H:%M", localtime_r(&when, &tm));
+    tpl_printf(o, "<p>Wifi scan %s</p>", ts);
+    for (i = 0; i < n; i++) {
+        tpl_puts(o, "<p>");
+        tpl_escape(o, aps[i].ssid);
+        tpl_printf(o, " ch %u rssi %d</p>", aps[i].channel, aps[i].rssi);
+    }
+}
+
+
+static void put_counters(struct tpl_out *o, void *arg)
+{
+    int i;
+    (void) arg;
+
+    tpl_puts(o, "<p>Counters:");
+    for (i = 0; i < CNT_MAX; i++)
+        tpl_printf(o, "%s %s %" PRIu32, i ? "," : "", counters_name(i),
+                   counters_get(i));
+
+    tpl_puts(o, "</p>");
+}
+
+
+static void put_log(struct tpl_out *o, void *arg)
+{
+    char line[LOG_LINE];
+    struct log_iter it;
+    (void) arg;
+
+    log_iter_init(&it);
+    while (log_next(&it, line, sizeof(line))) {
+        tpl_puts(o, "<p>");
+        tpl_escape(o, line);
+        tpl_puts(o, "</p>");
+    }
+}
+
+
+/* The page, served clears the one-shot reset notice */
+static esp_err_t put_page(struct tpl_out *o, bool served)
+{
+    struct page_vals v = {
+        .log      = put_log,
+        .scan     = put_scan,
+        .hist     = put_reconnects,
+        .counters = put_counters,
+    };
     char ctime[10] = {0};
     char stime[10];
-    const char *logl;
-    const char *checked = " checked=\"checked\"";
-    esp_err_t err;
+    struct settings set;
 
-    if (!d.hh && !d.mm)
-        init_hh_mm();
+    settings_get(&set);
+    /* shown only, a GET does not write the settings */
+    if (!set.hh && !set.mm)
+        now_hh_mm(&set);
 
     str_current_time(ctime, sizeof ctime);
-    snprintf(buf, sizeof(buf), HTML_HEADER, ctime);
-    err  = send_chunk(req, buf);
-
-    if (!d.reboot && !d.upgrade) {
-        err  = send_chunk(req, HTML_FORM1);
-        snprintf(stime, sizeof(stime), "%02d:%02d", d.hh, d.mm);
-        snprintf(buf, sizeof(buf), HTML_INPUT_TIME, stime, d.duration,
-                 d.duration);
-        err |= send_chunk(req, buf);
-        err |= send_chunk(req, HTML_FORM2);
-
-        snprintf(buf, sizeof(buf), HTML_FORM3,
-                 d.force == FORCE_NONE ? checked : "",
-                 d.force == FORCE_ON   ? checked : "",
-                 d.force == FORCE_OFF  ? checked : "");
-
-        err |= send_chunk(req, buf);
+    snprintf(stime, sizeof(stime), "%02d:%02d", (int) set.hh, (int) set.mm);
+    v.ctime      = ctime;
+    v.form       = !d.reboot && !cmd_pending(CMD_UPGRADE);
+    v.stime      = stime;
+    v.duration   = set.duration;
+    v.force_none = d.force == FORCE_NONE;
+    v.force_on   = d.force == FORCE_ON;
+    v.force_off  = d.force == FORCE_OFF;
+    v.state      = cmd_pending(CMD_UPGRADE) ? "Upgrading..." :
+                   webui_check_time() ? "Running" : "Sleeping";
+    v.notice_on  = d.reboot || d.reset;
+    v.notice     = d.reboot ? "Reboot" : "Reset";
+    v.scanning   = cmd_pending(CMD_WIFI_SCAN) || wifi_scan_running();
+
+    /* the reset notice is shown once */
+    if (served && d.reset) {
+        d.reset = false;
+        snapshot_touch();
     }
 
-    err |= send_chunk(req, HTML_LOG);
+    return tpl_render(o, page_tpl, sizeof(page_tpl) / sizeof(page_tpl[0]),
+                      &v, NULL);
+}
 
-    log_rewind();
-    logl = logr();
-    while (logl) {
-        snprintf(buf, sizeof(buf), "<p>%s</p>", logl);
-        err |= send_chunk(req, buf);
-        logl = logr();
+
+static esp_err_t render_page(struct tpl_out *o)
+{
+    return put_page(o, true);
+}
+
+
+static void put_json_str(struct tpl_out *o, const char *s)
+{
+    size_t n;
+
+    tpl_puts(o, "\"");
+    while (*s) {
+        n = strcspn(s, "\"\\\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b"
+                    "\x0c\x0d\x0e\x0f\x10\x11\x12\x13\x14\x15\x16\x17\x18"
+                    "\x19\x1a\x1b\x1c\x1d\x1e\x1f");
+        tpl_write(o, s, n);
+        s += n;
+        if (!*s)
+            break;
+
+        if (*s == '"' || *s == '\\')
+            tpl_printf(o, "\\%c", *s);
+        else
+            tpl_printf(o, "\\u%04x", (unsigned char) *s);
+        s++;
     }
 
-    if (snprintf(buf, sizeof(buf), "<p>%s ...</p>", d.upgrade ? "Upgrading..." :
-                webui_check_time() ? "Running" : "Sleeping") > 0)
-        err |= send_chunk(req, buf);
+    tpl_puts(o, "\"");
+}
+
 
-    if ((d.reboot || d.reset ) && snprintf(buf, sizeof(buf), "<p>%s ...</p>",
-                d.reboot ? "Reboot" :
-                d.reset ? "Reset" : "") > 0)
-        err |= send_chunk(req, buf);
+static void put_json_hist(struct tpl_out *o, const uint32_t *hist)
+{
+    int i;
 
-    d.reset = false;
-    if (d.wifi && snprintf(buf, sizeof(buf), "<p>Wifi scan ...</p>") > 0)
-        err |= send_chunk(req, buf);
+    for (i = 0; i < WIFI_HIST_BUCKETS; i++)
+        tpl_printf(o, "%s%" PRIu32, i ? "," : "", hist[i]);
+}
+
+
+/* JSON twin of the status page */
+static esp_err_t render_status(struct tpl_out *o)
+{
+    static const char *force[] = { "none", "on", "off" };
+    const struct wifi_hist *hist = wifi_reconnect_hist();
+    char line[LOG_LINE];
+    char ctime[10] = {0};
+    struct log_iter it;
+    struct settings set;
+    struct pool_state ps;
+    struct sysinfo si;
+    struct syslog_stats sl;
+    struct hist_stats hs;
+    uint32_t repeated;
+    uint32_t dropped;
+    bool first = true;
+    int i;
+
+    settings_get(&set);
+    str_current_time(ctime, sizeof(ctime));
+    tpl_printf(o, "{\"time\":\"%s\",\"start\":\"%02d:%02d\",\"duration\":%d,"
+               "\"force\":\"%s\",\"state\":\"%s\",\"scanning\":%s",
+               ctime, (int) set.hh, (int) set.mm, (int) set.duration,
+               force[d.force], cmd_pending(CMD_UPGRADE) ? "upgrading" :
+               webui_check_time() ? "running" : "sleeping",
+               cmd_pending(CMD_WIFI_SCAN) || wifi_scan_running() ?
+               "true" : "false");
+
+    /* for fleet monitoring, as fresh as the snapshot (one minute) */
+    pool_get_state(&ps);
+    sysinfo_get(&si);
+    tpl_printf(o, ",\"powered\":%s,\"flow\":%s,\"flow_rate\":%" PRId32
+               ",\"cutoff_ns\":%" PRIu32 ",\"fan\":%d,\"cell_ma\":%" PRId32
+               ",\"balance\":%" PRId32 ",\"cl2_g\":%" PRIu32
+               ",\"uptime\":%" PRIu32 ",\"boots\":%" PRIu32
+               ",\"reset\":\"%s\",\"sntp\":%d",
+               ps.powered ? "true" : "false", ps.flow_ok ? "true" : "false",
+               ps.flow_rate, ps.cutoff_ns, ps.fan, ps.cell.ma,
+               ps.cell.balance, ps.cell.cl2_g, si.uptime, si.boots,
+               si.reset, (int) si.sntp_age);
+
+    tpl_puts(o, ",\"boot_us\":{");
+    for (i = 0; i < BOOT_PHASES; i++) {
+        tpl_puts(o, i ? "," : "");
+        put_json_str(o, sysinfo_boot_name(i));
+        tpl_printf(o, ":%" PRIu32, si.boot_us[i]);
+    }
+
+    tpl_puts(o, "},\"reconnects\":{\"fast\":[");
+    put_json_hist(o, hist->fast);
+    tpl_puts(o, "],\"full\":[");
+    put_json_hist(o, hist->full);
+    tpl_puts(o, "]},\"counters\":{");
+    for (i = 0; i < CNT_MAX; i++) {
+        tpl_puts(o, i ? "," : "");
+        put_json_str(o, counters_name(i));
+        tpl_printf(o, ":%" PRIu32, counters_get(i));
+    }
+
+    log_stats(&repeated, &dropped);
+    syslog_stats(&sl);
+    history_stats(&hs);
+    tpl_printf(o, "},\"syslog\":{\"sent\":%" PRIu32 ",\"datagrams\":%" PRIu32
+               ",\"dropped\":%" PRIu32 ",\"errors\":%" PRIu32
+               ",\"backlog\":%" PRIu32 "}", sl.sent, sl.datagrams, sl.dropped,
+               sl.errors, sl.backlog);
+    tpl_printf(o, ",\"history\":{\"first\":%" PRIu32 ",\"next\":%" PRIu32
+               ",\"slots\":%" PRIu32 ",\"dropped\":%" PRIu32 "}", hs.first,
+               hs.next, hs.slots, hs.dropped);
+    tpl_printf(o, ",\"log_repeated\":%" PRIu32 ",\"log_dropped\":%" PRIu32
+               ",\"log\":[", repeated, dropped);
+    log_iter_init(&it);
+    while (log_next(&it, line, sizeof(line))) {
+        tpl_puts(o, first ? "" : ",");
+        put_json_str(o, line);
+        first = false;
+    }
+
+    tpl_puts(o, "]}");
+    return o->err;
+}
+
+
+/* Sends the snapshot of the current state with Content-Length and ETag, or
+ * 304 if the client has it already. Renders live if no buffer is free. */
+static esp_err_t send_snapshot(httpd_req_t *req, struct snapshot *s,
+                               snapshot_render_h *render)
+{
+    const struct snap_buf *b = s ? snapshot_get(s) : NULL;
+    char etag[sizeof(b->etag)];
+    struct tpl_out o;
+    esp_err_t err;
+
+    if (!b) {
+        tpl_init(&o, chunk_flush, req);
+        render(&o);
+        tpl_flush(&o);
+        return o.err ? o.err : httpd_resp_send_chunk(req, NULL, 0);
+    }
 
-    err |= send_chunk(req, HTML_FOOTER);
-    err |= send_chunk(req, "");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    httpd_resp_set_hdr(req, "ETag", b->etag);
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", etag,
+                                    sizeof(etag)) == ESP_OK &&
+            !strcmp(etag, b->etag)) {
+        httpd_resp_set_status(req, "304 Not Modified");
+        err = httpd_resp_send(req, NULL, 0);
+    }
+    else {
+        err = httpd_resp_send(req, b->data, b->len);
+    }
+
+    snapshot_put(s, b);
     return err;
 }
 
 
-/* HTTP GET handler */
-static esp_err_t handle_get(httpd_req_t *req)
+static esp_err_t send_html(httpd_req_t *req)
 {
-    char*  buf;
-    size_t buf_len;
+    return send_snapshot(req, page_snap, render_page);
+}
 
-    buf_len = httpd_req_get_hdr_value_len(req, "Host") + 1;
-    if (buf_len > 1) {
-        buf = malloc(buf_len);
-        /* Copy null terminated value string into buffer */
-        if (httpd_req_get_hdr_value_str(req, "Host", buf, buf_len) == ESP_OK) {
-            ESP_LOGI(TAG, "Found header => Host: %s", buf);
-        }
-        free(buf);
+
+static esp_err_t send_status_json(httpd_req_t *req)
+{
+    httpd_resp_set_type(req, "application/json");
+    return send_snapshot(req, status_snap, render_status);
+}
+
+
+#ifdef WEBUI_ASYNC
+static void async_worker(void *arg)
+{
+    struct async_req ar;
+    (void) arg;
+
+    while (true) {
+        xSemaphoreGive(async_ready);
+        if (xQueueReceive(async_queue, &ar, portMAX_DELAY) != pdTRUE)
+            continue;
+
+        ar.handler(ar.req);
+        httpd_req_async_handler_complete(ar.req);
     }
+}
+#endif
 
-    buf_len = httpd_req_get_url_query_len(req) + 1;
-    if (buf_len > 1) {
-        buf = malloc(buf_len);
-        if (httpd_req_get_url_query_str(req, buf, buf_len) == ESP_OK) {
-            ESP_LOGI(TAG, "Found URL query => %s", buf);
-            char param[32];
-            /* Get value of expected key from query string */
-            if (httpd_query_key_value(buf, "query1", param, sizeof(param)) == ESP_OK) {
-                ESP_LOGI(TAG, "Found URL query parameter => query1=%s", param);
-            }
-            if (httpd_query_key_value(buf, "query3", param, sizeof(param)) == ESP_OK) {
-                ESP_LOGI(TAG, "Found URL query parameter => query3=%s", param);
-            }
-            if (httpd_query_key_value(buf, "query2", param, sizeof(param)) == ESP_OK) {
-                ESP_LOGI(TAG, "Found URL query parameter => query2=%s", param);
-            }
+
+static void async_init(void)
+{
+#ifdef WEBUI_ASYNC
+    int i;
+
+    if (async_queue)
+        return;
+
+#if CONFIG_STATIC_MEM
+    static uint8_t qbuf[CONFIG_WEBUI_WORKERS * sizeof(struct async_req)];
+    static StaticQueue_t qstat;
+    static StaticSemaphore_t sstat;
+
+    async_queue = xQueueCreateStatic(CONFIG_WEBUI_WORKERS,
+                                     sizeof(struct async_req), qbuf, &qstat);
+    async_ready = xSemaphoreCreateCountingStatic(CONFIG_WEBUI_WORKERS, 0,
+                                                 &sstat);
+#else
+    async_queue = xQueueCreate(CONFIG_WEBUI_WORKERS, sizeof(struct async_req));
+    async_ready = xSemaphoreCreateCounting(CONFIG_WEBUI_WORKERS, 0);
+#endif
+    for (i = 0; i < CONFIG_WEBUI_WORKERS; i++)
+        MEM_TASK_CREATE(worker, i, &async_worker, "webui_worker", NULL, 5,
+                        NULL);
+#else
+    ESP_LOGW(TAG, "IDF older than 5.1, long responses block the httpd task");
+#endif
+}
+
+
+/* Passes the request to an idle worker task, so that a slow client does not
+ * block the httpd task. If all workers are busy the request is served
+ * synchronously. */
+static esp_err_t submit_async(httpd_req_t *req, async_handler_t handler)
+{
+#ifdef WEBUI_ASYNC
+    struct async_req ar = { .handler = handler };
+
+    if (async_ready && xSemaphoreTake(async_ready, 0) == pdTRUE) {
+        if (httpd_req_async_handler_begin(req, &ar.req) == ESP_OK) {
+            if (xQueueSend(async_queue, &ar, 0) == pdTRUE)
+                return ESP_OK;
+
+            httpd_req_async_handler_complete(ar.req);
         }
-        free(buf);
+
+        xSemaphoreGive(async_ready);
     }
+#endif
+    return handler(req);
+}
 
+
+static esp_err_t send_page(httpd_req_t *req)
+{
     send_html(req);
     return ESP_OK;
 }
 
 
+/* HTTP GET handler */
+static esp_err_t handle_get(httpd_req_t *req)
+{
+    char buf[128];
+
+    /* Copy null terminated value string into buffer */
+    if (httpd_req_get_hdr_value_str(req, "Host", buf, sizeof(buf)) == ESP_OK) {
+        ESP_LOGI(TAG, "Found header => Host: %s", buf);
+    }
+
+    if (httpd_req_get_url_query_str(req, buf, sizeof(buf)) == ESP_OK) {
+        ESP_LOGI(TAG, "Found URL query => %s", buf);
+        char param[32];
+        /* Get value of expected key from query string */
+        if (httpd_query_key_value(buf, "query1", param, sizeof(param)) == ESP_OK) {
+            ESP_LOGI(TAG, "Found URL query parameter => query1=%s", param);
+        }
+        if (httpd_query_key_value(buf, "query3", param, sizeof(param)) == ESP_OK) {
+            ESP_LOGI(TAG, "Found URL query parameter => query3=%s", param);
+        }
+        if (httpd_query_key_value(buf, "query2", param, sizeof(param)) == ESP_OK) {
+            ESP_LOGI(TAG, "Found URL query parameter => query2=%s", param);
+        }
+    }
+
+    return submit_async(req, send_page);
+}
+
+
 static const httpd_uri_t get_handler = {
     .uri       = "/",
     .method    = HTTP_GET,
@@ -252,6 +532,222 @@ static const httpd_uri_t get_handler = {
 };
 
 
+/* GET /scan, cached scan results as JSON */
+static esp_err_t send_scan_json(httpd_req_t *req)
+{
+    struct wifi_ap aps[WIFI_SCAN_MAX];
+    struct tpl_out o;
+    time_t when;
+    size_t i, n;
+
+    n = wifi_scan_get(aps, WIFI_SCAN_MAX, &when);
+    httpd_resp_set_type(req, "application/json");
+    tpl_init(&o, chunk_flush, req);
+    tpl_printf(&o, "{\"time\":%lld,\"running\":%s,\"aps\":[",
+               (long long) (n ? when : 0),
+               wifi_scan_running() ? "true" : "false");
+    for (i = 0; i < n; i++) {
+        tpl_puts(&o, i ? ",{\"ssid\":" : "{\"ssid\":");
+        put_json_str(&o, aps[i].ssid);
+        tpl_printf(&o, ",\"bssid\":\"%02x:%02x:%02x:%02x:%02x:%02x\","
+                   "\"channel\":%u,\"rssi\":%d,\"auth\":%d}",
+                   aps[i].bssid[0], aps[i].bssid[1], aps[i].bssid[2],
+                   aps[i].bssid[3], aps[i].bssid[4], aps[i].bssid[5],
+                   aps[i].channel, aps[i].rssi, aps[i].authmode);
+    }
+
+    tpl_puts(&o, "]}");
+    tpl_flush(&o);
+    return o.err ? o.err : httpd_resp_send_chunk(req, NULL, 0);
+}
+
+
+static esp_err_t handle_scan(httpd_req_t *req)
+{
+    return submit_async(req, send_scan_json);
+}
+
+
+static const httpd_uri_t scan_handler = {
+    .uri       = "/scan",
+    .method    = HTTP_GET,
+    .handler   = handle_scan,
+    .user_ctx  = NULL
+};
+
+
+static esp_err_t handle_status_json(httpd_req_t *req)
+{
+    return submit_async(req, send_status_json);
+}
+
+
+static const httpd_uri_t status_json_handler = {
+    .uri       = "/status.json",
+    .method    = HTTP_GET,
+    .handler   = handle_status_json,
+    .user_ctx  = NULL
+};
+
+
+/* GET /mem.json, stack high-water marks and heap per capability over time,
+ * oldest sample first */
+static esp_err_t send_mem_json(httpd_req_t *req)
+{
+    struct memprof_task tasks[MEMPROF_TASKS];
+    struct memprof_sample s;
+    struct mem_stats st;
+    struct tpl_out o;
+    size_t i, j, n;
+
+    mem_get(&st);
+    n = memprof_tasks(tasks, MEMPROF_TASKS);
+    httpd_resp_set_type(req, "application/json");
+    tpl_init(&o, chunk_flush, req);
+    tpl_printf(&o, "{\"interval\":%" PRIu32 ",\"late_allocs\":%" PRIu32
+               ",\"late_bytes\":%" PRIu32 ",\"tasks\":[",
+               memprof_interval(), st.late_allocs, st.late_bytes);
+    for (i = 0; i < n; i++) {
+        tpl_puts(&o, i ? ",{\"name\":" : "{\"name\":");
+        put_json_str(&o, tasks[i].name);
+        tpl_printf(&o, ",\"stack\":%" PRIu32 "}", tasks[i].stack);
+    }
+
+    tpl_puts(&o, "],\"caps\":[");
+    for (i = 0; i < MEMPROF_CAPS; i++)
+        tpl_printf(&o, "%s\"%s\"", i ? "," : "", memprof_cap_name(i));
+
+    tpl_puts(&o, "],\"samples\":[");
+    for (i = 0; memprof_get(i, &s); i++) {
+        tpl_printf(&o, "%s{\"t\":%" PRIu32 ",\"heap\":[", i ? "," : "",
+                   s.uptime);
+        for (j = 0; j < MEMPROF_CAPS; j++)
+            tpl_printf(&o, "%s[%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%u]",
+                       j ? "," : "", s.heap[j].free, s.heap[j].largest,
+                       s.heap[j].min, memprof_frag(&s.heap[j]));
+
+        tpl_puts(&o, "],\"hwm\":[");
+        for (j = 0; j < n; j++)
+            tpl_printf(&o, "%s%u", j ? "," : "", s.hwm[j]);
+
+        tpl_puts(&o, "]}");
+    }
+
+    tpl_puts(&o, "]}");
+    tpl_flush(&o);
+    return o.err ? o.err : httpd_resp_send_chunk(req, NULL, 0);
+}
+
+
+static esp_err_t handle_mem_json(httpd_req_t *req)
+{
+    return submit_async(req, send_mem_json);
+}
+
+
+static const httpd_uri_t mem_json_handler = {
+    .uri       = "/mem.json",
+    .method    = HTTP_GET,
+    .handler   = handle_mem_json,
+    .user_ctx  = NULL
+};
+
+
+/* GET /cmd.json, state of the last commands, newest first */
+static esp_err_t handle_cmd_json(httpd_req_t *req)
+{
+    struct cmd_result r;
+    struct tpl_out o;
+    uint32_t id = cmd_last();
+    bool first = true;
+    int i;
+
+    httpd_resp_set_type(req, "application/json");
+    tpl_init(&o, chunk_flush, req);
+    tpl_printf(&o, "{\"last\":%" PRIu32 ",\"commands\":[", id);
+    for (i = 0; i < CMD_RESULTS && id; i++, id--) {
+        if (!cmd_result(id, &r))
+            continue;
+
+        tpl_printf(&o, "%s{\"id\":%" PRIu32 ",\"cmd\":\"%s\",\"arg\":%"
+                   PRId32 ",\"state\":\"%s\",\"err\":%" PRId32
+                   ",\"latency_us\":%" PRIu32 "}", first ? "" : ",", r.id,
+                   cmd_name(r.type), r.arg, cmd_state_name(r.state), r.err,
+                   r.latency);
+        first = false;
+    }
+
+    tpl_puts(&o, "]}");
+    tpl_flush(&o);
+    return o.err ? o.err : httpd_resp_send_chunk(req, NULL, 0);
+}
+
+
+static const httpd_uri_t cmd_json_handler = {
+    .uri       = "/cmd.json",
+    .method    = HTTP_GET,
+    .handler   = handle_cmd_json,
+    .user_ctx  = NULL
+};
+
+
+/* GET /export?from=t&to=t&series=telemetry|journal&offset=n, records of
+ * the history in a time range (unix time) as stored, see history.c */
+static esp_err_t send_export(httpd_req_t *req)
+{
+    struct hist_query q = {0};
+    char query[96];
+    char val[16];
+    esp_err_t err;
+
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+        if (httpd_query_key_value(query, "from", val, sizeof(val)) == ESP_OK)
+            q.from = strtoul(val, NULL, 10);
+        if (httpd_query_key_value(query, "to", val, sizeof(val)) == ESP_OK)
+            q.to = strtoul(val, NULL, 10);
+        if (httpd_query_key_value(query, "offset", val, sizeof(val)) == ESP_OK)
+            q.offset = strtoul(val, NULL, 10);
+        if (httpd_query_key_value(query, "series", val, sizeof(val)) == ESP_OK) {
+            if (!strcmp(val, "telemetry"))
+                q.types = 1 << HIST_SAMPLE;
+            else if (!strcmp(val, "journal"))
+                q.types = 1 << HIST_EVENT;
+            else if (strcmp(val, "all"))
+                return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST,
+                                           "unknown series");
+        }
+    }
+
+    httpd_resp_set_type(req, HTTPD_TYPE_OCTET);
+    err = history_export(&q, chunk_flush, req);
+    if (err == ESP_ERR_NOT_FOUND)
+        return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "no history");
+    if (err == ESP_ERR_INVALID_STATE) {
+        /* busy, the client retries */
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        httpd_resp_set_type(req, "text/plain");
+        httpd_resp_set_hdr(req, "Retry-After", "1");
+        return httpd_resp_send(req, "export running", HTTPD_RESP_USE_STRLEN);
+    }
+
+    return err ? err : httpd_resp_send_chunk(req, NULL, 0);
+}
+
+
+static esp_err_t handle_export(httpd_req_t *req)
+{
+    return submit_async(req, send_export);
+}
+
+
+static const httpd_uri_t export_handler = {
+    .uri       = "/export",
+    .method    = HTTP_GET,
+    .handler   = handle_export,
+    .user_ctx  = NULL
+};
+
+
 static int body_value(char *val, size_t vlen, const char *body, const char *key)
 {
     size_t klen;
@@ -293,7 +789,7 @@ static time_t current_time(void)
 }
 
 
-static int convert_time(const char *stime)
+static int convert_time(struct settings *s, const char *stime)
 {
     struct tm tm;
     time_t time;
@@ -306,44 +802,12 @@ static int convert_time(const char *stime)
     if (sscanf(stime, "%d%%3A%d", &tm.tm_hour, &tm.tm_min) <= 0)
 	return EINVAL;
 
-    d.hh = tm.tm_hour;
-    d.mm = tm.tm_min;
+    s->hh = tm.tm_hour;
+    s->mm = tm.tm_min;
     return 0;
 }
 
 
-static int open_nvs(nvs_handle_t *nvs)
-{
-    int err;
-
-    err = nvs_open("storage", NVS_READWRITE, nvs);
-    if (err)
-        printf("Error (%s) opening NVS handle!\n", esp_err_to_name(err));
-
-    return err;
-}
-
-
-static void write_settings()
-{
-    nvs_handle_t nvs;
-    int err;
-
-    err = open_nvs(&nvs);
-    if (err)
-        return;
-
-    err  = nvs_set_i32(nvs, "time_hh", d.hh);
-    err |= nvs_set_i32(nvs, "time_mm", d.mm);
-    err |= nvs_set_i32(nvs, "duration", d.duration);
-    err |= nvs_commit(nvs);
-    nvs_close(nvs);
-    if (err) {
-        printf("Error (%s) could not update NVS.\n", esp_err_to_name(err));
-    }
-}
-
-
 /* An HTTP POST handler */
 static esp_err_t handle_post(httpd_req_t *req)
 {
@@ -351,6 +815,7 @@ static esp_err_t handle_post(httpd_req_t *req)
     int ret, remaining = req->content_len;
     char stime[10] = {0};
     char dur[10] = {0};
+    struct settings set;
     int err;
 
     while (remaining > 0) {
@@ -374,7 +839,7 @@ static esp_err_t handle_post(httpd_req_t *req)
         ESP_LOGI(TAG, "====================================");
         buf[sizeof(buf)-1]=0;
         if (strstr(buf, "command=upgrade")) {
-            d.upgrade = true;
+            webui_request_upgrade();
         }
         else if (strstr(buf, "command=reboot")) {
             ESP_LOGI(TAG, "=========== Reboot ==========");
@@ -383,51 +848,52 @@ static esp_err_t handle_post(httpd_req_t *req)
         }
         else if (strstr(buf, "command=reset")) {
             ESP_LOGI(TAG, "=========== Reset ==========");
-            init_hh_mm();
-            d.duration = 3;
+            settings_reset();
+            settings_get(&set);
+            now_hh_mm(&set);
+            settings_set(&set);
             d.reset=true;
-            ESP_ERROR_CHECK(nvs_flash_erase());
         }
         else if (strstr(buf, "command=wifi")) {
             ESP_LOGI(TAG, "=========== Wifi scan ==========");
-            d.wifi = true;
-            logw("command=wifi");
+            webui_request_wifi_scan();
         }
         else if (strstr(buf, "command=switch")) {
             ESP_LOGI(TAG, "=========== Switch Voltage ==========");
-            d.switc = true;
-            logw("command=switch");
+            webui_request_switch();
         }
         else if (d.force && strstr(buf, "force=none")) {
             ESP_LOGI(TAG, "=========== Force none ==========");
-            d.force = FORCE_NONE;
+            webui_request_force(FORCE_NONE);
         }
         else if (strstr(buf, "force=on")) {
             ESP_LOGI(TAG, "=========== Force on ==========");
-            d.force = FORCE_ON;
+            webui_request_force(FORCE_ON);
         }
         else if (strstr(buf, "force=off")) {
             ESP_LOGI(TAG, "=========== Force off ==========");
-            d.force = FORCE_OFF;
+            webui_request_force(FORCE_OFF);
         }
         else {
             if (body_value(stime, sizeof(stime), buf, "stime")) {
-                logw("Could not parse stime");
+                logs(LOG_SRC_NET, "Could not parse stime");
             }
             else if (body_value(dur, sizeof(dur), buf, "duration")) {
-                logw("Could not parse duration");
+                logs(LOG_SRC_NET, "Could not parse duration");
             } else {
-                d.duration = atoi(dur);
-                err = convert_time(stime);
+                settings_get(&set);
+                set.duration = atoi(dur);
+                err = convert_time(&set, stime);
                 if (!err)
-                    write_settings();
+                    settings_set(&set);
             }
         }
     }
 
+    snapshot_touch();
+
     // Send response
-    send_html(req);
-    return ESP_OK;
+    return submit_async(req, send_page);
 }
 
 static const httpd_uri_t post_handler = {
@@ -438,46 +904,129 @@ static const httpd_uri_t post_handler = {
 };
 
 
-static void read_settings()
+#if CONFIG_POOL_BENCH
+static struct tpl_out bench_out;
+
+static esp_err_t bench_discard(void *arg, const char *buf, size_t len)
 {
-    nvs_handle_t nvs;
-    int err;
+    (void) arg;
+    return ESP_OK;
+}
 
-    err = open_nvs(&nvs);
-    if (err) {
-        init_hh_mm();
-        d.duration = 3;
-        return;
-    }
 
-    err  = nvs_get_i32(nvs, "time_hh", &d.hh);
-    err |= nvs_get_i32(nvs, "time_mm", &d.mm);
-    if (err) {
-        printf("Error (%s) time not set.\n", esp_err_to_name(err));
-        init_hh_mm();
-    }
+static void bench_page(void *arg)
+{
+    (void) arg;
 
-    err = nvs_get_i32(nvs, "duration", &d.duration);
-    if (err) {
-        printf("Error (%s) duration not set.\n", esp_err_to_name(err));
-        d.duration = 3;
+    /* without the side effects of a served page */
+    tpl_init(&bench_out, bench_discard, NULL);
+    put_page(&bench_out, false);
+    tpl_flush(&bench_out);
+}
+
+
+static void bench_status(void *arg)
+{
+    (void) arg;
+
+    tpl_init(&bench_out, bench_discard, NULL);
+    render_status(&bench_out);
+    tpl_flush(&bench_out);
+}
+
+
+static void bench_form(void *arg)
+{
+    static const char body[] = "stime=07%3A30&duration=123";
+    char stime[10] = {0};
+    char dur[10] = {0};
+    (void) arg;
+
+    body_value(stime, sizeof(stime), body, "stime");
+    body_value(dur, sizeof(dur), body, "duration");
+}
+
+
+/* GET /bench?name=x&runs=n, microbenchmarks in CPU cycles */
+static esp_err_t send_bench(httpd_req_t *req)
+{
+    char query[64];
+    char name[24] = "";
+    char runs[8] = "";
+    struct tpl_out o;
+    esp_err_t err;
+
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+        httpd_query_key_value(query, "name", name, sizeof(name));
+        httpd_query_key_value(query, "runs", runs, sizeof(runs));
     }
 
-    logw("%s read %02d:%02d duration %d", __FUNCTION__, d.hh, d.mm,
-         d.duration);
-    nvs_close(nvs);
+    httpd_resp_set_type(req, "application/json");
+    tpl_init(&o, chunk_flush, req);
+    err = bench_render(&o, name, atoi(runs));
+    if (err == ESP_ERR_NOT_FOUND)
+        return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "no bench");
+    if (err)
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR,
+                                   "bench running");
+
+    tpl_flush(&o);
+    return o.err ? o.err : httpd_resp_send_chunk(req, NULL, 0);
+}
+
+
+static esp_err_t handle_bench(httpd_req_t *req)
+{
+    return submit_async(req, send_bench);
+}
+
+
+static const httpd_uri_t bench_handler = {
+    .uri       = "/bench",
+    .method    = HTTP_GET,
+    .handler   = handle_bench,
+    .user_ctx  = NULL
+};
+#endif
+
+
+/* Responses are written in full TCP segments already, without Nagle the
+ * last partial segment and the chunk trailer do not wait for a delayed ACK
+ * of the client */
+static esp_err_t sock_open(httpd_handle_t hd, int fd)
+{
+    int one = 1;
+    (void) hd;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return ESP_OK;
 }
 
 
 httpd_handle_t start_webserver(void)
 {
     memset(&d, 0, sizeof(d));
-    printf("Opening Non-Volatile Storage (NVS) handle... \n");
 
-    read_settings();
     httpd_handle_t server = NULL;
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
     config.lru_purge_enable = true;
+    config.max_open_sockets = CONFIG_WEBUI_MAX_SOCKETS;
+    config.stack_size = CONFIG_WEBUI_STACK;
+    config.backlog_conn = CONFIG_WEBUI_BACKLOG;
+    config.recv_wait_timeout = 5;
+    config.send_wait_timeout = 5;
+    /* detect dead keep-alive clients */
+    config.keep_alive_enable = true;
+    config.keep_alive_idle = 10;
+    config.keep_alive_interval = 5;
+    config.keep_alive_count = 3;
+    config.open_fn = sock_open;
+
+    async_init();
+    if (!page_snap)
+        page_snap = snapshot_alloc(render_page);
+    if (!status_snap)
+        status_snap = snapshot_alloc(render_status);
 
     // Start the httpd server
     ESP_LOGI(TAG, "Starting server on port: '%d'", config.server_port);
@@ -486,6 +1035,17 @@ httpd_handle_t start_webserver(void)
         ESP_LOGI(TAG, "Registering URI handlers");
         httpd_register_uri_handler(server, &get_handler);
         httpd_register_uri_handler(server, &post_handler);
+        httpd_register_uri_handler(server, &scan_handler);
+        httpd_register_uri_handler(server, &status_json_handler);
+        httpd_register_uri_handler(server, &mem_json_handler);
+        httpd_register_uri_handler(server, &cmd_json_handler);
+        httpd_register_uri_handler(server, &export_handler);
+#if CONFIG_POOL_BENCH
+        httpd_register_uri_handler(server, &bench_handler);
+        bench_add("form", bench_form, NULL, BENCH_IRQ_OFF);
+        bench_add("page", bench_page, NULL, 0);
+        bench_add("status", bench_status, NULL, 0);
+#endif
         return server;
     }
 
@@ -524,19 +1084,10 @@ void webui_connect_handler(void* arg, esp_event_base_t event_base,
 }
 
 
-bool webui_upgrade(void)
-{
-    bool upgrade = d.upgrade;
-    d.upgrade = false;
-    return upgrade;
-}
-
-
 bool webui_check_time()
 {
-    time_t timec;
-    time_t times;
-    struct tm tm;
+    struct settings set;
+    struct schedule sc;
 
     if (d.force == FORCE_OFF)
         return false;
@@ -544,27 +1095,68 @@ bool webui_check_time()
     if (d.force == FORCE_ON)
         return true;
 
-    timec = current_time();
-    localtime_r(&timec, &tm);
-    tm.tm_hour = d.hh;
-    tm.tm_min  = d.mm;
+    settings_get(&set);
+    sc.hh = set.hh;
+    sc.mm = set.mm;
+    sc.duration = set.duration;
+    return schedule_active(&sc, current_time());
+}
+
+
+/* Applies a force command, by the control task */
+void webui_set_force(enum force_run force)
+{
+    if (d.force == force)
+        return;
 
-    times = mktime(&tm);
-    return times <= timec && timec <= times + d.duration * 3600;
+    d.force = force;
+    snapshot_touch();
+}
+
+
+enum force_run webui_force(void)
+{
+    return d.force;
+}
+
+
+static uint32_t request(enum cmd_type type, int32_t arg)
+{
+    uint32_t id = cmd_post(type, arg);
+
+    if (id)
+        logs(LOG_SRC_NET, "command=%s %d id %" PRIu32, cmd_name(type),
+             (int) arg, id);
+    else
+        logs(LOG_SRC_NET, "command=%s dropped, mailbox full",
+             cmd_name(type));
+
+    snapshot_touch();
+    return id;
+}
+
+
+/* Commands, shared by the web form, MQTT and CoAP. They return the command
+ * id for cmd_result(), 0 if the command was dropped. */
+uint32_t webui_request_force(enum force_run force)
+{
+    return request(CMD_FORCE, force);
+}
+
+
+uint32_t webui_request_switch(void)
+{
+    return request(CMD_SWITCH, 0);
 }
 
 
-bool webui_wifi_scan()
+uint32_t webui_request_upgrade(void)
 {
-    bool wifi = d.wifi;
-    d.wifi = false;
-    return wifi;
+    return request(CMD_UPGRADE, 0);
 }
 
 
-bool webui_switch(void)
+uint32_t webui_request_wifi_scan(void)
 {
-    bool switc = d.switc;
-    d.switc = false;
-    return switc;
+    return request(CMD_WIFI_SCAN, 0);
 }
@@ -2,14 +2,25 @@
 #define WEBUI_H
 #include <esp_event.h>
 #include <esp_http_server.h>
+#include <stdint.h>
+
+enum force_run {
+    FORCE_NONE,
+    FORCE_ON,
+    FORCE_OFF
+};
+
 httpd_handle_t start_webserver(void);
 void stop_webserver(httpd_handle_t server);
 void webui_disconnect_handler(void* arg, esp_event_base_t event_base,
                                int32_t event_id, void* event_data);
 void webui_connect_handler(void* arg, esp_event_base_t event_base,
                             int32_t event_id, void* event_data);
-bool webui_upgrade(void);
 bool webui_check_time(void);
-bool webui_wifi_scan(void);
-bool webui_switch(void);
+void webui_set_force(enum force_run force);
+enum force_run webui_force(void);
+uint32_t webui_request_force(enum force_run force);
+uint32_t webui_request_switch(void);
+uint32_t webui_request_upgrade(void);
+uint32_t webui_request_wifi_scan(void);
 #endif
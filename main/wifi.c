@@ -5,6 +5,9 @@
  */
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
 #include "sdkconfig.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
@@ -14,9 +17,12 @@
 #include "esp_wifi.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "driver/gpio.h"
 #include "nvs_flash.h"
+#include "nvs.h"
 #include "esp_sntp.h"
+#include "mdns.h"
 
 #include "lwip/err.h"
 #include "lwip/sys.h"
@@ -24,13 +30,43 @@
 #include "wifi.h"
 #include "config.h"
 #include "log.h"
+#include "snapshot.h"
+#include "sysinfo.h"
+#include "schedule.h"
+#include "mem.h"
 
 #define GPIO_LED            22
 
 #define CONFIG_ESP_MAXIMUM_RETRY 9
 #define NTP_SERVER "de.pool.ntp.org"
-/* Western European Time */
-#define TZ_INFO "WEST-1DWEST-2,M3.5.0/02:00:00,M10.5.0/03:00:00"
+
+/* Reuse the cached DHCP lease as static IP on fast reconnect */
+#ifndef CONFIG_WIFI_FAST_STATIC_IP
+#define CONFIG_WIFI_FAST_STATIC_IP 0
+#endif
+
+/* Roam to a stronger AP of the same SSID if RSSI stays below this dBm
+ * value for CONFIG_WIFI_ROAM_SECS, 0 disables roaming */
+#ifndef CONFIG_WIFI_ROAM_RSSI
+#define CONFIG_WIFI_ROAM_RSSI 0
+#endif
+
+#ifndef CONFIG_WIFI_ROAM_SECS
+#define CONFIG_WIFI_ROAM_SECS 30
+#endif
+
+/* A roaming candidate has to be this many dB stronger */
+#ifndef CONFIG_WIFI_ROAM_HYST
+#define CONFIG_WIFI_ROAM_HYST 8
+#endif
+
+/* mDNS host and instance name, empty for pool-<last 3 bytes of the MAC> */
+#ifndef CONFIG_MDNS_HOSTNAME
+#define CONFIG_MDNS_HOSTNAME ""
+#endif
+
+#define NVS_WIFI_NS  "wifi_fast"
+#define NVS_WIFI_KEY "ap"
 
 
 /* FreeRTOS event group to signal when we are connected*/
@@ -48,16 +84,356 @@ static int s_retry_delay = 0;  /* in seconds */
 static bool led = true;
 static bool flash = true;
 
+/* Last good association, persisted in NVS */
+struct wifi_fast {
+    uint8_t  bssid[6];
+    uint8_t  channel;
+    uint8_t  valid;
+    esp_netif_ip_info_t ip_info;
+    esp_ip4_addr_t dns;
+};
+
+enum conn_mode {
+    CONN_FAST,
+    CONN_FULL,
+};
+
+static esp_netif_t *s_netif;
+static struct wifi_fast s_fast;
+static enum conn_mode s_mode = CONN_FULL;
+static bool s_connected;
+static int64_t s_disc_time;    /* in us, 0 if not reconnecting */
+static struct wifi_hist s_hist;
+
+/* Scan result cache, written by the event task */
+static portMUX_TYPE s_scan_mux = portMUX_INITIALIZER_UNLOCKED;
+static wifi_ap_record_t s_scan_rec[WIFI_SCAN_MAX];
+static struct wifi_ap s_scan_ap[WIFI_SCAN_MAX];
+static size_t s_scan_cnt;
+static time_t s_scan_time;
+static bool s_scanning;
+
+/* Roaming state */
+static bool s_roam_scan;
+static int s_roam_low;         /* seconds below CONFIG_WIFI_ROAM_RSSI */
+static struct {
+    bool set;
+    uint8_t bssid[6];
+    uint8_t channel;
+} s_roam;
+
+
+static void load_fast(void)
+{
+    nvs_handle_t nvs;
+    size_t len = sizeof(s_fast);
+
+    memset(&s_fast, 0, sizeof(s_fast));
+    if (nvs_open(NVS_WIFI_NS, NVS_READONLY, &nvs))
+        return;
+
+    if (nvs_get_blob(nvs, NVS_WIFI_KEY, &s_fast, &len) ||
+            len != sizeof(s_fast))
+        memset(&s_fast, 0, sizeof(s_fast));
+
+    nvs_close(nvs);
+}
+
+
+static void save_fast(const struct wifi_fast *fast)
+{
+    nvs_handle_t nvs;
+    int err;
+
+    /* avoid flash writes if nothing changed */
+    if (!memcmp(fast, &s_fast, sizeof(s_fast)))
+        return;
+
+    s_fast = *fast;
+    err = nvs_open(NVS_WIFI_NS, NVS_READWRITE, &nvs);
+    if (err) {
+        ESP_LOGE(TAG, "Error (%s) opening NVS", esp_err_to_name(err));
+        return;
+    }
+
+    err  = nvs_set_blob(nvs, NVS_WIFI_KEY, &s_fast, sizeof(s_fast));
+    err |= nvs_commit(nvs);
+    nvs_close(nvs);
+    if (err)
+        ESP_LOGE(TAG, "Error (%s) saving fast connect data",
+                 esp_err_to_name(err));
+}
+
+
+static void remember_ap(const esp_netif_ip_info_t *ip_info)
+{
+    struct wifi_fast fast;
+    wifi_ap_record_t ap;
+    esp_netif_dns_info_t dns;
+
+    if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK)
+        return;
+
+    memset(&fast, 0, sizeof(fast));
+    memcpy(fast.bssid, ap.bssid, sizeof(fast.bssid));
+    fast.channel = ap.primary;
+    fast.valid   = 1;
+    fast.ip_info = *ip_info;
+    if (esp_netif_get_dns_info(s_netif, ESP_NETIF_DNS_MAIN, &dns) == ESP_OK)
+        fast.dns = dns.ip.u_addr.ip4;
+
+    save_fast(&fast);
+}
+
+
+/* Configures the next connect attempt. The fast mode skips the scan by
+ * pinning BSSID and channel and optionally skips DHCP. */
+static void set_mode(enum conn_mode mode)
+{
+    wifi_config_t cfg;
+
+    if (mode == CONN_FAST && !s_fast.valid)
+        mode = CONN_FULL;
+
+    s_mode = mode;
+    if (esp_wifi_get_config(WIFI_IF_STA, &cfg) != ESP_OK)
+        return;
+
+    if (mode == CONN_FAST && s_roam.set) {
+        memcpy(cfg.sta.bssid, s_roam.bssid, sizeof(cfg.sta.bssid));
+        cfg.sta.bssid_set   = true;
+        cfg.sta.channel     = s_roam.channel;
+        cfg.sta.scan_method = WIFI_FAST_SCAN;
+    }
+    else if (mode == CONN_FAST) {
+        memcpy(cfg.sta.bssid, s_fast.bssid, sizeof(cfg.sta.bssid));
+        cfg.sta.bssid_set   = true;
+        cfg.sta.channel     = s_fast.channel;
+        cfg.sta.scan_method = WIFI_FAST_SCAN;
+    }
+    else {
+        s_roam.set          = false;
+        cfg.sta.bssid_set   = false;
+        cfg.sta.channel     = 0;
+        cfg.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+    }
+
+    esp_wifi_set_config(WIFI_IF_STA, &cfg);
+
+    if (!CONFIG_WIFI_FAST_STATIC_IP)
+        return;
+
+    if (mode == CONN_FAST) {
+        esp_netif_dns_info_t dns = { 0 };
+
+        esp_netif_dhcpc_stop(s_netif);
+        esp_netif_set_ip_info(s_netif, &s_fast.ip_info);
+        dns.ip.type = ESP_IPADDR_TYPE_V4;
+        dns.ip.u_addr.ip4 = s_fast.dns;
+        if (dns.ip.u_addr.ip4.addr)
+            esp_netif_set_dns_info(s_netif, ESP_NETIF_DNS_MAIN, &dns);
+    }
+    else {
+        esp_netif_dhcpc_start(s_netif);
+    }
+}
+
+
+/* The cached lease is a head start only, after a fast connect DHCP is
+ * restarted to renew it before it expires upstream. The address is down
+ * until the DHCP server acks, the next got ip comes from DHCP. */
+static void renew_lease(void)
+{
+    esp_netif_dhcp_status_t st;
+
+    if (!CONFIG_WIFI_FAST_STATIC_IP || s_mode != CONN_FAST)
+        return;
+
+    if (esp_netif_dhcpc_get_status(s_netif, &st) != ESP_OK ||
+            st != ESP_NETIF_DHCP_STOPPED)
+        return;
+
+    ESP_LOGI(TAG, "renewing the cached lease");
+    esp_netif_dhcpc_start(s_netif);
+}
+
+
+static void record_latency(void)
+{
+    uint32_t *hist = s_mode == CONN_FAST ? s_hist.fast : s_hist.full;
+    int64_t ms;
+    int i;
+
+    if (!s_disc_time)
+        return;
+
+    ms = (esp_timer_get_time() - s_disc_time) / 1000;
+    s_disc_time = 0;
+
+    /* bucket i holds latencies below 250 ms << i */
+    for (i = 0; i < WIFI_HIST_BUCKETS - 1; i++) {
+        if (ms < (250LL << i))
+            break;
+    }
+
+    hist[i]++;
+    logs(LOG_SRC_WIFI, "Wifi reconnect %s %d ms",
+         s_mode == CONN_FAST ? "fast" : "full", (int) ms);
+}
+
+/* Picks the strongest other AP of our SSID from the scan records. */
+static void roam_select(const wifi_ap_record_t *rec, size_t cnt)
+{
+    wifi_ap_record_t cur;
+    const wifi_ap_record_t *best = NULL;
+    size_t i;
+
+    if (esp_wifi_sta_get_ap_info(&cur) != ESP_OK)
+        return;
+
+    for (i = 0; i < cnt; i++) {
+        if (strcmp((const char *) rec[i].ssid, CONFIG_ESP_WIFI_SSID) ||
+                !memcmp(rec[i].bssid, cur.bssid, sizeof(cur.bssid)))
+            continue;
+
+        if (!best || rec[i].rssi > best->rssi)
+            best = &rec[i];
+    }
+
+    if (!best || best->rssi < cur.rssi + CONFIG_WIFI_ROAM_HYST)
+        return;
+
+    logs(LOG_SRC_WIFI, "Wifi roam rssi %d -> %d ch %u", cur.rssi,
+         best->rssi, best->primary);
+    memcpy(s_roam.bssid, best->bssid, sizeof(s_roam.bssid));
+    s_roam.channel = best->primary;
+    s_roam.set = true;
+
+    /* the disconnect handler reconnects via the fast path */
+    esp_wifi_disconnect();
+}
+
+
+static void scan_done(void)
+{
+    uint16_t cnt = WIFI_SCAN_MAX;
+    size_t i;
+
+    s_scanning = false;
+    if (esp_wifi_scan_get_ap_records(&cnt, s_scan_rec) != ESP_OK)
+        cnt = 0;
+
+    /* a roaming scan sees our SSID only, the cache keeps the full scan */
+    if (s_roam_scan) {
+        s_roam_scan = false;
+        ESP_LOGI(TAG, "roam scan done, %u APs", cnt);
+        roam_select(s_scan_rec, cnt);
+        return;
+    }
+
+    portENTER_CRITICAL(&s_scan_mux);
+    for (i = 0; i < cnt; i++) {
+        strlcpy(s_scan_ap[i].ssid, (const char *) s_scan_rec[i].ssid,
+                sizeof(s_scan_ap[i].ssid));
+        memcpy(s_scan_ap[i].bssid, s_scan_rec[i].bssid,
+               sizeof(s_scan_ap[i].bssid));
+        s_scan_ap[i].channel  = s_scan_rec[i].primary;
+        s_scan_ap[i].rssi     = s_scan_rec[i].rssi;
+        s_scan_ap[i].authmode = s_scan_rec[i].authmode;
+    }
+    s_scan_cnt  = cnt;
+    s_scan_time = time(NULL);
+    portEXIT_CRITICAL(&s_scan_mux);
+    snapshot_touch();
+
+    ESP_LOGI(TAG, "wifi scan done, %u APs", cnt);
+}
+
+
+static int scan_start(bool roam)
+{
+    wifi_scan_config_t scan_config = { 0 };
+    int err;
+
+    if (s_scanning)
+        return EALREADY;
+
+    if (roam) {
+        /* short active scan for our SSID only */
+        scan_config.ssid      = (uint8_t *) CONFIG_ESP_WIFI_SSID;
+        scan_config.scan_type = WIFI_SCAN_TYPE_ACTIVE;
+    }
+    else {
+        scan_config.scan_type = WIFI_SCAN_TYPE_PASSIVE;
+    }
+
+    err = esp_wifi_scan_start(&scan_config, false);
+    if (err) {
+        ESP_LOGW(TAG, "Error (%s) starting scan", esp_err_to_name(err));
+        return err;
+    }
+
+    s_scanning  = true;
+    s_roam_scan = roam;
+    snapshot_touch();
+    return 0;
+}
+
+
+static void roam_check(void)
+{
+    wifi_ap_record_t ap;
+
+    if (!CONFIG_WIFI_ROAM_RSSI || !s_connected ||
+            esp_wifi_sta_get_ap_info(&ap) != ESP_OK ||
+            ap.rssi >= CONFIG_WIFI_ROAM_RSSI) {
+        s_roam_low = 0;
+        return;
+    }
+
+    if (++s_roam_low < CONFIG_WIFI_ROAM_SECS)
+        return;
+
+    s_roam_low = 0;
+    scan_start(true);
+}
+
+
 static void event_handler(void* arg, esp_event_base_t event_base,
                                 int32_t event_id, void* event_data)
 {
     ESP_LOGI(TAG, "Wifi event_id %d", event_id);
-    logw("Wifi event_id %d", event_id);
-    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
+    logs(LOG_SRC_WIFI, "Wifi event_id %d", event_id);
+    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_SCAN_DONE) {
+        scan_done();
+    }
+    else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
+        set_mode(CONN_FAST);
         esp_wifi_connect();
     }
     else if (event_base == WIFI_EVENT &&
              event_id == WIFI_EVENT_STA_DISCONNECTED) {
+        flash = true;
+        if (!s_disc_time)
+            s_disc_time = esp_timer_get_time();
+
+        if (s_connected) {
+            /* link lost, try the cached AP first */
+            s_connected = false;
+            set_mode(CONN_FAST);
+            esp_wifi_connect();
+            ESP_LOGI(TAG, "fast reconnect to the AP");
+            return;
+        }
+
+        if (s_mode == CONN_FAST) {
+            /* cached or roaming AP failed, fall back to full scan without backoff */
+            set_mode(CONN_FULL);
+            esp_wifi_connect();
+            ESP_LOGI(TAG, "fast reconnect failed, full scan");
+            return;
+        }
+
         esp_wifi_connect();
 
         if (!s_retry_delay)
@@ -65,7 +441,6 @@ static void event_handler(void* arg, esp_event_base_t event_base,
         else if (s_retry_delay < 256)
             s_retry_delay *= 2;
 
-        flash = true;
         ESP_LOGI(TAG, "retry to connect to the AP");
     }
     else if (event_base == IP_EVENT &&
@@ -73,38 +448,86 @@ static void event_handler(void* arg, esp_event_base_t event_base,
         ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
         ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
         s_retry_delay = 0;
+        s_connected = true;
+        s_roam.set = false;
         flash = false;
-        setenv("TZ", TZ_INFO, 1);
+        record_latency();
+        remember_ap(&event->ip_info);
+        renew_lease();
+        setenv("TZ", SCHEDULE_TZ, 1);
         tzset();
-        sntp_setoperatingmode(SNTP_OPMODE_POLL);
-        sntp_setservername(0, NTP_SERVER);
-        sntp_init();
+        if (!sntp_enabled()) {
+            sntp_setoperatingmode(SNTP_OPMODE_POLL);
+            sntp_setservername(0, NTP_SERVER);
+            sntp_set_time_sync_notification_cb(sysinfo_time_sync);
+            sntp_init();
+        }
         xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
         gpio_set_level(GPIO_LED, true);
         ESP_LOGI(TAG, "Wifi ok, LED on");
-        logw("Wifi ok, LED on");
+        logs(LOG_SRC_WIFI, "Wifi ok, LED on");
     }
 }
 
 
+/* Advertises _pool._tcp for fleet discovery and _http._tcp for browsers */
+static void mdns_start(void)
+{
+    static mdns_txt_item_t txt[] = {
+        { "path", "/status.json" },
+    };
+    char name[32];
+    uint8_t mac[6];
+    esp_err_t err;
+
+    err = mdns_init();
+    if (err) {
+        ESP_LOGE(TAG, "mdns_init failed (%s)", esp_err_to_name(err));
+        return;
+    }
+
+    if (*CONFIG_MDNS_HOSTNAME) {
+        strlcpy(name, CONFIG_MDNS_HOSTNAME, sizeof(name));
+    }
+    else {
+        esp_wifi_get_mac(WIFI_IF_STA, mac);
+        snprintf(name, sizeof(name), "pool-%02x%02x%02x", mac[3], mac[4],
+                 mac[5]);
+    }
+
+    mdns_hostname_set(name);
+    mdns_instance_name_set(name);
+    mdns_service_add(NULL, "_pool", "_tcp", 80, txt,
+                     sizeof(txt) / sizeof(txt[0]));
+    mdns_service_add(NULL, "_http", "_tcp", 80, NULL, 0);
+    ESP_LOGI(TAG, "mdns %s.local", name);
+}
+
+
 static void vendor_ie_cb(void *ctx, wifi_vendor_ie_type_t type,
         const uint8_t sa[6], const vendor_ie_data_t *vnd_ie, int rssi)
 {
-    logw("%s:%d type=%u rssi=%d", __FUNCTION__, __LINE__, type, rssi);
+    logs(LOG_SRC_WIFI, "Wifi vendor ie type=%u rssi=%d", type, rssi);
 }
 
 
 int wifi_init_sta(void)
 {
     int err = ESP_OK;
+#if CONFIG_STATIC_MEM
+    static StaticEventGroup_t eg;
 
+    s_wifi_event_group = xEventGroupCreateStatic(&eg);
+#else
     s_wifi_event_group = xEventGroupCreate();
+#endif
 
     esp_wifi_set_vendor_ie_cb(vendor_ie_cb, NULL);
     ESP_ERROR_CHECK(esp_netif_init());
 
     ESP_ERROR_CHECK(esp_event_loop_create_default());
-    esp_netif_create_default_wifi_sta();
+    s_netif = esp_netif_create_default_wifi_sta();
+    load_fast();
 
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
@@ -137,6 +560,7 @@ int wifi_init_sta(void)
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA) );
     ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config) );
     ESP_ERROR_CHECK(esp_wifi_start() );
+    mdns_start();
 
     ESP_LOGI(TAG, "wifi_init_sta finished.");
 
@@ -160,15 +584,17 @@ int wifi_init_sta(void)
         err = ESP_ERR_WIFI_BASE + 2;
     }
 
-    /* The event will not be processed after unregister */
-    ESP_ERROR_CHECK(esp_event_handler_instance_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, instance_got_ip));
-    ESP_ERROR_CHECK(esp_event_handler_instance_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, instance_any_id));
-    vEventGroupDelete(s_wifi_event_group);
-
+    /* The handlers stay registered, they drive the reconnects */
     return err;
 }
 
 
+const struct wifi_hist *wifi_reconnect_hist(void)
+{
+    return &s_hist;
+}
+
+
 void wifi_check(void)
 {
     if (flash) {
@@ -180,47 +606,52 @@ void wifi_check(void)
 
         s_retry_delay--;
         if (!s_retry_delay) {
-            logw("Wifi reconnect");
+            logs(LOG_SRC_WIFI, "Wifi reconnect");
+            set_mode(CONN_FAST);
             esp_wifi_connect();
         }
     }
+
+    roam_check();
 }
 
 
 void wifi_scan(void)
 {
-    wifi_scan_config_t scan_config = { 0 };
-    uint16_t g_scan_ap_num;
-    wifi_ap_record_t *g_ap_list_buffer;
-
-    logw("%s", __FUNCTION__);
-/*    scan_config.ssid      = CONFIG_ESP_WIFI_SSID;*/
-    scan_config.scan_type = WIFI_SCAN_TYPE_PASSIVE;
-
-    logw("Starting wifi scan");
-    esp_wifi_scan_start(&scan_config, 0);
-    logw("wifi scan started");
-    ESP_LOGI(TAG, "wifi scan started");
-    return;
-
-    esp_wifi_scan_get_ap_num(&g_scan_ap_num);
-    if (g_scan_ap_num) {
-        g_ap_list_buffer = malloc(g_scan_ap_num * sizeof(wifi_ap_record_t));
-        if (g_ap_list_buffer) {
-            if (esp_wifi_scan_get_ap_records(&g_scan_ap_num,
-                            (wifi_ap_record_t *) g_ap_list_buffer) == ESP_OK) {
-                for (int i = 0; i < g_scan_ap_num; i++) {
-                    ESP_LOGI(TAG, "[%s][rssi=%d]",
-                             g_ap_list_buffer[i].ssid,
-                             g_ap_list_buffer[i].rssi);
-                    logw("[%s][rssi=%d]",
-                             g_ap_list_buffer[i].ssid,
-                             g_ap_list_buffer[i].rssi);
-                }
-            }
-
-            free(g_ap_list_buffer);
-        }
-    }
+    logs(LOG_SRC_WIFI, "Starting wifi scan");
+    if (!scan_start(false))
+        ESP_LOGI(TAG, "wifi scan started");
+}
+
+
+bool wifi_scan_running(void)
+{
+    return s_scanning;
+}
+
+
+/* RSSI of the current AP, 0 if not connected */
+int wifi_rssi(void)
+{
+    wifi_ap_record_t ap;
+
+    if (!s_connected || esp_wifi_sta_get_ap_info(&ap) != ESP_OK)
+        return 0;
+
+    return ap.rssi;
+}
+
+
+size_t wifi_scan_get(struct wifi_ap *aps, size_t max, time_t *when)
+{
+    size_t n;
+
+    portENTER_CRITICAL(&s_scan_mux);
+    n = s_scan_cnt < max ? s_scan_cnt : max;
+    memcpy(aps, s_scan_ap, n * sizeof(*aps));
+    if (when)
+        *when = s_scan_time;
+    portEXIT_CRITICAL(&s_scan_mux);
 
+    return n;
 }
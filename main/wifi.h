@@ -1,6 +1,34 @@
 #ifndef WIFI_H
 #define WIFI_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/* Reconnect latency histogram, bucket i counts latencies < 250 ms << i */
+#define WIFI_HIST_BUCKETS 8
+
+/* Max number of cached scan results */
+#define WIFI_SCAN_MAX 16
+
+struct wifi_hist {
+    uint32_t fast[WIFI_HIST_BUCKETS];
+    uint32_t full[WIFI_HIST_BUCKETS];
+};
+
+struct wifi_ap {
+    char ssid[33];
+    uint8_t bssid[6];
+    uint8_t channel;
+    int8_t rssi;
+    int authmode;
+};
+
 int wifi_init_sta(void);
 void wifi_check(void);
 void wifi_scan(void);
+bool wifi_scan_running(void);
+int wifi_rssi(void);
+size_t wifi_scan_get(struct wifi_ap *aps, size_t max, time_t *when);
+const struct wifi_hist *wifi_reconnect_hist(void);
 #endif
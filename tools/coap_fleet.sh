@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# Starts N host build instances as stand-ins for a fleet, each with its own
+# NVS file, HTTP port 18100 + i and CoAP port 15700 + i, and polls them with
+# coapbench.
+#
+# Usage: tools/coap_fleet.sh [build-dir] [devices] [rounds]
+#
+# Copyright (C) 2021 Christian Spielberger
+
+BUILD=${1:-build-host}
+COUNT=${2:-100}
+ROUNDS=${3:-10}
+DIR=$(dirname "$0")
+TMP=$(mktemp -d)
+PIDS=
+
+cleanup() {
+    kill $PIDS 2>/dev/null
+    rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+if [ ! -x "$BUILD/pool_host" ] || [ ! -x "$BUILD/coapbench" ]; then
+    echo "$BUILD/pool_host or coapbench not found, build with:"
+    echo "  cmake -S host -B $BUILD && cmake --build $BUILD"
+    exit 1
+fi
+
+BUILD=$(cd "$BUILD" && pwd)
+i=0
+while [ $i -lt "$COUNT" ]; do
+    mkdir "$TMP/$i"
+    (cd "$TMP/$i" && exec "$BUILD/pool_host" -p $((18100 + i)) \
+        -c $((15700 + i))) >"$TMP/$i/host.log" 2>&1 &
+    PIDS="$PIDS $!"
+    i=$((i + 1))
+done
+sleep 2
+
+"$BUILD/coapbench" -n "$COUNT" -r "$ROUNDS"
@@ -0,0 +1,350 @@
+/**
+ * @file coapbench.c  Fleet polling benchmark, CoAP against HTTP
+ *
+ * Polls the status of N devices per round, once with CoAP GET /status (CBOR)
+ * and once with HTTP GET /status.json on a new connection each, like a
+ * scraper would. All requests of a round are in flight at the same time.
+ * Device i is expected on HTTP port http-base + i and CoAP port
+ * coap-base + i, see coap_fleet.sh for local stand-ins.
+ *
+ * Reports the round time, latency percentiles and the bytes per poll. Wire
+ * bytes add the IPv4 and UDP or TCP headers, for HTTP of the minimum of 10
+ * segments (handshake, request, response, teardown and their ACKs).
+ *
+ * Build: cc -O2 -o coapbench coapbench.c
+ * Usage: coapbench [-n devices] [-r rounds] [-H http-base] [-C coap-base]
+ *                  [host]
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define TIMEOUT_US  3000000
+#define RETRY_US    1000000
+#define UDP_HDR     28
+#define TCP_HDR     40
+#define TCP_SEGS    10
+
+struct dev {
+    int fd;
+    bool done;
+    bool sent;
+    uint64_t start;
+};
+
+struct stats {
+    const char *name;
+    uint64_t *lat;      /* in us */
+    size_t nlat;
+    uint64_t round_us;
+    uint64_t payload;
+    uint64_t wire;
+    unsigned errors;
+};
+
+static struct in_addr host;
+static unsigned ndev = 100;
+static unsigned rounds = 10;
+static unsigned http_base = 18100;
+static unsigned coap_base = 15700;
+static struct dev *devs;
+
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static struct sockaddr_in dev_addr(unsigned port)
+{
+    struct sockaddr_in sa = { 0 };
+
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    sa.sin_addr = host;
+    return sa;
+}
+
+
+/* CON GET /status, token is the device index */
+static size_t coap_request(uint8_t *buf, uint16_t mid, unsigned i)
+{
+    size_t n = 0;
+
+    buf[n++] = 0x40 | 2;
+    buf[n++] = 0x01;
+    buf[n++] = mid >> 8;
+    buf[n++] = mid & 0xff;
+    buf[n++] = i >> 8;
+    buf[n++] = i & 0xff;
+    buf[n++] = 11 << 4 | 6;
+    memcpy(buf + n, "status", 6);
+    n += 6;
+
+    return n;
+}
+
+
+static void coap_send(int fd, struct stats *st, uint16_t mid, unsigned i)
+{
+    struct sockaddr_in sa = dev_addr(coap_base + i);
+    uint8_t buf[32];
+    size_t n = coap_request(buf, mid, i);
+
+    if (sendto(fd, buf, n, 0, (struct sockaddr *) &sa, sizeof(sa)) < 0)
+        return;
+
+    st->payload += n;
+    st->wire += n + UDP_HDR;
+}
+
+
+static void coap_round(int fd, struct stats *st, uint16_t mid)
+{
+    uint64_t t0 = now_us(), now;
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    uint8_t buf[512];
+    unsigned left = ndev, i;
+    bool retried = false;
+    ssize_t n;
+
+    for (i = 0; i < ndev; i++) {
+        devs[i].done = false;
+        devs[i].start = now_us();
+        coap_send(fd, st, mid + i, i);
+    }
+
+    while (left && (now = now_us()) - t0 < TIMEOUT_US) {
+        if (!retried && now - t0 >= RETRY_US) {
+            retried = true;
+            for (i = 0; i < ndev; i++) {
+                if (!devs[i].done)
+                    coap_send(fd, st, mid + i, i);
+            }
+        }
+
+        if (poll(&pfd, 1, 50) <= 0)
+            continue;
+
+        while ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+            if (n < 6 || (buf[0] & 0x0f) != 2)
+                continue;
+
+            i = buf[4] << 8 | buf[5];
+            if (i >= ndev || devs[i].done)
+                continue;
+
+            st->payload += n;
+            st->wire += n + UDP_HDR;
+            if (buf[1] != 0x45) {
+                st->errors++;
+                continue;
+            }
+
+            devs[i].done = true;
+            st->lat[st->nlat++] = now_us() - devs[i].start;
+            left--;
+        }
+    }
+
+    st->errors += left;
+    st->round_us += now_us() - t0;
+}
+
+
+static void http_close(int ep, struct dev *d, unsigned *left)
+{
+    epoll_ctl(ep, EPOLL_CTL_DEL, d->fd, NULL);
+    close(d->fd);
+    d->fd = -1;
+    d->done = true;
+    (*left)--;
+}
+
+
+static void http_round(int ep, struct stats *st)
+{
+    static const char req[] = "GET /status.json HTTP/1.1\r\nHost: pool\r\n"
+                              "Connection: close\r\n\r\n";
+    struct epoll_event ev, evs[64];
+    uint64_t t0 = now_us();
+    unsigned left = ndev, i;
+    struct sockaddr_in sa;
+    char buf[4096];
+    ssize_t n;
+    int k, m;
+
+    for (i = 0; i < ndev; i++) {
+        struct dev *d = &devs[i];
+
+        sa = dev_addr(http_base + i);
+        d->done = d->sent = false;
+        d->start = now_us();
+        d->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (d->fd < 0 || (connect(d->fd, (struct sockaddr *) &sa,
+                                  sizeof(sa)) && errno != EINPROGRESS)) {
+            if (d->fd >= 0)
+                close(d->fd);
+            d->fd = -1;
+            d->done = true;
+            st->errors++;
+            left--;
+            continue;
+        }
+
+        ev.events = EPOLLOUT | EPOLLIN;
+        ev.data.u32 = i;
+        epoll_ctl(ep, EPOLL_CTL_ADD, d->fd, &ev);
+    }
+
+    while (left && now_us() - t0 < TIMEOUT_US) {
+        m = epoll_wait(ep, evs, 64, 50);
+        for (k = 0; k < m; k++) {
+            struct dev *d = &devs[evs[k].data.u32];
+
+            if (d->done)
+                continue;
+
+            if (!d->sent && (evs[k].events & EPOLLOUT)) {
+                if (send(d->fd, req, sizeof(req) - 1, MSG_NOSIGNAL) < 0) {
+                    st->errors++;
+                    http_close(ep, d, &left);
+                    continue;
+                }
+
+                d->sent = true;
+                st->payload += sizeof(req) - 1;
+                st->wire += sizeof(req) - 1;
+                ev.events = EPOLLIN;
+                ev.data.u32 = evs[k].data.u32;
+                epoll_ctl(ep, EPOLL_CTL_MOD, d->fd, &ev);
+                continue;
+            }
+
+            while ((n = recv(d->fd, buf, sizeof(buf), 0)) > 0) {
+                st->payload += n;
+                st->wire += n;
+            }
+
+            if (n == 0) {
+                st->lat[st->nlat++] = now_us() - d->start;
+                st->wire += TCP_SEGS * TCP_HDR;
+                http_close(ep, d, &left);
+            }
+            else if (errno != EAGAIN) {
+                st->errors++;
+                http_close(ep, d, &left);
+            }
+        }
+    }
+
+    for (i = 0; i < ndev; i++) {
+        if (!devs[i].done) {
+            st->errors++;
+            http_close(ep, &devs[i], &left);
+        }
+    }
+
+    st->round_us += now_us() - t0;
+}
+
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+
+static double pct(const struct stats *st, double p)
+{
+    size_t i = (size_t) (p / 100.0 * (st->nlat - 1) + 0.5);
+
+    return st->nlat ? st->lat[i] / 1000.0 : 0;
+}
+
+
+static void report(struct stats *st)
+{
+    double polls = st->nlat ? st->nlat : 1;
+
+    if (st->nlat)
+        qsort(st->lat, st->nlat, sizeof(*st->lat), cmp_u64);
+
+    printf("%-4s  round %7.2f ms  p50 %6.2f ms  p99 %6.2f ms  "
+           "%5.0f B/poll  %5.0f B/poll on wire  errors %u\n", st->name,
+           st->round_us / 1000.0 / rounds, pct(st, 50), pct(st, 99),
+           st->payload / polls, st->wire / polls, st->errors);
+}
+
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: coapbench [-n devices] [-r rounds] "
+            "[-H http-base] [-C coap-base] [host]\n");
+    exit(2);
+}
+
+
+int main(int argc, char *argv[])
+{
+    struct stats coap = { .name = "coap" }, http = { .name = "http" };
+    uint16_t mid;
+    unsigned r;
+    int opt, ufd, ep;
+
+    while ((opt = getopt(argc, argv, "n:r:H:C:")) != -1) {
+        switch (opt) {
+        case 'n': ndev = atoi(optarg); break;
+        case 'r': rounds = atoi(optarg); break;
+        case 'H': http_base = atoi(optarg); break;
+        case 'C': coap_base = atoi(optarg); break;
+        default: usage();
+        }
+    }
+
+    if (!inet_aton(optind < argc ? argv[optind] : "127.0.0.1", &host) ||
+            !ndev || ndev > 65535 || !rounds)
+        usage();
+
+    devs = calloc(ndev, sizeof(*devs));
+    coap.lat = calloc((size_t) ndev * rounds, sizeof(uint64_t));
+    http.lat = calloc((size_t) ndev * rounds, sizeof(uint64_t));
+    ufd = socket(AF_INET, SOCK_DGRAM, 0);
+    ep = epoll_create1(0);
+    if (!devs || !coap.lat || !http.lat || ufd < 0 || ep < 0) {
+        perror("coapbench");
+        return 1;
+    }
+
+    mid = getpid();
+    for (r = 0; r < rounds; r++) {
+        coap_round(ufd, &coap, mid);
+        mid += ndev;
+        http_round(ep, &http);
+    }
+
+    printf("%u devices, %u rounds\n", ndev, rounds);
+    report(&coap);
+    report(&http);
+    return coap.errors || http.errors ? 1 : 0;
+}
@@ -0,0 +1,132 @@
+/**
+ * @file fansim.c  Simulation of the fan control
+ *
+ * Runs fanctl.c of the firmware in 100 ms steps through a pump window of
+ * the schedule: the cell current reading settles from the switch on level
+ * to the steady load with noise, drops to zero for a few seconds at every
+ * polarity flip (20 min) and low flow trips cut the cell for a minute.
+ * Prints the duty over time (-c) and a summary against the former fan
+ * that ran at full speed while the cell was energised: mean duty and fan
+ * energy, taking the fan power as the cube of its speed.
+ *
+ * Usage: fansim [-d hours] [-l mv] [-t trips] [-c secs] [-r ramp_s]
+ *               [-T tail_s] [-m min%] [-s seed]
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "fanctl.h"
+
+#define STEP_MS     100
+#define FLIP_SECS   (20 * 60)
+#define FLIP_GAP    5
+#define TRIP_SECS   60
+
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: fansim [-d hours] [-l mv] [-t trips] "
+            "[-c secs] [-r ramp_s] [-T tail_s] [-m min%%] [-s seed]\n");
+    exit(2);
+}
+
+
+/* Cell current reading at second t of the window, -1 while not energised */
+static int32_t cell_mv(uint32_t t, int32_t load, const uint32_t *trips,
+                       int ntrips)
+{
+    int32_t mv;
+    int i;
+
+    for (i = 0; i < ntrips; i++) {
+        if (t >= trips[i] && t < trips[i] + TRIP_SECS)
+            return -1;
+    }
+
+    if (t % FLIP_SECS < FLIP_GAP && t >= FLIP_SECS)
+        return 0;
+
+    /* the cell draws more until the brine warms up */
+    mv = load + (t < 600 ? (int32_t) (600 - t) * load / 2400 : 0);
+    return mv + rand() % (load / 10 + 1) - load / 20;
+}
+
+
+int main(int argc, char *argv[])
+{
+    struct fanctl_cfg cfg;
+    struct fanctl f;
+    uint32_t trips[16];
+    uint32_t hours = 8, csv = 0, secs, t, ms;
+    uint32_t on_ms = 0, fan_ms = 0;
+    int32_t load = 500;
+    double sum = 0, energy = 0, legacy = 0;
+    int ntrips = 0, c, i;
+    unsigned seed = 1;
+
+    fanctl_defaults(&cfg);
+    while ((c = getopt(argc, argv, "d:l:t:c:r:T:m:s:")) != -1) {
+        switch (c) {
+        case 'd': hours = atoi(optarg); break;
+        case 'l': load = atoi(optarg); break;
+        case 't': ntrips = atoi(optarg); break;
+        case 'c': csv = atoi(optarg); break;
+        case 'r': cfg.ramp_ms = atoi(optarg) * 1000; break;
+        case 'T': cfg.tail_ms = atoi(optarg) * 1000; break;
+        case 'm': cfg.min = atoi(optarg) * 10; break;
+        case 's': seed = atoi(optarg); break;
+        default: usage();
+        }
+    }
+
+    if (!hours || load <= 0 || ntrips < 0 ||
+        ntrips > (int) (sizeof(trips) / sizeof(trips[0])))
+        usage();
+
+    srand(seed);
+    secs = hours * 3600;
+    for (i = 0; i < ntrips; i++)
+        trips[i] = rand() % secs;
+
+    fanctl_init(&f, &cfg);
+    if (csv)
+        printf("t,mv,duty\n");
+
+    /* the window and the cool-down tail after it */
+    for (ms = 0; ms < (secs + 600) * 1000; ms += STEP_MS) {
+        int32_t mv, duty;
+
+        t = ms / 1000;
+        mv = t < secs ? cell_mv(t, load, trips, ntrips) : -1;
+        fanctl_run(&f, mv >= 0);
+        if (mv >= 0 && ms % 1000 == 0)
+            fanctl_load(&f, mv);
+
+        duty = fanctl_step(&f, STEP_MS);
+        if (mv >= 0) {
+            on_ms += STEP_MS;
+            legacy += 1.0;
+        }
+
+        if (duty) {
+            fan_ms += STEP_MS;
+            sum += duty / 1000.0;
+            energy += (duty / 1000.0) * (duty / 1000.0) * (duty / 1000.0);
+        }
+
+        if (csv && ms % (csv * 1000) == 0)
+            printf("%u,%d,%d\n", t, mv, duty / 10);
+    }
+
+    fprintf(csv ? stderr : stdout,
+            "cell on %.1f h, fan on %.1f h, mean duty %.0f%%, "
+            "fan energy %.0f%% of full speed\n",
+            on_ms / 3.6e6, fan_ms / 3.6e6,
+            fan_ms ? 100.0 * sum * STEP_MS / fan_ms : 0.0,
+            legacy ? 100.0 * energy / legacy : 0.0);
+    return 0;
+}
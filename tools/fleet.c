@@ -0,0 +1,1110 @@
+/**
+ * @file fleet.c  Fleet scraper for pool controllers
+ *
+ * Discovers controllers with mDNS (_pool._tcp) or takes them from the command
+ * line, fetches /status.json of all of them concurrently from one epoll loop
+ * and prints one line per device or writes all of it to a JSON file. At most
+ * -c requests are in flight and a response is capped at BODY_MAX, the memory
+ * is bounded by the number of devices and -c.
+ *
+ * Flags:
+ *   unreachable  no valid response
+ *   low-flow     flow switch open while the schedule runs, or the low flow
+ *                counter rose since the previous round (-i)
+ *   sntp-stale   no time sync for -s seconds, or never
+ *   crashed      reset by panic, watchdog or brownout less than 10 minutes
+ *                ago
+ *   reboot-loop  the same with 3 resets since power on (boots), or 3 resets
+ *                seen within an hour (-i)
+ *
+ * Build: cc -O2 -o fleet fleet.c
+ * Usage: fleet [-m] [-w ms] [-c conns] [-i secs] [-s secs] [-f] [-j file]
+ *              [host[:port[-last]] ..]
+ *
+ * -m browses mDNS for -w ms, also done without targets. -i repeats the scrape
+ * every secs seconds, -f lists flagged devices only.
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define DEV_MAX     1024
+#define BODY_MAX    32768
+#define HOST_LEN    64
+#define STR_LEN     16
+#define LOG_KEEP    3
+#define LOG_LEN     96
+#define CNT_KEEP    16
+#define TIMEOUT_US  5000000
+#define JSON_DEPTH  8
+#define LOOP_RESETS 3
+
+#define MDNS_PORT   5353
+#define MDNS_GROUP  "224.0.0.251"
+#define MDNS_SVC    "_pool._tcp.local"
+
+enum flag {
+    F_UNREACHABLE = 1 << 0,
+    F_LOW_FLOW    = 1 << 1,
+    F_SNTP_STALE  = 1 << 2,
+    F_REBOOT_LOOP = 1 << 3,
+    F_CRASHED     = 1 << 4,
+};
+
+static const char *flag_names[] = {
+    "unreachable", "low-flow", "sntp-stale", "reboot-loop", "crashed"
+};
+
+struct device {
+    char name[HOST_LEN];
+    struct sockaddr_in addr;
+    bool ok;
+    char error[32];
+
+    /* from /status.json */
+    char time[STR_LEN];
+    char start[STR_LEN];
+    char state[STR_LEN];
+    char force[STR_LEN];
+    char reset[STR_LEN];
+    long duration;
+    long uptime;
+    long boots;
+    long sntp;
+    bool powered;
+    bool flow;
+    unsigned ncnt;
+    char cnt_name[CNT_KEEP][STR_LEN];
+    unsigned long cnt[CNT_KEEP];
+    unsigned nlog;                      /* lines seen, last LOG_KEEP kept */
+    char log[LOG_KEEP][LOG_LEN];
+
+    /* history of the previous rounds */
+    bool seen;
+    long prev_uptime;
+    unsigned long prev_low_flow;
+    time_t resets[LOOP_RESETS];
+    unsigned flags;
+};
+
+struct conn {
+    int fd;
+    struct device *dev;
+    bool sent;
+    uint64_t start;
+    size_t len;
+    char buf[BODY_MAX];
+};
+
+struct json {
+    const char *p;
+    const char *end;
+};
+
+static struct device *devs;
+static unsigned ndev;
+static unsigned maxconn = 32;
+static long stale_secs = 86400;
+static bool flagged_only;
+
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static struct device *dev_add(const char *name, struct in_addr ip,
+                              unsigned port)
+{
+    struct device *d;
+    unsigned i;
+
+    for (i = 0; i < ndev; i++) {
+        if (devs[i].addr.sin_addr.s_addr == ip.s_addr &&
+                devs[i].addr.sin_port == htons(port))
+            return &devs[i];
+    }
+
+    if (ndev == DEV_MAX)
+        return NULL;
+
+    d = &devs[ndev++];
+    memset(d, 0, sizeof(*d));
+    snprintf(d->name, sizeof(d->name), "%s", name);
+    d->addr.sin_family = AF_INET;
+    d->addr.sin_addr = ip;
+    d->addr.sin_port = htons(port);
+    return d;
+}
+
+
+/* host, host:port or host:port-last */
+static bool add_target(const char *arg)
+{
+    struct addrinfo hints = { .ai_family = AF_INET }, *ai;
+    char host[HOST_LEN], name[HOST_LEN + 8];
+    unsigned port = 80, last;
+    struct in_addr ip;
+    const char *c;
+
+    c = strchr(arg, ':');
+    snprintf(host, sizeof(host), "%.*s", c ? (int) (c - arg) : HOST_LEN - 1,
+             arg);
+    if (c && sscanf(c + 1, "%u", &port) != 1)
+        return false;
+
+    last = port;
+    if (c && strchr(c, '-') && sscanf(strchr(c, '-') + 1, "%u", &last) != 1)
+        return false;
+
+    if (!port || last < port || last > 65535)
+        return false;
+
+    if (getaddrinfo(host, NULL, &hints, &ai))
+        return false;
+
+    ip = ((struct sockaddr_in *) ai->ai_addr)->sin_addr;
+    freeaddrinfo(ai);
+    for (; port <= last; port++) {
+        snprintf(name, sizeof(name), "%s:%u", host, port);
+        if (!dev_add(name, ip, port))
+            return false;
+    }
+
+    return true;
+}
+
+
+/* mDNS browse */
+
+struct rr_srv {
+    char name[HOST_LEN];
+    char target[HOST_LEN];
+    unsigned port;
+    struct in_addr from;
+};
+
+struct rr_a {
+    char name[HOST_LEN];
+    struct in_addr ip;
+};
+
+struct browse {
+    char ptr[DEV_MAX][HOST_LEN];
+    unsigned nptr;
+    struct rr_srv srv[DEV_MAX];
+    unsigned nsrv;
+    struct rr_a a[DEV_MAX];
+    unsigned na;
+};
+
+
+/* Decodes a possibly compressed name, returns the offset after it */
+static long dns_name(const uint8_t *msg, size_t len, size_t off, char *out,
+                     size_t size)
+{
+    long next = -1;
+    size_t n = 0;
+    int jumps = 0;
+    uint8_t l;
+
+    while (off < len) {
+        l = msg[off];
+        if ((l & 0xc0) == 0xc0) {
+            if (off + 1 >= len || ++jumps > 16)
+                return -1;
+
+            if (next < 0)
+                next = off + 2;
+
+            off = (l & 0x3f) << 8 | msg[off + 1];
+            continue;
+        }
+
+        if (!l) {
+            out[n ? n - 1 : 0] = '\0';
+            return next < 0 ? (long) off + 1 : next;
+        }
+
+        if (off + 1 + l > len || n + l + 1 >= size)
+            return -1;
+
+        memcpy(out + n, msg + off + 1, l);
+        n += l;
+        out[n++] = '.';
+        off += 1 + l;
+    }
+
+    return -1;
+}
+
+
+static void browse_parse(struct browse *b, const uint8_t *msg, size_t len,
+                         struct in_addr from)
+{
+    char name[HOST_LEN];
+    unsigned count, i;
+    uint16_t type, rdlen;
+    long off;
+
+    if (len < 12 || !(msg[2] & 0x80))
+        return;
+
+    count = (msg[6] << 8 | msg[7]) + (msg[8] << 8 | msg[9]) +
+            (msg[10] << 8 | msg[11]);
+    off = 12;
+    for (i = 0; i < (unsigned) (msg[4] << 8 | msg[5]); i++) {
+        off = dns_name(msg, len, off, name, sizeof(name));
+        if (off < 0 || (size_t) off + 4 > len)
+            return;
+        off += 4;
+    }
+
+    for (i = 0; i < count; i++) {
+        off = dns_name(msg, len, off, name, sizeof(name));
+        if (off < 0 || (size_t) off + 10 > len)
+            return;
+
+        type  = msg[off] << 8 | msg[off + 1];
+        rdlen = msg[off + 8] << 8 | msg[off + 9];
+        off += 10;
+        if ((size_t) off + rdlen > len)
+            return;
+
+        if (type == 12 && !strcasecmp(name, MDNS_SVC) && b->nptr < DEV_MAX) {
+            if (dns_name(msg, len, off, b->ptr[b->nptr], HOST_LEN) > 0)
+                b->nptr++;
+        }
+        else if (type == 33 && rdlen > 6 && b->nsrv < DEV_MAX) {
+            struct rr_srv *s = &b->srv[b->nsrv];
+
+            snprintf(s->name, sizeof(s->name), "%s", name);
+            s->port = msg[off + 4] << 8 | msg[off + 5];
+            s->from = from;
+            if (dns_name(msg, len, off + 6, s->target, HOST_LEN) > 0)
+                b->nsrv++;
+        }
+        else if (type == 1 && rdlen == 4 && b->na < DEV_MAX) {
+            snprintf(b->a[b->na].name, HOST_LEN, "%s", name);
+            memcpy(&b->a[b->na].ip, msg + off, 4);
+            b->na++;
+        }
+
+        off += rdlen;
+    }
+}
+
+
+static size_t browse_query(uint8_t *buf)
+{
+    const char *p = MDNS_SVC, *dot;
+    size_t n = 12;
+
+    memset(buf, 0, 12);
+    buf[5] = 1;
+    do {
+        dot = strchr(p, '.');
+        buf[n] = dot ? (size_t) (dot - p) : strlen(p);
+        memcpy(buf + n + 1, p, buf[n]);
+        n += 1 + buf[n];
+        p = dot + 1;
+    } while (dot);
+
+    buf[n++] = 0;
+    buf[n++] = 0;
+    buf[n++] = 12;      /* PTR */
+    buf[n++] = 0;
+    buf[n++] = 1;       /* IN */
+    return n;
+}
+
+
+/* Queries twice and collects answers for wait_ms. Listens on 5353 for
+ * multicast answers if possible, else on an ephemeral port for legacy
+ * unicast answers. */
+static void discover(unsigned wait_ms)
+{
+    struct sockaddr_in sa = { .sin_family = AF_INET }, from;
+    struct ip_mreq mreq = { 0 };
+    socklen_t flen;
+    uint64_t t0 = now_us(), now;
+    uint8_t buf[1500];
+    struct browse *b;
+    struct pollfd pfd;
+    unsigned i, j, k, before = ndev;
+    int fd, one = 1, sent = 0;
+    char label[HOST_LEN];
+    ssize_t n;
+
+    b = calloc(1, sizeof(*b));
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (!b || fd < 0) {
+        free(b);
+        return;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+#ifdef SO_REUSEPORT
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+#endif
+    sa.sin_port = htons(MDNS_PORT);
+    if (bind(fd, (struct sockaddr *) &sa, sizeof(sa))) {
+        sa.sin_port = 0;
+        bind(fd, (struct sockaddr *) &sa, sizeof(sa));
+    }
+    else {
+        inet_aton(MDNS_GROUP, &mreq.imr_multiaddr);
+        setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+    }
+
+    sa.sin_port = htons(MDNS_PORT);
+    inet_aton(MDNS_GROUP, &sa.sin_addr);
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while ((now = now_us()) - t0 < wait_ms * 1000ULL) {
+        if (sent < 2 && now - t0 >= sent * wait_ms * 500ULL) {
+            n = browse_query(buf);
+            sendto(fd, buf, n, 0, (struct sockaddr *) &sa, sizeof(sa));
+            sent++;
+        }
+
+        if (poll(&pfd, 1, 50) <= 0)
+            continue;
+
+        flen = sizeof(from);
+        n = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *) &from,
+                     &flen);
+        if (n > 0)
+            browse_parse(b, buf, n, from.sin_addr);
+    }
+
+    close(fd);
+    for (i = 0; i < b->nptr; i++) {
+        for (j = 0; j < b->nsrv; j++) {
+            struct rr_srv *s = &b->srv[j];
+            struct in_addr ip = s->from;
+
+            if (strcasecmp(s->name, b->ptr[i]))
+                continue;
+
+            for (k = 0; k < b->na; k++) {
+                if (!strcasecmp(b->a[k].name, s->target))
+                    ip = b->a[k].ip;
+            }
+
+            /* instance name without the service */
+            snprintf(label, sizeof(label), "%s", s->name);
+            label[strcspn(label, ".")] = '\0';
+            dev_add(label, ip, s->port);
+            break;
+        }
+    }
+
+    fprintf(stderr, "mdns: %u controllers\n", ndev - before);
+    free(b);
+}
+
+
+/* minimal JSON reader for /status.json */
+
+static void json_ws(struct json *j)
+{
+    while (j->p < j->end && strchr(" \t\r\n", *j->p))
+        j->p++;
+}
+
+
+static bool json_char(struct json *j, char c)
+{
+    json_ws(j);
+    if (j->p < j->end && *j->p == c) {
+        j->p++;
+        return true;
+    }
+
+    return false;
+}
+
+
+/* Reads a string, out may be NULL, escapes other than the short ones end
+ * up as '?' */
+static bool json_str(struct json *j, char *out, size_t size)
+{
+    size_t n = 0;
+    char c;
+
+    if (!json_char(j, '"'))
+        return false;
+
+    while (j->p < j->end && *j->p != '"') {
+        c = *j->p++;
+        if (c == '\\' && j->p < j->end) {
+            c = *j->p++;
+            switch (c) {
+            case 'n': c = ' '; break;
+            case 't': c = ' '; break;
+            case 'u':
+                j->p += j->end - j->p >= 4 ? 4 : j->end - j->p;
+                c = '?';
+                break;
+            case '"': case '\\': case '/': break;
+            default: c = '?'; break;
+            }
+        }
+
+        if (out && n + 1 < size)
+            out[n++] = c;
+    }
+
+    if (out && size)
+        out[n] = '\0';
+
+    return json_char(j, '"');
+}
+
+
+static bool json_num(struct json *j, long *v)
+{
+    char *e;
+
+    json_ws(j);
+    *v = strtol(j->p, &e, 10);
+    if (e == j->p || e > j->end)
+        return false;
+
+    j->p = e;
+    return true;
+}
+
+
+static bool json_bool(struct json *j, bool *v)
+{
+    json_ws(j);
+    if (j->end - j->p >= 4 && !strncmp(j->p, "true", 4)) {
+        j->p += 4;
+        *v = true;
+        return true;
+    }
+
+    if (j->end - j->p >= 5 && !strncmp(j->p, "false", 5)) {
+        j->p += 5;
+        *v = false;
+        return true;
+    }
+
+    return false;
+}
+
+
+static bool json_skip(struct json *j, int depth)
+{
+    char open, close;
+
+    json_ws(j);
+    if (j->p >= j->end || depth > JSON_DEPTH)
+        return false;
+
+    if (*j->p == '"')
+        return json_str(j, NULL, 0);
+
+    if (*j->p != '{' && *j->p != '[') {
+        while (j->p < j->end && !strchr(",]} \t\r\n", *j->p))
+            j->p++;
+        return true;
+    }
+
+    open = *j->p++;
+    close = open == '{' ? '}' : ']';
+    if (json_char(j, close))
+        return true;
+
+    do {
+        if (open == '{' && (!json_str(j, NULL, 0) || !json_char(j, ':')))
+            return false;
+
+        if (!json_skip(j, depth + 1))
+            return false;
+    } while (json_char(j, ','));
+
+    return json_char(j, close);
+}
+
+
+static bool parse_counters(struct json *j, struct device *d)
+{
+    char name[STR_LEN];
+    long v;
+
+    if (!json_char(j, '{'))
+        return false;
+
+    if (json_char(j, '}'))
+        return true;
+
+    do {
+        if (!json_str(j, name, sizeof(name)) || !json_char(j, ':') ||
+                !json_num(j, &v))
+            return false;
+
+        if (d->ncnt < CNT_KEEP) {
+            memcpy(d->cnt_name[d->ncnt], name, sizeof(name));
+            d->cnt[d->ncnt++] = v;
+        }
+    } while (json_char(j, ','));
+
+    return json_char(j, '}');
+}
+
+
+static bool parse_log(struct json *j, struct device *d)
+{
+    if (!json_char(j, '['))
+        return false;
+
+    if (json_char(j, ']'))
+        return true;
+
+    do {
+        if (!json_str(j, d->log[d->nlog % LOG_KEEP], LOG_LEN))
+            return false;
+        d->nlog++;
+    } while (json_char(j, ','));
+
+    return json_char(j, ']');
+}
+
+
+static bool parse_status(struct device *d, const char *body, size_t len)
+{
+    struct json j = { body, body + len };
+    char key[STR_LEN];
+    bool ok;
+
+    d->ncnt = d->nlog = 0;
+    d->sntp = -1;
+    if (!json_char(&j, '{'))
+        return false;
+
+    do {
+        if (!json_str(&j, key, sizeof(key)) || !json_char(&j, ':'))
+            return false;
+
+        if (!strcmp(key, "time"))
+            ok = json_str(&j, d->time, sizeof(d->time));
+        else if (!strcmp(key, "start"))
+            ok = json_str(&j, d->start, sizeof(d->start));
+        else if (!strcmp(key, "state"))
+            ok = json_str(&j, d->state, sizeof(d->state));
+        else if (!strcmp(key, "force"))
+            ok = json_str(&j, d->force, sizeof(d->force));
+        else if (!strcmp(key, "reset"))
+            ok = json_str(&j, d->reset, sizeof(d->reset));
+        else if (!strcmp(key, "duration"))
+            ok = json_num(&j, &d->duration);
+        else if (!strcmp(key, "uptime"))
+            ok = json_num(&j, &d->uptime);
+        else if (!strcmp(key, "boots"))
+            ok = json_num(&j, &d->boots);
+        else if (!strcmp(key, "sntp"))
+            ok = json_num(&j, &d->sntp);
+        else if (!strcmp(key, "powered"))
+            ok = json_bool(&j, &d->powered);
+        else if (!strcmp(key, "flow"))
+            ok = json_bool(&j, &d->flow);
+        else if (!strcmp(key, "counters"))
+            ok = parse_counters(&j, d);
+        else if (!strcmp(key, "log"))
+            ok = parse_log(&j, d);
+        else
+            ok = json_skip(&j, 0);
+
+        if (!ok)
+            return false;
+    } while (json_char(&j, ','));
+
+    return json_char(&j, '}');
+}
+
+
+static const char *last_log(const struct device *d)
+{
+    return d->nlog ? d->log[(d->nlog - 1) % LOG_KEEP] : "";
+}
+
+
+static unsigned long counter(const struct device *d, const char *name)
+{
+    unsigned i;
+
+    for (i = 0; i < d->ncnt; i++) {
+        if (!strcmp(d->cnt_name[i], name))
+            return d->cnt[i];
+    }
+
+    return 0;
+}
+
+
+static void evaluate(struct device *d, time_t now)
+{
+    static const char *abnormal[] = {
+        "panic", "int_wdt", "task_wdt", "wdt", "brownout"
+    };
+    unsigned long low_flow = counter(d, "low flow");
+    unsigned i;
+
+    d->flags = 0;
+    if (!d->ok) {
+        d->flags = F_UNREACHABLE;
+        return;
+    }
+
+    if (!strcmp(d->state, "running") && !d->flow)
+        d->flags |= F_LOW_FLOW;
+
+    if (d->sntp < 0 || d->sntp > stale_secs)
+        d->flags |= F_SNTP_STALE;
+
+    /* a single crash is no loop, boots counts the resets since power on */
+    for (i = 0; i < sizeof(abnormal) / sizeof(abnormal[0]); i++) {
+        if (strcmp(d->reset, abnormal[i]) || d->uptime >= 600)
+            continue;
+
+        d->flags |= d->boots >= LOOP_RESETS ? F_REBOOT_LOOP : F_CRASHED;
+    }
+
+    if (d->seen) {
+        if (low_flow > d->prev_low_flow)
+            d->flags |= F_LOW_FLOW;
+
+        if (d->uptime < d->prev_uptime) {
+            memmove(d->resets + 1, d->resets,
+                    (LOOP_RESETS - 1) * sizeof(d->resets[0]));
+            d->resets[0] = now;
+        }
+
+        if (d->resets[LOOP_RESETS - 1] &&
+                now - d->resets[LOOP_RESETS - 1] < 3600)
+            d->flags |= F_REBOOT_LOOP;
+    }
+
+    d->seen = true;
+    d->prev_uptime = d->uptime;
+    d->prev_low_flow = low_flow;
+}
+
+
+/* scraping */
+
+static void conn_close(int ep, struct conn *c)
+{
+    epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    c->dev = NULL;
+}
+
+
+static void fail(int ep, struct conn *c, const char *err)
+{
+    snprintf(c->dev->error, sizeof(c->dev->error), "%s", err);
+    c->dev->ok = false;
+    conn_close(ep, c);
+}
+
+
+/* Decodes a chunked body in place */
+static bool dechunk(char *p, size_t *len)
+{
+    char *in = p, *end = p + *len, *e;
+    size_t n = 0;
+    unsigned long sz;
+
+    while (in < end) {
+        sz = strtoul(in, &e, 16);
+        if (e == in || !(e = strstr(e, "\r\n")) || e + 2 + sz > end)
+            return false;
+
+        if (!sz)
+            break;
+
+        memmove(p + n, e + 2, sz);
+        n += sz;
+        in = e + 2 + sz + 2;
+    }
+
+    *len = n;
+    return true;
+}
+
+
+static void finish(int ep, struct conn *c)
+{
+    char *body, *hdr = c->buf;
+    size_t blen;
+
+    c->buf[c->len] = '\0';
+    body = strstr(hdr, "\r\n\r\n");
+    if (strncmp(hdr, "HTTP/1.", 7) || !body || atoi(hdr + 9) != 200) {
+        fail(ep, c, "bad response");
+        return;
+    }
+
+    *body = '\0';
+    body += 4;
+    blen = c->len - (body - c->buf);
+    if (strcasestr(hdr, "transfer-encoding: chunked") &&
+            !dechunk(body, &blen)) {
+        fail(ep, c, "bad chunk");
+        return;
+    }
+
+    c->dev->ok = parse_status(c->dev, body, blen);
+    if (!c->dev->ok)
+        snprintf(c->dev->error, sizeof(c->dev->error), "bad json");
+
+    conn_close(ep, c);
+}
+
+
+static bool conn_start(int ep, struct conn *c, struct device *d)
+{
+    struct epoll_event ev = { .events = EPOLLOUT | EPOLLIN };
+
+    c->dev = d;
+    c->sent = false;
+    c->len = 0;
+    c->start = now_us();
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0) {
+        snprintf(d->error, sizeof(d->error), "socket: %s", strerror(errno));
+        c->dev = NULL;
+        return false;
+    }
+
+    if (connect(c->fd, (struct sockaddr *) &d->addr, sizeof(d->addr)) &&
+            errno != EINPROGRESS) {
+        snprintf(d->error, sizeof(d->error), "%s", strerror(errno));
+        close(c->fd);
+        c->fd = -1;
+        c->dev = NULL;
+        return false;
+    }
+
+    ev.data.ptr = c;
+    epoll_ctl(ep, EPOLL_CTL_ADD, c->fd, &ev);
+    return true;
+}
+
+
+static void on_event(int ep, struct conn *c, uint32_t events)
+{
+    static const char req[] = "GET /status.json HTTP/1.1\r\nHost: pool\r\n"
+                              "Connection: close\r\n\r\n";
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+    ssize_t n;
+
+    if (!c->sent) {
+        if (!(events & EPOLLOUT))
+            return;
+
+        if (send(c->fd, req, sizeof(req) - 1, MSG_NOSIGNAL) < 0) {
+            fail(ep, c, strerror(errno));
+            return;
+        }
+
+        c->sent = true;
+        epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+        return;
+    }
+
+    while ((n = recv(c->fd, c->buf + c->len, BODY_MAX - 1 - c->len, 0)) > 0) {
+        c->len += n;
+        if (c->len == BODY_MAX - 1) {
+            fail(ep, c, "too large");
+            return;
+        }
+    }
+
+    if (!n)
+        finish(ep, c);
+    else if (errno != EAGAIN)
+        fail(ep, c, strerror(errno));
+}
+
+
+static void scrape(int ep, struct conn *conns)
+{
+    struct epoll_event evs[64];
+    unsigned next = 0, active = 0, i;
+    uint64_t now;
+    int k, m;
+
+    for (i = 0; i < ndev; i++) {
+        devs[i].ok = false;
+        snprintf(devs[i].error, sizeof(devs[i].error), "timeout");
+    }
+
+    while (next < ndev || active) {
+        for (i = 0; i < maxconn && next < ndev; i++) {
+            if (conns[i].dev)
+                continue;
+
+            if (conn_start(ep, &conns[i], &devs[next++]))
+                active++;
+        }
+
+        m = epoll_wait(ep, evs, 64, 100);
+        for (k = 0; k < m; k++)
+            on_event(ep, evs[k].data.ptr, evs[k].events);
+
+        now = now_us();
+        active = 0;
+        for (i = 0; i < maxconn; i++) {
+            if (conns[i].dev && now - conns[i].start > TIMEOUT_US)
+                fail(ep, &conns[i], "timeout");
+
+            if (conns[i].dev)
+                active++;
+        }
+    }
+}
+
+
+/* output */
+
+static void flags_str(unsigned flags, char *buf, size_t size)
+{
+    size_t n = 0;
+    unsigned i;
+
+    buf[0] = '\0';
+    for (i = 0; i < sizeof(flag_names) / sizeof(flag_names[0]); i++) {
+        if (flags & (1u << i))
+            n += snprintf(buf + n, n < size ? size - n : 0, "%s%s",
+                          n ? "," : "", flag_names[i]);
+    }
+}
+
+
+static void print_table(void)
+{
+    char flags[64];
+    unsigned i, bad = 0;
+
+    printf("%-20s %-9s %-5s %-4s %8s %5s %-9s %6s  %-24s %s\n", "device",
+           "state", "force", "flow", "uptime", "boots", "reset", "sntp",
+           "flags", "last log");
+    for (i = 0; i < ndev; i++) {
+        const struct device *d = &devs[i];
+
+        flags_str(d->flags, flags, sizeof(flags));
+        bad += d->flags != 0;
+        if (flagged_only && !d->flags)
+            continue;
+
+        if (!d->ok) {
+            printf("%-20s %-9s %-5s %-4s %8s %5s %-9s %6s  %-24s %s\n",
+                   d->name, "-", "-", "-", "-", "-", "-", "-", flags,
+                   d->error);
+            continue;
+        }
+
+        printf("%-20s %-9s %-5s %-4s %8ld %5ld %-9s %6ld  %-24s %.40s\n",
+               d->name, d->state, d->force, d->flow ? "ok" : "low",
+               d->uptime, d->boots, d->reset, d->sntp, flags, last_log(d));
+    }
+
+    printf("%u devices, %u flagged\n", ndev, bad);
+}
+
+
+static void json_put_str(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(f, "\\%c", *s);
+        else if ((unsigned char) *s < 0x20)
+            fprintf(f, "\\u%04x", *s);
+        else
+            fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+
+static int write_json(const char *path)
+{
+    char tmp[256];
+    unsigned i, k, first;
+    FILE *f;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    f = fopen(tmp, "w");
+    if (!f)
+        return -1;
+
+    fprintf(f, "{\"time\":%ld,\"devices\":[", (long) time(NULL));
+    for (i = 0; i < ndev; i++) {
+        const struct device *d = &devs[i];
+
+        fprintf(f, "%s\n{\"name\":", i ? "," : "");
+        json_put_str(f, d->name);
+        fprintf(f, ",\"addr\":\"%s:%u\",\"flags\":[",
+                inet_ntoa(d->addr.sin_addr), ntohs(d->addr.sin_port));
+        for (k = 0; k < sizeof(flag_names) / sizeof(flag_names[0]); k++) {
+            if (d->flags & (1u << k))
+                fprintf(f, "%s\"%s\"", d->flags & ((1u << k) - 1) ? "," : "",
+                        flag_names[k]);
+        }
+
+        if (!d->ok) {
+            fprintf(f, "],\"error\":");
+            json_put_str(f, d->error);
+            fputc('}', f);
+            continue;
+        }
+
+        fprintf(f, "],\"state\":");
+        json_put_str(f, d->state);
+        fprintf(f, ",\"force\":");
+        json_put_str(f, d->force);
+        fprintf(f, ",\"start\":");
+        json_put_str(f, d->start);
+        fprintf(f, ",\"duration\":%ld,\"powered\":%s,\"flow\":%s,"
+                "\"uptime\":%ld,\"boots\":%ld,\"reset\":", d->duration,
+                d->powered ? "true" : "false", d->flow ? "true" : "false",
+                d->uptime, d->boots);
+        json_put_str(f, d->reset);
+        fprintf(f, ",\"sntp\":%ld,\"counters\":{", d->sntp);
+        for (k = 0; k < d->ncnt; k++) {
+            fputs(k ? "," : "", f);
+            json_put_str(f, d->cnt_name[k]);
+            fprintf(f, ":%lu", d->cnt[k]);
+        }
+
+        fprintf(f, "},\"log\":[");
+        first = d->nlog > LOG_KEEP ? d->nlog - LOG_KEEP : 0;
+        for (k = first; k < d->nlog; k++) {
+            fputs(k > first ? "," : "", f);
+            json_put_str(f, d->log[k % LOG_KEEP]);
+        }
+        fputs("]}", f);
+    }
+
+    fputs("\n]}\n", f);
+    if (fclose(f))
+        return -1;
+
+    return rename(tmp, path);
+}
+
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: fleet [-m] [-w ms] [-c conns] [-i secs] "
+            "[-s secs] [-f] [-j file] [host[:port[-last]] ..]\n");
+    exit(2);
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *json = NULL;
+    unsigned wait_ms = 1500, interval = 0, i;
+    bool mdns = false;
+    struct conn *conns;
+    uint64_t t0;
+    int opt, ep;
+
+    while ((opt = getopt(argc, argv, "mw:c:i:s:fj:")) != -1) {
+        switch (opt) {
+        case 'm': mdns = true; break;
+        case 'w': wait_ms = atoi(optarg); break;
+        case 'c': maxconn = atoi(optarg); break;
+        case 'i': interval = atoi(optarg); break;
+        case 's': stale_secs = atol(optarg); break;
+        case 'f': flagged_only = true; break;
+        case 'j': json = optarg; break;
+        default: usage();
+        }
+    }
+
+    devs = calloc(DEV_MAX, sizeof(*devs));
+    if (!devs || !maxconn)
+        usage();
+
+    for (i = optind; i < (unsigned) argc; i++) {
+        if (!add_target(argv[i])) {
+            fprintf(stderr, "bad target %s\n", argv[i]);
+            return 2;
+        }
+    }
+
+    if (mdns || optind == argc)
+        discover(wait_ms);
+
+    if (!ndev) {
+        fprintf(stderr, "no controllers\n");
+        return 1;
+    }
+
+    if (maxconn > ndev)
+        maxconn = ndev;
+
+    conns = calloc(maxconn, sizeof(*conns));
+    ep = epoll_create1(0);
+    if (!conns || ep < 0) {
+        perror("fleet");
+        return 1;
+    }
+
+    for (i = 0; i < maxconn; i++)
+        conns[i].fd = -1;
+
+    do {
+        t0 = now_us();
+        scrape(ep, conns);
+        for (i = 0; i < ndev; i++)
+            evaluate(&devs[i], time(NULL));
+
+        if (json) {
+            if (write_json(json))
+                perror(json);
+        }
+        else {
+            print_table();
+        }
+
+        fprintf(stderr, "scraped %u devices in %.1f ms\n", ndev,
+                (now_us() - t0) / 1000.0);
+        if (interval && (now_us() - t0) / 1000000 < interval)
+            sleep(interval - (now_us() - t0) / 1000000);
+    } while (interval);
+
+    close(ep);
+    free(conns);
+    free(devs);
+    return 0;
+}
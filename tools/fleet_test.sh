@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# Starts N host build instances on HTTP ports 18100 + i and scrapes them with
+# fleet. Instance 1 simulates low flow, instance 2 a panic reset and the
+# port after the last instance is left unused to show an unreachable device.
+#
+# Usage: tools/fleet_test.sh [build-dir] [devices]
+#
+# Copyright (C) 2021 Christian Spielberger
+
+BUILD=${1:-build-host}
+COUNT=${2:-100}
+TMP=$(mktemp -d)
+PIDS=
+
+cleanup() {
+    kill $PIDS 2>/dev/null
+    rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+if [ ! -x "$BUILD/pool_host" ] || [ ! -x "$BUILD/fleet" ]; then
+    echo "$BUILD/pool_host or fleet not found, build with:"
+    echo "  cmake -S host -B $BUILD && cmake --build $BUILD"
+    exit 1
+fi
+
+BUILD=$(cd "$BUILD" && pwd)
+i=0
+while [ $i -lt "$COUNT" ]; do
+    case $i in
+    1) OPT=-F ;;
+    2) OPT=-P ;;
+    *) OPT= ;;
+    esac
+    mkdir "$TMP/$i"
+    (cd "$TMP/$i" && exec "$BUILD/pool_host" -p $((18100 + i)) -l 1 $OPT) \
+        >"$TMP/$i/host.log" 2>&1 &
+    PIDS="$PIDS $!"
+    i=$((i + 1))
+done
+sleep 2
+
+"$BUILD/fleet" -j "$TMP/fleet.json" 127.0.0.1:18100-$((18100 + COUNT)) &&
+    echo "fleet.json $(wc -c <"$TMP/fleet.json") bytes"
+"$BUILD/fleet" -f 127.0.0.1:18100-$((18100 + COUNT))
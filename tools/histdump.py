@@ -0,0 +1,185 @@
+#!/usr/bin/env python3
+"""
+Downloads and decodes the history of a pool controller
+Usage::
+    ./histdump.py [-p port] [-f from] [-t to] [-s series] [-o csv] host
+    ./histdump.py -r dump.bin [-o csv]
+
+Fetches GET /export for a time range (unix time, or -d days back from now)
+and writes the records as CSV, one line per record. A broken download is
+resumed with offset=<last sequence number + 1>, a busy device (503) is
+asked again after Retry-After. Resolve and connection errors before the
+first byte and other HTTP errors end the download. -w saves the raw
+export, -r decodes a saved export instead. Prints records, bytes, time and
+throughput of the download, CRC errors make the exit code 1.
+"""
+import argparse
+import http.client
+import os
+import socket
+import struct
+import sys
+import time
+import zlib
+
+HDR = struct.Struct('<4sBBHII')
+REC = struct.Struct('<IIhBBBbH')
+EVENTS = ['on', 'off', 'cutoff', 'flow_ok', 'flow_low', 'polarity']
+
+
+class Fatal(Exception):
+    """An error a retry does not fix"""
+
+
+def header(data, state):
+    magic, version, size, _, first, nxt = HDR.unpack_from(data)
+    if magic != b'PHST' or version != 1 or size != REC.size:
+        raise ValueError('not a history export')
+    state.setdefault('first', first)
+    state['next'] = nxt
+
+
+def records(data, out, state):
+    """Decodes the whole records of data, returns the bytes used"""
+    used = 0
+    while used + REC.size <= len(data):
+        rec = data[used:used + REC.size]
+        seq, t, val, typ, code, cell_s, rssi, crc = REC.unpack(rec)
+        used += REC.size
+        if zlib.crc32(rec[:14]) & 0xffff != crc:
+            state['crc'] += 1
+            continue
+        state['records'] += 1
+        state['last'] = seq
+        if not out:
+            continue
+        if typ == 0:
+            out.write('%d,%d,sample,%d,%d,%d,%d,%d,%d\n' % (
+                seq, t, code & 1, code >> 1 & 1, code >> 2 & 1, cell_s,
+                val, rssi))
+        else:
+            name = EVENTS[code] if code < len(EVENTS) else str(code)
+            out.write('%d,%d,%s,,,,,%d,\n' % (seq, t, name, val))
+    return used
+
+
+def fetch(args, out, state, raw):
+    """One request, returns True if the export was complete. Sets
+    state['wait'] to the seconds to wait before the next one."""
+    query = 'series=%s&offset=%d' % (args.series, state['last'] + 1)
+    if args.frm:
+        query += '&from=%d' % args.frm
+    if args.to:
+        query += '&to=%d' % args.to
+    conn = http.client.HTTPConnection(args.host, args.port, timeout=10)
+    buf = b''
+    hdr = False
+    state['wait'] = 0
+    try:
+        conn.connect()
+    except OSError as e:
+        # a resumed download may meet the device rebooting
+        if state['bytes'] and not isinstance(e, socket.gaierror):
+            print('interrupted: %s' % e, file=sys.stderr)
+            return False
+        hint = ', -r decodes a file' if os.path.isfile(args.host) else ''
+        raise Fatal('cannot connect to %s: %s%s' % (args.host, e, hint))
+    try:
+        conn.request('GET', '/export?' + query)
+        resp = conn.getresponse()
+        if resp.status == 503:
+            state['wait'] = int(resp.getheader('Retry-After', '1'))
+            print('busy, retry in %d s' % state['wait'], file=sys.stderr)
+            return False
+        if resp.status != 200:
+            raise Fatal('%d %s' % (resp.status, resp.read().decode()))
+        while True:
+            chunk = resp.read1(65536)
+            if not chunk:
+                break
+            state['bytes'] += len(chunk)
+            buf += chunk
+            if not hdr:
+                if len(buf) < HDR.size:
+                    continue
+                header(buf, state)
+                if raw and not raw.tell():
+                    raw.write(buf[:HDR.size])
+                buf = buf[HDR.size:]
+                hdr = True
+            n = records(buf, out, state)
+            if raw:
+                raw.write(buf[:n])
+            buf = buf[n:]
+        return hdr and not buf
+    except (OSError, RuntimeError, http.client.HTTPException) as e:
+        print('interrupted: %s' % e, file=sys.stderr)
+        return False
+    finally:
+        conn.close()
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument('host', nargs='?')
+    ap.add_argument('-p', '--port', type=int, default=80)
+    ap.add_argument('-f', '--from', dest='frm', type=int, default=0)
+    ap.add_argument('-t', '--to', type=int, default=0)
+    ap.add_argument('-d', '--days', type=float, default=0)
+    ap.add_argument('-s', '--series', default='all',
+                    choices=['all', 'telemetry', 'journal'])
+    ap.add_argument('-o', '--output', help='CSV file, - for stdout')
+    ap.add_argument('-w', '--write', help='save the raw export')
+    ap.add_argument('-r', '--read', help='decode a saved export')
+    ap.add_argument('-n', '--retries', type=int, default=5)
+    args = ap.parse_args()
+
+    if not args.host and not args.read:
+        ap.error('host or -r needed')
+    if args.days:
+        args.frm = int(time.time() - args.days * 86400)
+
+    out = None
+    if args.output == '-':
+        out = sys.stdout
+    elif args.output:
+        out = open(args.output, 'w')
+    if out:
+        out.write('seq,t,type,powered,polarity,flow_ok,cell_s,val,rssi\n')
+
+    state = {'records': 0, 'bytes': 0, 'crc': 0, 'last': -1}
+    if args.read:
+        with open(args.read, 'rb') as f:
+            data = f.read()
+        state['bytes'] = len(data)
+        header(data, state)
+        records(data[HDR.size:], out, state)
+        print('decoded    %d records, %d CRC errors' % (
+            state['records'], state['crc']), file=sys.stderr)
+        return 1 if state['crc'] else 0
+
+    raw = open(args.write, 'wb') if args.write else None
+    start = time.monotonic()
+    done = False
+    for i in range(args.retries + 1):
+        try:
+            done = fetch(args, out, state, raw)
+        except Fatal as e:
+            print('error: %s' % e, file=sys.stderr)
+            break
+        if done:
+            break
+        time.sleep(state['wait'] or 0.5 * (i + 1))
+    secs = time.monotonic() - start
+
+    print('records    %d (%d..%d stored), %d bytes in %.3f s, %.0f kB/s%s' % (
+        state['records'], state.get('first', 0), state.get('next', 1) - 1,
+        state['bytes'], secs, state['bytes'] / 1000 / secs if secs else 0,
+        '' if done else ', incomplete'), file=sys.stderr)
+    if state['crc']:
+        print('crc errors %d' % state['crc'], file=sys.stderr)
+    return 0 if done and not state['crc'] else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
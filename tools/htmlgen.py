@@ -0,0 +1,154 @@
+#!/usr/bin/env python3
+"""
+Compiles an HTML template into a static segment table for tpl_render()
+Usage::
+    ./htmlgen.py <template.html> <output.h>
+
+The table is named <template>_tpl, the slot values are passed in a
+generated struct <template>_vals. Template syntax:
+    {{name}}                    string, HTML escaped, NULL renders nothing
+    {{name:int}}                integer
+    {{name:fn}}                 callback, writes into the output itself
+    {{#name}} ... {{/name}}     section, rendered if the bool name is true
+    {{! comment }}
+"""
+import os
+import re
+import sys
+
+TYPES = {
+    'str':  ('TPL_STR',  'const char *'),
+    'int':  ('TPL_INT',  'int '),
+    'bool': ('TPL_BOOL', 'bool '),
+    'fn':   ('TPL_FN',   'tpl_fn *'),
+}
+
+TAG = re.compile(r'\{\{\s*(.*?)\s*\}\}', re.S)
+NAME = re.compile(r'^[a-z_][a-z0-9_]*$')
+
+
+class TemplateError(Exception):
+    pass
+
+
+def c_string(text):
+    """C string literal lines for text, split after newlines"""
+    out = []
+    for line in re.split(r'(?<=\n)', text):
+        if not line:
+            continue
+        s = line.replace('\\', '\\\\').replace('"', '\\"')
+        s = s.replace('\n', '\\n').replace('\t', '\\t')
+        out.append('"%s"' % s)
+    return out
+
+
+def parse(src):
+    segs = []
+    slots = {}
+    stack = []
+    pos = 0
+
+    def slot(name, typ):
+        if not NAME.match(name):
+            raise TemplateError('bad slot name "%s"' % name)
+        if typ not in TYPES:
+            raise TemplateError('unknown type "%s" of "%s"' % (typ, name))
+        if slots.setdefault(name, typ) != typ:
+            raise TemplateError('"%s" used as %s and %s' %
+                                (name, slots[name], typ))
+
+    for m in TAG.finditer(src):
+        if m.start() > pos:
+            segs.append(['TPL_TEXT', src[pos:m.start()], None])
+        pos = m.end()
+
+        tag = m.group(1)
+        if tag.startswith('!'):
+            continue
+        if tag.startswith('#'):
+            name = tag[1:].strip()
+            slot(name, 'bool')
+            stack.append((name, len(segs)))
+            segs.append(['TPL_BOOL', 0, name])
+        elif tag.startswith('/'):
+            name = tag[1:].strip()
+            if not stack or stack[-1][0] != name:
+                raise TemplateError('unexpected {{/%s}}' % name)
+            _, i = stack.pop()
+            segs[i][1] = len(segs) - i - 1
+        else:
+            name, _, typ = tag.partition(':')
+            name = name.strip()
+            typ = typ.strip() or 'str'
+            slot(name, typ)
+            segs.append([TYPES[typ][0], 0, name])
+
+    if stack:
+        raise TemplateError('unclosed {{#%s}}' % stack[-1][0])
+    if pos < len(src):
+        segs.append(['TPL_TEXT', src[pos:], None])
+
+    return segs, slots
+
+
+def generate(src, base, srcname):
+    segs, slots = parse(src)
+    guard = '%s_TPL_H' % base.upper()
+    vals = 'struct %s_vals' % base
+    out = []
+
+    out.append('/* Generated by htmlgen.py from %s, do not edit */' % srcname)
+    out.append('#ifndef %s' % guard)
+    out.append('#define %s' % guard)
+    out.append('#include <stdbool.h>')
+    out.append('#include <stddef.h>')
+    out.append('#include "tpl.h"')
+    out.append('')
+    out.append('%s {' % vals)
+    for name, typ in slots.items():
+        out.append('    %s%s;' % (TYPES[typ][1], name))
+    out.append('};')
+    out.append('')
+    out.append('static const struct tpl_seg %s_tpl[] = {' % base)
+    for typ, arg, name in segs:
+        if typ == 'TPL_TEXT':
+            data = arg.encode('utf-8')
+            if len(data) > 0xffff:
+                raise TemplateError('text segment too long')
+            out.append('    { TPL_TEXT, %d, 0,' % len(data))
+            for line in c_string(arg):
+                out.append('      %s' % line)
+            out[-1] += ' },'
+        else:
+            out.append('    { %s, %d, offsetof(%s, %s), NULL },' %
+                       (typ, arg, vals, name))
+    out.append('};')
+    out.append('')
+    out.append('#endif')
+    return '\n'.join(out) + '\n'
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.stderr.write(__doc__)
+        return 2
+
+    path, dst = sys.argv[1:]
+    base = os.path.splitext(os.path.basename(path))[0]
+    with open(path, encoding='utf-8') as f:
+        src = f.read()
+
+    try:
+        code = generate(src, base, os.path.basename(path))
+    except TemplateError as e:
+        sys.stderr.write('%s: %s\n' % (path, e))
+        return 1
+
+    with open(dst, 'w', encoding='utf-8') as f:
+        f.write(code)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
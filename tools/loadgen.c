@@ -0,0 +1,499 @@
+/**
+ * @file loadgen.c  HTTP load generator for the pool web UI
+ *
+ * Keeps N connections busy with requests against a device or the host build
+ * and reports requests per second and latency percentiles.
+ *
+ * Build: cc -O2 -o loadgen loadgen.c
+ * Usage: loadgen [-c conns] [-n requests] [-t seconds] [-k 0|1]
+ *                [-b post-body] host port [path]
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define HDR_MAX   8192
+#define RECV_SIZE 16384
+
+enum body_mode {
+    BODY_LENGTH,
+    BODY_CHUNKED,
+    BODY_CLOSE,
+};
+
+enum chunk_state {
+    CHUNK_SIZE,
+    CHUNK_DATA,
+    CHUNK_CRLF,
+    CHUNK_TRAILER,
+};
+
+struct conn {
+    int fd;
+    bool connected;
+    bool in_body;
+    bool close;
+    char hdr[HDR_MAX];
+    size_t hlen;
+    enum body_mode mode;
+    enum chunk_state cs;
+    size_t remain;
+    char line[32];
+    size_t llen;
+    size_t sent;
+    uint64_t start;
+};
+
+struct stats {
+    uint64_t *lat;      /* in us */
+    size_t nlat;
+    size_t size;
+    uint64_t bytes;
+    unsigned errors;
+    unsigned connects;
+    unsigned bad_status;
+};
+
+static struct addrinfo *addr;
+static char req[1024];
+static size_t req_len;
+static bool keepalive = true;
+static struct stats st;
+static unsigned started;
+static unsigned limit;
+
+
+static uint64_t now_us(void)
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (uint64_t) tp.tv_sec * 1000000 + tp.tv_nsec / 1000;
+}
+
+
+static void add_latency(uint64_t us)
+{
+    if (st.nlat == st.size) {
+        st.size = st.size ? st.size * 2 : 4096;
+        st.lat = realloc(st.lat, st.size * sizeof(*st.lat));
+        if (!st.lat) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+
+    st.lat[st.nlat++] = us;
+}
+
+
+static int conn_open(int ep, struct conn *c)
+{
+    struct epoll_event ev;
+    int one = 1;
+
+    c->fd = socket(addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0)
+        return errno;
+
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, addr->ai_addr, addr->ai_addrlen) && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        return errno;
+    }
+
+    c->connected = false;
+    st.connects++;
+    ev.events = EPOLLOUT | EPOLLIN;
+    ev.data.ptr = c;
+    return epoll_ctl(ep, EPOLL_CTL_ADD, c->fd, &ev) ? errno : 0;
+}
+
+
+static void conn_close(struct conn *c)
+{
+    if (c->fd >= 0)
+        close(c->fd);
+
+    c->fd = -1;
+}
+
+
+static void req_start(int ep, struct conn *c)
+{
+    struct epoll_event ev;
+
+    c->in_body = false;
+    c->close = !keepalive;
+    c->hlen = 0;
+    c->sent = 0;
+    c->llen = 0;
+    c->start = now_us();
+    started++;
+
+    ev.events = EPOLLOUT | EPOLLIN;
+    ev.data.ptr = c;
+    epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+
+static const char *hdr_value(const char *hdr, const char *name)
+{
+    size_t l = strlen(name);
+    const char *p = hdr;
+
+    while ((p = strchr(p, '\n'))) {
+        p++;
+        if (!strncasecmp(p, name, l) && p[l] == ':')
+            return p + l + 1 + strspn(p + l + 1, " ");
+    }
+
+    return NULL;
+}
+
+
+/* Parses the header, returns false on a malformed response */
+static bool parse_header(struct conn *c)
+{
+    const char *v;
+    int status;
+
+    c->hdr[c->hlen] = 0;
+    if (sscanf(c->hdr, "HTTP/1.%*d %d", &status) != 1)
+        return false;
+
+    if (status != 200)
+        st.bad_status++;
+
+    c->mode = BODY_CLOSE;
+    c->remain = 0;
+    if ((v = hdr_value(c->hdr, "Transfer-Encoding")) &&
+            !strncasecmp(v, "chunked", 7)) {
+        c->mode = BODY_CHUNKED;
+        c->cs = CHUNK_SIZE;
+    }
+    else if ((v = hdr_value(c->hdr, "Content-Length"))) {
+        c->mode = BODY_LENGTH;
+        c->remain = strtoul(v, NULL, 10);
+    }
+
+    if ((v = hdr_value(c->hdr, "Connection")) && !strncasecmp(v, "close", 5))
+        c->close = true;
+
+    if (!strncmp(c->hdr, "HTTP/1.0", 8) &&
+            !((v = hdr_value(c->hdr, "Connection")) &&
+              !strncasecmp(v, "keep-alive", 10)))
+        c->close = true;
+
+    if (c->mode == BODY_CLOSE)
+        c->close = true;
+
+    return true;
+}
+
+
+/* Consumes body bytes, returns true if the response is complete */
+static bool parse_body(struct conn *c, const char *p, size_t n)
+{
+    size_t k;
+
+    if (c->mode == BODY_CLOSE)
+        return false;
+
+    if (c->mode == BODY_LENGTH) {
+        c->remain -= n < c->remain ? n : c->remain;
+        return c->remain == 0;
+    }
+
+    while (n) {
+        switch (c->cs) {
+        case CHUNK_SIZE:
+        case CHUNK_TRAILER:
+            if (*p == '\n') {
+                c->line[c->llen] = 0;
+                if (c->cs == CHUNK_TRAILER) {
+                    if (c->llen <= 1)
+                        return true;
+                }
+                else {
+                    c->remain = strtoul(c->line, NULL, 16);
+                    c->cs = c->remain ? CHUNK_DATA : CHUNK_TRAILER;
+                }
+                c->llen = 0;
+            }
+            else if (c->llen < sizeof(c->line) - 1) {
+                c->line[c->llen++] = *p;
+            }
+            p++;
+            n--;
+            break;
+        case CHUNK_DATA:
+            k = n < c->remain ? n : c->remain;
+            c->remain -= k;
+            p += k;
+            n -= k;
+            if (!c->remain) {
+                c->cs = CHUNK_CRLF;
+                c->remain = 2;
+            }
+            break;
+        case CHUNK_CRLF:
+            k = n < c->remain ? n : c->remain;
+            c->remain -= k;
+            p += k;
+            n -= k;
+            if (!c->remain)
+                c->cs = CHUNK_SIZE;
+            break;
+        }
+    }
+
+    return false;
+}
+
+
+static void finish(int ep, struct conn *c, bool ok)
+{
+    if (ok)
+        add_latency(now_us() - c->start);
+    else
+        st.errors++;
+
+    if (!ok || c->close) {
+        conn_close(c);
+        if (limit && started >= limit)
+            return;
+
+        if (conn_open(ep, c)) {
+            st.errors++;
+            return;
+        }
+    }
+
+    if (!limit || started < limit)
+        req_start(ep, c);
+}
+
+
+static void on_event(int ep, struct conn *c, uint32_t events)
+{
+    char buf[RECV_SIZE];
+    struct epoll_event ev;
+    const char *end;
+    ssize_t n;
+    size_t k;
+
+    if (events & (EPOLLERR | EPOLLHUP) && !(events & EPOLLIN)) {
+        finish(ep, c, false);
+        return;
+    }
+
+    if (events & EPOLLOUT) {
+        if (!c->connected) {
+            c->connected = true;
+            if (!c->start)
+                req_start(ep, c);
+        }
+
+        n = send(c->fd, req + c->sent, req_len - c->sent, MSG_NOSIGNAL);
+        if (n < 0 && errno != EAGAIN) {
+            finish(ep, c, false);
+            return;
+        }
+
+        if (n > 0)
+            c->sent += n;
+
+        if (c->sent == req_len) {
+            ev.events = EPOLLIN;
+            ev.data.ptr = c;
+            epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+        }
+    }
+
+    if (!(events & EPOLLIN))
+        return;
+
+    n = recv(c->fd, buf, sizeof(buf), 0);
+    if (n < 0 && errno == EAGAIN)
+        return;
+
+    if (n <= 0) {
+        /* end of a read-until-close body */
+        finish(ep, c, c->in_body && c->mode == BODY_CLOSE);
+        return;
+    }
+
+    st.bytes += n;
+    if (c->in_body) {
+        if (parse_body(c, buf, n))
+            finish(ep, c, true);
+        return;
+    }
+
+    k = (size_t) n < HDR_MAX - 1 - c->hlen ? (size_t) n : HDR_MAX - 1 - c->hlen;
+    memcpy(c->hdr + c->hlen, buf, k);
+    c->hlen += k;
+    c->hdr[c->hlen] = 0;
+    end = strstr(c->hdr, "\r\n\r\n");
+    if (!end) {
+        if (c->hlen == HDR_MAX - 1)
+            finish(ep, c, false);
+        return;
+    }
+
+    /* bytes of this read after the header */
+    k = (c->hdr + c->hlen) - (end + 4);
+    c->hlen = end + 4 - c->hdr;
+    if (!parse_header(c)) {
+        finish(ep, c, false);
+        return;
+    }
+
+    c->in_body = true;
+    if ((c->mode == BODY_LENGTH && !c->remain) ||
+            parse_body(c, buf + n - k, k))
+        finish(ep, c, true);
+}
+
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+
+static double pct(double p)
+{
+    size_t i;
+
+    if (!st.nlat)
+        return 0;
+
+    i = (size_t) (p / 100.0 * (st.nlat - 1) + 0.5);
+    return st.lat[i] / 1000.0;
+}
+
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: loadgen [-c conns] [-n requests] [-t seconds] "
+            "[-k 0|1] [-b post-body] host port [path]\n");
+    exit(2);
+}
+
+
+int main(int argc, char *argv[])
+{
+    struct addrinfo hints = { 0 };
+    struct epoll_event evs[64];
+    struct conn *conns;
+    const char *host, *port, *path = "/";
+    const char *body = NULL;
+    unsigned nconn = 4;
+    double secs = 10;
+    uint64_t t0, tend, elapsed;
+    int ep, opt, n, i;
+
+    while ((opt = getopt(argc, argv, "c:n:t:k:b:")) != -1) {
+        switch (opt) {
+        case 'c': nconn = atoi(optarg); break;
+        case 'n': limit = atoi(optarg); break;
+        case 't': secs = atof(optarg); break;
+        case 'k': keepalive = atoi(optarg); break;
+        case 'b': body = optarg; break;
+        default: usage();
+        }
+    }
+
+    if (argc - optind < 2 || !nconn)
+        usage();
+
+    host = argv[optind];
+    port = argv[optind + 1];
+    if (argc - optind > 2)
+        path = argv[optind + 2];
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &addr)) {
+        fprintf(stderr, "could not resolve %s\n", host);
+        return 1;
+    }
+
+    if (body)
+        req_len = snprintf(req, sizeof(req), "POST %s HTTP/1.1\r\nHost: %s\r\n"
+                "Connection: %s\r\n"
+                "Content-Type: application/x-www-form-urlencoded\r\n"
+                "Content-Length: %zu\r\n\r\n%s", path, host,
+                keepalive ? "keep-alive" : "close", strlen(body), body);
+    else
+        req_len = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: %s\r\n"
+                "Connection: %s\r\n\r\n", path, host,
+                keepalive ? "keep-alive" : "close");
+
+    if (req_len >= sizeof(req)) {
+        fprintf(stderr, "request too long\n");
+        return 1;
+    }
+
+    ep = epoll_create1(0);
+    conns = calloc(nconn, sizeof(*conns));
+    if (ep < 0 || !conns) {
+        perror("init");
+        return 1;
+    }
+
+    for (i = 0; i < (int) nconn; i++) {
+        if (conn_open(ep, &conns[i])) {
+            perror("connect");
+            return 1;
+        }
+    }
+
+    t0 = now_us();
+    tend = t0 + (uint64_t) (secs * 1e6);
+    while (now_us() < tend && (!limit || st.nlat + st.errors < limit)) {
+        n = epoll_wait(ep, evs, 64, 100);
+        for (i = 0; i < n; i++)
+            on_event(ep, evs[i].data.ptr, evs[i].events);
+    }
+
+    elapsed = now_us() - t0;
+    if (st.nlat)
+        qsort(st.lat, st.nlat, sizeof(*st.lat), cmp_u64);
+
+    printf("requests   %zu in %.2f s, %u errors, %u non-200, %u connects\n",
+           st.nlat, elapsed / 1e6, st.errors, st.bad_status, st.connects);
+    printf("throughput %.1f req/s, %.1f kB/s\n", st.nlat * 1e6 / elapsed,
+           st.bytes * 1e3 / elapsed);
+    printf("latency    p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+           pct(50), pct(90), pct(99), pct(100));
+
+    for (i = 0; i < (int) nconn; i++)
+        conn_close(&conns[i]);
+
+    free(conns);
+    free(st.lat);
+    freeaddrinfo(addr);
+    return st.nlat ? 0 : 1;
+}
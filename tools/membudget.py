@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+"""
+Static memory budget per module of the firmware or the host build
+Usage::
+    ./membudget.py [-v] [-s] <libmain.a | *.o>..
+
+Sums .data, .bss and .rodata of every object file by nm, set NM for the
+cross toolchain (NM=xtensa-esp32-elf-nm). RAM is .data plus .bss, on the
+ESP32 .rodata stays in flash. Modules that call the heap directly instead
+of through mem.c are listed in the last column, -s fails if there are any
+(expected with CONFIG_STATIC_MEM 1 only for mem.c). -v lists the symbols of
+256 bytes and more.
+
+Firmware::
+    NM=xtensa-esp32-elf-nm ./membudget.py build/esp-idf/main/libmain.a
+Host::
+    ./membudget.py build-host/CMakeFiles/pool_host.dir/*/*/main/*.o
+"""
+import os
+import re
+import subprocess
+import sys
+
+HEAP = {'malloc', 'calloc', 'realloc', 'free', 'strdup', 'strndup',
+        'heap_caps_malloc', 'heap_caps_calloc', 'heap_caps_realloc'}
+SECTIONS = {'d': 'data', 'g': 'data', 'b': 'bss', 's': 'bss', 'c': 'bss',
+            'r': 'rodata'}
+BIG = 256
+
+
+def module(obj):
+    """Module name of an object file: log.c.obj -> log"""
+    name = os.path.basename(obj)
+    return re.sub(r'(\.c)?\.(o|obj)$', '', name)
+
+
+def scan(path, nm):
+    """Yields (module, type, size, symbol), type 'U' for undefined"""
+    out = subprocess.run([nm, '-A', '-S', '-t', 'd', path], check=True,
+                         capture_output=True, text=True).stdout
+    for line in out.splitlines():
+        obj, _, rest = line.rpartition(':')
+        f = rest.split()
+        if len(f) == 2 and f[0] == 'U':
+            yield module(obj), 'U', 0, f[1]
+        elif len(f) == 4:
+            yield module(obj), f[2].lower(), int(f[1]), f[3]
+
+
+def main():
+    args = sys.argv[1:]
+    verbose = '-v' in args
+    strict = '-s' in args
+    paths = [a for a in args if not a.startswith('-')]
+    if not paths:
+        print(__doc__.strip(), file=sys.stderr)
+        sys.exit(2)
+
+    nm = os.environ.get('NM', 'nm')
+    mods = {}
+    for path in paths:
+        for mod, t, size, sym in scan(path, nm):
+            m = mods.setdefault(mod, {'data': 0, 'bss': 0, 'rodata': 0,
+                                      'heap': set(), 'big': []})
+            if t == 'U':
+                if sym in HEAP:
+                    m['heap'].add(sym)
+            elif t in SECTIONS:
+                m[SECTIONS[t]] += size
+                if size >= BIG:
+                    m['big'].append((size, sym))
+
+    print('%-12s %8s %8s %8s %8s  %s' % ('module', 'data', 'bss', 'ram',
+                                         'rodata', 'heap calls'))
+    total = {'data': 0, 'bss': 0, 'rodata': 0}
+    offenders = []
+    for mod, m in sorted(mods.items(), key=lambda kv:
+                         -(kv[1]['data'] + kv[1]['bss'])):
+        for k in total:
+            total[k] += m[k]
+        if m['heap'] and mod != 'mem':
+            offenders.append(mod)
+        print('%-12s %8d %8d %8d %8d  %s' % (mod, m['data'], m['bss'],
+              m['data'] + m['bss'], m['rodata'],
+              ' '.join(sorted(m['heap']))))
+        if verbose:
+            for size, sym in sorted(m['big'], reverse=True):
+                print('    %-32s %8d' % (sym, size))
+
+    print('%-12s %8d %8d %8d %8d' % ('total', total['data'], total['bss'],
+          total['data'] + total['bss'], total['rodata']))
+
+    if strict and offenders:
+        print('heap calls outside mem.c: %s' % ' '.join(offenders),
+              file=sys.stderr)
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,182 @@
+#!/usr/bin/env python3
+"""
+MQTT command latency and publish throughput of a pool controller
+Usage::
+    ./mqtt_bench.py [-H broker] [-p port] [-t topic] [-n commands]
+
+Latency: sends <topic>/cmd/force on/off one at a time and waits for the
+retained <topic>/state/force to follow. Throughput: sends the same commands
+back to back and counts the messages published by the device until all are
+acknowledged on <topic>/ack. Plain sockets, no client library needed.
+"""
+import argparse
+import socket
+import struct
+import sys
+import time
+
+
+class Mqtt:
+    def __init__(self, host, port):
+        self.sock = socket.create_connection((host, port))
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.buf = b''
+        self.mid = 0
+        cid = ('bench-%d' % time.time_ns()).encode()
+        body = (self._str(b'MQTT') + bytes([4, 0x02]) + struct.pack('!H', 60)
+                + self._str(cid))
+        self._send(0x10, body)
+        typ, body = self.read(5)
+        if typ != 0x20 or body[1] != 0:
+            raise RuntimeError('connect refused')
+
+    @staticmethod
+    def _str(s):
+        return struct.pack('!H', len(s)) + s
+
+    def _send(self, typ, body):
+        n = len(body)
+        hdr = bytearray([typ])
+        while True:
+            b = n % 128
+            n //= 128
+            hdr.append(b | (0x80 if n else 0))
+            if not n:
+                break
+        self.sock.sendall(bytes(hdr) + body)
+
+    def _fill(self, n, deadline):
+        while len(self.buf) < n:
+            left = deadline - time.monotonic()
+            if left <= 0:
+                return False
+            self.sock.settimeout(left)
+            try:
+                data = self.sock.recv(65536)
+            except socket.timeout:
+                return False
+            if not data:
+                raise RuntimeError('connection closed')
+            self.buf += data
+        return True
+
+    def read(self, timeout):
+        """Returns (type, body) or (None, None) on timeout"""
+        deadline = time.monotonic() + timeout
+        if not self._fill(2, deadline):
+            return None, None
+        n, shift, i = 0, 0, 1
+        while True:
+            if not self._fill(i + 1, deadline):
+                return None, None
+            b = self.buf[i]
+            n |= (b & 0x7f) << shift
+            shift += 7
+            i += 1
+            if not b & 0x80:
+                break
+        if not self._fill(i + n, deadline):
+            return None, None
+        typ, body = self.buf[0], self.buf[i:i + n]
+        self.buf = self.buf[i + n:]
+        return typ, body
+
+    def recv_publish(self, timeout):
+        """Returns (topic, payload) or (None, None) on timeout"""
+        deadline = time.monotonic() + timeout
+        while True:
+            typ, body = self.read(max(0, deadline - time.monotonic()))
+            if typ is None:
+                return None, None
+            if typ & 0xf0 != 0x30:
+                continue
+            tl = struct.unpack('!H', body[:2])[0]
+            off = 2 + tl + (2 if typ & 0x06 else 0)
+            if typ & 0x06:
+                self._send(0x40, body[2 + tl:4 + tl])
+            return body[2:2 + tl].decode(), body[off:].decode()
+
+    def subscribe(self, topic):
+        self.mid += 1
+        self._send(0x82, struct.pack('!H', self.mid) + self._str(topic.encode())
+                   + b'\x00')
+
+    def publish(self, topic, payload):
+        self._send(0x30, self._str(topic.encode()) + payload.encode())
+
+
+def pct(lat, p):
+    lat = sorted(lat)
+    return lat[min(len(lat) - 1, int(p / 100.0 * (len(lat) - 1) + 0.5))]
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument('-H', '--host', default='127.0.0.1')
+    ap.add_argument('-p', '--port', type=int, default=1883)
+    ap.add_argument('-t', '--topic', default='pool')
+    ap.add_argument('-n', '--count', type=int, default=100)
+    args = ap.parse_args()
+
+    m = Mqtt(args.host, args.port)
+    m.subscribe(args.topic + '/#')
+    cmd = args.topic + '/cmd/force'
+    state = args.topic + '/state/force'
+
+    # retained state
+    force = None
+    while True:
+        topic, payload = m.recv_publish(1.0)
+        if topic is None:
+            break
+        if topic == state:
+            force = payload
+    if force is None:
+        print('no retained %s, device not connected?' % state)
+        return 1
+
+    lat = []
+    for i in range(args.count):
+        want = 'off' if force == 'on' else 'on'
+        t0 = time.monotonic()
+        m.publish(cmd, want)
+        while True:
+            topic, payload = m.recv_publish(5.0)
+            if topic is None:
+                print('timeout waiting for %s=%s' % (state, want))
+                return 1
+            if topic == state and payload == want:
+                break
+        lat.append((time.monotonic() - t0) * 1000)
+        force = want
+
+    print('latency    %d commands, p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, '
+          'max %.2f ms' % (len(lat), pct(lat, 50), pct(lat, 90),
+                           pct(lat, 99), max(lat)))
+
+    t0 = time.monotonic()
+    for i in range(args.count):
+        force = 'off' if force == 'on' else 'on'
+        m.publish(cmd, force)
+    acks = msgs = 0
+    while acks < args.count:
+        topic, payload = m.recv_publish(10.0)
+        if topic is None:
+            print('timeout, %d of %d acks' % (acks, args.count))
+            return 1
+        if '/cmd/' in topic:
+            continue
+        msgs += 1
+        if topic == args.topic + '/ack':
+            acks += 1
+    elapsed = time.monotonic() - t0
+    print('throughput %d device messages in %.2f s, %.0f msg/s, '
+          '%.0f commands/s' % (msgs, elapsed, msgs / elapsed,
+                               args.count / elapsed))
+
+    m.publish(cmd, 'none')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
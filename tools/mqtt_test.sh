@@ -0,0 +1,38 @@
+#!/bin/sh
+#
+# Runs the host build against a local mosquitto broker and measures command
+# latency and publish throughput with mqtt_bench.py.
+#
+# Usage: tools/mqtt_test.sh [build-dir] [commands]
+#
+# Copyright (C) 2021 Christian Spielberger
+
+BUILD=${1:-build-host}
+COUNT=${2:-200}
+PORT=18830
+DIR=$(dirname "$0")
+TMP=$(mktemp -d)
+
+cleanup() {
+    kill $HOST $BROKER 2>/dev/null
+    rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+if [ ! -x "$BUILD/pool_host" ]; then
+    echo "$BUILD/pool_host not found, build with:"
+    echo "  cmake -S host -B $BUILD && cmake --build $BUILD"
+    exit 1
+fi
+
+BUILD=$(cd "$BUILD" && pwd)
+mosquitto -p $PORT >"$TMP/broker.log" 2>&1 &
+BROKER=$!
+sleep 0.5
+
+(cd "$TMP" && exec "$BUILD/pool_host" -p 18080 \
+    -m mqtt://127.0.0.1:$PORT) >"$TMP/host.log" 2>&1 &
+HOST=$!
+sleep 1
+
+"$DIR/mqtt_bench.py" -p $PORT -n "$COUNT"
@@ -0,0 +1,165 @@
+#!/bin/sh
+#
+# Boots the firmware image in Espressif's QEMU (esp32 machine, OpenCores
+# Ethernet, user mode network), drives GET and POST against the web UI,
+# reboots by the web UI and by restarting QEMU to check that the settings
+# survive in NVS, and records the boot phases and the request latency.
+#
+# One line per run is appended to the results file. A run whose ready time
+# or /status.json median is more than TOLERANCE percent (default 20) above
+# the previous line fails.
+#
+# Needs an ESP-IDF environment (idf.py, esptool.py), qemu-system-xtensa of
+# Espressif's fork and loadgen of the host build.
+#
+# Usage: tools/qemu_test.sh [build-dir] [host-build-dir] [results]
+#
+# Copyright (C) 2021 Christian Spielberger
+
+BUILD=${1:-build-qemu}
+HOST_BUILD=${2:-build-host}
+RESULTS=${3:-qemu-results.csv}
+PORT=${PORT:-18090}
+TOLERANCE=${TOLERANCE:-20}
+TOP=$(cd "$(dirname "$0")/.." && pwd)
+TMP=$(mktemp -d)
+QEMU=
+
+cleanup() {
+    [ -n "$QEMU" ] && kill $QEMU 2>/dev/null
+    rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAIL: $*"
+    tail -20 "$TMP/serial.log" 2>/dev/null
+    exit 1
+}
+
+for t in idf.py esptool.py qemu-system-xtensa curl python3; do
+    if ! command -v $t >/dev/null; then
+        echo "$t not found"
+        exit 1
+    fi
+done
+
+if [ ! -x "$HOST_BUILD/loadgen" ]; then
+    echo "$HOST_BUILD/loadgen not found, build with:"
+    echo "  cmake -S host -B $HOST_BUILD && cmake --build $HOST_BUILD"
+    exit 1
+fi
+
+mkdir -p "$BUILD"
+BUILD=$(cd "$BUILD" && pwd)
+HOST_BUILD=$(cd "$HOST_BUILD" && pwd)
+
+idf.py -C "$TOP" -B "$BUILD" -DSDKCONFIG="$BUILD/sdkconfig" \
+    -DSDKCONFIG_DEFAULTS="sdkconfig;sdkconfig.qemu" build \
+    >"$TMP/build.log" 2>&1 || { tail -30 "$TMP/build.log"; exit 1; }
+
+# a fresh flash with erased NVS for each run
+(cd "$BUILD" && esptool.py --chip esp32 merge_bin --fill-flash-size 4MB \
+    -o "$TMP/flash.bin" @flash_args) >/dev/null || fail "merge_bin"
+
+boot() {
+    qemu-system-xtensa -nographic -machine esp32 \
+        -drive file="$TMP/flash.bin",if=mtd,format=raw \
+        -nic user,model=open_eth,hostfwd=tcp:127.0.0.1:$PORT-:80 \
+        -global driver=timer.esp32.timg,property=wdt_disable,value=true \
+        </dev/null >>"$TMP/serial.log" 2>&1 &
+    QEMU=$!
+}
+
+now_ms() {
+    echo $(($(date +%s%N) / 1000000))
+}
+
+# waits for the web UI, the status is kept in $TMP/status.json
+wait_up() {
+    i=0
+    while ! curl -sf -m 2 -o "$TMP/status.json" \
+            "http://127.0.0.1:$PORT/status.json"; do
+        i=$((i + 1))
+        [ $i -gt 240 ] && fail "no answer from the web UI ($1)"
+        sleep 0.5
+    done
+}
+
+# prints a field of $TMP/status.json, nested keys as arguments
+field() {
+    python3 -c 'import json, sys
+v = json.load(open(sys.argv[1]))
+for k in sys.argv[2:]:
+    v = v[k]
+print(v)' "$TMP/status.json" "$@"
+}
+
+check() {
+    [ "$(field start)" = "07:30" ] && [ "$(field duration)" = "123" ] ||
+        fail "settings lost after $1 ($(field start) $(field duration))"
+    [ "$(field reset)" = "$2" ] || fail "reset $(field reset) after $1"
+}
+
+# p50 and p99 in ms of loadgen against path, body for POST
+bench() {
+    "$HOST_BUILD/loadgen" -c 1 -n "$1" -t 120 ${3:+-b "$3"} \
+        127.0.0.1 $PORT "$2" >"$TMP/loadgen.log" 2>&1
+    grep -q " 0 errors, 0 non-200" "$TMP/loadgen.log" ||
+        fail "loadgen $2: $(head -1 "$TMP/loadgen.log")"
+    sed -n 's/^latency *p50 \([0-9.]*\) ms.* p99 \([0-9.]*\) ms.*/\1,\2/p' \
+        "$TMP/loadgen.log"
+}
+
+t0=$(now_ms)
+boot
+wait_up "power on"
+BOOT_MS=$(($(now_ms) - t0))
+PHASES=
+for p in app nvs net httpd ready; do
+    PHASES="$PHASES,$(field boot_us $p)"
+done
+echo "boot     ${BOOT_MS} ms wall, phases us (app nvs net httpd ready)" \
+     "${PHASES#,}"
+
+GET=$(bench 200 /)
+STATUS=$(bench 200 /status.json)
+POST=$(bench 20 / "stime=07%3A30&duration=123")
+echo "latency  p50,p99 ms GET / $GET, /status.json $STATUS, POST / $POST"
+
+# reboot by the web UI, the request itself gets no answer
+curl -s -m 2 -d "command=reboot" "http://127.0.0.1:$PORT/" >/dev/null
+sleep 2
+wait_up "reboot"
+check "reboot" sw
+
+kill $QEMU
+wait $QEMU 2>/dev/null
+boot
+wait_up "restart"
+check "restart" poweron
+echo "nvs      settings kept over reboot and restart"
+
+COMMIT=$(git -C "$TOP" describe --always --dirty 2>/dev/null)
+LINE="$COMMIT,$(date +%F),$BOOT_MS$PHASES,$GET,$STATUS,$POST"
+if [ -s "$RESULTS" ]; then
+    tail -1 "$RESULTS" | awk -F, -v line="$LINE" -v tol="$TOLERANCE" '
+        function slow(what, old, new) {
+            if (old + 0 > 0 && new + 0 > (old + 0) * (100 + tol) / 100) {
+                printf "FAIL: %s %s -> %s\n", what, old, new
+                bad = 1
+            }
+        }
+        {
+            split(line, n, ",")
+            slow("ready us", $8, n[8])
+            slow("/status.json p50 ms", $11, n[11])
+            exit bad
+        }' || { echo "$LINE" >>"$RESULTS"; exit 1; }
+else
+    echo "commit,date,boot_ms,app_us,nvs_us,net_us,httpd_us,ready_us," \
+         "get_p50,get_p99,status_p50,status_p99,post_p50,post_p99" |
+        tr -d ' ' >"$RESULTS"
+fi
+
+echo "$LINE" >>"$RESULTS"
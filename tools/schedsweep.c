@@ -0,0 +1,278 @@
+/**
+ * @file schedsweep.c  Year sweep of the schedule evaluation
+ *
+ * Evaluates schedule_active() of main/schedule.c for every minute of a year
+ * in each time zone and checks it against a reference that walks the local
+ * wall clock minute by minute: a window starts at the first minute of a
+ * local day that reads the start time or later, or with the next day if the
+ * clocks skip past the end of the day before. Start and end of every
+ * window are also checked to the second. Reports mismatches and the
+ * evaluation throughput, -l checks the former webui.c logic instead.
+ *
+ * Build: cc -O2 -I main -o schedsweep tools/schedsweep.c main/schedule.c
+ * Usage: schedsweep [-y year] [-z tz].. [-s HH:MM/hours].. [-l] [-v]
+ *
+ * Copyright (C) 2021 Christian Spielberger
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "schedule.h"
+
+#define ZONES_MAX   16
+#define SCHEDS_MAX  16
+#define REPORT_MAX  5
+
+typedef bool (active_h)(const struct schedule *s, time_t now);
+
+static const char *default_zones[] = {
+    SCHEDULE_TZ,
+    "CET-1CEST,M3.5.0,M10.5.0/3",
+    "EST5EDT,M3.2.0,M11.1.0",
+    "AEST-10AEDT,M10.1.0,M4.1.0/3",
+    "<+1030>-10:30<+11>-11,M10.1.0,M4.1.0",
+    "<-02>2<-01>,M3.5.0/-1,M10.5.0/0",
+    "UTC0",
+};
+
+static const char *default_scheds[] = {
+    "00:00/12", "01:30/3", "02:30/2", "12:00/1", "22:00/4", "23:30/8",
+};
+
+static active_h *active = schedule_active;
+static bool verbose;
+
+
+/* The evaluation webui.c used before schedule.c */
+static bool legacy_active(const struct schedule *s, time_t now)
+{
+    struct tm tm;
+    time_t times;
+
+    localtime_r(&now, &tm);
+    tm.tm_hour = s->hh;
+    tm.tm_min  = s->mm;
+    times = mktime(&tm);
+    return times <= now && now <= times + s->duration * 3600;
+}
+
+
+static double now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void set_tz(const char *tz)
+{
+    setenv("TZ", tz, 1);
+    tzset();
+}
+
+
+static time_t year_start(int year)
+{
+    struct tm tm = { .tm_year = year - 1900, .tm_mday = 1, .tm_isdst = -1 };
+
+    return mktime(&tm);
+}
+
+
+static void report(const char *what, time_t t, bool got, unsigned *n)
+{
+    char buf[32];
+    struct tm tm;
+
+    if ((*n)++ >= REPORT_MAX && !verbose)
+        return;
+
+    localtime_r(&t, &tm);
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S %Z", &tm);
+    printf("    %s %s: %s\n", what, buf, got ? "on" : "off");
+}
+
+
+/* Checks start and end of the window to the second */
+static unsigned check_bounds(const struct schedule *s, time_t start,
+                             unsigned *n)
+{
+    time_t end = start + (time_t) s->duration * 3600;
+    unsigned err = 0;
+
+    if (active(s, start - 1)) {
+        report("before start", start - 1, true, n);
+        err++;
+    }
+    if (!active(s, start)) {
+        report("start", start, false, n);
+        err++;
+    }
+    if (!active(s, end - 1)) {
+        report("before end", end - 1, false, n);
+        err++;
+    }
+    if (active(s, end)) {
+        report("end", end, true, n);
+        err++;
+    }
+
+    return err;
+}
+
+
+static void add_start(const struct schedule *s, time_t starts[2], time_t t,
+                      time_t begin, time_t end, unsigned *err, unsigned *n)
+{
+    starts[1] = starts[0];
+    starts[0] = t;
+    if (t >= begin && t + (time_t) s->duration * 3600 < end)
+        *err += check_bounds(s, t, n);
+}
+
+
+/* Sweeps the year minute by minute, returns the number of errors */
+static unsigned sweep(const struct schedule *s, time_t begin, time_t end,
+                      unsigned long *evals)
+{
+    const time_t len = (time_t) s->duration * 3600;
+    const int start_min = s->hh * 60 + s->mm;
+    time_t starts[2] = { 0, 0 };    /* last two, [0] newest */
+    bool started = false, ref, got;
+    unsigned err = 0, n = 0;
+    long date = -1, d;
+    struct tm tm;
+    time_t t;
+
+    for (t = begin - 2 * 86400; t < end; t += 60) {
+        localtime_r(&t, &tm);
+        d = (long) tm.tm_year * 400 + tm.tm_yday;
+        if (d != date) {
+            /* start of the day before never reached, the jump counts */
+            if (date != -1 && !started)
+                add_start(s, starts, t, begin, end, &err, &n);
+            date = d;
+            started = false;
+        }
+
+        if (!started && tm.tm_hour * 60 + tm.tm_min >= start_min) {
+            started = true;
+            add_start(s, starts, t, begin, end, &err, &n);
+        }
+
+        if (t < begin)
+            continue;
+
+        ref = (starts[0] && starts[0] <= t && t < starts[0] + len) ||
+              (starts[1] && starts[1] <= t && t < starts[1] + len);
+        got = active(s, t);
+        (*evals)++;
+        if (got != ref) {
+            report("minute", t, got, &n);
+            err++;
+        }
+    }
+
+    return err;
+}
+
+
+static bool parse_sched(const char *arg, struct schedule *s)
+{
+    return sscanf(arg, "%d:%d/%d", &s->hh, &s->mm, &s->duration) == 3 &&
+           s->hh >= 0 && s->hh <= 23 && s->mm >= 0 && s->mm <= 59 &&
+           s->duration >= 1 && s->duration <= 12;
+}
+
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: schedsweep [-y year] [-z tz].. "
+            "[-s HH:MM/hours].. [-l] [-v]\n");
+    exit(2);
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *zones[ZONES_MAX], *scheds[SCHEDS_MAX];
+    size_t nzones = 0, nscheds = 0, z, i;
+    struct schedule sc[SCHEDS_MAX];
+    unsigned long evals, total = 0;
+    unsigned err, errors = 0;
+    double t0, secs = 0;
+    time_t begin, end;
+    int year = 2024;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "y:z:s:lv")) != -1) {
+        switch (opt) {
+        case 'y': year = atoi(optarg); break;
+        case 'z':
+            if (nzones == ZONES_MAX)
+                usage();
+            zones[nzones++] = optarg;
+            break;
+        case 's':
+            if (nscheds == SCHEDS_MAX)
+                usage();
+            scheds[nscheds++] = optarg;
+            break;
+        case 'l': active = legacy_active; break;
+        case 'v': verbose = true; break;
+        default: usage();
+        }
+    }
+
+    for (i = 0; !nzones && i < sizeof(default_zones) / sizeof(*zones); i++)
+        zones[i] = default_zones[i];
+    if (!nzones)
+        nzones = i;
+
+    for (i = 0; !nscheds && i < sizeof(default_scheds) / sizeof(*scheds); i++)
+        scheds[i] = default_scheds[i];
+    if (!nscheds)
+        nscheds = i;
+
+    for (i = 0; i < nscheds; i++) {
+        if (!parse_sched(scheds[i], &sc[i])) {
+            fprintf(stderr, "bad schedule %s\n", scheds[i]);
+            return 2;
+        }
+    }
+
+    for (z = 0; z < nzones; z++) {
+        set_tz(zones[z]);
+        begin = year_start(year);
+        end = year_start(year + 1);
+        printf("%s\n", zones[z]);
+        for (i = 0; i < nscheds; i++) {
+            evals = 0;
+            err = sweep(&sc[i], begin, end, &evals);
+            total += evals;
+            errors += err;
+            printf("  %02d:%02d %2dh  %lu minutes  %u errors\n", sc[i].hh,
+                   sc[i].mm, sc[i].duration, evals, err);
+        }
+
+        /* throughput of the evaluation alone */
+        t0 = now_s();
+        for (i = 0; i < nscheds; i++) {
+            time_t t;
+
+            for (t = begin; t < end; t += 60)
+                active(&sc[i], t);
+        }
+        secs += now_s() - t0;
+    }
+
+    printf("%lu evaluations, %u errors, %.2f M evaluations/s\n", total,
+           errors, secs > 0 ? total / secs / 1e6 : 0);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+"""
+Local syslog collector for the RFC 5424 datagrams of a pool controller
+Usage::
+    ./syslog_listen.py [-p port] [-t seconds] [-n records] [-q]
+
+Splits the datagrams into messages (one per line), checks each against the
+RFC 5424 header the firmware sends and prints it, -q prints the summary
+only. Stops after -t seconds or -n messages and prints messages, datagrams,
+the mean datagram size and malformed messages. Exits with 1 if a message
+was malformed or a sequence number in "host log line N" went backwards.
+"""
+import argparse
+import re
+import socket
+import sys
+import time
+
+HEADER = re.compile(
+    r'<(\d{1,3})>1 '
+    r'(-|\d{4}-\d\d-\d\dT\d\d:\d\d:\d\d\.\d{6}Z) '
+    r'(\S+) pool - (pool|wifi|net|sys) - (.*)$')
+SEQ = re.compile(r'host log line (\d+)')
+SEVERITY = {5: 'notice', 6: 'info'}
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument('-p', '--port', type=int, default=5514)
+    ap.add_argument('-t', '--time', type=float, default=0)
+    ap.add_argument('-n', '--count', type=int, default=0)
+    ap.add_argument('-q', '--quiet', action='store_true')
+    args = ap.parse_args()
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(('0.0.0.0', args.port))
+    end = time.monotonic() + args.time if args.time else None
+    msgs = dgrams = size = bad = 0
+    last = -1
+    gaps = 0
+
+    while not args.count or msgs < args.count:
+        if end is not None:
+            left = end - time.monotonic()
+            if left <= 0:
+                break
+            sock.settimeout(left)
+        try:
+            data, _ = sock.recvfrom(65536)
+        except socket.timeout:
+            break
+        dgrams += 1
+        size += len(data)
+        for line in data.decode('utf-8', 'replace').splitlines():
+            msgs += 1
+            m = HEADER.match(line)
+            if not m or int(m.group(1)) // 8 != 16 or \
+                    int(m.group(1)) % 8 not in SEVERITY:
+                bad += 1
+                print('malformed: %r' % line)
+                continue
+            seq = SEQ.search(m.group(5))
+            if seq:
+                n = int(seq.group(1))
+                if n <= last:
+                    bad += 1
+                    print('out of order: %d after %d' % (n, last))
+                gaps += n > last + 1 and last >= 0
+                last = n
+            if not args.quiet:
+                print('%s %s %s %s: %s' % (
+                    m.group(2), m.group(3), SEVERITY[int(m.group(1)) % 8],
+                    m.group(4), m.group(5)))
+
+    print('received   %d messages in %d datagrams, %.0f bytes/datagram, '
+          '%d malformed, %d gaps' % (msgs, dgrams, size / dgrams if dgrams
+                                     else 0, bad, gaps))
+    return 1 if bad or not msgs else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
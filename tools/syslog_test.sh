@@ -0,0 +1,43 @@
+#!/bin/sh
+#
+# Ships the emulated log lines of the host build to syslog_listen.py and
+# checks the messages and their batching.
+#
+# Usage: tools/syslog_test.sh [build-dir] [lines/s] [seconds]
+#
+# Copyright (C) 2021 Christian Spielberger
+
+BUILD=${1:-build-host}
+RATE=${2:-200}
+SECS=${3:-10}
+PORT=15514
+DIR=$(dirname "$0")
+TMP=$(mktemp -d)
+
+cleanup() {
+    kill $HOST 2>/dev/null
+    rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+if [ ! -x "$BUILD/pool_host" ]; then
+    echo "$BUILD/pool_host not found, build with:"
+    echo "  cmake -S host -B $BUILD && cmake --build $BUILD"
+    exit 1
+fi
+
+BUILD=$(cd "$BUILD" && pwd)
+"$DIR/syslog_listen.py" -q -p $PORT -t $((SECS + 4)) &
+LISTEN=$!
+sleep 0.5
+
+(cd "$TMP" && exec "$BUILD/pool_host" -p 18081 -l "$RATE" \
+    -s 127.0.0.1:$PORT) >"$TMP/host.log" 2>&1 &
+HOST=$!
+sleep "$SECS"
+
+curl -s http://127.0.0.1:18081/status.json |
+    python3 -c 'import json, sys; print("device    ", json.load(sys.stdin)["syslog"])'
+kill $HOST
+HOST=
+wait $LISTEN